@@ -15,6 +15,7 @@
 #include "worker_info.h"
 #include "worker.h"
 #include "comm.h"
+#include "../profiler.h"
 
 
 #define FIFO_PATH   "./fifo/"
@@ -37,6 +38,7 @@ static void readInput(Worker *workers, int);
 static int commandSearch(Worker *workers, int, char **, int, int);
 static char *commandMaxMin(Worker *, int, char *, int *, int);
 static int commandWC(Worker *, int, int *, int *, int *);
+static int commandProfile(Worker *, int, int);
 static void signal_handler(int);
 static void usage(char *);
 
@@ -45,6 +47,7 @@ static Worker *g_workers = NULL;
 static int g_numberOfWorkers;
 static char **g_directoryList = NULL;
 static int g_numberOfDirs;
+static Profiler *g_profiler = NULL; // Shared with the workers
 
 static volatile sig_atomic_t g_timedout = 0; // Used for search deadline
 
@@ -179,6 +182,12 @@ int main(int argc, char *argv[]) {
 
 
 
+	// Created before the workers, so that they record their samples in it
+	if ((g_profiler = profilerCreate()) == NULL) {
+		freeDirs(g_directoryList, g_numberOfDirs);
+		return -5;
+	}
+
 	// Create the workers
 	if (g_numberOfWorkers > g_numberOfDirs) {
 		g_numberOfWorkers = g_numberOfDirs;
@@ -188,6 +197,7 @@ int main(int argc, char *argv[]) {
 	if (g_workers == NULL) {
 		perror("malloc (workers)");
 		freeDirs(g_directoryList, g_numberOfDirs);
+		profilerDestroy(g_profiler);
 		return -5;
 	}
 
@@ -197,6 +207,7 @@ int main(int argc, char *argv[]) {
 		fprintf(stderr, "[-] Error when creating the workers\n");
 		free(g_workers);
 		freeDirs(g_directoryList, g_numberOfDirs);
+		profilerDestroy(g_profiler);
 		return -6;
 	}
 	printf("[*] Workers ready (%d)\n\n\n", activeWorkers);
@@ -248,6 +259,7 @@ int main(int argc, char *argv[]) {
 	g_workers = NULL;
 	freeDirs(g_directoryList, g_numberOfDirs);
 	g_directoryList = NULL;
+	profilerDestroy(g_profiler);
 	return 0;
 }
 
@@ -329,7 +341,7 @@ int createWorkers(Worker *workers, int numberOfWorkers, char **dirList, int numO
 
 			// (Swap read and write fifos)
 			int ret = 0;
-			if (startWorker(fifoWrite, fifoRead) < 0) {
+			if (startWorker(fifoWrite, fifoRead, g_profiler) < 0) {
 				fprintf(stderr, "[-] Failed to start worker %d\n", i+1);
 				activeWorkers--;
 				ret = -1;
@@ -399,7 +411,7 @@ void restartWorker(Worker *worker, char **directoryList) {
 		freeDirs(g_directoryList, g_numberOfDirs);
 		free(g_workers);
 
-		if (startWorker(writeFifo, readFifo) < 0) {
+		if (startWorker(writeFifo, readFifo, g_profiler) < 0) {
 			fprintf(stderr, "[-] Failed to restart worker\n");
 			exit(-1);
 		}
@@ -635,6 +647,34 @@ void readInput(Worker *workers, int numberOfWorkers) {
 				free(buf);
 				break;
 			}
+		/* ########### PROFILE ############ */
+		} else if (strcmp(cmd, "/profile") == 0) {
+			char *arg = strtok(NULL, " \t\n");
+			if (arg == NULL) {
+				// Folded stacks of the last run
+				int length;
+				char *stacks = profilerReport(g_profiler, &length);
+				if (stacks == NULL) {
+					printf("[-] Command failed\n");
+				} else {
+					printf("%s\n", stacks);
+					free(stacks);
+				}
+			} else {
+				int seconds = atoi(arg);
+				if (seconds <= 0 || seconds > MAX_PROFILE_SECONDS) {
+					printf("[-] Invalid syntax\n");
+				} else {
+					int res = commandProfile(workers, numberOfWorkers, seconds);
+					if (res == -1) {
+						printf("[-] Profile already running\n\n");
+					} else if (res < 0) {
+						printf("[-] Command failed\n");
+					} else {
+						printf("[+] Profiling for %d seconds\n\n", seconds);
+					}
+				}
+			}
 		/* ############ EXIT ############## */
 		} else if (strcmp(cmd, "/exit") == 0) {
 			printf("Exiting program...\n");
@@ -1115,6 +1155,28 @@ int commandWC(Worker *workers, int numberOfWorkers, int *totalBytes, int *totalW
 }
 
 
+/* Start a profile of the given seconds in the Job Executor and tell the
+ * workers to sample themselves too. They don't send a result.
+ * Returns -1 if a profile is already running, -2 if a worker wasn't told */
+int commandProfile(Worker *workers, int numberOfWorkers, int seconds) {
+	if (profilerStart(g_profiler, seconds) < 0) {
+		return -1;
+	}
+
+	char cmd[12] = "CMD:PROFILE";
+	int i;
+	for (i = 0; i < numberOfWorkers; i++) {
+		if (workers[i].pid != -1) {
+			kill(workers[i].pid, SIGUSR1);
+			if (fifoSend(workers[i].writefd, cmd, 12, 1) == -1) {
+				return -2;
+			}
+		}
+	}
+	return 0;
+}
+
+
 
 
 void signal_handler(int sig) {
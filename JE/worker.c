@@ -13,6 +13,7 @@
 #include "comm.h"
 #include "textfile.h"
 #include "util.h"
+#include "../profiler.h"
 
 #define BUF_SIZE           256
 #define LOG_PREFIX   "Worker_"
@@ -47,8 +48,12 @@ static volatile sig_atomic_t g_cmdReady = 0; // Command requested
 static volatile sig_atomic_t g_timedout = 0; // Used for search deadline
 static volatile sig_atomic_t g_parentPid = 0;
 
+static Profiler *g_profiler = NULL; // Created by the job executor
+
+
+int startWorker(char *readFifo, char *writeFifo, Profiler *profiler) {
+	g_profiler = profiler;
 
-int startWorker(char *readFifo, char *writeFifo) {
 	// Setup signal handler
 	struct sigaction act = {0};
 	sigemptyset(&(act.sa_mask));
@@ -425,6 +430,9 @@ int recvCommand(int readfd, int writefd, Trie *trie, FileList *fileList, Keyword
 			free(buf);
 			return -1;
 		}
+	} else if (strcmp(cmd[0], "CMD:PROFILE") == 0) {
+		// The job executor started a profile. No result is sent
+		profilerArm(g_profiler);
 	} else {
 		fprintf(stderr, "[-] Invalid worker command\n");
 		return -1;
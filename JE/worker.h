@@ -1,6 +1,8 @@
 #ifndef WORKER_H
 #define WORKER_H
 
+#include "../profiler.h"
+
 #define LOG_PATH      "./log/"
 #define LOG_DIR_PERM      0700
 
@@ -24,6 +26,6 @@ typedef struct fileList {
 } FileList;
 
 
-int startWorker(char *, char *);
+int startWorker(char *, char *, Profiler *);
 
 #endif // WORKER_H
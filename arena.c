@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "arena.h"
+
+#define ALIGN(n) (((n) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+static void freeBlocks(Arena *);
+
+
+/* The first block is size bytes at mem, which must be aligned */
+void arenaInit(Arena *arena, char *mem, int size) {
+	arena->base = mem;
+	arena->size = size;
+	arena->used = 0;
+	arena->mark = 0;
+	arena->blocks = NULL;
+}
+
+
+/* Returns size bytes that stay valid until the next reset, NULL if
+ * they didn't fit and a new block couldn't be allocated */
+void *arenaAlloc(Arena *arena, int size) {
+	size = ALIGN(size);
+	if (arena->used + size <= arena->size) {
+		void *ptr = arena->base + arena->used;
+		arena->used += size;
+		return ptr;
+	}
+
+	ArenaBlock *block = arena->blocks;
+	if (block == NULL || block->used + size > block->size) {
+		int blockSize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+		block = malloc(ALIGN(sizeof(ArenaBlock)) + blockSize);
+		if (block == NULL) {
+			perror("malloc");
+			return NULL;
+		}
+		block->size = blockSize;
+		block->used = 0;
+		block->next = arena->blocks;
+		arena->blocks = block;
+	}
+
+	void *ptr = (char *) block + ALIGN(sizeof(ArenaBlock)) + block->used;
+	block->used += size;
+	return ptr;
+}
+
+
+/* Keep what has been allocated so far on every reset. Only the first
+ * block can be kept, so this must be done before it is full */
+void arenaMark(Arena *arena) {
+	if (arena->blocks == NULL) {
+		arena->mark = arena->used;
+	}
+}
+
+
+/* Free everything allocated after the mark */
+void arenaReset(Arena *arena) {
+	freeBlocks(arena);
+	arena->used = arena->mark;
+}
+
+
+/* Free the added blocks. The first block belongs to the owner */
+void arenaDestroy(Arena *arena) {
+	freeBlocks(arena);
+	arena->used = 0;
+	arena->mark = 0;
+}
+
+
+void freeBlocks(Arena *arena) {
+	while (arena->blocks != NULL) {
+		ArenaBlock *next = arena->blocks->next;
+		free(arena->blocks);
+		arena->blocks = next;
+	}
+}
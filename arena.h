@@ -0,0 +1,33 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#define ARENA_ALIGN 8
+#define ARENA_BLOCK_SIZE 4096 // Size of the blocks added when the first one is full
+
+/* Block added to an arena, freed by the next reset */
+typedef struct arenaBlock {
+	struct arenaBlock *next;
+	int size;
+	int used;
+} ArenaBlock;
+
+/* Bump allocator. Memory is taken from the first block (given by the owner)
+ * and only given back all at once by arenaReset, which keeps what was
+ * allocated before arenaMark. Allocations that don't fit go to blocks
+ * allocated with malloc. Not thread safe: an arena has one user at a time */
+typedef struct arena {
+	char *base;
+	int size;
+	int used;
+	int mark;
+	ArenaBlock *blocks; // Most recent first
+} Arena;
+
+
+void arenaInit(Arena *, char *, int);
+void *arenaAlloc(Arena *, int);
+void arenaMark(Arena *);
+void arenaReset(Arena *);
+void arenaDestroy(Arena *);
+
+#endif // ARENA_H
@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "bench.h"
+
+static char *suite = "";
+static long long allocCount = 0;
+static long long allocBytes = 0;
+
+void *__real_malloc(size_t);
+void *__real_calloc(size_t, size_t);
+void *__real_realloc(void *, size_t);
+
+static long long now(void);
+
+
+/* Name of the suite written with every result */
+void benchSuite(char *name) {
+	suite = name;
+	fprintf(stderr, "%-32s %12s %12s %10s %12s %10s\n", name, "ops", "ns/op", "allocs/op", "bytes/op", "MB/s");
+}
+
+
+void benchBegin(Bench *bench, char *name) {
+	bench->name = name;
+	bench->allocs = allocCount;
+	bench->allocBytes = allocBytes;
+	bench->start = now();
+}
+
+
+/* Report ops operations done since benchBegin. bytes is the data they
+ * processed, used for the throughput (0 if it doesn't apply).
+ * The results are written to stdout as one JSON object per line, and
+ * as a table to stderr */
+void benchEnd(Bench *bench, long long ops, long long bytes) {
+	long long elapsed = now() - bench->start;
+	long long allocs = allocCount - bench->allocs;
+	long long allocated = allocBytes - bench->allocBytes;
+	if (ops <= 0) {
+		ops = 1;
+	}
+
+	double nsPerOp = (double) elapsed / ops;
+	double mbPerSec = elapsed > 0 ? (bytes / 1e6) / (elapsed / 1e9) : 0;
+	fprintf(stderr, "  %-30s %12lld %12.1f %10.2f %12.1f %10.1f\n", bench->name, ops, nsPerOp,
+			(double) allocs / ops, (double) allocated / ops, mbPerSec);
+	printf("{\"suite\": \"%s\", \"name\": \"%s\", \"ops\": %lld, \"ns_per_op\": %.2f, \"allocs_per_op\": %.3f, "
+			"\"alloc_bytes_per_op\": %.1f, \"mb_per_s\": %.2f}\n",
+			suite, bench->name, ops, nsPerOp, (double) allocs / ops, (double) allocated / ops, mbPerSec);
+	fflush(stdout);
+}
+
+
+void *__wrap_malloc(size_t size) {
+	allocCount++;
+	allocBytes += size;
+	return __real_malloc(size);
+}
+
+
+void *__wrap_calloc(size_t count, size_t size) {
+	allocCount++;
+	allocBytes += count * size;
+	return __real_calloc(count, size);
+}
+
+
+void *__wrap_realloc(void *ptr, size_t size) {
+	allocCount++;
+	allocBytes += size;
+	return __real_realloc(ptr, size);
+}
+
+
+long long now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
@@ -0,0 +1,19 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+/* One measured benchmark. Allocations are counted by wrapping malloc,
+ * calloc and realloc at link time (-Wl,--wrap=...), so only the calls made
+ * by the benchmarked code are seen, not the ones made inside libc */
+typedef struct bench {
+	char *name;
+	long long start; // Nanoseconds
+	long long allocs;
+	long long allocBytes;
+} Bench;
+
+
+void benchSuite(char *);
+void benchBegin(Bench *, char *);
+void benchEnd(Bench *, long long, long long);
+
+#endif // BENCH_H
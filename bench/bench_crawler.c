@@ -0,0 +1,274 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bench.h"
+#include "../hash_table.h"
+#include "../fingerprint_set.h"
+#include "../url_queue.h"
+#include "../url_table.h"
+#include "../frontier.h"
+#include "../link_extractor.h"
+
+#define URL_COUNT    100000
+#define QUEUE_URLS   1000 // queueExists scans the whole queue
+#define EXISTS_OPS   20000
+#define URL_LEN      64
+#define BATCH_SIZE   64 // Links of a page given to HT_insertBatch
+#define FS_RATE      0.0001 // False positive rate of the fingerprint set
+#define PAGE_SIZE    (256 * 1024) // Bytes of the page given to extractLinks
+#define PAGE_RUNS    200
+
+static char **createUrls(int);
+static void freeUrls(char **, int);
+static char *createPage(int *);
+
+
+int main(void) {
+	Bench bench;
+	int i;
+	benchSuite("mycrawler");
+
+	// The URLs are created before the measurements
+	char **urls = createUrls(URL_COUNT);
+	if (urls == NULL) {
+		return -1;
+	}
+
+	HashTable *table = malloc(sizeof(HashTable));
+	if (table == NULL) {
+		perror("malloc");
+		freeUrls(urls, URL_COUNT);
+		return -1;
+	}
+	if (HT_initialize(table) < 0) {
+		free(table);
+		freeUrls(urls, URL_COUNT);
+		return -1;
+	}
+	benchBegin(&bench, "HT_insert new");
+	for (i = 0; i < URL_COUNT; i++) {
+		HT_insert(table, urls[i]);
+	}
+	benchEnd(&bench, URL_COUNT, 0);
+
+	benchBegin(&bench, "HT_insert existing");
+	for (i = 0; i < URL_COUNT; i++) {
+		HT_insert(table, urls[i]);
+	}
+	benchEnd(&bench, URL_COUNT, 0);
+
+	int found = 0;
+	benchBegin(&bench, "HT_contains");
+	for (i = 0; i < URL_COUNT; i++) {
+		found += HT_contains(table, urls[i]);
+	}
+	benchEnd(&bench, URL_COUNT, 0);
+	HT_destroy(table);
+
+	int isNew[BATCH_SIZE];
+	HT_initialize(table);
+	benchBegin(&bench, "HT_insertBatch new (64)");
+	for (i = 0; i + BATCH_SIZE <= URL_COUNT; i += BATCH_SIZE) {
+		HT_insertBatch(table, urls + i, BATCH_SIZE, isNew);
+	}
+	benchEnd(&bench, i, 0);
+	HT_destroy(table);
+	free(table);
+
+	// The bytes allocated per insert compare with the ones of the hash table
+	FingerprintSet *set = malloc(sizeof(FingerprintSet));
+	if (set == NULL || FS_initialize(set, FS_RATE, NULL) < 0) {
+		free(set);
+		freeUrls(urls, URL_COUNT);
+		return -1;
+	}
+	benchBegin(&bench, "FS_insert new");
+	for (i = 0; i < URL_COUNT; i++) {
+		FS_insert(set, urls[i]);
+	}
+	benchEnd(&bench, URL_COUNT, 0);
+
+	benchBegin(&bench, "FS_contains");
+	for (i = 0; i < URL_COUNT; i++) {
+		found += FS_contains(set, urls[i]);
+	}
+	benchEnd(&bench, URL_COUNT, 0);
+	FS_destroy(set);
+
+	FS_initialize(set, FS_RATE, NULL);
+	benchBegin(&bench, "FS_insertBatch new (64)");
+	for (i = 0; i + BATCH_SIZE <= URL_COUNT; i += BATCH_SIZE) {
+		FS_insertBatch(set, urls + i, BATCH_SIZE, isNew);
+	}
+	benchEnd(&bench, i, 0);
+	FS_destroy(set);
+	free(set);
+
+	// The same URLs stored once in chunks, compared with the hash table
+	UrlTable *urlTable = malloc(sizeof(UrlTable));
+	unsigned int *ids = malloc(URL_COUNT * sizeof(unsigned int));
+	if (urlTable == NULL || ids == NULL || UT_initialize(urlTable, 1) < 0) {
+		free(urlTable);
+		free(ids);
+		freeUrls(urls, URL_COUNT);
+		return -1;
+	}
+	benchBegin(&bench, "UT_intern new");
+	for (i = 0; i < URL_COUNT; i++) {
+		UT_intern(urlTable, urls[i], &ids[i]);
+	}
+	benchEnd(&bench, URL_COUNT, 0);
+
+	benchBegin(&bench, "UT_intern existing");
+	for (i = 0; i < URL_COUNT; i++) {
+		UT_intern(urlTable, urls[i], &ids[i]);
+	}
+	benchEnd(&bench, URL_COUNT, 0);
+
+	benchBegin(&bench, "UT_get");
+	for (i = 0; i < URL_COUNT; i++) {
+		found += UT_get(urlTable, ids[i])[0] == 'h';
+	}
+	benchEnd(&bench, URL_COUNT, 0);
+	UT_destroy(urlTable);
+
+	UT_initialize(urlTable, 1);
+	benchBegin(&bench, "UT_internBatch new (64)");
+	for (i = 0; i + BATCH_SIZE <= URL_COUNT; i += BATCH_SIZE) {
+		UT_internBatch(urlTable, urls + i, BATCH_SIZE, ids + i, isNew);
+	}
+	benchEnd(&bench, i, 0);
+	for (; i < URL_COUNT; i++) {
+		UT_intern(urlTable, urls[i], &ids[i]);
+	}
+
+	// One thread: hosts are taken from its own deque, never stolen
+	Frontier frontier;
+	if (frontierInit(&frontier, urlTable, 1, 0) < 0) {
+		UT_destroy(urlTable);
+		free(urlTable);
+		free(ids);
+		freeUrls(urls, URL_COUNT);
+		return -1;
+	}
+	benchBegin(&bench, "frontierAdd");
+	for (i = 0; i < URL_COUNT; i++) {
+		frontierAdd(&frontier, 0, ids[i]);
+	}
+	benchEnd(&bench, URL_COUNT, 0);
+
+	benchBegin(&bench, "frontierNext + frontierDone");
+	for (i = 0; i < URL_COUNT; i++) {
+		unsigned int id;
+		frontierNext(&frontier, 0, &id);
+		frontierDone(&frontier, 0, id);
+	}
+	benchEnd(&bench, URL_COUNT, 0);
+	frontierDestroy(&frontier);
+	UT_destroy(urlTable);
+	free(urlTable);
+	free(ids);
+
+	// Text with <br> tags and a link every few lines, like the generated pages
+	int pageLen;
+	char *page = createPage(&pageLen);
+	if (page == NULL) {
+		freeUrls(urls, URL_COUNT);
+		return -1;
+	}
+	int scans[] = {LINK_SCAN_SCALAR, LINK_SCAN_SSE2, LINK_SCAN_AVX2};
+	char *scanNames[] = {"extractLinks scalar", "extractLinks SSE2", "extractLinks AVX2"};
+	for (i = 0; i < 3; i++) {
+		LinkExtractor ex;
+		if (linkExtractorInit(&ex, scans[i]) < 0) {
+			continue; // Not run by this CPU
+		}
+		int j;
+		benchBegin(&bench, scanNames[i]);
+		for (j = 0; j < PAGE_RUNS; j++) {
+			found += extractLinks(&ex, page, pageLen) > 0;
+		}
+		benchEnd(&bench, PAGE_RUNS, (long long) PAGE_RUNS * pageLen);
+		linkExtractorDestroy(&ex);
+	}
+	free(page);
+
+	URLQueue queue;
+	queueInit(&queue);
+	benchBegin(&bench, "url_queue queueInsert");
+	for (i = 0; i < URL_COUNT; i++) {
+		queueInsert(&queue, urls[i]);
+	}
+	benchEnd(&bench, URL_COUNT, 0);
+
+	benchBegin(&bench, "url_queue queueRemove");
+	for (i = 0; i < URL_COUNT; i++) {
+		free(queueRemove(&queue));
+	}
+	benchEnd(&bench, URL_COUNT, 0);
+
+	// Half of the lookups find their URL, at a random position
+	for (i = 0; i < QUEUE_URLS; i++) {
+		queueInsert(&queue, urls[i]);
+	}
+	benchBegin(&bench, "url_queue queueExists (1000)");
+	for (i = 0; i < EXISTS_OPS; i++) {
+		found += queueExists(&queue, urls[(i * 7919) % (2 * QUEUE_URLS)]);
+	}
+	benchEnd(&bench, EXISTS_OPS, 0);
+	queueDestroy(&queue);
+
+	freeUrls(urls, URL_COUNT);
+	return found > 0 ? 0 : -1;
+}
+
+
+/* URLs like the ones found in the generated websites */
+char **createUrls(int count) {
+	char **urls = malloc(count * sizeof(char *));
+	if (urls == NULL) {
+		perror("malloc");
+		return NULL;
+	}
+	int i;
+	for (i = 0; i < count; i++) {
+		urls[i] = malloc(URL_LEN * sizeof(char));
+		if (urls[i] == NULL) {
+			perror("malloc");
+			freeUrls(urls, i);
+			return NULL;
+		}
+		snprintf(urls[i], URL_LEN, "http://localhost:8080/site%d/page%d_%d.html", i % 100, i % 100, i * 31 % 100003);
+	}
+	return urls;
+}
+
+
+void freeUrls(char **urls, int count) {
+	int i;
+	for (i = 0; i < count; i++) {
+		free(urls[i]);
+	}
+	free(urls);
+}
+
+
+char *createPage(int *length) {
+	char *page = malloc(PAGE_SIZE + 1);
+	if (page == NULL) {
+		perror("malloc");
+		return NULL;
+	}
+	int len = sprintf(page, "<!DOCTYPE html>\n<html>\n   <body>\n");
+	int line;
+	for (line = 0; len < PAGE_SIZE - 256; line++) {
+		if (line % 8 == 0) {
+			len += sprintf(page + len, "   <a href=\"/site%d/page%d_%d.html\">link_%d</a><br>\n", line % 10, line % 10, line * 31 % 100003, line);
+		} else {
+			len += sprintf(page + len, "   But to conquer those obstacles which bristled round the South Pole,<br>\n");
+		}
+	}
+	len += sprintf(page + len, "   </body>\n</html>\n");
+	*length = len;
+	return page;
+}
@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bench.h"
+#include "../req_queue.h"
+#include "../requests.h"
+
+#define QUEUE_OPS    2000000
+#define PARSE_OPS    500000
+#define HEADERS_OPS  500000
+#define BATCH        16 // Requests queued before they are removed (the queue holds 32)
+
+static char request[] = "GET /site0/page0_1234.html HTTP/1.1\r\nHost: localhost:8080\r\n"
+		"User-Agent: bench\r\nAccept: */*\r\nConnection: keep-alive\r\n\r\n";
+
+
+int main(void) {
+	Bench bench;
+	long long i;
+	int j;
+	benchSuite("myhttpd");
+
+	// Request queue: nodes come from the caller like in the server
+	RequestQueue queue;
+	queueInit(&queue);
+	Request nodes[BATCH];
+	for (j = 0; j < BATCH; j++) {
+		nodes[j].filename = "/site0/page0_1234.html";
+		nodes[j].conn = NULL;
+	}
+	benchBegin(&bench, "req_queue insert+remove");
+	for (i = 0; i < QUEUE_OPS; i += BATCH) {
+		for (j = 0; j < BATCH; j++) {
+			queueInsert(&queue, &nodes[j]);
+		}
+		for (j = 0; j < BATCH; j++) {
+			char *filename;
+			Connection *conn;
+			queueRemove(&queue, &filename, &conn);
+		}
+	}
+	benchEnd(&bench, i, 0);
+	queueDestroy(&queue);
+
+	// parseRequest changes the request, so every op parses a fresh copy
+	char buf[sizeof(request)];
+	int keepAlive;
+	int valid = 0;
+	benchBegin(&bench, "parseRequest");
+	for (i = 0; i < PARSE_OPS; i++) {
+		memcpy(buf, request, sizeof(request));
+		valid += parseRequest(buf, &keepAlive) != NULL;
+	}
+	benchEnd(&bench, i, i * (sizeof(request) - 1));
+	if (valid != PARSE_OPS) {
+		fprintf(stderr, "[-] parseRequest rejected the request\n");
+		return -1;
+	}
+
+	char headers[RESPONSE_HEADER_SIZE];
+	long long total = 0;
+	benchBegin(&bench, "createResponseHeaders");
+	for (i = 0; i < HEADERS_OPS; i++) {
+		total += createResponseHeaders(headers, RESPONSE_HEADER_SIZE, CODE_OK, i, 1);
+	}
+	benchEnd(&bench, i, total);
+	return 0;
+}
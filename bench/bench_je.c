@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include "bench.h"
+#include "../JE/trie.h"
+#include "../JE/textfile.h"
+#include "../JE/comm.h"
+
+#define DOCUMENTS     8 // The text is split in this many documents
+#define MERGE_OPS     2000
+#define TEXTFILE_OPS  3
+#define FIFO_OPS      20000
+
+static char *documents[DOCUMENTS] = {"doc0", "doc1", "doc2", "doc3", "doc4", "doc5", "doc6", "doc7"};
+
+// Words of the text file in order, with the line and document they are in
+typedef struct wordList {
+	char **words;
+	int *lines;
+	int count;
+	char *text;
+} WordList;
+
+static int loadWords(char *, WordList *);
+static void benchFifo(char *, int);
+static void echoServer(int, int);
+
+
+int main(int argc, char *argv[]) {
+	char *textFile = argc > 1 ? argv[1] : "pg164.txt";
+	Bench bench;
+	int i;
+	benchSuite("jobExecutor");
+
+	WordList list;
+	if (loadWords(textFile, &list) < 0) {
+		return -1;
+	}
+
+	Trie *trie;
+	initialize(&trie);
+	benchBegin(&bench, "trieInsert");
+	for (i = 0; i < list.count; i++) {
+		trieInsert(trie, list.words[i], documents[list.lines[i] % DOCUMENTS], list.lines[i]);
+	}
+	benchEnd(&bench, list.count, 0);
+
+	int found = 0;
+	benchBegin(&bench, "findPostingsList");
+	for (i = 0; i < list.count; i++) {
+		found += findPostingsList(trie, list.words[i]) != NULL;
+	}
+	benchEnd(&bench, list.count, 0);
+
+	// Two word searches, like /search with two keywords
+	PostingsNode *heads[2];
+	benchBegin(&bench, "mergePostingsLists (2 words)");
+	for (i = 0; i < MERGE_OPS; i++) {
+		heads[0] = findPostingsList(trie, list.words[i % list.count])->head;
+		heads[1] = findPostingsList(trie, list.words[(i + 1) % list.count])->head;
+		freePostings(mergePostingsLists(heads, 2));
+	}
+	benchEnd(&bench, MERGE_OPS, 0);
+	destroy(trie);
+
+	// The whole file is read (and indexed) by every op
+	long long size = 0;
+	benchBegin(&bench, "readTextfile");
+	for (i = 0; i < TEXTFILE_OPS; i++) {
+		int bytes, words, lines;
+		initialize(&trie);
+		char **text = readTextfile(textFile, trie, &bytes, &words, &lines);
+		if (text == NULL) {
+			fprintf(stderr, "[-] Could not read %s\n", textFile);
+			return -1;
+		}
+		int l;
+		for (l = 0; l < lines; l++) {
+			free(text[l]);
+		}
+		free(text);
+		destroy(trie);
+		size += bytes;
+	}
+	benchEnd(&bench, TEXTFILE_OPS, size);
+
+	benchFifo("fifo round trip 64B", 64);
+	benchFifo("fifo round trip 4KB", 4096);
+	benchFifo("fifo round trip 32KB", 32768);
+
+	free(list.words);
+	free(list.lines);
+	free(list.text);
+	return found == list.count ? 0 : -1;
+}
+
+
+/* Split the file in words, keeping the number of their line */
+int loadWords(char *filename, WordList *list) {
+	FILE *fp = fopen(filename, "r");
+	if (fp == NULL) {
+		perror("fopen");
+		return -1;
+	}
+	fseek(fp, 0, SEEK_END);
+	long size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	list->text = malloc(size + 1);
+	list->words = malloc((size / 2 + 1) * sizeof(char *));
+	list->lines = malloc((size / 2 + 1) * sizeof(int));
+	if (list->text == NULL || list->words == NULL || list->lines == NULL) {
+		perror("malloc");
+		fclose(fp);
+		return -1;
+	}
+	size = fread(list->text, 1, size, fp);
+	list->text[size] = '\0';
+	fclose(fp);
+
+	list->count = 0;
+	int line = 0;
+	char *pos = list->text;
+	while (*pos != '\0') {
+		char *end = pos + strcspn(pos, " \t\r\n");
+		if (end > pos) {
+			list->words[list->count] = pos;
+			list->lines[list->count] = line;
+			list->count++;
+		}
+		if (*end == '\n') {
+			line++;
+		}
+		if (*end == '\0') {
+			break;
+		}
+		*end = '\0';
+		pos = end + 1;
+	}
+	return 0;
+}
+
+
+/* Send a message of size bytes to a process that sends it back */
+void benchFifo(char *name, int size) {
+	int toChild[2], toParent[2];
+	if (pipe(toChild) < 0 || pipe(toParent) < 0) {
+		perror("pipe");
+		return;
+	}
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return;
+	} else if (pid == 0) {
+		close(toChild[1]);
+		close(toParent[0]);
+		echoServer(toChild[0], toParent[1]);
+		exit(0);
+	}
+	close(toChild[0]);
+	close(toParent[1]);
+
+	// A single string, including its null byte
+	char *msg = malloc(size);
+	if (msg == NULL) {
+		perror("malloc");
+		return;
+	}
+	memset(msg, 'a', size - 1);
+	msg[size - 1] = '\0';
+
+	Bench bench;
+	int i;
+	benchBegin(&bench, name);
+	for (i = 0; i < FIFO_OPS; i++) {
+		if (fifoSend(toChild[1], msg, size, 1) < 0) {
+			perror("write");
+			break;
+		}
+		int count;
+		char **results = fifoRecv(toParent[0], &count);
+		if (results == NULL) {
+			break;
+		}
+		freeResults(results, count);
+	}
+	benchEnd(&bench, i, 2LL * i * size);
+
+	free(msg);
+	close(toChild[1]);
+	close(toParent[0]);
+	waitpid(pid, NULL, 0);
+}
+
+
+/* Send back every message until the other end is closed */
+void echoServer(int readfd, int writefd) {
+	while (1) {
+		int count;
+		char **results = fifoRecv(readfd, &count);
+		if (results == NULL) {
+			return;
+		}
+		fifoSend(writefd, results[0], strlen(results[0]) + 1, 1);
+		freeResults(results, count);
+	}
+}
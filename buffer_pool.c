@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "buffer_pool.h"
+
+
+int poolInit(BufferPool *pool, int bufferSize, int maxBuffers) {
+	if (maxBuffers <= 0) {
+		maxBuffers = 1;
+	}
+	pool->freeBuffers = malloc(maxBuffers * sizeof(char *));
+	if (pool->freeBuffers == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	pool->freeCount = 0;
+	pool->allocated = 0;
+	pool->maxBuffers = maxBuffers;
+	pool->bufferSize = bufferSize;
+	pthread_mutex_init(&(pool->mtx), NULL);
+	pthread_cond_init(&(pool->cond_available), NULL);
+	return 0;
+}
+
+
+/* Get a buffer, allocating it if the limit hasn't been reached.
+ * Blocks until another thread releases one otherwise */
+char *poolAcquire(BufferPool *pool) {
+	char *buf = NULL;
+	pthread_mutex_lock(&(pool->mtx));
+	while (pool->freeCount == 0 && pool->allocated >= pool->maxBuffers) {
+		pthread_cond_wait(&(pool->cond_available), &(pool->mtx));
+	}
+
+	if (pool->freeCount > 0) {
+		buf = pool->freeBuffers[--(pool->freeCount)];
+	} else {
+		buf = malloc(pool->bufferSize * sizeof(char));
+		if (buf == NULL) {
+			perror("malloc");
+		} else {
+			(pool->allocated)++;
+		}
+	}
+	pthread_mutex_unlock(&(pool->mtx));
+	return buf;
+}
+
+
+void poolRelease(BufferPool *pool, char *buf) {
+	pthread_mutex_lock(&(pool->mtx));
+	pool->freeBuffers[(pool->freeCount)++] = buf;
+	pthread_cond_signal(&(pool->cond_available));
+	pthread_mutex_unlock(&(pool->mtx));
+}
+
+
+/* Free the buffers. All of them must have been released */
+void poolDestroy(BufferPool *pool) {
+	int i;
+	for (i = 0; i < pool->freeCount; i++) {
+		free(pool->freeBuffers[i]);
+	}
+	free(pool->freeBuffers);
+	pthread_mutex_destroy(&(pool->mtx));
+	pthread_cond_destroy(&(pool->cond_available));
+}
@@ -0,0 +1,25 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <pthread.h>
+
+/* Fixed-size buffers shared by the threads. At most maxBuffers are ever
+ * allocated, threads wait for a buffer to be released after that */
+typedef struct bufferPool {
+	char **freeBuffers;
+	int freeCount;
+	int allocated;
+	int maxBuffers;
+	int bufferSize;
+
+	pthread_mutex_t mtx;
+	pthread_cond_t cond_available;
+} BufferPool;
+
+
+int poolInit(BufferPool *, int, int);
+char *poolAcquire(BufferPool *);
+void poolRelease(BufferPool *, char *);
+void poolDestroy(BufferPool *);
+
+#endif // BUFFER_POOL_H
@@ -0,0 +1,623 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h> // fstat, stat
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <ctype.h> // isdigit
+#include <limits.h> // PATH_MAX
+#include "checkpoint.h"
+#include "hash_table.h"
+
+static void *checkpointThread(void *);
+static int openLog(Checkpoint *, unsigned long long);
+static int appendRecords(Checkpoint *, char *, int);
+static int putRecord(char *, int, int, unsigned int, char *, int);
+static int compact(Checkpoint *, unsigned long long);
+static int foldLogs(Checkpoint *, unsigned long long, unsigned long long, int, HashTable *, FILE *, SnapshotHeader *, char *);
+static int copyUrls(FILE *, long long, HashTable *, FILE *, long long *, char *);
+static long loadSnapshot(Checkpoint *, void (*)(char *, int, void *), void *, long long *, long long *);
+static int openSnapshot(Checkpoint *, SnapshotHeader *, FILE **);
+static int readRecord(FILE *, int *, int *, unsigned int *, char *);
+static int readUrl(FILE *, char *);
+static int writeUrl(FILE *, char *);
+static long long lastLog(Checkpoint *);
+static int clearDir(Checkpoint *);
+static long long parseLogName(char *);
+static void filePath(Checkpoint *, char *, char *, long long);
+
+
+/* Start logging a crawl in dir. With resume, the snapshot and the logs left
+ * there are folded into a new snapshot, whose URLs are given to restore (done
+ * is set for the ones downloaded) and whose stats are put in pages and bytes;
+ * without it they are removed. A checkpoint is then written every interval
+ * seconds. Returns the number of URLs restored, -1 on error */
+int checkpointOpen(Checkpoint *ckpt, char *dir, int interval, int resume, void (*restore)(char *, int, void *), void *arg, long long *pages, long long *bytes) {
+	memset(ckpt, 0, sizeof(Checkpoint));
+	ckpt->dir = dir;
+	ckpt->interval = interval > 0 ? interval : CKPT_INTERVAL;
+	ckpt->logFd = -1;
+	pthread_mutex_init(&(ckpt->logMtx), NULL);
+	pthread_mutex_init(&(ckpt->stopMtx), NULL);
+	// The checkpoints follow the interval even if the clock is changed
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&(ckpt->stopCond), &attr);
+	pthread_condattr_destroy(&attr);
+	*pages = 0;
+	*bytes = 0;
+
+	long restored = 0;
+	unsigned long long next = 0;
+	if (!resume) {
+		if (clearDir(ckpt) < 0) {
+			checkpointClose(ckpt);
+			return -1;
+		}
+	} else {
+		// Every log written after the snapshot is folded in
+		SnapshotHeader header;
+		FILE *fp;
+		int found = openSnapshot(ckpt, &header, &fp);
+		long long last = lastLog(ckpt);
+		if (found < 0 || last < -1) {
+			if (found > 0) {
+				fclose(fp);
+			}
+			checkpointClose(ckpt);
+			return -1;
+		}
+		if (found > 0) {
+			fclose(fp);
+		}
+		next = header.nextLog > (unsigned long long) (last + 1) ? header.nextLog : (unsigned long long) (last + 1);
+
+		if (compact(ckpt, next) < 0 || (restored = loadSnapshot(ckpt, restore, arg, pages, bytes)) < 0) {
+			checkpointClose(ckpt);
+			return -1;
+		}
+	}
+
+	if (openLog(ckpt, next) < 0) {
+		checkpointClose(ckpt);
+		return -1;
+	}
+	if (pthread_create(&(ckpt->thread), NULL, checkpointThread, ckpt) != 0) {
+		fprintf(stderr, "[-] Failed to start the checkpoint thread\n");
+		checkpointClose(ckpt);
+		return -1;
+	}
+	ckpt->running = 1;
+	return restored;
+}
+
+
+/* Log the URLs of urls whose isNew is set, before they are queued.
+ * Returns -1 on error */
+int checkpointFound(Checkpoint *ckpt, char **urls, int *isNew, int count) {
+	char buf[CKPT_BUF_SIZE];
+	int used = 0;
+	int res = 0;
+	int i;
+	for (i = 0; i < count; i++) {
+		if (!isNew[i]) {
+			continue;
+		}
+		int len = strlen(urls[i]);
+		if (len > CKPT_MAX_URL) {
+			continue;
+		}
+		if (used + 3 + len > CKPT_BUF_SIZE) {
+			if (appendRecords(ckpt, buf, used) < 0) {
+				res = -1;
+			}
+			used = 0;
+		}
+		used += putRecord(buf + used, CKPT_FOUND, 0, 0, urls[i], len);
+	}
+	if (used > 0 && appendRecords(ckpt, buf, used) < 0) {
+		res = -1;
+	}
+	return res;
+}
+
+
+/* Log that the page of url was downloaded (ok set, with its length in bytes)
+ * or failed, so it isn't downloaded again. Returns -1 on error */
+int checkpointDone(Checkpoint *ckpt, char *url, int ok, int length) {
+	int len = strlen(url);
+	if (len > CKPT_MAX_URL) {
+		return 0;
+	}
+	char buf[8 + CKPT_MAX_URL];
+	return appendRecords(ckpt, buf, putRecord(buf, CKPT_DONE, ok, length, url, len));
+}
+
+
+/* Start a new log and fold the previous ones into the snapshot. The fetch
+ * threads only wait while the log is switched. Nothing is written if the logs
+ * are empty or, unless all is set, smaller than 1/CKPT_COMPACT_RATIO of the
+ * snapshot, so that rewriting it costs at most that many times the records
+ * logged. Returns 1 if a checkpoint was written, 0 if not and -1 on error */
+int checkpointWrite(Checkpoint *ckpt, int all) {
+	pthread_mutex_lock(&(ckpt->logMtx));
+	long long size = ckpt->unfolded + ckpt->logSize;
+	if (size == 0 || (!all && size < ckpt->snapshotSize / CKPT_COMPACT_RATIO)) {
+		pthread_mutex_unlock(&(ckpt->logMtx));
+		return 0;
+	}
+	int oldFd = ckpt->logFd;
+	unsigned long long upTo = ckpt->logNumber + 1;
+	int res = openLog(ckpt, upTo);
+	pthread_mutex_unlock(&(ckpt->logMtx));
+	if (res < 0) {
+		return -1;
+	}
+	close(oldFd);
+	if (compact(ckpt, upTo) < 0) {
+		ckpt->unfolded = size; // Folded by the next checkpoint
+		return -1;
+	}
+	ckpt->unfolded = 0;
+	return 1;
+}
+
+
+/* Stop the checkpoint thread and, if it was running, write a last checkpoint.
+ * Called once the fetch threads have exited */
+void checkpointClose(Checkpoint *ckpt) {
+	if (ckpt->running) {
+		pthread_mutex_lock(&(ckpt->stopMtx));
+		ckpt->stop = 1;
+		pthread_cond_signal(&(ckpt->stopCond));
+		pthread_mutex_unlock(&(ckpt->stopMtx));
+		pthread_join(ckpt->thread, NULL);
+		ckpt->running = 0;
+
+		if (checkpointWrite(ckpt, 1) > 0) {
+			printf("[+] Wrote the last checkpoint to %s\n", ckpt->dir);
+		}
+	}
+	if (ckpt->logFd >= 0) {
+		close(ckpt->logFd);
+		ckpt->logFd = -1;
+	}
+	pthread_mutex_destroy(&(ckpt->logMtx));
+	pthread_mutex_destroy(&(ckpt->stopMtx));
+	pthread_cond_destroy(&(ckpt->stopCond));
+}
+
+
+void *checkpointThread(void *arg) {
+	Checkpoint *ckpt = (Checkpoint *) arg;
+	pthread_mutex_lock(&(ckpt->stopMtx));
+	while (!ckpt->stop) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += ckpt->interval;
+		int res = 0;
+		while (!ckpt->stop && res != ETIMEDOUT) {
+			res = pthread_cond_timedwait(&(ckpt->stopCond), &(ckpt->stopMtx), &deadline);
+		}
+		if (ckpt->stop) {
+			break;
+		}
+
+		pthread_mutex_unlock(&(ckpt->stopMtx));
+		checkpointWrite(ckpt, 0);
+		pthread_mutex_lock(&(ckpt->stopMtx));
+	}
+	pthread_mutex_unlock(&(ckpt->stopMtx));
+	return NULL;
+}
+
+
+/* Create (or empty) the log of number and append to it from now on.
+ * Nothing changes on error */
+int openLog(Checkpoint *ckpt, unsigned long long number) {
+	char path[PATH_MAX];
+	filePath(ckpt, path, CKPT_LOG, number);
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if (fd < 0) {
+		perror("open: checkpoint log");
+		return -1;
+	}
+	ckpt->logFd = fd;
+	ckpt->logNumber = number;
+	ckpt->logSize = 0;
+	return 0;
+}
+
+
+/* Write whole records to the log with a single append (short writes aside),
+ * so that a crash can only cut the last one. A failed append is taken back */
+int appendRecords(Checkpoint *ckpt, char *buf, int size) {
+	pthread_mutex_lock(&(ckpt->logMtx));
+	int written = 0;
+	while (written < size) {
+		int res = write(ckpt->logFd, buf + written, size - written);
+		if (res < 0 && errno == EINTR) {
+			continue;
+		}
+		if (res <= 0) {
+			perror("write: checkpoint log");
+			if (ftruncate(ckpt->logFd, ckpt->logSize) < 0) {
+				perror("ftruncate: checkpoint log");
+			}
+			break;
+		}
+		written += res;
+	}
+	if (written == size) {
+		ckpt->logSize += size;
+	}
+	pthread_mutex_unlock(&(ckpt->logMtx));
+	return written == size ? 0 : -1;
+}
+
+
+/* Write a record to buf. Returns its size */
+int putRecord(char *buf, int type, int ok, unsigned int length, char *url, int len) {
+	int size = 0;
+	buf[size++] = type;
+	if (type == CKPT_DONE) {
+		buf[size++] = ok != 0;
+		memcpy(buf + size, &length, sizeof(length));
+		size += sizeof(length);
+	}
+	unsigned short urlLen = len;
+	memcpy(buf + size, &urlLen, sizeof(urlLen));
+	size += sizeof(urlLen);
+	memcpy(buf + size, url, len);
+	return size + len;
+}
+
+
+/* Fold the logs before upTo into a new snapshot, which replaces the old one
+ * once it is on disk, then remove them. On error the old snapshot and the
+ * logs are left as they were, so the next checkpoint folds them in.
+ * Returns -1 on error */
+int compact(Checkpoint *ckpt, unsigned long long upTo) {
+	SnapshotHeader old;
+	FILE *in;
+	int found = openSnapshot(ckpt, &old, &in);
+	if (found < 0) {
+		return -1;
+	}
+	struct stat st;
+	if (upTo <= old.nextLog) {
+		if (found > 0) {
+			if (fstat(fileno(in), &st) == 0) {
+				ckpt->snapshotSize = st.st_size;
+			}
+			fclose(in);
+		}
+		return 0;
+	}
+
+	SnapshotHeader header = old;
+	memcpy(header.magic, CKPT_MAGIC, sizeof(header.magic));
+	header.version = CKPT_VERSION;
+	header.nextLog = upTo;
+	header.done = 0;
+	header.pending = 0;
+
+	char tmpPath[PATH_MAX];
+	filePath(ckpt, tmpPath, CKPT_SNAPSHOT ".tmp", -1);
+	FILE *out = fopen(tmpPath, "w");
+	char *url = malloc(CKPT_MAX_URL + 1);
+	HashTable done; // URLs done in the logs, the pending ones among them are left out
+	int res = -1;
+	if (out == NULL || url == NULL) {
+		perror(out == NULL ? "fopen: checkpoint snapshot" : "malloc");
+	} else if (HT_initialize(&done) == 0) {
+		// The done URLs go first, those of the old snapshot then those of the
+		// logs. The header is written again once the counts are known
+		if (fwrite(&header, sizeof(header), 1, out) == 1
+				&& copyUrls(in, old.done, NULL, out, &header.done, url) == 0
+				&& foldLogs(ckpt, old.nextLog, upTo, CKPT_DONE, &done, out, &header, url) == 0
+				&& copyUrls(in, old.pending, &done, out, &header.pending, url) == 0
+				&& foldLogs(ckpt, old.nextLog, upTo, CKPT_FOUND, &done, out, &header, url) == 0
+				&& fseek(out, 0, SEEK_SET) == 0
+				&& fwrite(&header, sizeof(header), 1, out) == 1
+				&& fflush(out) == 0 && fsync(fileno(out)) == 0) {
+			res = 0;
+		}
+		HT_destroy(&done);
+	}
+	free(url);
+	if (found > 0) {
+		fclose(in);
+	}
+	if (out != NULL && fclose(out) != 0) {
+		res = -1;
+	}
+
+	char path[PATH_MAX];
+	filePath(ckpt, path, CKPT_SNAPSHOT, -1);
+	if (res == 0 && rename(tmpPath, path) < 0) {
+		perror("rename: checkpoint snapshot");
+		res = -1;
+	}
+	if (res == 0 && stat(path, &st) == 0) {
+		ckpt->snapshotSize = st.st_size;
+	}
+	if (res < 0) {
+		fprintf(stderr, "[-] Failed to write the checkpoint snapshot in %s\n", ckpt->dir);
+		unlink(tmpPath);
+		return -1;
+	}
+
+	// The rename is on disk before the logs are gone
+	int dirFd = open(ckpt->dir, O_RDONLY);
+	if (dirFd >= 0) {
+		fsync(dirFd);
+		close(dirFd);
+	}
+	unsigned long long n;
+	for (n = old.nextLog; n < upTo; n++) {
+		filePath(ckpt, path, CKPT_LOG, n);
+		if (unlink(path) < 0 && errno != ENOENT) {
+			perror("unlink: checkpoint log");
+		}
+	}
+	return 0;
+}
+
+
+/* Copy the records of type of the logs from first to upTo to the snapshot.
+ * The done URLs are added to done and counted with their pages in header;
+ * the found ones are left out if they are in done. A record cut short by a
+ * crash ends its log. Returns -1 on error */
+int foldLogs(Checkpoint *ckpt, unsigned long long first, unsigned long long upTo, int type, HashTable *done, FILE *out, SnapshotHeader *header, char *url) {
+	unsigned long long n;
+	for (n = first; n < upTo; n++) {
+		char path[PATH_MAX];
+		filePath(ckpt, path, CKPT_LOG, n);
+		FILE *log = fopen(path, "r");
+		if (log == NULL) {
+			if (errno == ENOENT) {
+				continue;
+			}
+			perror("fopen: checkpoint log");
+			return -1;
+		}
+
+		int recordType, ok, res;
+		unsigned int length;
+		while ((res = readRecord(log, &recordType, &ok, &length, url)) > 0) {
+			if (recordType != type) {
+				continue;
+			}
+			if (type == CKPT_DONE) {
+				if (HT_insert(done, url) < 0) {
+					continue;
+				}
+				header->done++;
+				if (ok) {
+					header->pages++;
+					header->bytes += length;
+				}
+			} else if (HT_contains(done, url)) {
+				continue;
+			} else {
+				header->pending++;
+			}
+			if (writeUrl(out, url) < 0) {
+				fclose(log);
+				return -1;
+			}
+		}
+		if (res < 0 && type == CKPT_DONE) {
+			fprintf(stderr, "[-] Invalid record in %s, the rest of it is ignored\n", path);
+		}
+		fclose(log);
+	}
+	return 0;
+}
+
+
+/* Copy count URLs of the snapshot in to out, leaving out those in skip.
+ * written is increased by the URLs copied. Returns -1 on error */
+int copyUrls(FILE *in, long long count, HashTable *skip, FILE *out, long long *written, char *url) {
+	long long i;
+	for (i = 0; i < count; i++) {
+		if (readUrl(in, url) != 1) {
+			fprintf(stderr, "[-] The checkpoint snapshot is cut short\n");
+			return -1;
+		}
+		if (skip != NULL && HT_contains(skip, url)) {
+			continue;
+		}
+		if (writeUrl(out, url) < 0) {
+			return -1;
+		}
+		(*written)++;
+	}
+	return 0;
+}
+
+
+/* Give the URLs of the snapshot to restore, and its stats. Returns the
+ * number of URLs, -1 on error */
+long loadSnapshot(Checkpoint *ckpt, void (*restore)(char *, int, void *), void *arg, long long *pages, long long *bytes) {
+	SnapshotHeader header;
+	FILE *in;
+	int found = openSnapshot(ckpt, &header, &in);
+	if (found <= 0) {
+		return found;
+	}
+	char *url = malloc(CKPT_MAX_URL + 1);
+	if (url == NULL) {
+		perror("malloc");
+		fclose(in);
+		return -1;
+	}
+
+	long count;
+	for (count = 0; count < header.done + header.pending; count++) {
+		if (readUrl(in, url) != 1) {
+			fprintf(stderr, "[-] The checkpoint snapshot is cut short\n");
+			count = -1;
+			break;
+		}
+		restore(url, count < header.done, arg);
+	}
+	*pages = header.pages;
+	*bytes = header.bytes;
+	free(url);
+	fclose(in);
+	return count;
+}
+
+
+/* Open the snapshot and read its header, which is all 0 if there is no
+ * snapshot. Returns 1 if it was opened, 0 if there is none, -1 on error */
+int openSnapshot(Checkpoint *ckpt, SnapshotHeader *header, FILE **fp) {
+	memset(header, 0, sizeof(SnapshotHeader));
+	char path[PATH_MAX];
+	filePath(ckpt, path, CKPT_SNAPSHOT, -1);
+	*fp = fopen(path, "r");
+	if (*fp == NULL) {
+		if (errno == ENOENT) {
+			return 0;
+		}
+		perror("fopen: checkpoint snapshot");
+		return -1;
+	}
+
+	if (fread(header, sizeof(SnapshotHeader), 1, *fp) != 1
+			|| memcmp(header->magic, CKPT_MAGIC, sizeof(header->magic)) != 0
+			|| header->version != CKPT_VERSION) {
+		fprintf(stderr, "[-] Invalid checkpoint snapshot %s\n", path);
+		fclose(*fp);
+		*fp = NULL;
+		return -1;
+	}
+	return 1;
+}
+
+
+/* Read the next record of a log. Returns 1 if there was one, 0 at the
+ * end of the log (or of its last whole record) and -1 if it is invalid */
+int readRecord(FILE *fp, int *type, int *ok, unsigned int *length, char *url) {
+	int c = fgetc(fp);
+	if (c == EOF) {
+		return 0;
+	}
+	*type = c;
+	*ok = 0;
+	*length = 0;
+	if (c == CKPT_DONE) {
+		int flag = fgetc(fp);
+		if (flag == EOF || fread(length, sizeof(unsigned int), 1, fp) != 1) {
+			return 0;
+		}
+		*ok = flag;
+	} else if (c != CKPT_FOUND) {
+		return -1;
+	}
+	return readUrl(fp, url);
+}
+
+
+/* Read a URL (its length, then its bytes). Returns 1 if there was a
+ * whole one, 0 at the end of the file and -1 if it is invalid */
+int readUrl(FILE *fp, char *url) {
+	unsigned short len;
+	if (fread(&len, sizeof(len), 1, fp) != 1) {
+		return 0;
+	}
+	if (len > CKPT_MAX_URL) {
+		return -1;
+	}
+	if (fread(url, 1, len, fp) != len) {
+		return 0;
+	}
+	url[len] = '\0';
+	return 1;
+}
+
+
+int writeUrl(FILE *fp, char *url) {
+	unsigned short len = strlen(url);
+	if (fwrite(&len, sizeof(len), 1, fp) != 1 || fwrite(url, 1, len, fp) != len) {
+		perror("fwrite: checkpoint snapshot");
+		return -1;
+	}
+	return 0;
+}
+
+
+/* The highest number of the logs in the directory. Returns -1
+ * if there is none, -2 on error */
+long long lastLog(Checkpoint *ckpt) {
+	DIR *dir = opendir(ckpt->dir);
+	if (dir == NULL) {
+		perror("opendir: checkpoint");
+		return -2;
+	}
+	long long last = -1;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		long long number = parseLogName(entry->d_name);
+		if (number > last) {
+			last = number;
+		}
+	}
+	closedir(dir);
+	return last;
+}
+
+
+/* Remove the snapshot and the logs of an earlier crawl. Returns -1 on error */
+int clearDir(Checkpoint *ckpt) {
+	DIR *dir = opendir(ckpt->dir);
+	if (dir == NULL) {
+		perror("opendir: checkpoint");
+		return -1;
+	}
+	char path[PATH_MAX];
+	int res = 0;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		// Other files may be kept in the directory
+		if (parseLogName(entry->d_name) < 0 && strcmp(entry->d_name, CKPT_SNAPSHOT) != 0
+				&& strcmp(entry->d_name, CKPT_SNAPSHOT ".tmp") != 0) {
+			continue;
+		}
+		filePath(ckpt, path, entry->d_name, -1);
+		if (unlink(path) < 0 && errno != ENOENT) {
+			perror("unlink: checkpoint");
+			res = -1;
+		}
+	}
+	closedir(dir);
+	return res;
+}
+
+
+/* The number of the log of a file name, -1 if it isn't a log */
+long long parseLogName(char *name) {
+	int prefixLen = strlen(CKPT_LOG);
+	if (strncmp(name, CKPT_LOG, prefixLen) != 0 || !isdigit((unsigned char) name[prefixLen])) {
+		return -1;
+	}
+	char *end;
+	long long number = strtoll(name + prefixLen, &end, 10);
+	return *end == '\0' ? number : -1;
+}
+
+
+/* The path of a file of the checkpoint, name followed by number if it isn't -1 */
+void filePath(Checkpoint *ckpt, char *path, char *name, long long number) {
+	if (number < 0) {
+		snprintf(path, PATH_MAX, "%s/%s", ckpt->dir, name);
+	} else {
+		snprintf(path, PATH_MAX, "%s/%s%lld", ckpt->dir, name, number);
+	}
+}
@@ -0,0 +1,61 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <pthread.h>
+
+#define CKPT_MAGIC     "MCCK"
+#define CKPT_VERSION   1
+#define CKPT_SNAPSHOT  "snapshot"
+#define CKPT_LOG       "log." // Followed by the number of the log
+#define CKPT_MAX_URL   4095
+#define CKPT_BUF_SIZE  65536 // Bytes of records written at once
+#define CKPT_INTERVAL  30 // Default seconds between checkpoints
+#define CKPT_COMPACT_RATIO 4 // The logs are folded once they are 1/4 of the snapshot
+
+// Records of the logs. A found URL is logged before it is queued, a done one
+// after its page is downloaded (or failed), so a URL found and not done is
+// still to be downloaded
+#define CKPT_FOUND 'U' // Then the length (2 bytes) and the URL
+#define CKPT_DONE  'D' // Then ok (1 byte), the bytes of the page (4), the length (2) and the URL
+
+/* First bytes of the snapshot, followed by the done and the pending URLs,
+ * each as its length (2 bytes) and its bytes */
+typedef struct snapshotHeader {
+	char magic[4];
+	unsigned int version;
+	unsigned long long nextLog; // First log not folded in
+	long long pages; // Downloaded
+	long long bytes;
+	long long done; // URLs downloaded or failed
+	long long pending; // URLs found and not done
+} SnapshotHeader;
+
+/* The state of a crawl kept in a directory: a snapshot of the URLs found and
+ * the stats, and numbered logs appended to by the fetch threads after it. A
+ * checkpoint starts a new log and folds the previous ones into a new snapshot
+ * in its own thread, so the fetch threads only wait for an append */
+typedef struct checkpoint {
+	char *dir;
+	int interval; // Seconds between checkpoints
+
+	int logFd;
+	unsigned long long logNumber; // Of the log appended to
+	long long logSize; // Bytes of the whole records in it
+	long long unfolded; // Bytes of the previous logs left by a failed checkpoint
+	long long snapshotSize;
+	pthread_mutex_t logMtx;
+
+	pthread_t thread;
+	int running;
+	int stop;
+	pthread_mutex_t stopMtx;
+	pthread_cond_t stopCond;
+} Checkpoint;
+
+int checkpointOpen(Checkpoint *, char *, int, int, void (*)(char *, int, void *), void *, long long *, long long *);
+int checkpointFound(Checkpoint *, char **, int *, int);
+int checkpointDone(Checkpoint *, char *, int, int);
+int checkpointWrite(Checkpoint *, int);
+void checkpointClose(Checkpoint *);
+
+#endif // CHECKPOINT_H
@@ -0,0 +1,33 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include "timer_wheel.h"
+#include "arena.h"
+
+#define CONN_READING 0 // Main loop is reading the request headers
+#define CONN_SERVING 1 // A thread is sending the response
+#define CONN_IDLE    2 // Keep-alive connection waiting for the next request
+
+typedef struct connection {
+	int sock;
+	unsigned int addr; // Client IPv4 address (network byte order)
+	int state;
+	int keepAlive; // Client didn't ask to close the connection
+	int timedOut; // Deadline expired while a thread was serving it
+
+	// Memory of the current request, given back after its response.
+	// The first block follows the connection in the same allocation
+	Arena arena;
+
+	// Bytes received for the current request (allocated from the arena)
+	char *buf;
+	int bufSize;
+	int bufOffset;
+
+	Timer timer; // Header read, idle or write deadline depending on state
+
+	unsigned int traceId; // Id of the current request if it is traced, else 0
+	long long traceStart; // Start of its current stage (microseconds)
+} Connection;
+
+#endif // CONNECTION_H
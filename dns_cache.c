@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include "dns_cache.h"
+#include "util.h"
+
+static void *resolverFunc(void *);
+static DnsEntry *findEntry(DnsCache *, char *);
+static long long now(void);
+
+
+int dnsInit(DnsCache *cache, void (*notify)(void *), void *arg) {
+	memset(cache, 0, sizeof(DnsCache));
+	cache->notify = notify;
+	cache->arg = arg;
+	pthread_mutex_init(&(cache->mtx), NULL);
+	pthread_cond_init(&(cache->cond_pending), NULL);
+
+	int i;
+	for (i = 0; i < DNS_THREADS; i++) {
+		if (pthread_create(&(cache->threads[i]), NULL, resolverFunc, cache) != 0) {
+			perror("pthread_create");
+			dnsDestroy(cache);
+			return -1;
+		}
+		cache->threadCount++;
+	}
+	return 0;
+}
+
+
+/* Find the address of name without blocking. Returns DNS_HIT with addr set,
+ * DNS_FAILED if the name is known not to resolve, or DNS_PENDING while a
+ * resolver thread works on it */
+int dnsLookup(DnsCache *cache, char *name, struct in_addr *addr) {
+	pthread_mutex_lock(&(cache->mtx));
+	DnsEntry *entry = findEntry(cache, name);
+	if (entry != NULL) {
+		if (entry->state == DNS_RESOLVING) {
+			pthread_mutex_unlock(&(cache->mtx));
+			return DNS_PENDING;
+		} else if (entry->expires > now()) {
+			cache->hits++;
+			int res = DNS_FAILED;
+			if (entry->state == DNS_RESOLVED) {
+				*addr = entry->addr;
+				res = DNS_HIT;
+			}
+			pthread_mutex_unlock(&(cache->mtx));
+			return res;
+		}
+	} else {
+		entry = calloc(1, sizeof(DnsEntry));
+		if (entry == NULL || (entry->name = malloc((strlen(name) + 1) * sizeof(char))) == NULL) {
+			perror("malloc");
+			free(entry);
+			pthread_mutex_unlock(&(cache->mtx));
+			return DNS_FAILED;
+		}
+		strcpy(entry->name, name);
+		int len;
+		unsigned int bucket = hashString(name, &len) % DNS_BUCKETS;
+		entry->next = cache->buckets[bucket];
+		cache->buckets[bucket] = entry;
+	}
+
+	// Missing or expired: queue it for the resolver threads
+	cache->misses++;
+	entry->state = DNS_RESOLVING;
+	entry->nextPending = NULL;
+	if (cache->pendingLast == NULL) {
+		cache->pendingFirst = entry;
+	} else {
+		cache->pendingLast->nextPending = entry;
+	}
+	cache->pendingLast = entry;
+	pthread_cond_signal(&(cache->cond_pending));
+	pthread_mutex_unlock(&(cache->mtx));
+	return DNS_PENDING;
+}
+
+
+void dnsStats(DnsCache *cache, unsigned long long *hits, unsigned long long *misses) {
+	pthread_mutex_lock(&(cache->mtx));
+	*hits = cache->hits;
+	*misses = cache->misses;
+	pthread_mutex_unlock(&(cache->mtx));
+}
+
+
+/* Stop the resolver threads, after the resolutions in progress */
+void dnsDestroy(DnsCache *cache) {
+	pthread_mutex_lock(&(cache->mtx));
+	cache->stop = 1;
+	pthread_cond_broadcast(&(cache->cond_pending));
+	pthread_mutex_unlock(&(cache->mtx));
+
+	int i;
+	for (i = 0; i < cache->threadCount; i++) {
+		pthread_join(cache->threads[i], NULL);
+	}
+
+	for (i = 0; i < DNS_BUCKETS; i++) {
+		while (cache->buckets[i] != NULL) {
+			DnsEntry *entry = cache->buckets[i];
+			cache->buckets[i] = entry->next;
+			free(entry->name);
+			free(entry);
+		}
+	}
+	pthread_mutex_destroy(&(cache->mtx));
+	pthread_cond_destroy(&(cache->cond_pending));
+}
+
+
+/* Resolve the queued names, one at a time, without holding the lock */
+void *resolverFunc(void *ptr) {
+	DnsCache *cache = (DnsCache *) ptr;
+
+	pthread_mutex_lock(&(cache->mtx));
+	while (1) {
+		while (cache->pendingFirst == NULL && !cache->stop) {
+			pthread_cond_wait(&(cache->cond_pending), &(cache->mtx));
+		}
+		if (cache->stop) {
+			break;
+		}
+
+		DnsEntry *entry = cache->pendingFirst;
+		cache->pendingFirst = entry->nextPending;
+		if (cache->pendingFirst == NULL) {
+			cache->pendingLast = NULL;
+		}
+		// Entries are only freed by dnsDestroy, after this thread exits
+		pthread_mutex_unlock(&(cache->mtx));
+
+		struct addrinfo hints;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_family = AF_INET;
+		struct addrinfo *info = NULL;
+		int res = getaddrinfo(entry->name, NULL, &hints, &info);
+		if (res != 0) {
+			fprintf(stderr, "[-] Could not resolve %s: %s\n", entry->name, gai_strerror(res));
+		}
+
+		pthread_mutex_lock(&(cache->mtx));
+		if (res == 0) {
+			entry->addr = ((struct sockaddr_in *) info->ai_addr)->sin_addr;
+			entry->state = DNS_RESOLVED;
+			entry->expires = now() + DNS_TTL_MS;
+			freeaddrinfo(info);
+		} else {
+			entry->state = DNS_UNKNOWN;
+			entry->expires = now() + DNS_NEGATIVE_TTL_MS;
+		}
+		pthread_mutex_unlock(&(cache->mtx));
+
+		if (cache->notify != NULL) {
+			cache->notify(cache->arg);
+		}
+		pthread_mutex_lock(&(cache->mtx));
+	}
+	pthread_mutex_unlock(&(cache->mtx));
+	return NULL;
+}
+
+
+DnsEntry *findEntry(DnsCache *cache, char *name) {
+	int len;
+	DnsEntry *entry;
+	for (entry = cache->buckets[hashString(name, &len) % DNS_BUCKETS]; entry != NULL; entry = entry->next) {
+		if (strcmp(entry->name, name) == 0) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+
+long long now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,55 @@
+#ifndef DNS_CACHE_H
+#define DNS_CACHE_H
+
+#include <pthread.h>
+#include <netinet/in.h> // struct in_addr
+
+#define DNS_HIT      0
+#define DNS_PENDING  1 // Being resolved, notify is called when it is done
+#define DNS_FAILED  -1
+
+#define DNS_TTL_MS          60000 // getaddrinfo doesn't report the record's TTL
+#define DNS_NEGATIVE_TTL_MS 5000
+#define DNS_BUCKETS         64
+#define DNS_THREADS         2
+
+#define DNS_RESOLVING 0
+#define DNS_RESOLVED  1
+#define DNS_UNKNOWN   2 // The name couldn't be resolved
+
+typedef struct dnsEntry {
+	char *name;
+	int state;
+	struct in_addr addr;
+	long long expires; // CLOCK_MONOTONIC milliseconds
+
+	struct dnsEntry *next; // In the bucket
+	struct dnsEntry *nextPending; // In the queue of the resolver threads
+} DnsEntry;
+
+/* Addresses of the hostnames, shared by the threads. A name missing or expired
+ * is resolved once by a resolver thread, however many threads look it up meanwhile */
+typedef struct dnsCache {
+	DnsEntry *buckets[DNS_BUCKETS];
+	DnsEntry *pendingFirst;
+	DnsEntry *pendingLast;
+	int stop;
+	unsigned long long hits;
+	unsigned long long misses;
+
+	pthread_t threads[DNS_THREADS];
+	int threadCount;
+	pthread_mutex_t mtx;
+	pthread_cond_t cond_pending;
+
+	void (*notify)(void *); // Called by the resolver threads after every resolution
+	void *arg;
+} DnsCache;
+
+
+int dnsInit(DnsCache *, void (*)(void *), void *);
+int dnsLookup(DnsCache *, char *, struct in_addr *);
+void dnsStats(DnsCache *, unsigned long long *, unsigned long long *);
+void dnsDestroy(DnsCache *);
+
+#endif // DNS_CACHE_H
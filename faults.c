@@ -0,0 +1,306 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h> // mmap
+#include "faults.h"
+#include "util.h"
+
+#define LINE_SIZE 256
+
+static int parseRule(FaultRule *, char *, char *, char **);
+static void beginWrite(FaultTable *);
+static void endWrite(FaultTable *);
+static int findRule(FaultTable *, char *);
+static int readRule(FaultTable *, char *, FaultRule *);
+static double uniform(unsigned long long, int);
+
+
+/* The table is placed in shared memory, so that processes forked
+ * after its creation see the same rules */
+FaultTable *faultsCreate(void) {
+	FaultTable *table = mmap(NULL, sizeof(FaultTable), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (table == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+	// Anonymous mappings are zero-filled: no rules and seed 0
+	return table;
+}
+
+
+/* Change the rules. args is one of:
+ *   SEED <n>
+ *   CLEAR
+ *   <prefix> off
+ *   <prefix> [delay=<min>[-<max>]] [drop=<p>] [error=<p>] [truncate=<p>] [trickle=<bytes/s>]
+ * Returns -1 if it is invalid */
+int faultsCommand(FaultTable *table, char *args) {
+	char line[LINE_SIZE];
+	strncpy(line, args, LINE_SIZE - 1);
+	line[LINE_SIZE - 1] = '\0';
+
+	char *savePtr;
+	char *word = strtok_r(line, " \t\r\n", &savePtr);
+	if (word == NULL) {
+		return -1;
+	}
+
+	if (strcmp(word, "SEED") == 0) {
+		char *seed = strtok_r(NULL, " \t\r\n", &savePtr);
+		char *end;
+		if (seed == NULL) {
+			return -1;
+		}
+		unsigned long long value = strtoull(seed, &end, 10);
+		if (*end != '\0' || strtok_r(NULL, " \t\r\n", &savePtr) != NULL) {
+			return -1;
+		}
+
+		// Start every rule over so that the same requests get the same faults
+		beginWrite(table);
+		table->seed = value;
+		memset(table->hits, 0, sizeof(table->hits));
+		endWrite(table);
+		return 0;
+	} else if (strcmp(word, "CLEAR") == 0) {
+		beginWrite(table);
+		table->count = 0;
+		endWrite(table);
+		return 0;
+	}
+
+	// Rules apply to the paths requested, which always start with '/'
+	if (word[0] != '/' || strlen(word) >= MAX_PREFIX_LEN) {
+		return -1;
+	}
+	char *prefix = word;
+	int index = findRule(table, prefix);
+
+	char *option = strtok_r(NULL, " \t\r\n", &savePtr);
+	if (option != NULL && strcmp(option, "off") == 0) {
+		if (index < 0 || strtok_r(NULL, " \t\r\n", &savePtr) != NULL) {
+			return -1;
+		}
+		beginWrite(table);
+		table->count--;
+		table->rules[index] = table->rules[table->count];
+		table->hits[index] = table->hits[table->count];
+		endWrite(table);
+		return 0;
+	}
+
+	FaultRule rule;
+	if (parseRule(&rule, prefix, option, &savePtr) < 0) {
+		return -1;
+	}
+	if (index < 0) {
+		if (table->count == MAX_FAULT_RULES) {
+			return -1;
+		}
+		index = table->count;
+	}
+
+	beginWrite(table);
+	table->rules[index] = rule;
+	table->hits[index] = 0;
+	if (index == table->count) {
+		table->count++;
+	}
+	endWrite(table);
+	return 0;
+}
+
+
+/* Apply the commands of a file, one per line. Empty lines and lines
+ * starting with '#' are ignored */
+int faultsLoad(FaultTable *table, char *filename) {
+	FILE *fp = fopen(filename, "r");
+	if (fp == NULL) {
+		perror("fopen");
+		return -1;
+	}
+
+	char line[LINE_SIZE];
+	int lineNumber = 0;
+	while (fgets(line, LINE_SIZE, fp) != NULL) {
+		lineNumber++;
+		char *start = line + strspn(line, " \t\r\n");
+		if (*start == '\0' || *start == '#') {
+			continue;
+		}
+		if (faultsCommand(table, start) < 0) {
+			fprintf(stderr, "[-] Invalid fault rule at line %d of %s\n", lineNumber, filename);
+			fclose(fp);
+			return -1;
+		}
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+
+/* Write the seed and the rules with the requests they matched in buf.
+ * Returns the length written */
+int faultsList(FaultTable *table, char *buf, int size) {
+	int offset = snprintf(buf, size, "Fault seed %llu, %d rules\n", table->seed, table->count);
+	int i;
+	for (i = 0; i < table->count && offset < size; i++) {
+		FaultRule *rule = &(table->rules[i]);
+		offset += snprintf(buf + offset, size - offset,
+				"%s delay=%d-%d drop=%.3f error=%.3f truncate=%.3f trickle=%d (%llu requests)\n",
+				rule->prefix, rule->delayMin, rule->delayMax, rule->dropRate, rule->errorRate,
+				rule->truncateRate, rule->trickleRate, __atomic_load_n(&(table->hits[i]), __ATOMIC_RELAXED));
+	}
+	return offset < size ? offset : size - 1;
+}
+
+
+/* Pick the faults of a request for path using the rule with the longest
+ * matching prefix. Returns 0 and no faults if no rule matches */
+int faultsDecide(FaultTable *table, char *path, Fault *fault) {
+	memset(fault, 0, sizeof(Fault));
+	fault->limit = -1;
+
+	FaultRule rule;
+	int index = readRule(table, path, &rule);
+	if (index < 0) {
+		return 0;
+	}
+
+	// The decisions only depend on the seed, the rule and the request's position
+	unsigned long long seq = __atomic_fetch_add(&(table->hits[index]), 1, __ATOMIC_RELAXED);
+	unsigned long long seed = __atomic_load_n(&(table->seed), __ATOMIC_RELAXED);
+	unsigned long long base = mixHash(seed ^ mixHash(fnvHash(rule.prefix) ^ mixHash(seq)));
+
+	fault->delayMs = rule.delayMin;
+	if (rule.delayMax > rule.delayMin) {
+		fault->delayMs += mixHash(base) % (rule.delayMax - rule.delayMin + 1);
+	}
+	fault->drop = uniform(base, 1) < rule.dropRate;
+	fault->error = uniform(base, 2) < rule.errorRate;
+	fault->truncate = uniform(base, 3) < rule.truncateRate;
+	fault->trickleRate = rule.trickleRate;
+	return 1;
+}
+
+
+void faultsDestroy(FaultTable *table) {
+	munmap(table, sizeof(FaultTable));
+}
+
+
+/* Parse the options following the prefix. Unset options inject nothing */
+int parseRule(FaultRule *rule, char *prefix, char *option, char **savePtr) {
+	memset(rule, 0, sizeof(FaultRule));
+	strcpy(rule->prefix, prefix);
+	if (option == NULL) {
+		return -1;
+	}
+
+	for (; option != NULL; option = strtok_r(NULL, " \t\r\n", savePtr)) {
+		char *value = strchr(option, '=');
+		if (value == NULL) {
+			return -1;
+		}
+		*value = '\0';
+		value++;
+
+		char *end;
+		if (strcmp(option, "delay") == 0) {
+			rule->delayMin = strtol(value, &end, 10);
+			rule->delayMax = rule->delayMin;
+			if (*end == '-') {
+				rule->delayMax = strtol(end + 1, &end, 10);
+			}
+			if (*end != '\0' || rule->delayMin < 0 || rule->delayMax < rule->delayMin || rule->delayMax > MAX_DELAY_MS) {
+				return -1;
+			}
+		} else if (strcmp(option, "trickle") == 0) {
+			rule->trickleRate = strtol(value, &end, 10);
+			if (*end != '\0' || rule->trickleRate < 0) {
+				return -1;
+			}
+		} else {
+			double rate = strtod(value, &end);
+			if (*end != '\0' || rate < 0 || rate > 1) {
+				return -1;
+			}
+			if (strcmp(option, "drop") == 0) {
+				rule->dropRate = rate;
+			} else if (strcmp(option, "error") == 0) {
+				rule->errorRate = rate;
+			} else if (strcmp(option, "truncate") == 0) {
+				rule->truncateRate = rate;
+			} else {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+
+void beginWrite(FaultTable *table) {
+	__atomic_add_fetch(&(table->version), 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+
+void endWrite(FaultTable *table) {
+	__atomic_add_fetch(&(table->version), 1, __ATOMIC_RELEASE);
+}
+
+
+/* Index of the rule with exactly this prefix (only used by the writer) */
+int findRule(FaultTable *table, char *prefix) {
+	int i;
+	for (i = 0; i < table->count; i++) {
+		if (strcmp(table->rules[i].prefix, prefix) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+
+/* Copy the rule with the longest prefix of path. Retries if the
+ * table changed while reading it. Returns its index or -1 */
+int readRule(FaultTable *table, char *path, FaultRule *rule) {
+	while (1) {
+		unsigned int version = __atomic_load_n(&(table->version), __ATOMIC_ACQUIRE);
+		if (version & 1) {
+			continue;
+		}
+
+		int best = -1;
+		int bestLen = -1;
+		int count = table->count;
+		int i;
+		for (i = 0; i < count && i < MAX_FAULT_RULES; i++) {
+			int len = strnlen(table->rules[i].prefix, MAX_PREFIX_LEN);
+			if (len > bestLen && strncmp(path, table->rules[i].prefix, len) == 0) {
+				best = i;
+				bestLen = len;
+			}
+		}
+		if (best >= 0) {
+			*rule = table->rules[best];
+		}
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&(table->version), __ATOMIC_RELAXED) == version) {
+			if (best >= 0) {
+				rule->prefix[MAX_PREFIX_LEN - 1] = '\0';
+			}
+			return best;
+		}
+	}
+}
+
+
+/* Uniform number in [0, 1) */
+double uniform(unsigned long long base, int salt) {
+	return (mixHash(base + salt) >> 11) * (1.0 / 9007199254740992.0);
+}
+
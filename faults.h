@@ -0,0 +1,50 @@
+#ifndef FAULTS_H
+#define FAULTS_H
+
+#define MAX_FAULT_RULES 16
+#define MAX_PREFIX_LEN  64
+#define MAX_DELAY_MS    60000
+
+/* Misbehaviour injected in the requests whose path starts with prefix */
+typedef struct faultRule {
+	char prefix[MAX_PREFIX_LEN];
+	int delayMin; // Milliseconds, uniformly distributed between min and max
+	int delayMax;
+	double dropRate; // Close the connection without a response
+	double errorRate; // Reply with 503 Service Unavailable
+	double truncateRate; // Close the connection after half of the body
+	int trickleRate; // Bytes per second, 0 to send at full speed
+} FaultRule;
+
+/* Rules set through the command port. The table is in shared memory so that
+ * prefork children see the rules set by the master. Only one process changes
+ * it; the version is odd while it does so and readers retry */
+typedef struct faultTable {
+	unsigned int version;
+	unsigned long long seed;
+	int count;
+	FaultRule rules[MAX_FAULT_RULES];
+	// Requests matched by each rule. The n-th request of a rule always gets
+	// the same faults for a given seed
+	unsigned long long hits[MAX_FAULT_RULES];
+} FaultTable;
+
+/* Faults picked for one request */
+typedef struct fault {
+	int delayMs;
+	int drop;
+	int error;
+	int truncate;
+	int trickleRate;
+	long long limit; // Body bytes left before truncating, -1 if not truncated
+} Fault;
+
+
+FaultTable *faultsCreate(void);
+int faultsCommand(FaultTable *, char *);
+int faultsLoad(FaultTable *, char *);
+int faultsList(FaultTable *, char *, int);
+int faultsDecide(FaultTable *, char *, Fault *);
+void faultsDestroy(FaultTable *);
+
+#endif // FAULTS_H
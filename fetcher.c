@@ -0,0 +1,748 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "fetcher.h"
+#include "requests.h"
+
+#define MAX_EVENTS    64
+#define BUF_SIZE      16384 // Size of the buffer of a connection, bytes read at a time
+#define MAX_HEADERS   16384
+#define CHECK_MS      1000 // Longest sleep before checking the deadlines
+
+static int startFetch(Fetcher *, Fetch *, unsigned int, char *);
+static void assignWaiting(Fetcher *);
+static Conn *checkoutConn(Fetcher *, Host *, int *);
+static int isStale(Conn *);
+static void enqueue(Fetcher *, Conn *, Fetch *);
+static void pushWaiting(Fetcher *, Fetch *);
+static void handleEvent(Fetcher *, Conn *, int);
+static int sendRequests(Conn *);
+static int readResponses(Fetcher *, Conn *);
+static int processResponses(Fetcher *, Conn *);
+static int parseHeaders(Conn *);
+static int growBuffer(Conn *, int);
+static int updateEvents(Fetcher *, Conn *);
+static void connLost(Fetcher *, Conn *);
+static void closeConn(Fetcher *, Conn *);
+static void checkDeadlines(Fetcher *);
+static Host *findHost(Fetcher *, char *, int);
+static void finishFetch(Fetcher *, Fetch *, int);
+static long long now(void);
+
+
+int fetcherInit(Fetcher *fetcher, int maxFetches, int maxPerHost, int pipeline, char *(*next)(void *, unsigned int *),
+		int (*connect)(char *), void *(*begin)(unsigned int, char *, int, void *), void (*part)(void *, char *, int, void *),
+		void (*done)(unsigned int, char *, void *, int, void *), void *arg) {
+	memset(fetcher, 0, sizeof(Fetcher));
+	fetcher->maxFetches = maxFetches;
+	fetcher->maxPerHost = maxPerHost;
+	fetcher->pipeline = pipeline;
+	fetcher->next = next;
+	fetcher->connect = connect;
+	fetcher->begin = begin;
+	fetcher->part = part;
+	fetcher->done = done;
+	fetcher->arg = arg;
+
+	fetcher->fetches = calloc(maxFetches, sizeof(Fetch));
+	if (fetcher->fetches == NULL) {
+		perror("calloc");
+		return -1;
+	}
+	if ((fetcher->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		perror("epoll_create1");
+		free(fetcher->fetches);
+		return -1;
+	}
+	if ((fetcher->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+		perror("eventfd");
+		close(fetcher->epfd);
+		free(fetcher->fetches);
+		return -1;
+	}
+
+	// The eventfd is told apart from the connections by its NULL pointer
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(fetcher->epfd, EPOLL_CTL_ADD, fetcher->wakeFd, &ev) < 0) {
+		perror("epoll_ctl");
+		fetcherDestroy(fetcher);
+		return -1;
+	}
+	return 0;
+}
+
+
+/* Download pages until fetcherStop is called. Downloads in progress
+ * when it is called are abandoned */
+void fetcherRun(Fetcher *fetcher) {
+	struct epoll_event events[MAX_EVENTS];
+
+	while (!__atomic_load_n(&(fetcher->stop), __ATOMIC_ACQUIRE)) {
+		// Fill the free slots
+		int i;
+		for (i = 0; i < fetcher->maxFetches && fetcher->active < fetcher->maxFetches; i++) {
+			if (fetcher->fetches[i].state != FETCH_FREE) {
+				continue;
+			}
+			unsigned int id;
+			char *url = fetcher->next(fetcher->arg, &id);
+			if (url == NULL) {
+				break;
+			}
+			startFetch(fetcher, &(fetcher->fetches[i]), id, url);
+		}
+		assignWaiting(fetcher);
+
+		int nfds = epoll_wait(fetcher->epfd, events, MAX_EVENTS, CHECK_MS);
+		if (nfds < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("epoll_wait");
+			break;
+		}
+
+		// Only the connection of an event can be closed while handling it,
+		// so the pointers of the rest stay valid
+		for (i = 0; i < nfds; i++) {
+			Conn *conn = (Conn *) events[i].data.ptr;
+			if (conn == NULL) {
+				unsigned long long count;
+				read(fetcher->wakeFd, &count, sizeof(count));
+			} else {
+				handleEvent(fetcher, conn, events[i].events);
+			}
+		}
+
+		checkDeadlines(fetcher);
+	}
+
+	// Abandon the downloads in progress and close every connection
+	Host *host;
+	for (host = fetcher->hosts; host != NULL; host = host->next) {
+		while (host->conns != NULL) {
+			Conn *conn = host->conns;
+			while (conn->first != NULL) {
+				Fetch *fetch = conn->first;
+				conn->first = fetch->next;
+				finishFetch(fetcher, fetch, 0);
+			}
+			closeConn(fetcher, conn);
+		}
+	}
+	while (fetcher->waitFirst != NULL) {
+		Fetch *fetch = fetcher->waitFirst;
+		fetcher->waitFirst = fetch->next;
+		finishFetch(fetcher, fetch, 0);
+	}
+	fetcher->waitLast = NULL;
+}
+
+
+/* Make the thread of the fetcher look for new URLs */
+void fetcherWake(Fetcher *fetcher) {
+	unsigned long long one = 1;
+	write(fetcher->wakeFd, &one, sizeof(one));
+}
+
+
+void fetcherStop(Fetcher *fetcher) {
+	__atomic_store_n(&(fetcher->stop), 1, __ATOMIC_RELEASE);
+	fetcherWake(fetcher);
+}
+
+
+void fetcherDestroy(Fetcher *fetcher) {
+	while (fetcher->hosts != NULL) {
+		Host *host = fetcher->hosts;
+		fetcher->hosts = host->next;
+		free(host->name);
+		free(host);
+	}
+	close(fetcher->wakeFd);
+	close(fetcher->epfd);
+	free(fetcher->fetches);
+}
+
+
+/* Prepare the request for url ("http://name:port/path") and make the fetch
+ * wait for a connection. Returns -1 if it failed at once (done has been called) */
+int startFetch(Fetcher *fetcher, Fetch *fetch, unsigned int id, char *url) {
+	memset(fetch, 0, sizeof(Fetch));
+	fetch->id = id;
+	fetch->url = url;
+	fetch->state = FETCH_WAITING;
+	fetch->deadline = now() + FETCH_TIMEOUT_MS;
+	fetcher->active++;
+
+	// Split the URL in host and file
+	char *name = url + 7; // Ignore http://
+	char *file = strchr(name, '/');
+	if (strncmp(url, "http://", 7) != 0 || file == NULL) {
+		finishFetch(fetcher, fetch, 0);
+		return -1;
+	}
+	int nameLen = file - name;
+	char hostname[nameLen + 1];
+	memcpy(hostname, name, nameLen);
+	hostname[nameLen] = '\0';
+
+	fetch->req = createRequestHeaders(hostname, file);
+	fetch->host = findHost(fetcher, hostname, nameLen);
+	if (fetch->req == NULL || fetch->host == NULL) {
+		fprintf(stderr, "[-] Error while creating request\n");
+		finishFetch(fetcher, fetch, 0);
+		return -1;
+	}
+	fetch->reqLen = strlen(fetch->req);
+
+	pushWaiting(fetcher, fetch);
+	return 0;
+}
+
+
+/* Give the waiting fetches a connection, in the order they started */
+void assignWaiting(Fetcher *fetcher) {
+	Fetch *prev = NULL;
+	Fetch *fetch = fetcher->waitFirst;
+	while (fetch != NULL) {
+		Fetch *next = fetch->next;
+		int failed = 0;
+		Conn *conn = checkoutConn(fetcher, fetch->host, &failed);
+		if (conn == NULL && !failed) {
+			prev = fetch; // Every connection to the host is busy
+			fetch = next;
+			continue;
+		}
+
+		if (prev == NULL) {
+			fetcher->waitFirst = next;
+		} else {
+			prev->next = next;
+		}
+		if (fetcher->waitLast == fetch) {
+			fetcher->waitLast = prev;
+		}
+		fetch->next = NULL;
+
+		if (conn == NULL) {
+			fprintf(stderr, "[-] Error while connecting\n");
+			finishFetch(fetcher, fetch, 0);
+		} else {
+			enqueue(fetcher, conn, fetch);
+		}
+		fetch = next;
+	}
+}
+
+
+/* Find a connection for a request to host: an idle one from the pool, else a
+ * new one if the host has less than maxPerHost, else an open one with room in
+ * its pipeline. Returns NULL if there is none yet, setting failed if connecting failed */
+Conn *checkoutConn(Fetcher *fetcher, Host *host, int *failed) {
+	Conn *conn = host->conns;
+	while (conn != NULL) {
+		Conn *next = conn->next;
+		if (conn->state == CONN_IDLE) {
+			if (!isStale(conn)) {
+				return conn;
+			}
+			closeConn(fetcher, conn);
+		}
+		conn = next;
+	}
+
+	if (host->open < fetcher->maxPerHost) {
+		// connect may change the name while parsing it
+		char name[strlen(host->name) + 1];
+		strcpy(name, host->name);
+		int sock = fetcher->connect(name);
+		if (sock == CONNECT_LATER) {
+			return NULL;
+		} else if (sock < 0) {
+			*failed = 1;
+			return NULL;
+		}
+
+		conn = calloc(1, sizeof(Conn));
+		if (conn == NULL) {
+			perror("calloc");
+			close(sock);
+			*failed = 1;
+			return NULL;
+		}
+		conn->sock = sock;
+		conn->state = CONN_CONNECTING;
+		conn->host = host;
+
+		// The socket is writable once connected
+		struct epoll_event ev;
+		ev.events = EPOLLOUT;
+		ev.data.ptr = conn;
+		if (epoll_ctl(fetcher->epfd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+			perror("epoll_ctl");
+			close(sock);
+			free(conn);
+			*failed = 1;
+			return NULL;
+		}
+		conn->events = EPOLLOUT;
+
+		conn->next = host->conns;
+		if (host->conns != NULL) {
+			host->conns->prev = conn;
+		}
+		host->conns = conn;
+		host->open++;
+		return conn;
+	}
+
+	for (conn = host->conns; conn != NULL; conn = conn->next) {
+		if (conn->state == CONN_OPEN && !conn->closing && conn->queued < fetcher->pipeline) {
+			return conn;
+		}
+	}
+	return NULL;
+}
+
+
+/* An idle connection the server has closed (or sent bytes on) can't be used */
+int isStale(Conn *conn) {
+	char byte;
+	int res = recv(conn->sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+	return !(res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+
+void enqueue(Fetcher *fetcher, Conn *conn, Fetch *fetch) {
+	fetch->state = FETCH_QUEUED;
+	fetch->conn = conn;
+	fetch->next = NULL;
+	if (conn->last == NULL) {
+		conn->first = fetch;
+	} else {
+		conn->last->next = fetch;
+	}
+	conn->last = fetch;
+	conn->queued++;
+
+	if (conn->unsent == NULL) {
+		conn->unsent = fetch;
+		conn->unsentOffset = 0;
+	}
+	if (conn->state == CONN_IDLE) {
+		conn->state = CONN_OPEN;
+	}
+	if (updateEvents(fetcher, conn) < 0) {
+		connLost(fetcher, conn);
+	}
+}
+
+
+void pushWaiting(Fetcher *fetcher, Fetch *fetch) {
+	fetch->state = FETCH_WAITING;
+	fetch->conn = NULL;
+	fetch->next = NULL;
+	if (fetcher->waitLast == NULL) {
+		fetcher->waitFirst = fetch;
+	} else {
+		fetcher->waitLast->next = fetch;
+	}
+	fetcher->waitLast = fetch;
+}
+
+
+/* Move the requests of a connection forward after its socket became ready */
+void handleEvent(Fetcher *fetcher, Conn *conn, int events) {
+	if (conn->state == CONN_IDLE) {
+		// Nothing is expected on an idle connection: the server closed it
+		closeConn(fetcher, conn);
+		return;
+	}
+
+	if (conn->state == CONN_CONNECTING) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+		if (getsockopt(conn->sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+			fprintf(stderr, "[-] Error while connecting: %s\n", strerror(err));
+			connLost(fetcher, conn);
+			return;
+		}
+		conn->state = CONN_OPEN;
+	}
+
+	if (conn->unsent != NULL && sendRequests(conn) < 0) {
+		connLost(fetcher, conn);
+		return;
+	}
+
+	if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && readResponses(fetcher, conn) < 0) {
+		connLost(fetcher, conn);
+		return;
+	}
+
+	if (updateEvents(fetcher, conn) < 0) {
+		connLost(fetcher, conn);
+	}
+}
+
+
+/* Write the requests of the queue until the socket is full. Returns -1 on error */
+int sendRequests(Conn *conn) {
+	while (conn->unsent != NULL) {
+		Fetch *fetch = conn->unsent;
+		int written = write(conn->sock, fetch->req + conn->unsentOffset, fetch->reqLen - conn->unsentOffset);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			return -1; // Mostly EPIPE from a connection the server closed
+		}
+		conn->unsentOffset += written;
+		if (conn->unsentOffset == fetch->reqLen) {
+			conn->unsent = fetch->next;
+			conn->unsentOffset = 0;
+		}
+	}
+	return 0;
+}
+
+
+/* Read what the socket has and complete the responses received.
+ * Returns -1 if the connection can't be used anymore */
+int readResponses(Fetcher *fetcher, Conn *conn) {
+	while (1) {
+		if (conn->bufOffset >= conn->bufSize - 1 && growBuffer(conn, conn->bufSize * 2) < 0) {
+			return -1;
+		}
+
+		int bytesRecv = read(conn->sock, conn->buf + conn->bufOffset, conn->bufSize - conn->bufOffset - 1);
+		if (bytesRecv < 0) {
+			if (errno == EINTR) {
+				continue;
+			} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			return -1;
+		} else if (bytesRecv == 0) {
+			// Closed by the server. A response cut short fails in connLost,
+			// so that its page isn't kept (or logged as done) incomplete
+			return -1;
+		}
+
+		conn->bufOffset += bytesRecv;
+		if (processResponses(fetcher, conn) < 0) {
+			return -1;
+		}
+		if (conn->state == CONN_IDLE) {
+			return 0;
+		}
+	}
+}
+
+
+/* Hand the bodies in the buffer to their fetches as they arrive, and finish
+ * the complete ones. Returns -1 if the connection can't be used anymore */
+int processResponses(Fetcher *fetcher, Conn *conn) {
+	while (conn->first != NULL) {
+		Fetch *fetch = conn->first;
+		if (!conn->started) {
+			int res = parseHeaders(conn);
+			if (res <= 0) {
+				return res;
+			}
+			conn->started = 1;
+			conn->bodyLeft = conn->contentLength;
+			if (conn->status == CODE_OK && conn->contentLength > 0) {
+				fetch->page = fetcher->begin(fetch->id, fetch->url, conn->contentLength, fetcher->arg);
+			} else if (conn->status == CODE_OK) {
+				fprintf(stderr, "[-] Received invalid response\n");
+			} else {
+				fprintf(stderr, "[-] Page not found or not accessible\n");
+			}
+		}
+
+		// Hand over the bytes of the body received so far and drop them
+		int length = conn->bufOffset < conn->bodyLeft ? conn->bufOffset : conn->bodyLeft;
+		if (length > 0 && fetch->page != NULL) {
+			fetcher->part(fetch->page, conn->buf, length, fetcher->arg);
+			fetch->received += length;
+		}
+		conn->bodyLeft -= length;
+		// Only the bytes of the next responses are moved
+		memmove(conn->buf, conn->buf + length, conn->bufOffset - length);
+		conn->bufOffset -= length;
+		if (conn->bodyLeft > 0) {
+			return 0;
+		}
+
+		// The response is complete
+		conn->first = fetch->next;
+		if (conn->last == fetch) {
+			conn->last = NULL;
+		}
+		if (conn->unsent == fetch) {
+			conn->unsent = fetch->next;
+			conn->unsentOffset = 0;
+		}
+		conn->queued--;
+		conn->served++;
+		conn->started = 0;
+		conn->searchFrom = 0;
+
+		finishFetch(fetcher, fetch, fetch->page != NULL);
+		if (conn->closing) {
+			return -1;
+		}
+	}
+
+	if (conn->bufOffset > 0) {
+		fprintf(stderr, "[-] Received invalid response\n");
+		return -1;
+	}
+
+	// Nothing is outstanding: return the connection to the pool
+	conn->state = CONN_IDLE;
+	conn->idleSince = now();
+	return 0;
+}
+
+
+/* Parse the status line and headers of the first response once they are complete.
+ * Returns 1 when they are, 0 if more bytes are needed and -1 for invalid responses */
+int parseHeaders(Conn *conn) {
+	conn->buf[conn->bufOffset] = '\0';
+	char *headerEnd = strstr(conn->buf + conn->searchFrom, "\r\n\r\n");
+	if (headerEnd == NULL) {
+		// Only the next bytes (and the 3 before them) can complete "\r\n\r\n"
+		conn->searchFrom = conn->bufOffset > 3 ? conn->bufOffset - 3 : 0;
+		if (conn->bufOffset >= MAX_HEADERS) {
+			fprintf(stderr, "[-] Received invalid response\n");
+			return -1;
+		}
+		return 0;
+	}
+
+	if (strncmp(conn->buf, "HTTP/1.1 ", 9) != 0) {
+		fprintf(stderr, "[-] Received invalid response\n");
+		return -1;
+	}
+	conn->status = atoi(conn->buf + 9);
+
+	// Find Content-Length header to check how much is left to read
+	*headerEnd = '\0';
+	char *lengthHeader = strstr(conn->buf, "Content-Length:");
+	conn->contentLength = lengthHeader == NULL ? -1 : atoi(lengthHeader + 15);
+	if (strstr(conn->buf, "Connection: close") != NULL) {
+		conn->closing = 1;
+	}
+	*headerEnd = '\r';
+	if (conn->contentLength < 0) {
+		fprintf(stderr, "[-] Received invalid response\n");
+		return -1;
+	}
+
+	// The body is handed over from the start of the buffer
+	int headerLen = headerEnd + 4 - conn->buf;
+	memmove(conn->buf, conn->buf + headerLen, conn->bufOffset - headerLen);
+	conn->bufOffset -= headerLen;
+	return 1;
+}
+
+
+int growBuffer(Conn *conn, int size) {
+	if (size < BUF_SIZE) {
+		size = BUF_SIZE;
+	}
+	char *buf = realloc(conn->buf, size);
+	if (buf == NULL) {
+		perror("realloc");
+		return -1;
+	}
+	conn->buf = buf;
+	conn->bufSize = size;
+	return 0;
+}
+
+
+/* Wait for writes only while requests are unsent */
+int updateEvents(Fetcher *fetcher, Conn *conn) {
+	int events = EPOLLIN;
+	if (conn->state == CONN_CONNECTING) {
+		events = EPOLLOUT;
+	} else if (conn->unsent != NULL) {
+		events = EPOLLIN | EPOLLOUT;
+	}
+	if (events == conn->events) {
+		return 0;
+	}
+
+	struct epoll_event ev;
+	ev.events = events;
+	ev.data.ptr = conn;
+	if (epoll_ctl(fetcher->epfd, EPOLL_CTL_MOD, conn->sock, &ev) < 0) {
+		perror("epoll_ctl");
+		return -1;
+	}
+	conn->events = events;
+	return 0;
+}
+
+
+/* Close a connection that failed or that the server closed. The first request
+ * is retried once if its response hadn't started. The ones pipelined behind it
+ * weren't answered yet, so they go back to waiting without using their retry */
+void connLost(Fetcher *fetcher, Conn *conn) {
+	long long current = now();
+	int head = 1;
+	while (conn->first != NULL) {
+		Fetch *fetch = conn->first;
+		conn->first = fetch->next;
+
+		if (fetch->deadline <= current) {
+			fprintf(stderr, "[-] Timed out fetching %s\n", fetch->url);
+			finishFetch(fetcher, fetch, 0);
+		} else if (head && (conn->bufOffset > 0 || conn->started || fetch->retried)) {
+			fprintf(stderr, "[-] Connection lost while fetching %s\n", fetch->url);
+			finishFetch(fetcher, fetch, 0);
+		} else {
+			if (head) {
+				fetch->retried = 1;
+			}
+			pushWaiting(fetcher, fetch);
+		}
+		head = 0;
+	}
+	conn->last = NULL;
+	conn->unsent = NULL;
+	conn->queued = 0;
+	closeConn(fetcher, conn);
+}
+
+
+/* Close a connection without requests */
+void closeConn(Fetcher *fetcher, Conn *conn) {
+	close(conn->sock); // Also removes it from epoll
+
+	Host *host = conn->host;
+	if (conn->prev == NULL) {
+		host->conns = conn->next;
+	} else {
+		conn->prev->next = conn->next;
+	}
+	if (conn->next != NULL) {
+		conn->next->prev = conn->prev;
+	}
+	host->open--;
+
+	free(conn->buf);
+	free(conn);
+}
+
+
+/* Give up on the downloads whose deadline has passed and close
+ * the connections that stayed idle for too long */
+void checkDeadlines(Fetcher *fetcher) {
+	long long current = now();
+
+	Fetch *prev = NULL;
+	Fetch *fetch = fetcher->waitFirst;
+	while (fetch != NULL) {
+		Fetch *next = fetch->next;
+		if (fetch->deadline > current) {
+			prev = fetch;
+			fetch = next;
+			continue;
+		}
+
+		if (prev == NULL) {
+			fetcher->waitFirst = next;
+		} else {
+			prev->next = next;
+		}
+		if (fetcher->waitLast == fetch) {
+			fetcher->waitLast = prev;
+		}
+		fprintf(stderr, "[-] Timed out fetching %s\n", fetch->url);
+		finishFetch(fetcher, fetch, 0);
+		fetch = next;
+	}
+
+	Host *host;
+	for (host = fetcher->hosts; host != NULL; host = host->next) {
+		Conn *conn = host->conns;
+		while (conn != NULL) {
+			Conn *next = conn->next;
+			if (conn->state == CONN_IDLE) {
+				if (conn->idleSince + POOL_IDLE_MS <= current) {
+					closeConn(fetcher, conn);
+				}
+			} else if (conn->first != NULL && conn->first->deadline <= current) {
+				// The responses come in order, so the connection is stuck
+				connLost(fetcher, conn);
+			}
+			conn = next;
+		}
+	}
+}
+
+
+/* Find the pool of a host, creating it the first time */
+Host *findHost(Fetcher *fetcher, char *name, int nameLen) {
+	Host *host;
+	for (host = fetcher->hosts; host != NULL; host = host->next) {
+		if (strcmp(host->name, name) == 0) {
+			return host;
+		}
+	}
+
+	host = calloc(1, sizeof(Host));
+	if (host == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+	host->name = malloc((nameLen + 1) * sizeof(char));
+	if (host->name == NULL) {
+		perror("malloc");
+		free(host);
+		return NULL;
+	}
+	strcpy(host->name, name);
+	host->next = fetcher->hosts;
+	fetcher->hosts = host;
+	return host;
+}
+
+
+/* Hand the state of the page to done and free the slot */
+void finishFetch(Fetcher *fetcher, Fetch *fetch, int ok) {
+	char *url = fetch->url;
+	void *page = fetch->page;
+	free(fetch->req);
+	fetch->req = NULL;
+	fetch->url = NULL;
+	fetch->page = NULL;
+	fetch->conn = NULL;
+	fetch->next = NULL;
+	fetch->state = FETCH_FREE;
+	fetcher->active--;
+
+	fetcher->done(fetch->id, url, page, ok, fetcher->arg);
+}
+
+
+long long now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
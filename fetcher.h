@@ -0,0 +1,120 @@
+#ifndef FETCHER_H
+#define FETCHER_H
+
+#define FETCH_FREE    0
+#define FETCH_WAITING 1 // Waiting for a connection to its host
+#define FETCH_QUEUED  2 // Sent (or about to be sent) on a connection
+
+#define CONN_CONNECTING 0 // Waiting for the non-blocking connect to finish
+#define CONN_OPEN       1
+#define CONN_IDLE       2 // Kept alive in the pool of its host
+
+#define CONNECT_LATER -2 // Returned by connect while the address of the host is resolved
+
+#define FETCH_TIMEOUT_MS 30000
+#define POOL_IDLE_MS     10000 // Below the 15 seconds myhttpd keeps idle connections
+
+struct host;
+struct conn;
+
+/* One page being downloaded */
+typedef struct fetch {
+	int state;
+	unsigned int id; // Given by next with the URL
+	char *url; // Owned by the caller of the fetcher
+	void *page; // Given by begin, NULL until the body starts
+	int received; // Bytes of the body handed to part
+	struct host *host;
+	struct conn *conn; // Connection it is queued on
+	long long deadline; // CLOCK_MONOTONIC milliseconds
+	int retried; // Sent again after its connection closed before the response
+
+	char *req;
+	int reqLen;
+
+	struct fetch *next; // In the waiting list or the queue of its connection
+} Fetch;
+
+/* Persistent HTTP/1.1 connection. Requests are written in the order of the
+ * queue and the responses come back in the same order */
+typedef struct conn {
+	int state;
+	int sock;
+	int events; // Registered in epoll
+	struct host *host;
+	int served; // Responses received
+	int closing; // The server will close it after the first response of the queue
+	long long idleSince;
+
+	Fetch *first; // Queue of the requests waiting for their response
+	Fetch *last;
+	Fetch *unsent; // First request of the queue not completely written
+	int unsentOffset;
+	int queued;
+
+	char *buf; // Bytes received and not handed over, starting with the response of first
+	int bufSize;
+	int bufOffset;
+	int searchFrom; // Where the search for the end of the headers goes on
+	int started; // The headers of the response were parsed, its body is handed over as it arrives
+	int contentLength;
+	int bodyLeft; // Bytes of the body not received yet
+	int status;
+
+	struct conn *prev; // Connections of the host
+	struct conn *next;
+} Conn;
+
+/* Connections open to a "name:port" */
+typedef struct host {
+	char *name;
+	int open;
+	Conn *conns;
+	struct host *next;
+} Host;
+
+/* Event loop driving up to maxFetches downloads at the same time. Pages are
+ * taken from next when a slot is free and handed to done when they finish.
+ * Every fetcher is driven by one thread; other threads only call fetcherWake
+ * and fetcherStop */
+typedef struct fetcher {
+	int epfd;
+	int wakeFd; // eventfd signaled when new URLs are available or to stop
+	int stop;
+	int maxFetches;
+	int active;
+	Fetch *fetches;
+	Fetch *waitFirst; // Fetches without a connection, in the order they started
+	Fetch *waitLast;
+
+	int maxPerHost; // Connections open to a host at the same time
+	int pipeline; // Requests outstanding on a connection, 1 to wait for every response
+	Host *hosts;
+
+	// Returns the next URL and sets its id, or returns NULL if there is none.
+	// The URL must stay valid until it is handed to done
+	char *(*next)(void *, unsigned int *);
+	// Returns a non-blocking socket connecting to host ("name:port"), -1 on error
+	// or CONNECT_LATER to be called again after a wake up
+	int (*connect)(char *);
+	// Called when the body of a page (status 200) starts to arrive, with its
+	// id, URL and length. Returns the state of the page given to part and done
+	void *(*begin)(unsigned int, char *, int, void *);
+	// Receives the next bytes of the body of a page, which it doesn't keep
+	void (*part)(void *, char *, int, void *);
+	// Called when the page is finished, with its id, URL and state (NULL if the
+	// body never started). The last is 0 if the download failed
+	void (*done)(unsigned int, char *, void *, int, void *);
+	void *arg;
+} Fetcher;
+
+
+int fetcherInit(Fetcher *, int, int, int, char *(*)(void *, unsigned int *), int (*)(char *),
+		void *(*)(unsigned int, char *, int, void *), void (*)(void *, char *, int, void *),
+		void (*)(unsigned int, char *, void *, int, void *), void *);
+void fetcherRun(Fetcher *);
+void fetcherWake(Fetcher *);
+void fetcherStop(Fetcher *);
+void fetcherDestroy(Fetcher *);
+
+#endif // FETCHER_H
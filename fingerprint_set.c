@@ -0,0 +1,594 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h> // pread, pwrite
+#include <limits.h> // PATH_MAX
+#include "fingerprint_set.h"
+#include "util.h"
+
+#define SPILL_READ_SLOTS 16 // Index slots read at once (FS_SPILL_SLOTS is a multiple)
+#define KEY_BUF_SIZE     512 // Longer keys are copied to and from the log through malloc
+
+typedef struct spillSlot {
+	unsigned long long hash;
+	unsigned long long offset; // Offset of the key in the log + 1, 0 for empty slots
+} SpillSlot;
+
+static int stripeInsert(FingerprintSet *, FingerprintStripe *, unsigned long long, char *, int);
+static int stripeContains(FingerprintStripe *, unsigned long long, char *, int);
+static void stripeDestroy(FingerprintStripe *);
+static int addFilter(FingerprintSet *, FingerprintStripe *);
+static int filterFull(Filter *);
+static void filterInsert(Filter *, unsigned long long, unsigned long long *);
+static int filterContains(Filter *, unsigned long long);
+static int bucketInsert(Filter *, unsigned long long, unsigned int);
+static unsigned long long altBucket(Filter *, unsigned long long, unsigned int);
+static unsigned int fingerprint(unsigned long long, int);
+static unsigned int getSlot(Filter *, unsigned long long);
+static void setSlot(Filter *, unsigned long long, unsigned int);
+static int spillOpen(Spill *, char *);
+static int spillInsert(Spill *, unsigned long long, char *, int);
+static int spillFind(Spill *, int, unsigned long long, unsigned long long, char *, int, unsigned long long *);
+static int spillMatch(Spill *, long long, char *, int);
+static int spillGrow(Spill *);
+static void spillClose(Spill *);
+static int createFile(char *, long long);
+
+
+/* Create the first filter of every stripe, with fingerprints long enough
+ * for the false positive rate, and the spill files if spillDir isn't NULL.
+ * Returns -1 on error */
+int FS_initialize(FingerprintSet *set, double rate, char *spillDir) {
+	if (rate <= 0 || rate >= 1) {
+		fprintf(stderr, "[-] The false positive rate must be between 0 and 1\n");
+		return -1;
+	}
+
+	// A missing key matches a full filter with a chance of about
+	// 2 * FS_BUCKET_SLOTS / 2^bits and the first filter gets half of the rate
+	int bits = 1;
+	while (bits <= FS_MAX_BITS && (double) (1ULL << bits) * rate < 4 * FS_BUCKET_SLOTS) {
+		bits++;
+	}
+	if (bits > FS_MAX_BITS) {
+		fprintf(stderr, "[-] A false positive rate of %g needs fingerprints over %d bits\n", rate, FS_MAX_BITS);
+		return -1;
+	}
+	set->firstBits = bits;
+	set->spillDir = spillDir;
+
+	int i;
+	for (i = 0; i < FS_STRIPES; i++) {
+		FingerprintStripe *stripe = &(set->stripes[i]);
+		memset(stripe, 0, sizeof(FingerprintStripe));
+		stripe->random = i + 1; // xorshift never leaves 0
+		stripe->spill.logFd = -1;
+		stripe->spill.indexFd = -1;
+		pthread_mutex_init(&(stripe->mtx), NULL);
+
+		if (addFilter(set, stripe) < 0 || (spillDir != NULL && spillOpen(&(stripe->spill), spillDir) < 0)) {
+			for (; i >= 0; i--) {
+				stripeDestroy(&(set->stripes[i]));
+			}
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+/* Insert key if it isn't already in the set. Returns -1 if it is
+ * (or seems to be, without a spill) or if there was an error */
+int FS_insert(FingerprintSet *set, char *key) {
+	int len;
+	unsigned long long h = hashString(key, &len);
+	FingerprintStripe *stripe = &(set->stripes[h >> (64 - FS_STRIPE_BITS)]);
+
+	pthread_mutex_lock(&(stripe->mtx));
+	int res = stripeInsert(set, stripe, h, key, len);
+	pthread_mutex_unlock(&(stripe->mtx));
+	return res;
+}
+
+
+/* Insert count keys, locking each stripe once. isNew[i] is set to 1 if keys[i]
+ * was inserted and to 0 if it already existed (also earlier in keys).
+ * Returns the number of keys inserted, -1 on error */
+int FS_insertBatch(FingerprintSet *set, char **keys, int count, int *isNew) {
+	if (count <= 0) {
+		return 0;
+	}
+	unsigned long long *hashes = malloc(count * sizeof(unsigned long long));
+	int *lens = malloc(count * sizeof(int));
+	if (hashes == NULL || lens == NULL) {
+		perror("malloc");
+		free(hashes);
+		free(lens);
+		return -1;
+	}
+
+	int i;
+	for (i = 0; i < count; i++) {
+		hashes[i] = hashString(keys[i], &lens[i]);
+	}
+	int inserted = FS_insertHashed(set, keys, hashes, lens, count, isNew);
+
+	free(hashes);
+	free(lens);
+	return inserted;
+}
+
+
+/* FS_insertBatch for keys whose hashes (hashString) and lengths are known,
+ * so that the caller can use them again */
+int FS_insertHashed(FingerprintSet *set, char **keys, unsigned long long *hashes, int *lens, int count, int *isNew) {
+	if (count <= 0) {
+		return 0;
+	}
+	int *order = malloc(count * sizeof(int));
+	if (order == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	// Each stripe is then locked once for all of its keys
+	int start[FS_STRIPES + 1];
+	sortByStripe(hashes, count, FS_STRIPE_BITS, order, start);
+
+	int inserted = 0;
+	int i, s;
+	for (s = 0; s < FS_STRIPES; s++) {
+		if (start[s] == start[s + 1]) {
+			continue;
+		}
+		FingerprintStripe *stripe = &(set->stripes[s]);
+		pthread_mutex_lock(&(stripe->mtx));
+		for (i = start[s]; i < start[s + 1]; i++) {
+			int k = order[i];
+			isNew[k] = stripeInsert(set, stripe, hashes[k], keys[k], lens[k]) == 0;
+			inserted += isNew[k];
+		}
+		pthread_mutex_unlock(&(stripe->mtx));
+	}
+
+	free(order);
+	return inserted;
+}
+
+
+int FS_contains(FingerprintSet *set, char *key) {
+	int len;
+	unsigned long long h = hashString(key, &len);
+	FingerprintStripe *stripe = &(set->stripes[h >> (64 - FS_STRIPE_BITS)]);
+
+	pthread_mutex_lock(&(stripe->mtx));
+	int res = stripeContains(stripe, h, key, len);
+	pthread_mutex_unlock(&(stripe->mtx));
+	return res == 1;
+}
+
+
+long FS_size(FingerprintSet *set) {
+	long size = 0;
+	int i;
+	for (i = 0; i < FS_STRIPES; i++) {
+		pthread_mutex_lock(&(set->stripes[i].mtx));
+		size += set->stripes[i].count;
+		pthread_mutex_unlock(&(set->stripes[i].mtx));
+	}
+	return size;
+}
+
+
+/* Bytes taken by the filters */
+long long FS_memory(FingerprintSet *set) {
+	long long bytes = 0;
+	int i, j;
+	for (i = 0; i < FS_STRIPES; i++) {
+		FingerprintStripe *stripe = &(set->stripes[i]);
+		pthread_mutex_lock(&(stripe->mtx));
+		for (j = 0; j < stripe->filterCount; j++) {
+			Filter *filter = &(stripe->filters[j]);
+			bytes += (filter->mask + 1) * FS_BUCKET_SLOTS * filter->bits / 8 + 8;
+		}
+		pthread_mutex_unlock(&(stripe->mtx));
+	}
+	return bytes;
+}
+
+
+/* Number of fingerprint matches checked in the spill and how many of them
+ * were collisions with another key */
+void FS_stats(FingerprintSet *set, unsigned long long *verified, unsigned long long *collisions) {
+	*verified = 0;
+	*collisions = 0;
+	int i;
+	for (i = 0; i < FS_STRIPES; i++) {
+		pthread_mutex_lock(&(set->stripes[i].mtx));
+		*verified += set->stripes[i].verified;
+		*collisions += set->stripes[i].collisions;
+		pthread_mutex_unlock(&(set->stripes[i].mtx));
+	}
+}
+
+
+void FS_destroy(FingerprintSet *set) {
+	int i;
+	for (i = 0; i < FS_STRIPES; i++) {
+		stripeDestroy(&(set->stripes[i]));
+	}
+}
+
+
+/* Called with the stripe locked. New keys go to the last filter and a
+ * larger one is added when it fills up */
+int stripeInsert(FingerprintSet *set, FingerprintStripe *stripe, unsigned long long h, char *key, int len) {
+	if (stripeContains(stripe, h, key, len) != 0) {
+		return -1;
+	}
+	if (filterFull(&(stripe->filters[stripe->filterCount - 1])) && addFilter(set, stripe) < 0) {
+		return -1;
+	}
+	if (stripe->spill.logFd >= 0 && spillInsert(&(stripe->spill), h, key, len) < 0) {
+		return -1;
+	}
+
+	filterInsert(&(stripe->filters[stripe->filterCount - 1]), h, &(stripe->random));
+	stripe->count++;
+	return 0;
+}
+
+
+/* Called with the stripe locked. Returns 1 if the key is in the set, 0 if it
+ * isn't and -1 if the spill couldn't be read */
+int stripeContains(FingerprintStripe *stripe, unsigned long long h, char *key, int len) {
+	// The last filters are the largest, so they are the most likely to match
+	int i;
+	for (i = stripe->filterCount - 1; i >= 0; i--) {
+		if (filterContains(&(stripe->filters[i]), h)) {
+			break;
+		}
+	}
+	if (i < 0) {
+		return 0;
+	}
+	if (stripe->spill.logFd < 0) {
+		return 1;
+	}
+
+	unsigned long long empty;
+	int res = spillFind(&(stripe->spill), stripe->spill.indexFd, stripe->spill.mask, h, key, len, &empty);
+	stripe->verified++;
+	if (res == 0) {
+		stripe->collisions++;
+	}
+	return res;
+}
+
+
+void stripeDestroy(FingerprintStripe *stripe) {
+	int i;
+	for (i = 0; i < stripe->filterCount; i++) {
+		free(stripe->filters[i].slots);
+	}
+	spillClose(&(stripe->spill));
+	pthread_mutex_destroy(&(stripe->mtx));
+}
+
+
+/* Add a filter twice as large as the last one, with fingerprints one bit
+ * longer so that it only takes half of the rate left */
+int addFilter(FingerprintSet *set, FingerprintStripe *stripe) {
+	if (stripe->filterCount == FS_MAX_FILTERS) {
+		fprintf(stderr, "[-] Fingerprint set is full\n");
+		return -1;
+	}
+
+	int level = stripe->filterCount;
+	Filter *filter = &(stripe->filters[level]);
+	unsigned long long buckets = (unsigned long long) FS_INITIAL_BUCKETS << level;
+	filter->bits = set->firstBits + level < FS_MAX_BITS ? set->firstBits + level : FS_MAX_BITS;
+	// Slots are read and written 8 bytes at a time, so 8 more bytes follow the last one
+	filter->slots = calloc(buckets * FS_BUCKET_SLOTS * filter->bits / 8 + 8, 1);
+	if (filter->slots == NULL) {
+		perror("calloc");
+		return -1;
+	}
+	filter->mask = buckets - 1;
+	filter->count = 0;
+	filter->victim = 0;
+
+	stripe->filterCount++;
+	return 0;
+}
+
+
+int filterFull(Filter *filter) {
+	return filter->victim != 0 || (unsigned long long) filter->count * 100 >= (filter->mask + 1) * FS_BUCKET_SLOTS * FS_MAX_LOAD;
+}
+
+
+/* Place the fingerprint of h in one of its buckets. If both are full, a random
+ * fingerprint of the bucket is moved to its other bucket to make room, and so
+ * on. The one still without a slot after FS_MAX_KICKS moves becomes the victim */
+void filterInsert(Filter *filter, unsigned long long h, unsigned long long *random) {
+	unsigned int fp = fingerprint(h, filter->bits);
+	unsigned long long bucket = (h >> 32) & filter->mask;
+	filter->count++;
+	if (bucketInsert(filter, bucket, fp)) {
+		return;
+	}
+	bucket = altBucket(filter, bucket, fp);
+	if (bucketInsert(filter, bucket, fp)) {
+		return;
+	}
+
+	int kick;
+	for (kick = 0; kick < FS_MAX_KICKS; kick++) {
+		// xorshift64
+		*random ^= *random << 13;
+		*random ^= *random >> 7;
+		*random ^= *random << 17;
+		unsigned long long slot = bucket * FS_BUCKET_SLOTS + *random % FS_BUCKET_SLOTS;
+
+		unsigned int evicted = getSlot(filter, slot);
+		setSlot(filter, slot, fp);
+		fp = evicted;
+		bucket = altBucket(filter, bucket, fp);
+		if (bucketInsert(filter, bucket, fp)) {
+			return;
+		}
+	}
+	filter->victim = fp;
+	filter->victimBucket = bucket;
+}
+
+
+int filterContains(Filter *filter, unsigned long long h) {
+	unsigned int fp = fingerprint(h, filter->bits);
+	unsigned long long first = (h >> 32) & filter->mask;
+	unsigned long long second = altBucket(filter, first, fp);
+	if (filter->victim == fp && (filter->victimBucket == first || filter->victimBucket == second)) {
+		return 1;
+	}
+
+	int i;
+	for (i = 0; i < FS_BUCKET_SLOTS; i++) {
+		if (getSlot(filter, first * FS_BUCKET_SLOTS + i) == fp || getSlot(filter, second * FS_BUCKET_SLOTS + i) == fp) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+/* Put fp in an empty slot of the bucket. Returns 0 if it is full */
+int bucketInsert(Filter *filter, unsigned long long bucket, unsigned int fp) {
+	int i;
+	for (i = 0; i < FS_BUCKET_SLOTS; i++) {
+		if (getSlot(filter, bucket * FS_BUCKET_SLOTS + i) == 0) {
+			setSlot(filter, bucket * FS_BUCKET_SLOTS + i, fp);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+/* The other bucket of a fingerprint. Applied twice it gives the first one back */
+unsigned long long altBucket(Filter *filter, unsigned long long bucket, unsigned int fp) {
+	return (bucket ^ ((fp * 0xc6a4a7935bd1e995ULL) >> 32)) & filter->mask;
+}
+
+
+/* The low bits of the hash: the stripe and the bucket come from the high ones */
+unsigned int fingerprint(unsigned long long h, int bits) {
+	unsigned int fp = h & ((1ULL << bits) - 1);
+	return fp != 0 ? fp : 1; // 0 marks empty slots
+}
+
+
+/* The slots are packed in little endian words */
+unsigned int getSlot(Filter *filter, unsigned long long index) {
+	unsigned long long bit = index * filter->bits;
+	unsigned long long word;
+	memcpy(&word, filter->slots + bit / 8, sizeof(word));
+	return (word >> (bit % 8)) & ((1ULL << filter->bits) - 1);
+}
+
+
+void setSlot(Filter *filter, unsigned long long index, unsigned int fp) {
+	unsigned long long bit = index * filter->bits;
+	unsigned long long mask = ((1ULL << filter->bits) - 1) << (bit % 8);
+	unsigned long long word;
+	memcpy(&word, filter->slots + bit / 8, sizeof(word));
+	word = (word & ~mask) | ((unsigned long long) fp << (bit % 8));
+	memcpy(filter->slots + bit / 8, &word, sizeof(word));
+}
+
+
+int spillOpen(Spill *spill, char *dir) {
+	spill->dir = dir;
+	spill->mask = FS_SPILL_SLOTS - 1;
+	if ((spill->logFd = createFile(dir, 0)) < 0) {
+		return -1;
+	}
+	if ((spill->indexFd = createFile(dir, FS_SPILL_SLOTS * sizeof(SpillSlot))) < 0) {
+		close(spill->logFd);
+		spill->logFd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+
+/* Append the key to the log and add it to the index. Returns -1 on error */
+int spillInsert(Spill *spill, unsigned long long h, char *key, int len) {
+	if ((unsigned long long) (spill->count + 1) * 100 > (spill->mask + 1) * FS_SPILL_LOAD && spillGrow(spill) < 0) {
+		return -1;
+	}
+	unsigned long long empty;
+	if (spillFind(spill, spill->indexFd, spill->mask, h, NULL, 0, &empty) < 0) {
+		return -1;
+	}
+
+	char stackBuf[KEY_BUF_SIZE];
+	int size = sizeof(int) + len;
+	char *record = size <= KEY_BUF_SIZE ? stackBuf : malloc(size);
+	if (record == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	memcpy(record, &len, sizeof(int));
+	memcpy(record + sizeof(int), key, len);
+	int written = pwrite(spill->logFd, record, size, spill->logSize);
+	if (record != stackBuf) {
+		free(record);
+	}
+	if (written != size) {
+		perror("pwrite");
+		return -1;
+	}
+
+	SpillSlot slot = { h, spill->logSize + 1 };
+	if (pwrite(spill->indexFd, &slot, sizeof(SpillSlot), empty * sizeof(SpillSlot)) != sizeof(SpillSlot)) {
+		perror("pwrite");
+		return -1;
+	}
+	spill->logSize += size;
+	spill->count++;
+	return 0;
+}
+
+
+/* Probe the index in fd for h. Returns 1 if key is there and 0 if it isn't,
+ * with the empty slot where it would go in *empty; -1 on error. Without a key
+ * (when the index grows) only the empty slot is looked for */
+int spillFind(Spill *spill, int fd, unsigned long long mask, unsigned long long h, char *key, int len, unsigned long long *empty) {
+	SpillSlot slots[SPILL_READ_SLOTS];
+	unsigned long long i = h & mask;
+	while (1) {
+		// Read up to the end of the index at most, the probe goes on from its start
+		unsigned long long count = mask + 1 - i < SPILL_READ_SLOTS ? mask + 1 - i : SPILL_READ_SLOTS;
+		if (pread(fd, slots, count * sizeof(SpillSlot), i * sizeof(SpillSlot)) != (ssize_t) (count * sizeof(SpillSlot))) {
+			perror("pread");
+			return -1;
+		}
+
+		unsigned long long j;
+		for (j = 0; j < count; j++) {
+			if (slots[j].offset == 0) {
+				*empty = i + j;
+				return 0;
+			}
+			if (key != NULL && slots[j].hash == h) {
+				int res = spillMatch(spill, slots[j].offset - 1, key, len);
+				if (res != 0) {
+					return res;
+				}
+			}
+		}
+		i = (i + count) & mask;
+	}
+}
+
+
+/* Compare key with the one at offset in the log. Returns 1 if they are
+ * the same, 0 if they aren't and -1 on error */
+int spillMatch(Spill *spill, long long offset, char *key, int len) {
+	char stackBuf[KEY_BUF_SIZE];
+	int size = sizeof(int) + len;
+	char *record = size <= KEY_BUF_SIZE ? stackBuf : malloc(size);
+	if (record == NULL) {
+		perror("malloc");
+		return -1;
+	}
+
+	// A shorter key at the end of the log gives fewer bytes
+	int res = -1;
+	int bytes = pread(spill->logFd, record, size, offset);
+	if (bytes < 0) {
+		perror("pread");
+	} else {
+		int storedLen = -1;
+		if (bytes >= (int) sizeof(int)) {
+			memcpy(&storedLen, record, sizeof(int));
+		}
+		res = storedLen == len && bytes == size && memcmp(record + sizeof(int), key, len) == 0;
+	}
+
+	if (record != stackBuf) {
+		free(record);
+	}
+	return res;
+}
+
+
+/* Move the index to a file twice as large */
+int spillGrow(Spill *spill) {
+	unsigned long long size = (spill->mask + 1) * 2;
+	int fd = createFile(spill->dir, size * sizeof(SpillSlot));
+	if (fd < 0) {
+		return -1;
+	}
+
+	SpillSlot slots[SPILL_READ_SLOTS];
+	unsigned long long i, j;
+	for (i = 0; i <= spill->mask; i += SPILL_READ_SLOTS) {
+		if (pread(spill->indexFd, slots, sizeof(slots), i * sizeof(SpillSlot)) != sizeof(slots)) {
+			perror("pread");
+			close(fd);
+			return -1;
+		}
+		for (j = 0; j < SPILL_READ_SLOTS; j++) {
+			if (slots[j].offset == 0) {
+				continue;
+			}
+			unsigned long long empty;
+			if (spillFind(spill, fd, size - 1, slots[j].hash, NULL, 0, &empty) < 0) {
+				close(fd);
+				return -1;
+			}
+			if (pwrite(fd, &(slots[j]), sizeof(SpillSlot), empty * sizeof(SpillSlot)) != sizeof(SpillSlot)) {
+				perror("pwrite");
+				close(fd);
+				return -1;
+			}
+		}
+	}
+
+	close(spill->indexFd);
+	spill->indexFd = fd;
+	spill->mask = size - 1;
+	return 0;
+}
+
+
+void spillClose(Spill *spill) {
+	if (spill->logFd >= 0) {
+		close(spill->logFd);
+	}
+	if (spill->indexFd >= 0) {
+		close(spill->indexFd);
+	}
+}
+
+
+/* Create a file of size bytes (all 0) in dir. It is unlinked right away,
+ * so it goes away with its descriptor */
+int createFile(char *dir, long long size) {
+	char path[PATH_MAX];
+	snprintf(path, PATH_MAX, "%s/visited.XXXXXX", dir);
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		perror("mkstemp");
+		return -1;
+	}
+	unlink(path);
+
+	if (ftruncate(fd, size) < 0) {
+		perror("ftruncate");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
@@ -0,0 +1,76 @@
+#ifndef FINGERPRINT_SET_H
+#define FINGERPRINT_SET_H
+
+#include <pthread.h>
+
+#define FS_STRIPES         64 // Independent sets, each behind its own lock
+#define FS_STRIPE_BITS     6
+#define FS_BUCKET_SLOTS    4 // Fingerprints in a bucket
+#define FS_INITIAL_BUCKETS 256 // Buckets of the first filter of a stripe (a power of 2)
+#define FS_MAX_FILTERS     16 // Every filter of a stripe is twice as large as the previous
+#define FS_MAX_LOAD        90 // Percent of the slots used before a stripe adds a filter
+#define FS_MAX_KICKS       500 // Fingerprints moved by an insert before a filter counts as full
+#define FS_MAX_BITS        32
+#define FS_SPILL_SLOTS     1024 // Slots of the index of a spill at first (a power of 2)
+#define FS_SPILL_LOAD      50 // Percent of the index slots used before it grows
+
+/* Cuckoo filter. The fingerprint of a key is stored in one of two buckets:
+ * the second is found from the first and the fingerprint, so fingerprints can
+ * be moved without their key. The slots are packed, bits bits each, 0 = empty */
+typedef struct filter {
+	unsigned char *slots;
+	unsigned long long mask; // Buckets - 1
+	int bits;
+	long count;
+	unsigned int victim; // Fingerprint left without a slot, which fills the filter
+	unsigned long long victimBucket;
+} Filter;
+
+/* Exact copy of the keys of a stripe on disk, used to check the keys whose
+ * fingerprint matches. The keys are appended to the log (length, then the
+ * bytes) and the index is an open addressing table of (hash, log offset + 1).
+ * Both files are unlinked as soon as they are created */
+typedef struct spill {
+	char *dir;
+	int logFd; // -1 without a spill
+	int indexFd;
+	long long logSize;
+	unsigned long long mask; // Index slots - 1
+	long count;
+} Spill;
+
+typedef struct fingerprintStripe {
+	Filter filters[FS_MAX_FILTERS]; // New keys go to the last one
+	int filterCount;
+	long count;
+	unsigned long long random; // State of the choices of the evictions
+
+	Spill spill;
+	unsigned long long verified; // Fingerprint matches checked in the spill
+	unsigned long long collisions; // Matches that were another key
+
+	pthread_mutex_t mtx;
+} FingerprintStripe;
+
+/* Set of strings keeping only a fingerprint of each one, so it may claim that a
+ * new key was already inserted. Every filter gets half of the remaining budget,
+ * so the rate of these errors stays below the one given (until the fingerprints
+ * reach FS_MAX_BITS bits). With a spill directory every match is checked on
+ * disk and the set is exact */
+typedef struct fingerprintSet {
+	FingerprintStripe stripes[FS_STRIPES];
+	int firstBits; // Fingerprint bits of the first filter of a stripe
+	char *spillDir; // NULL without a spill
+} FingerprintSet;
+
+int FS_initialize(FingerprintSet *, double, char *);
+int FS_insert(FingerprintSet *, char *);
+int FS_insertBatch(FingerprintSet *, char **, int, int *);
+int FS_insertHashed(FingerprintSet *, char **, unsigned long long *, int *, int, int *);
+int FS_contains(FingerprintSet *, char *);
+long FS_size(FingerprintSet *);
+long long FS_memory(FingerprintSet *);
+void FS_stats(FingerprintSet *, unsigned long long *, unsigned long long *);
+void FS_destroy(FingerprintSet *);
+
+#endif // FINGERPRINT_SET_H
@@ -0,0 +1,326 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h> // INT_MAX
+#include "frontier.h"
+#include "util.h"
+
+static FrontierHost *findHost(Frontier *, char *, int);
+static int growStripe(HostStripe *);
+static int pushUrl(FrontierHost *, unsigned int);
+static void schedule(Frontier *, int, FrontierHost *);
+static int dequePush(HostDeque *, FrontierHost *);
+static FrontierHost *dequePop(HostDeque *);
+static FrontierHost *dequeSteal(HostDeque *);
+
+
+/* Create the host index and a deque for each of the threads. The URLs are
+ * given as ids of urls. maxPerHost is the number of URLs of a host out at the
+ * same time, 0 for no limit. Returns -1 on error */
+int frontierInit(Frontier *frontier, UrlTable *urls, int threads, int maxPerHost) {
+	memset(frontier, 0, sizeof(Frontier));
+	frontier->urls = urls;
+	frontier->maxPerHost = maxPerHost > 0 ? maxPerHost : INT_MAX;
+
+	int i;
+	for (i = 0; i < FRONTIER_STRIPES; i++) {
+		pthread_mutex_init(&(frontier->stripes[i].mtx), NULL);
+	}
+	for (i = 0; i < FRONTIER_STRIPES; i++) {
+		HostStripe *stripe = &(frontier->stripes[i]);
+		stripe->buckets = calloc(FRONTIER_INITIAL_BUCKETS, sizeof(FrontierHost *));
+		if (stripe->buckets == NULL) {
+			perror("calloc");
+			frontierDestroy(frontier);
+			return -1;
+		}
+		stripe->mask = FRONTIER_INITIAL_BUCKETS - 1;
+	}
+
+	frontier->deques = calloc(threads, sizeof(HostDeque));
+	if (frontier->deques == NULL) {
+		perror("calloc");
+		frontierDestroy(frontier);
+		return -1;
+	}
+	frontier->dequeCount = threads;
+	for (i = 0; i < threads; i++) {
+		pthread_mutex_init(&(frontier->deques[i].mtx), NULL);
+	}
+	return 0;
+}
+
+
+/* Queue the URL of id, which mustn't be queued already. If its host can hand
+ * it out, the host is scheduled in the deque of thread self. Returns -1 on error */
+int frontierAdd(Frontier *frontier, int self, unsigned int id) {
+	FrontierHost *host = findHost(frontier, UT_get(frontier->urls, id), 1);
+	if (host == NULL) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&(host->mtx));
+	if (pushUrl(host, id) < 0) {
+		pthread_mutex_unlock(&(host->mtx));
+		return -1;
+	}
+	// Before the URL being parsed is done, so that the count can't reach 0 meanwhile
+	__atomic_add_fetch(&(frontier->outstanding), 1, __ATOMIC_RELAXED);
+	schedule(frontier, self, host);
+	pthread_mutex_unlock(&(host->mtx));
+	return 0;
+}
+
+
+/* Set *id to the next URL of a host of the deque of self, or of a host stolen
+ * from the deque of another thread if it is empty. Returns -1 if no host can
+ * hand out one */
+int frontierNext(Frontier *frontier, int self, unsigned int *id) {
+	while (1) {
+		FrontierHost *host = dequePop(&(frontier->deques[self]));
+		int i;
+		for (i = 1; host == NULL && i < frontier->dequeCount; i++) {
+			host = dequeSteal(&(frontier->deques[(self + i) % frontier->dequeCount]));
+		}
+		if (host == NULL) {
+			return -1;
+		}
+
+		// A stolen host is scheduled again in the deque of the thief
+		pthread_mutex_lock(&(host->mtx));
+		host->scheduled = 0;
+		int found = host->count > 0;
+		if (found) {
+			*id = host->urls[host->first];
+			host->first = (host->first + 1) % host->size;
+			host->count--;
+			host->active++;
+		}
+		if (host->count == 0 && host->size > HOST_INITIAL_URLS) {
+			// Give back the room taken by a burst of URLs
+			free(host->urls);
+			host->urls = NULL;
+			host->size = 0;
+		}
+		schedule(frontier, self, host);
+		pthread_mutex_unlock(&(host->mtx));
+
+		if (found) {
+			return 0;
+		}
+	}
+}
+
+
+/* A URL handed out has been downloaded (or failed). Its host may hand out
+ * another one. Returns 1 if nothing is queued or out anymore */
+int frontierDone(Frontier *frontier, int self, unsigned int id) {
+	FrontierHost *host = findHost(frontier, UT_get(frontier->urls, id), 0);
+	if (host != NULL) {
+		pthread_mutex_lock(&(host->mtx));
+		host->active--;
+		schedule(frontier, self, host);
+		pthread_mutex_unlock(&(host->mtx));
+	}
+	return __atomic_sub_fetch(&(frontier->outstanding), 1, __ATOMIC_ACQ_REL) == 0;
+}
+
+
+/* URLs queued or handed out */
+long frontierOutstanding(Frontier *frontier) {
+	return __atomic_load_n(&(frontier->outstanding), __ATOMIC_RELAXED);
+}
+
+
+void frontierDestroy(Frontier *frontier) {
+	int i;
+	unsigned long long j;
+	for (i = 0; i < FRONTIER_STRIPES; i++) {
+		HostStripe *stripe = &(frontier->stripes[i]);
+		for (j = 0; stripe->buckets != NULL && j <= stripe->mask; j++) {
+			while (stripe->buckets[j] != NULL) {
+				FrontierHost *host = stripe->buckets[j];
+				stripe->buckets[j] = host->next;
+				free(host->urls);
+				pthread_mutex_destroy(&(host->mtx));
+				free(host->name);
+				free(host);
+			}
+		}
+		free(stripe->buckets);
+		pthread_mutex_destroy(&(stripe->mtx));
+	}
+
+	for (i = 0; i < frontier->dequeCount; i++) {
+		free(frontier->deques[i].hosts);
+		pthread_mutex_destroy(&(frontier->deques[i].mtx));
+	}
+	free(frontier->deques);
+}
+
+
+/* Find the host ("name:port" after http://) of url in the index.
+ * If it isn't there and create is set, it is added */
+FrontierHost *findHost(Frontier *frontier, char *url, int create) {
+	char *name = strncmp(url, "http://", 7) == 0 ? url + 7 : url;
+	int len = strcspn(name, "/");
+	unsigned long long h = hashBytes(name, len);
+	HostStripe *stripe = &(frontier->stripes[h >> (64 - FRONTIER_STRIPE_BITS)]);
+
+	pthread_mutex_lock(&(stripe->mtx));
+	FrontierHost *host;
+	for (host = stripe->buckets[h & stripe->mask]; host != NULL; host = host->next) {
+		if (host->hash == h && strncmp(host->name, name, len) == 0 && host->name[len] == '\0') {
+			break;
+		}
+	}
+
+	if (host == NULL && create) {
+		// Keep one host per bucket on average. If it can't grow, the chains get longer
+		if ((unsigned long long) stripe->count + 1 > stripe->mask + 1) {
+			growStripe(stripe);
+		}
+
+		host = calloc(1, sizeof(FrontierHost));
+		if (host == NULL || (host->name = malloc(len + 1)) == NULL) {
+			perror("malloc");
+			free(host);
+			pthread_mutex_unlock(&(stripe->mtx));
+			return NULL;
+		}
+		memcpy(host->name, name, len);
+		host->name[len] = '\0';
+		host->hash = h;
+		pthread_mutex_init(&(host->mtx), NULL);
+
+		host->next = stripe->buckets[h & stripe->mask];
+		stripe->buckets[h & stripe->mask] = host;
+		stripe->count++;
+	}
+	pthread_mutex_unlock(&(stripe->mtx));
+	return host;
+}
+
+
+/* Called with the stripe locked */
+int growStripe(HostStripe *stripe) {
+	unsigned long long size = (stripe->mask + 1) * 2;
+	FrontierHost **buckets = calloc(size, sizeof(FrontierHost *));
+	if (buckets == NULL) {
+		perror("calloc");
+		return -1;
+	}
+
+	unsigned long long i;
+	for (i = 0; i <= stripe->mask; i++) {
+		while (stripe->buckets[i] != NULL) {
+			FrontierHost *host = stripe->buckets[i];
+			stripe->buckets[i] = host->next;
+			host->next = buckets[host->hash & (size - 1)];
+			buckets[host->hash & (size - 1)] = host;
+		}
+	}
+	free(stripe->buckets);
+	stripe->buckets = buckets;
+	stripe->mask = size - 1;
+	return 0;
+}
+
+
+/* Called with the host locked. Add id after its other URLs */
+int pushUrl(FrontierHost *host, unsigned int id) {
+	if (host->count == host->size) {
+		int size = host->size > 0 ? host->size * 2 : HOST_INITIAL_URLS;
+		unsigned int *urls = malloc(size * sizeof(unsigned int));
+		if (urls == NULL) {
+			perror("malloc");
+			return -1;
+		}
+		// Move the ids to the start of the new array
+		int i;
+		for (i = 0; i < host->count; i++) {
+			urls[i] = host->urls[(host->first + i) % host->size];
+		}
+		free(host->urls);
+		host->urls = urls;
+		host->size = size;
+		host->first = 0;
+	}
+
+	host->urls[(host->first + host->count) % host->size] = id;
+	host->count++;
+	return 0;
+}
+
+
+/* Called with the host locked. Put it in the deque of self if it isn't in
+ * one, has URLs and may hand out one more */
+void schedule(Frontier *frontier, int self, FrontierHost *host) {
+	if (host->scheduled || host->count == 0 || host->active >= frontier->maxPerHost) {
+		return;
+	}
+	// Without memory it stays out, until one of its URLs is added or done
+	if (dequePush(&(frontier->deques[self]), host) == 0) {
+		host->scheduled = 1;
+	}
+}
+
+
+int dequePush(HostDeque *deque, FrontierHost *host) {
+	pthread_mutex_lock(&(deque->mtx));
+	if (deque->count == deque->size) {
+		int size = deque->size > 0 ? deque->size * 2 : DEQUE_INITIAL_SIZE;
+		FrontierHost **hosts = malloc(size * sizeof(FrontierHost *));
+		if (hosts == NULL) {
+			perror("malloc");
+			pthread_mutex_unlock(&(deque->mtx));
+			return -1;
+		}
+		// Move the hosts to the start of the new array
+		int i;
+		for (i = 0; i < deque->count; i++) {
+			hosts[i] = deque->hosts[(deque->top + i) % deque->size];
+		}
+		free(deque->hosts);
+		deque->hosts = hosts;
+		deque->size = size;
+		deque->top = 0;
+	}
+
+	deque->hosts[(deque->top + deque->count) % deque->size] = host;
+	__atomic_store_n(&(deque->count), deque->count + 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&(deque->mtx));
+	return 0;
+}
+
+
+/* Take the host pushed last */
+FrontierHost *dequePop(HostDeque *deque) {
+	FrontierHost *host = NULL;
+	pthread_mutex_lock(&(deque->mtx));
+	if (deque->count > 0) {
+		__atomic_store_n(&(deque->count), deque->count - 1, __ATOMIC_RELAXED);
+		host = deque->hosts[(deque->top + deque->count) % deque->size];
+	}
+	pthread_mutex_unlock(&(deque->mtx));
+	return host;
+}
+
+
+/* Take the host pushed first. Idle threads look at every deque, so the empty
+ * ones are skipped without taking their lock */
+FrontierHost *dequeSteal(HostDeque *deque) {
+	if (__atomic_load_n(&(deque->count), __ATOMIC_RELAXED) == 0) {
+		return NULL;
+	}
+
+	FrontierHost *host = NULL;
+	pthread_mutex_lock(&(deque->mtx));
+	if (deque->count > 0) {
+		host = deque->hosts[deque->top];
+		deque->top = (deque->top + 1) % deque->size;
+		__atomic_store_n(&(deque->count), deque->count - 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&(deque->mtx));
+	return host;
+}
@@ -0,0 +1,67 @@
+#ifndef FRONTIER_H
+#define FRONTIER_H
+
+#include <pthread.h>
+#include "url_table.h"
+
+#define FRONTIER_STRIPES         64 // Parts of the host index, each behind its own lock
+#define FRONTIER_STRIPE_BITS     6
+#define FRONTIER_INITIAL_BUCKETS 16 // Buckets of a stripe at first (a power of 2)
+#define DEQUE_INITIAL_SIZE       64
+#define HOST_INITIAL_URLS        4 // Ids a host has room for at first
+
+/* URLs of one host waiting to be downloaded */
+typedef struct frontierHost {
+	char *name; // "name:port"
+	unsigned long long hash;
+	unsigned int *urls; // Circular list of the ids of the URLs, in the order they were added
+	int size;
+	int first;
+	int count;
+	int active; // URLs handed out and not done yet
+	int scheduled; // In a deque: it has URLs and may hand out one more
+	pthread_mutex_t mtx;
+
+	struct frontierHost *next; // In its bucket of the index
+} FrontierHost;
+
+/* Hosts of the index whose hash picks the stripe. Hosts are never removed */
+typedef struct hostStripe {
+	FrontierHost **buckets;
+	unsigned long long mask; // Buckets - 1
+	int count;
+	pthread_mutex_t mtx;
+} HostStripe;
+
+/* Circular list of the scheduled hosts of a thread. The thread pushes and
+ * pops them at the bottom, the other threads steal them from the top */
+typedef struct hostDeque {
+	FrontierHost **hosts;
+	int size;
+	int top;
+	int count;
+	pthread_mutex_t mtx;
+} HostDeque;
+
+/* URLs to download, queued by host. A host is scheduled in at most one deque
+ * at a time, so only the thread taking it from there hands out its URLs, and
+ * at most maxPerHost of them are out at the same time. Duplicates are left to
+ * the caller (the visited set) */
+typedef struct frontier {
+	UrlTable *urls; // Of the ids
+	HostStripe stripes[FRONTIER_STRIPES];
+	HostDeque *deques; // One per thread
+	int dequeCount;
+	int maxPerHost;
+	long outstanding; // URLs queued or handed out (atomic)
+} Frontier;
+
+
+int frontierInit(Frontier *, UrlTable *, int, int);
+int frontierAdd(Frontier *, int, unsigned int);
+int frontierNext(Frontier *, int, unsigned int *);
+int frontierDone(Frontier *, int, unsigned int);
+long frontierOutstanding(Frontier *);
+void frontierDestroy(Frontier *);
+
+#endif // FRONTIER_H
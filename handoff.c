@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include "handoff.h"
+
+#define MAX_FDS 8
+
+
+/* Pass open file descriptors through a Unix domain socket (SCM_RIGHTS) */
+int sendListeners(int sock, int *fds, int count) {
+	if (count <= 0 || count > MAX_FDS) {
+		return -1;
+	}
+
+	// At least one byte of data has to be sent with the descriptors
+	char data = (char) count;
+	struct iovec iov;
+	iov.iov_base = &data;
+	iov.iov_len = 1;
+
+	char control[CMSG_SPACE(MAX_FDS * sizeof(int))];
+	memset(control, 0, sizeof(control));
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+
+	while (sendmsg(sock, &msg, 0) < 0) {
+		if (errno != EINTR) {
+			perror("sendmsg");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+/* Receive exactly count file descriptors sent with sendListeners.
+ * The received descriptors are marked close-on-exec */
+int recvListeners(int sock, int *fds, int count) {
+	if (count <= 0 || count > MAX_FDS) {
+		return -1;
+	}
+
+	char data;
+	struct iovec iov;
+	iov.iov_base = &data;
+	iov.iov_len = 1;
+
+	char control[CMSG_SPACE(MAX_FDS * sizeof(int))];
+	memset(control, 0, sizeof(control));
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	int res;
+	while ((res = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0) {
+		if (errno != EINTR) {
+			perror("recvmsg");
+			return -1;
+		}
+	}
+	if (res == 0) {
+		fprintf(stderr, "[-] Listening sockets were not received\n");
+		return -1;
+	}
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+			cmsg->cmsg_len != CMSG_LEN(count * sizeof(int))) {
+		fprintf(stderr, "[-] Received invalid listening sockets\n");
+		return -1;
+	}
+	memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+	return 0;
+}
@@ -0,0 +1,11 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+// Environment variable telling a new server which socket carries the listeners
+#define HANDOFF_ENV "MYHTTPD_HANDOFF_FD"
+#define HANDOFF_READY 'R'
+
+int sendListeners(int, int *, int);
+int recvListeners(int, int *, int);
+
+#endif // HANDOFF_H
@@ -2,76 +2,226 @@
 #include <stdlib.h>
 #include <string.h>
 #include "hash_table.h"
+#include "util.h"
 
+static int stripeInsert(Stripe *, unsigned long long, char *, int);
+static int stripeContains(Stripe *, unsigned long long, char *);
+static Slot *probe(Slot *, unsigned long long, unsigned long long, char *);
+static int grow(Stripe *);
+static void migrate(Stripe *, unsigned long long);
 
-/* https://en.wikipedia.org/wiki/Jenkins_hash_function */
-static unsigned long hash(char *key) {
-	unsigned long hash = 0;
+
+/* Allocate the first slots of every stripe. Returns -1 on error */
+int HT_initialize(HashTable *table) {
 	int i;
-	for (i = 0; i < strlen(key); i++) {
-		hash += key[i];
-		hash += (hash << 10);
-		hash ^= (hash >> 6);
+	for (i = 0; i < HT_STRIPES; i++) {
+		Stripe *stripe = &(table->stripes[i]);
+		memset(stripe, 0, sizeof(Stripe));
+		stripe->slots = calloc(HT_INITIAL_SLOTS, sizeof(Slot));
+		if (stripe->slots == NULL) {
+			perror("calloc");
+			for (i--; i >= 0; i--) {
+				free(table->stripes[i].slots);
+				pthread_mutex_destroy(&(table->stripes[i].mtx));
+			}
+			return -1;
+		}
+		stripe->mask = HT_INITIAL_SLOTS - 1;
+		arenaInit(&(stripe->keys), NULL, 0);
+		pthread_mutex_init(&(stripe->mtx), NULL);
 	}
-	hash += (hash << 3);
-	hash ^= (hash >> 11);
-	hash += (hash << 15);
+	return 0;
+}
+
+
+/* Insert new entry in Hash Table if the key doesn't already exist.
+ * Returns -1 if it does (or if there was no memory for it) */
+int HT_insert(HashTable *table, char *key) {
+	int len;
+	unsigned long long h = hashString(key, &len);
+	Stripe *stripe = &(table->stripes[h >> (64 - HT_STRIPE_BITS)]);
 
-	return hash % TABLE_SIZE;
+	pthread_mutex_lock(&(stripe->mtx));
+	int res = stripeInsert(stripe, h, key, len);
+	pthread_mutex_unlock(&(stripe->mtx));
+	return res;
 }
 
 
-/* Initialize hash table buckets to NULL */
-void HT_initialize(HashTable *table) {
-	unsigned long i;
-	for (i = 0; i < TABLE_SIZE; i++) {
-		table->entries[i] = NULL;
+/* Insert count keys, locking each stripe once. isNew[i] is set to 1 if keys[i]
+ * was inserted and to 0 if it already existed (also earlier in keys).
+ * Returns the number of keys inserted, -1 on error */
+int HT_insertBatch(HashTable *table, char **keys, int count, int *isNew) {
+	if (count <= 0) {
+		return 0;
+	}
+	unsigned long long *hashes = malloc(count * sizeof(unsigned long long));
+	int *lens = malloc(count * sizeof(int));
+	int *order = malloc(count * sizeof(int));
+	if (hashes == NULL || lens == NULL || order == NULL) {
+		perror("malloc");
+		free(hashes);
+		free(lens);
+		free(order);
+		return -1;
+	}
+
+	int i;
+	for (i = 0; i < count; i++) {
+		hashes[i] = hashString(keys[i], &lens[i]);
+	}
+	// Each stripe is then locked once for all of its keys
+	int start[HT_STRIPES + 1];
+	sortByStripe(hashes, count, HT_STRIPE_BITS, order, start);
+
+	int inserted = 0;
+	int s;
+	for (s = 0; s < HT_STRIPES; s++) {
+		if (start[s] == start[s + 1]) {
+			continue;
+		}
+		Stripe *stripe = &(table->stripes[s]);
+		pthread_mutex_lock(&(stripe->mtx));
+		for (i = start[s]; i < start[s + 1]; i++) {
+			int k = order[i];
+			isNew[k] = stripeInsert(stripe, hashes[k], keys[k], lens[k]) == 0;
+			inserted += isNew[k];
+		}
+		pthread_mutex_unlock(&(stripe->mtx));
 	}
+
+	free(hashes);
+	free(lens);
+	free(order);
+	return inserted;
 }
 
 
-/* Insert new entry in Hash Table if the key doesn't already exist. */
-int HT_insert(HashTable *table, char *key) {
-	unsigned long index = hash(key);
+int HT_contains(HashTable *table, char *key) {
+	int len;
+	unsigned long long h = hashString(key, &len);
+	Stripe *stripe = &(table->stripes[h >> (64 - HT_STRIPE_BITS)]);
 
-	// Check if key already exists
-	Entry *entry = table->entries[index];
-	while (entry != NULL) {
-		if (strcmp(entry->key, key) == 0) {
-			return -1;
-		}
-		entry = entry->next;
+	pthread_mutex_lock(&(stripe->mtx));
+	int res = stripeContains(stripe, h, key);
+	pthread_mutex_unlock(&(stripe->mtx));
+	return res;
+}
+
+
+long HT_size(HashTable *table) {
+	long size = 0;
+	int i;
+	for (i = 0; i < HT_STRIPES; i++) {
+		pthread_mutex_lock(&(table->stripes[i].mtx));
+		size += table->stripes[i].count;
+		pthread_mutex_unlock(&(table->stripes[i].mtx));
 	}
+	return size;
+}
 
-	// Create new entry
-	Entry *newEntry = malloc(sizeof(Entry));
-	if (newEntry == NULL) {
-		perror("malloc");
+
+/* Free Hash Table memory */
+void HT_destroy(HashTable *table) {
+	int i;
+	for (i = 0; i < HT_STRIPES; i++) {
+		Stripe *stripe = &(table->stripes[i]);
+		free(stripe->slots);
+		free(stripe->oldSlots);
+		arenaDestroy(&(stripe->keys));
+		pthread_mutex_destroy(&(stripe->mtx));
+	}
+}
+
+
+/* Called with the stripe locked */
+int stripeInsert(Stripe *stripe, unsigned long long h, char *key, int len) {
+	migrate(stripe, HT_MIGRATE_STEP);
+
+	if (stripeContains(stripe, h, key)) {
+		return -1;
+	}
+	if ((unsigned long long) (stripe->count + 1) * 100 > (stripe->mask + 1) * HT_MAX_LOAD && grow(stripe) < 0) {
+		return -1;
+	}
+
+	char *copy = arenaAlloc(&(stripe->keys), len + 1);
+	if (copy == NULL) {
 		return -1;
 	}
-	newEntry->key = malloc((strlen(key) + 1) * sizeof(char));
-	strcpy(newEntry->key, key);
+	memcpy(copy, key, len + 1);
 
-	// Insert the new entry at the start of the chain of calculated index
-	newEntry->next = table->entries[index];
-	table->entries[index] = newEntry;
+	Slot *slot = probe(stripe->slots, stripe->mask, h, key);
+	slot->hash = h;
+	slot->key = copy;
+	stripe->count++;
 	return 0;
 }
 
 
-/* Free Hash Table memory */
-void HT_destroy(HashTable *table) {
-	unsigned long i;
-	for (i = 0; i < TABLE_SIZE; i++) {
-		if (table->entries[i] != NULL) {
-			Entry *temp;
-			Entry *curr = table->entries[i];
-			while (curr != NULL) {
-				temp = curr;
-				curr = curr->next;
-				free(temp->key);
-				free(temp);
-			}
+/* Called with the stripe locked. A key being moved is in one of the tables */
+int stripeContains(Stripe *stripe, unsigned long long h, char *key) {
+	if (probe(stripe->slots, stripe->mask, h, key)->key != NULL) {
+		return 1;
+	}
+	return stripe->oldSlots != NULL && probe(stripe->oldSlots, stripe->oldMask, h, key)->key != NULL;
+}
+
+
+/* Find the slot of key, or the empty slot where it would be inserted.
+ * The hashes are compared first, so strcmp only runs for the key itself */
+Slot *probe(Slot *slots, unsigned long long mask, unsigned long long h, char *key) {
+	unsigned long long i = h & mask;
+	while (slots[i].key != NULL) {
+		if (slots[i].hash == h && strcmp(slots[i].key, key) == 0) {
+			break;
 		}
+		i = (i + 1) & mask;
+	}
+	return &(slots[i]);
+}
+
+
+/* Double the slots. The keys stay in the old ones until they are moved */
+int grow(Stripe *stripe) {
+	// The previous resize must be over: finish it now
+	migrate(stripe, stripe->oldMask + 1);
+
+	unsigned long long size = (stripe->mask + 1) * 2;
+	Slot *slots = calloc(size, sizeof(Slot));
+	if (slots == NULL) {
+		perror("calloc");
+		return -1;
+	}
+	stripe->oldSlots = stripe->slots;
+	stripe->oldMask = stripe->mask;
+	stripe->migrated = 0;
+	stripe->slots = slots;
+	stripe->mask = size - 1;
+	return 0;
+}
+
+
+/* Move up to step old slots to the new table. The old slots aren't
+ * cleared, so that the probe sequences of the rest stay intact */
+void migrate(Stripe *stripe, unsigned long long step) {
+	if (stripe->oldSlots == NULL) {
+		return;
+	}
+
+	unsigned long long end = stripe->migrated + step;
+	if (end > stripe->oldMask + 1) {
+		end = stripe->oldMask + 1;
+	}
+	for (; stripe->migrated < end; stripe->migrated++) {
+		Slot *old = &(stripe->oldSlots[stripe->migrated]);
+		if (old->key != NULL) {
+			*probe(stripe->slots, stripe->mask, old->hash, old->key) = *old;
+		}
+	}
+
+	if (stripe->migrated > stripe->oldMask) {
+		free(stripe->oldSlots);
+		stripe->oldSlots = NULL;
 	}
 }
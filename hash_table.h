@@ -1,20 +1,47 @@
 #ifndef HASH_TABLE_H
 #define HASH_TABLE_H
 
-#define TABLE_SIZE 5077 // 5077 is a prime number
+#include <pthread.h>
+#include "arena.h"
 
-typedef struct entry {
-	char *key;
+#define HT_STRIPES       64 // Independent tables, each behind its own lock
+#define HT_STRIPE_BITS   6
+#define HT_INITIAL_SLOTS 64 // Slots of a stripe at first (a power of 2)
+#define HT_MAX_LOAD      75 // Percent of the slots used before a stripe grows
+#define HT_MIGRATE_STEP  32 // Old slots moved by every insert while a stripe grows
 
-	struct entry *next;
-} Entry;
+typedef struct slot {
+	unsigned long long hash;
+	char *key; // NULL for empty slots
+} Slot;
 
+/* Open addressing table with linear probing. When it grows, the keys are
+ * moved from oldSlots a few at a time by the following inserts, so no
+ * insert pays for the whole resize; lookups check both tables meanwhile */
+typedef struct stripe {
+	Slot *slots;
+	unsigned long long mask; // Number of slots - 1
+	int count; // Keys in slots and oldSlots
+
+	Slot *oldSlots; // NULL when not growing
+	unsigned long long oldMask;
+	unsigned long long migrated; // Old slots moved so far
+
+	Arena keys; // Copies of the keys, only freed with the table
+	pthread_mutex_t mtx;
+} Stripe;
+
+/* Set of strings. The top bits of a key's hash pick its stripe, so
+ * threads only wait for each other when they use the same stripe */
 typedef struct table {
-	Entry *entries[TABLE_SIZE];
+	Stripe stripes[HT_STRIPES];
 } HashTable;
 
-void HT_initialize(HashTable *);
+int HT_initialize(HashTable *);
 int HT_insert(HashTable *, char *);
+int HT_insertBatch(HashTable *, char **, int, int *);
+int HT_contains(HashTable *, char *);
+long HT_size(HashTable *);
 void HT_destroy(HashTable *);
 
 #endif // HASH_TABLE_H
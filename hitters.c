@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h> // mmap
+#include "hitters.h"
+#include "util.h"
+
+#define SKETCH_MASK (SKETCH_WIDTH - 1)
+#define READ_RETRIES 8
+
+static void atomicMax(unsigned long long *, unsigned long long);
+static int readHitter(Hitter *, Hitter *);
+static int compareHitters(const void *, const void *);
+
+
+/* The table is placed in shared memory, so that processes forked
+ * after its creation update the same counters */
+HitterTable *hittersCreate(void) {
+	HitterTable *table = mmap(NULL, sizeof(HitterTable), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (table == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+	// Anonymous mappings are zero-filled, every slot starts empty
+	return table;
+}
+
+
+/* Count a request for path that sent the given bytes. Only atomic
+ * operations are used, so it can be called by every thread at once */
+void hittersUpdate(HitterTable *table, char *path, long long bytes) {
+	unsigned long long hash = fnvHash(path);
+	if (hash == 0) { // Reserved for empty slots
+		hash = 1;
+	}
+	// Row indexes derived from two halves of the hash (Kirsch-Mitzenmacher)
+	unsigned int h1 = (unsigned int) hash;
+	unsigned int h2 = (unsigned int) (hash >> 32) | 1;
+
+	unsigned long long estCount = 0;
+	unsigned long long estBytes = 0;
+	int row;
+	for (row = 0; row < SKETCH_DEPTH; row++) {
+		unsigned int col = (h1 + row * h2) & SKETCH_MASK;
+		unsigned long long c = __atomic_add_fetch(&(table->counts[row][col]), 1, __ATOMIC_RELAXED);
+		unsigned long long b = __atomic_add_fetch(&(table->bytes[row][col]), bytes, __ATOMIC_RELAXED);
+		// The estimate is the least overcounted row
+		if (row == 0 || c < estCount) {
+			estCount = c;
+		}
+		if (row == 0 || b < estBytes) {
+			estBytes = b;
+		}
+	}
+
+	// Update the path if it is already a candidate and find the weakest candidate
+	int minIndex = 0;
+	unsigned long long minCount = ~0ULL;
+	int i;
+	for (i = 0; i < TOP_K; i++) {
+		Hitter *slot = &(table->top[i]);
+		if (__atomic_load_n(&(slot->hash), __ATOMIC_ACQUIRE) == hash) {
+			atomicMax(&(slot->count), estCount);
+			atomicMax(&(slot->bytes), estBytes);
+			return;
+		}
+		unsigned long long count = __atomic_load_n(&(slot->count), __ATOMIC_RELAXED);
+		if (count < minCount) {
+			minCount = count;
+			minIndex = i;
+		}
+	}
+
+	// Space-saving: a path that is now counted more than the weakest
+	// candidate takes its slot
+	if (estCount <= minCount) {
+		return;
+	}
+	Hitter *slot = &(table->top[minIndex]);
+	unsigned int version = __atomic_load_n(&(slot->version), __ATOMIC_ACQUIRE);
+	if ((version & 1) || !__atomic_compare_exchange_n(&(slot->version), &version, version + 1,
+			0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		return; // Another thread is replacing it. The next request will try again
+	}
+	if (__atomic_load_n(&(slot->count), __ATOMIC_RELAXED) < estCount) {
+		strncpy(slot->path, path, MAX_PATH_LEN - 1);
+		slot->path[MAX_PATH_LEN - 1] = '\0';
+		__atomic_store_n(&(slot->count), estCount, __ATOMIC_RELAXED);
+		__atomic_store_n(&(slot->bytes), estBytes, __ATOMIC_RELAXED);
+		__atomic_store_n(&(slot->hash), hash, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&(slot->version), version + 2, __ATOMIC_RELEASE);
+}
+
+
+/* Copy at most n heavy hitters, most requested first, and return how many were copied */
+int hittersTop(HitterTable *table, Hitter *results, int n) {
+	Hitter all[TOP_K];
+	int found = 0;
+	int i;
+	for (i = 0; i < TOP_K; i++) {
+		if (readHitter(&(table->top[i]), &all[found]) && all[found].hash != 0) {
+			found++;
+		}
+	}
+
+	qsort(all, found, sizeof(Hitter), compareHitters);
+	if (n > found) {
+		n = found;
+	}
+	memcpy(results, all, n * sizeof(Hitter));
+	return n;
+}
+
+
+void hittersDestroy(HitterTable *table) {
+	munmap(table, sizeof(HitterTable));
+}
+
+
+/* Take a consistent copy of a slot. Returns 0 if it kept changing */
+int readHitter(Hitter *slot, Hitter *copy) {
+	int tries;
+	for (tries = 0; tries < READ_RETRIES; tries++) {
+		unsigned int before = __atomic_load_n(&(slot->version), __ATOMIC_ACQUIRE);
+		if (before & 1) {
+			continue;
+		}
+		copy->hash = __atomic_load_n(&(slot->hash), __ATOMIC_ACQUIRE);
+		copy->count = __atomic_load_n(&(slot->count), __ATOMIC_RELAXED);
+		copy->bytes = __atomic_load_n(&(slot->bytes), __ATOMIC_RELAXED);
+		memcpy(copy->path, slot->path, MAX_PATH_LEN);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&(slot->version), __ATOMIC_RELAXED) == before) {
+			copy->path[MAX_PATH_LEN - 1] = '\0';
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+void atomicMax(unsigned long long *target, unsigned long long value) {
+	unsigned long long curr = __atomic_load_n(target, __ATOMIC_RELAXED);
+	while (curr < value && !__atomic_compare_exchange_n(target, &curr, value,
+			1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		// curr was reloaded by the failed exchange
+	}
+}
+
+
+int compareHitters(const void *a, const void *b) {
+	const Hitter *x = a;
+	const Hitter *y = b;
+	if (x->count != y->count) {
+		return x->count < y->count ? 1 : -1;
+	}
+	return strcmp(x->path, y->path);
+}
@@ -0,0 +1,34 @@
+#ifndef HITTERS_H
+#define HITTERS_H
+
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH 4096 // Must be a power of 2
+#define TOP_K        64
+#define MAX_PATH_LEN 128
+
+/* Candidate heavy hitter. The slot is replaced without a lock: the version
+ * is odd while a thread rewrites it, so readers retry and writers back off */
+typedef struct hitter {
+	unsigned int version;
+	unsigned long long hash; // 0 if the slot is empty
+	unsigned long long count;
+	unsigned long long bytes;
+	char path[MAX_PATH_LEN];
+} Hitter;
+
+/* Count-min sketch of requests and bytes per path plus a space-saving
+ * table of the most requested paths. Its size doesn't depend on the
+ * number of distinct paths */
+typedef struct hitterTable {
+	unsigned long long counts[SKETCH_DEPTH][SKETCH_WIDTH];
+	unsigned long long bytes[SKETCH_DEPTH][SKETCH_WIDTH];
+	Hitter top[TOP_K];
+} HitterTable;
+
+
+HitterTable *hittersCreate(void);
+void hittersUpdate(HitterTable *, char *, long long);
+int hittersTop(HitterTable *, Hitter *, int);
+void hittersDestroy(HitterTable *);
+
+#endif // HITTERS_H
@@ -0,0 +1,641 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h> // strncasecmp
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "link_extractor.h"
+
+static void openTag(LinkExtractor *);
+static void startRaw(LinkExtractor *, const char *, int);
+static const char *scanComment(LinkExtractor *, const char *, const char *);
+static const char *scanRaw(LinkExtractor *, const char *, const char *);
+static int tagIs(LinkExtractor *, const char *, int);
+static int mayOpen(LinkExtractor *, const char *, int);
+static int endValue(LinkExtractor *, const char *, const char *, const char *);
+static void holdValue(LinkExtractor *, const char *, const char *);
+static int addSpan(LinkExtractor *, const char *, const char *, const char *, int);
+static int decodeEntity(const char *, int, char *, int *);
+static int isBlank(char);
+static const char *findTag(LinkExtractor *, const char *, const char *);
+static const char *find(LinkExtractor *, const char *, const char *, char);
+static const char *findTagScalar(const char *, const char *);
+static const char *findScalar(const char *, const char *, char);
+#if defined(__SSE2__)
+static const char *findTagSse2(const char *, const char *);
+static const char *findSse2(const char *, const char *, char);
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+static const char *findTagAvx2(const char *, const char *) __attribute__((target("avx2")));
+static const char *findAvx2(const char *, const char *, char) __attribute__((target("avx2")));
+#endif
+
+// Named entities decoded in the links
+static const struct {
+	char *name;
+	char c;
+} entities[] = {{"amp;", '&'}, {"lt;", '<'}, {"gt;", '>'}, {"quot;", '"'}, {"apos;", '\''}};
+
+
+/* scan is one of LINK_SCAN_*. Returns -1 if the CPU can't run it */
+int linkExtractorInit(LinkExtractor *ex, int scan) {
+	memset(ex, 0, sizeof(LinkExtractor));
+#if defined(__x86_64__) || defined(__i386__)
+	int avx2 = __builtin_cpu_supports("avx2");
+#else
+	int avx2 = 0;
+#endif
+#if defined(__SSE2__)
+	int sse2 = 1;
+#else
+	int sse2 = 0;
+#endif
+
+	if (scan == LINK_SCAN_AUTO) {
+		scan = avx2 ? LINK_SCAN_AVX2 : sse2 ? LINK_SCAN_SSE2 : LINK_SCAN_SCALAR;
+	}
+	if ((scan == LINK_SCAN_AVX2 && !avx2) || (scan == LINK_SCAN_SSE2 && !sse2)) {
+		return -1;
+	}
+	ex->scan = scan;
+	return 0;
+}
+
+
+/* Start a new page */
+void linkExtractorReset(LinkExtractor *ex) {
+	ex->count = 0;
+	ex->state = LX_TEXT;
+	ex->heldUsed = 0;
+	ex->pending = 0;
+	ex->holding = 0;
+}
+
+
+/* Find the links of a whole page of length bytes. Returns the number of
+ * spans (all of them in page), -1 on error */
+int extractLinks(LinkExtractor *ex, const char *page, int length) {
+	linkExtractorReset(ex);
+	return extractLinksPart(ex, page, length);
+}
+
+
+/* Find the href values of the <a> tags in the next length bytes of the page,
+ * in any attribute order and quoting style. Comments and the text of <script>
+ * and <style> are skipped. Returns the number of spans, -1 on error */
+int extractLinksPart(LinkExtractor *ex, const char *part, int length) {
+	const char *end = part + length;
+	const char *p = part;
+	ex->count = 0;
+
+	// The value ended in the last part was handed out with it
+	if (ex->heldUsed > 0) {
+		memmove(ex->held, ex->held + ex->heldUsed, ex->pending);
+		ex->heldUsed = 0;
+	}
+	const char *value = part; // Start of the value being read in this part
+
+	while (p < end) {
+		switch (ex->state) {
+		case LX_TEXT:
+			if ((p = findTag(ex, p, end)) == end) {
+				// A '<' ending the part needs the next one to tell its tag
+				if (end[-1] == '<') {
+					ex->state = LX_OPEN;
+					ex->tagLen = 0;
+				}
+				break;
+			}
+			p++;
+			ex->state = LX_OPEN;
+			ex->tagLen = 0;
+			break;
+
+		case LX_OPEN:
+			while (p < end && ex->state == LX_OPEN) {
+				ex->tag[ex->tagLen++] = *p++;
+				openTag(ex);
+			}
+			break;
+
+		case LX_ATTRS:
+			while (p < end && (isBlank(*p) || *p == '/')) {
+				p++;
+			}
+			if (p == end) {
+				break;
+			}
+			if (*p == '>') {
+				p++;
+				ex->state = LX_TEXT;
+			} else {
+				ex->nameLen = 0;
+				ex->state = LX_NAME;
+			}
+			break;
+
+		case LX_NAME:
+			// The name ends at a blank, '=' or the end of the tag
+			while (p < end && !isBlank(*p) && *p != '=' && *p != '>' && *p != '/') {
+				if (ex->nameLen < 4) {
+					ex->name[ex->nameLen] = *p;
+				}
+				ex->nameLen++;
+				p++;
+			}
+			if (p < end) {
+				ex->state = LX_AFTER_NAME;
+			}
+			break;
+
+		case LX_AFTER_NAME:
+			while (p < end && isBlank(*p)) {
+				p++;
+			}
+			if (p == end) {
+				break;
+			}
+			if (*p == '=') {
+				p++;
+				ex->state = LX_BEFORE_VALUE;
+			} else {
+				ex->state = LX_ATTRS; // No value
+			}
+			break;
+
+		case LX_BEFORE_VALUE:
+			while (p < end && isBlank(*p)) {
+				p++;
+			}
+			if (p == end) {
+				break;
+			}
+			ex->isHref = !ex->found && ex->nameLen == 4 && strncasecmp(ex->name, "href", 4) == 0;
+			ex->found |= ex->isHref;
+			if (*p == '"' || *p == '\'') {
+				ex->quote = *p++;
+				ex->state = LX_QUOTED;
+			} else {
+				ex->state = LX_UNQUOTED;
+			}
+			value = p;
+			break;
+
+		case LX_QUOTED: {
+			const char *valueEnd = find(ex, p, end, ex->quote);
+			if (valueEnd == end) {
+				holdValue(ex, value, end);
+				p = end;
+				break;
+			}
+			if (endValue(ex, part, value, valueEnd) < 0) {
+				return -1;
+			}
+			p = valueEnd + 1;
+			ex->state = LX_ATTRS;
+			break;
+		}
+
+		case LX_UNQUOTED:
+			while (p < end && !isBlank(*p) && *p != '>') {
+				p++;
+			}
+			if (p == end) {
+				holdValue(ex, value, end);
+				break;
+			}
+			if (endValue(ex, part, value, p) < 0) {
+				return -1;
+			}
+			ex->state = LX_ATTRS;
+			break;
+
+		case LX_COMMENT:
+			p = scanComment(ex, p, end);
+			break;
+
+		case LX_RAW:
+			p = scanRaw(ex, p, end);
+			break;
+		}
+	}
+	return ex->count;
+}
+
+
+/* Copy the length bytes of a link to out, decoding its entities, and end it
+ * with a NULL byte. out must have room for length + 1 bytes: a decoded entity
+ * is never longer than its text. Returns the length of the decoded link */
+int decodeLink(const char *link, int length, char *out) {
+	int len = 0;
+	int i = 0;
+	while (i < length) {
+		int written;
+		int used;
+		if (link[i] == '&' && (used = decodeEntity(link + i + 1, length - i - 1, out + len, &written)) > 0) {
+			i += 1 + used;
+			len += written;
+		} else {
+			out[len++] = link[i++];
+		}
+	}
+	out[len] = '\0';
+	return len;
+}
+
+
+void linkExtractorDestroy(LinkExtractor *ex) {
+	free(ex->spans);
+	free(ex->held);
+	ex->spans = NULL;
+	ex->held = NULL;
+	ex->count = 0;
+	ex->size = 0;
+}
+
+
+/* Tell the tag from the bytes after '<' read so far: an <a> tag, a comment,
+ * <script>, <style> or one of no interest. It stays LX_OPEN if more are needed */
+void openTag(LinkExtractor *ex) {
+	if (tagIs(ex, "a", 1)) {
+		// The byte after the name is read already
+		ex->found = 0;
+		ex->state = ex->tag[1] == '>' ? LX_TEXT : LX_ATTRS;
+	} else if (ex->tagLen == 3 && memcmp(ex->tag, "!--", 3) == 0) {
+		ex->dashes = 0;
+		ex->state = LX_COMMENT;
+	} else if (tagIs(ex, "script", 6)) {
+		startRaw(ex, "script", 6);
+	} else if (tagIs(ex, "style", 5)) {
+		startRaw(ex, "style", 5);
+	} else if (!mayOpen(ex, "a", 2) && !mayOpen(ex, "!--", 3) && !mayOpen(ex, "script", 7) && !mayOpen(ex, "style", 6)) {
+		// A '<' read after the first one may start the tag
+		int i;
+		for (i = ex->tagLen - 1; i >= 0 && ex->tag[i] != '<'; i--);
+		if (i < 0) {
+			ex->state = LX_TEXT;
+			return;
+		}
+		ex->tagLen -= i + 1;
+		memmove(ex->tag, ex->tag + i + 1, ex->tagLen);
+		if (ex->tagLen > 0) {
+			openTag(ex);
+		}
+	}
+}
+
+
+/* The bytes after '<' may still become name, which is told after len bytes */
+int mayOpen(LinkExtractor *ex, const char *name, int len) {
+	int nameLen = strlen(name);
+	return ex->tagLen < len && strncasecmp(ex->tag, name, ex->tagLen < nameLen ? ex->tagLen : nameLen) == 0;
+}
+
+
+void startRaw(LinkExtractor *ex, const char *name, int len) {
+	ex->raw = name;
+	ex->rawLen = len;
+	ex->rawMatched = 0;
+	ex->state = LX_RAW;
+}
+
+
+/* The bytes after '<' are name and a blank, '>' or '/', in any case */
+int tagIs(LinkExtractor *ex, const char *name, int len) {
+	if (ex->tagLen != len + 1 || strncasecmp(ex->tag, name, len) != 0) {
+		return 0;
+	}
+	char c = ex->tag[len];
+	return isBlank(c) || c == '>' || c == '/';
+}
+
+
+/* Look for the "-->" ending the comment. Returns where the scan goes on */
+const char *scanComment(LinkExtractor *ex, const char *p, const char *end) {
+	while (p < end) {
+		const char *close = find(ex, p, end, '>');
+
+		// The dashes before close (or end), with the ones of the last part
+		const char *q = close;
+		while (q > p && q[-1] == '-' && close - q < 2) {
+			q--;
+		}
+		int dashes = close - q;
+		if (q == p) {
+			dashes += ex->dashes;
+		}
+
+		if (close == end) {
+			ex->dashes = dashes > 2 ? 2 : dashes;
+			return end;
+		}
+		if (dashes >= 2) {
+			ex->state = LX_TEXT;
+			return close + 1;
+		}
+		ex->dashes = 0;
+		p = close + 1;
+	}
+	return end;
+}
+
+
+/* Look for the end tag of the raw text, "</script" or "</style" in any case */
+const char *scanRaw(LinkExtractor *ex, const char *p, const char *end) {
+	while (p < end) {
+		if (ex->rawMatched == 0) {
+			if ((p = find(ex, p, end, '<')) == end) {
+				return end;
+			}
+			ex->rawMatched = 1;
+			p++;
+		}
+		while (p < end && ex->rawMatched < ex->rawLen + 2) {
+			char want = ex->rawMatched == 1 ? '/' : ex->raw[ex->rawMatched - 2];
+			if ((*p | 0x20) != want) {
+				break;
+			}
+			ex->rawMatched++;
+			p++;
+		}
+		if (ex->rawMatched == ex->rawLen + 2) {
+			ex->state = LX_TEXT;
+			return p;
+		}
+		if (p < end) {
+			ex->rawMatched = 0; // *p may be the next '<'
+		}
+	}
+	return end;
+}
+
+
+/* The value from start to end (in part) is complete. If it is an href, its
+ * span is added: in part, or in held if it started in an earlier part.
+ * Returns -1 on error */
+int endValue(LinkExtractor *ex, const char *part, const char *start, const char *end) {
+	if (!ex->isHref) {
+		ex->holding = 0;
+		return 0;
+	}
+	if (!ex->holding) {
+		return addSpan(ex, part, start, end, 0);
+	}
+
+	// Nothing ended before it in this part, so it starts held
+	holdValue(ex, start, end);
+	ex->holding = 0;
+	if (!ex->isHref) {
+		return 0; // Too long
+	}
+	ex->heldUsed = ex->pending;
+	ex->pending = 0;
+	return addSpan(ex, ex->held, ex->held, ex->held + ex->heldUsed, 1);
+}
+
+
+/* Keep the bytes from start to end of the href being read for the next part */
+void holdValue(LinkExtractor *ex, const char *start, const char *end) {
+	if (!ex->isHref) {
+		return;
+	}
+	if (!ex->holding) {
+		ex->holding = 1;
+		ex->pending = 0;
+	}
+	if (ex->held == NULL && (ex->held = malloc(2 * LINK_MAX_HELD)) == NULL) {
+		perror("malloc");
+		ex->isHref = 0;
+		return;
+	}
+	if (ex->pending + (end - start) > LINK_MAX_HELD) {
+		ex->isHref = 0; // Dropped
+		ex->pending = 0;
+		return;
+	}
+	memcpy(ex->held + ex->heldUsed + ex->pending, start, end - start);
+	ex->pending += end - start;
+}
+
+
+/* Add the span of the value from start to end in base, without its
+ * blanks around */
+int addSpan(LinkExtractor *ex, const char *base, const char *start, const char *end, int held) {
+	while (start < end && isBlank(*start)) {
+		start++;
+	}
+	while (end > start && isBlank(end[-1])) {
+		end--;
+	}
+	if (start == end) {
+		return 0;
+	}
+
+	if (ex->count == ex->size) {
+		int size = ex->size > 0 ? ex->size * 2 : LINKS_INITIAL;
+		LinkSpan *spans = realloc(ex->spans, size * sizeof(LinkSpan));
+		if (spans == NULL) {
+			perror("realloc");
+			return -1;
+		}
+		ex->spans = spans;
+		ex->size = size;
+	}
+	ex->spans[ex->count].offset = start - base;
+	ex->spans[ex->count].length = end - start;
+	ex->spans[ex->count].held = held;
+	ex->count++;
+	return 0;
+}
+
+
+/* Decode the entity at s (after '&') to out, setting *written to its bytes.
+ * Returns the bytes of s used, 0 if it isn't an entity */
+int decodeEntity(const char *s, int len, char *out, int *written) {
+	unsigned int i;
+	for (i = 0; i < sizeof(entities) / sizeof(entities[0]); i++) {
+		int nameLen = strlen(entities[i].name);
+		if (len >= nameLen && memcmp(s, entities[i].name, nameLen) == 0) {
+			*out = entities[i].c;
+			*written = 1;
+			return nameLen;
+		}
+	}
+
+	// &#decimal; or &#xhex;
+	if (len < 3 || s[0] != '#') {
+		return 0;
+	}
+	int hex = s[1] == 'x' || s[1] == 'X';
+	int j = hex ? 2 : 1;
+	long code = 0;
+	int digits = 0;
+	for (; j < len && digits < 8; j++, digits++) {
+		int d;
+		if (s[j] >= '0' && s[j] <= '9') {
+			d = s[j] - '0';
+		} else if (hex && (s[j] | 0x20) >= 'a' && (s[j] | 0x20) <= 'f') {
+			d = (s[j] | 0x20) - 'a' + 10;
+		} else {
+			break;
+		}
+		code = code * (hex ? 16 : 10) + d;
+	}
+	if (digits == 0 || j == len || s[j] != ';' || code == 0 || code > 0x10FFFF || (code >= 0xD800 && code <= 0xDFFF)) {
+		return 0;
+	}
+
+	// UTF-8, which takes fewer bytes than the entity
+	if (code < 0x80) {
+		out[0] = code;
+		*written = 1;
+	} else if (code < 0x800) {
+		out[0] = 0xC0 | (code >> 6);
+		out[1] = 0x80 | (code & 0x3F);
+		*written = 2;
+	} else if (code < 0x10000) {
+		out[0] = 0xE0 | (code >> 12);
+		out[1] = 0x80 | ((code >> 6) & 0x3F);
+		out[2] = 0x80 | (code & 0x3F);
+		*written = 3;
+	} else {
+		out[0] = 0xF0 | (code >> 18);
+		out[1] = 0x80 | ((code >> 12) & 0x3F);
+		out[2] = 0x80 | ((code >> 6) & 0x3F);
+		out[3] = 0x80 | (code & 0x3F);
+		*written = 4;
+	}
+	return j + 1;
+}
+
+
+int isBlank(char c) {
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f';
+}
+
+
+/* The first '<' from p on that may start a tag the links are looked for
+ * in or skipped by: <a, <s(cript), <s(tyle) or <!(--), in any case.
+ * Returns end if there is none */
+const char *findTag(LinkExtractor *ex, const char *p, const char *end) {
+	switch (ex->scan) {
+#if defined(__x86_64__) || defined(__i386__)
+	case LINK_SCAN_AVX2:
+		return findTagAvx2(p, end);
+#endif
+#if defined(__SSE2__)
+	case LINK_SCAN_SSE2:
+		return findTagSse2(p, end);
+#endif
+	default:
+		return findTagScalar(p, end);
+	}
+}
+
+
+/* The first c from p on, or end if there is none */
+const char *find(LinkExtractor *ex, const char *p, const char *end, char c) {
+	switch (ex->scan) {
+#if defined(__x86_64__) || defined(__i386__)
+	case LINK_SCAN_AVX2:
+		return findAvx2(p, end, c);
+#endif
+#if defined(__SSE2__)
+	case LINK_SCAN_SSE2:
+		return findSse2(p, end, c);
+#endif
+	default:
+		return findScalar(p, end, c);
+	}
+}
+
+
+const char *findTagScalar(const char *p, const char *end) {
+	for (; end - p >= 2; p++) {
+		char next = p[1] | 0x20; // Lower case, '!' stays the same
+		if (*p == '<' && (next == 'a' || next == 's' || next == '!')) {
+			return p;
+		}
+	}
+	return end;
+}
+
+
+const char *findScalar(const char *p, const char *end, char c) {
+	while (p < end && *p != c) {
+		p++;
+	}
+	return p;
+}
+
+
+#if defined(__SSE2__)
+/* Compare 16 positions at a time: the bytes at them with '<' and the bytes
+ * after them with the first letters. The loads are unaligned and never pass end */
+const char *findTagSse2(const char *p, const char *end) {
+	__m128i open = _mm_set1_epi8('<');
+	__m128i lower = _mm_set1_epi8(0x20);
+	__m128i a = _mm_set1_epi8('a');
+	__m128i s = _mm_set1_epi8('s');
+	__m128i bang = _mm_set1_epi8('!');
+	for (; end - p >= 17; p += 16) {
+		__m128i next = _mm_or_si128(_mm_loadu_si128((const __m128i *) (p + 1)), lower);
+		__m128i letter = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(next, a), _mm_cmpeq_epi8(next, s)), _mm_cmpeq_epi8(next, bang));
+		__m128i tag = _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) p), open), letter);
+		int mask = _mm_movemask_epi8(tag);
+		if (mask != 0) {
+			return p + __builtin_ctz(mask);
+		}
+	}
+	return findTagScalar(p, end);
+}
+
+
+/* Compare 16 bytes at a time. The loads are unaligned and never pass end */
+const char *findSse2(const char *p, const char *end, char c) {
+	__m128i needle = _mm_set1_epi8(c);
+	for (; end - p >= 16; p += 16) {
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) p), needle));
+		if (mask != 0) {
+			return p + __builtin_ctz(mask);
+		}
+	}
+	return findScalar(p, end, c);
+}
+#endif
+
+
+#if defined(__x86_64__) || defined(__i386__)
+/* Like findTagSse2, 32 positions at a time. Only called if the CPU has AVX2 */
+const char *findTagAvx2(const char *p, const char *end) {
+	__m256i open = _mm256_set1_epi8('<');
+	__m256i lower = _mm256_set1_epi8(0x20);
+	__m256i a = _mm256_set1_epi8('a');
+	__m256i s = _mm256_set1_epi8('s');
+	__m256i bang = _mm256_set1_epi8('!');
+	for (; end - p >= 33; p += 32) {
+		__m256i next = _mm256_or_si256(_mm256_loadu_si256((const __m256i *) (p + 1)), lower);
+		__m256i letter = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(next, a), _mm256_cmpeq_epi8(next, s)), _mm256_cmpeq_epi8(next, bang));
+		__m256i tag = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) p), open), letter);
+		unsigned int mask = _mm256_movemask_epi8(tag);
+		if (mask != 0) {
+			return p + __builtin_ctz(mask);
+		}
+	}
+	return findTagScalar(p, end);
+}
+
+
+/* Compare 32 bytes at a time. Only called if the CPU has AVX2 */
+const char *findAvx2(const char *p, const char *end, char c) {
+	__m256i needle = _mm256_set1_epi8(c);
+	for (; end - p >= 32; p += 32) {
+		unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) p), needle));
+		if (mask != 0) {
+			return p + __builtin_ctz(mask);
+		}
+	}
+	return findScalar(p, end, c);
+}
+#endif
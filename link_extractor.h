@@ -0,0 +1,69 @@
+#ifndef LINK_EXTRACTOR_H
+#define LINK_EXTRACTOR_H
+
+#define LINK_SCAN_AUTO   0 // The widest scan the CPU runs
+#define LINK_SCAN_SCALAR 1
+#define LINK_SCAN_SSE2   2
+#define LINK_SCAN_AVX2   3
+#define LINKS_INITIAL    64 // Spans there is room for at first
+#define LINK_MAX_HELD    8192 // Longest value kept across parts, longer links are dropped
+
+// Where the scan of a page stopped
+#define LX_TEXT         0
+#define LX_OPEN         1 // After '<', reading the name of the tag
+#define LX_ATTRS        2 // In an <a> tag, before the name of an attribute
+#define LX_NAME         3
+#define LX_AFTER_NAME   4
+#define LX_BEFORE_VALUE 5 // After '='
+#define LX_QUOTED       6
+#define LX_UNQUOTED     7
+#define LX_COMMENT      8
+#define LX_RAW          9 // In the text of <script> or <style>
+
+/* Where the value of the href attribute of an <a> tag is: in the part of the
+ * page given, or in held if the value started in an earlier part. It is the
+ * value as written, without the quotes: entities aren't decoded */
+typedef struct linkSpan {
+	int offset;
+	int length;
+	int held;
+} LinkSpan;
+
+/* Finds the links of a page without modifying or copying it. The page may be
+ * given in parts as it arrives: the scan goes on where the last part ended.
+ * The spans of a part are kept until the next one */
+typedef struct linkExtractor {
+	LinkSpan *spans;
+	int count;
+	int size;
+	int scan; // LINK_SCAN_* used to look for tags and the closing quotes
+
+	int state; // LX_*
+	char tag[8]; // Bytes after '<' read so far
+	int tagLen;
+	char name[4]; // First bytes of the attribute name, only href matters
+	int nameLen;
+	char quote;
+	int found; // The tag had an href already
+	int isHref; // The value being read is the first href of the tag
+	int dashes; // Of the comment just before the part
+	const char *raw; // "script" or "style"
+	int rawLen;
+	int rawMatched; // Bytes of "</" and raw matched before the part
+
+	// Copies of the values crossing the end of a part: the one ended in the
+	// last part, then the start of the one that didn't end yet
+	char *held; // 2 * LINK_MAX_HELD bytes, allocated the first time
+	int heldUsed; // Bytes of the ended value
+	int pending; // Bytes of the value not ended
+	int holding; // The value being read started in an earlier part
+} LinkExtractor;
+
+int linkExtractorInit(LinkExtractor *, int);
+void linkExtractorReset(LinkExtractor *);
+int extractLinks(LinkExtractor *, const char *, int);
+int extractLinksPart(LinkExtractor *, const char *, int);
+int decodeLink(const char *, int, char *);
+void linkExtractorDestroy(LinkExtractor *);
+
+#endif // LINK_EXTRACTOR_H
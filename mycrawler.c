@@ -10,6 +10,7 @@
 #include <sys/types.h>
 #include <sys/wait.h> // waitpid
 #include <sys/socket.h>
+#include <sys/un.h> // sockaddr_un
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <pthread.h>
@@ -17,33 +18,65 @@
 #include <sys/time.h> // gettimeofday
 #include <limits.h> // PATH_MAX
 #include <errno.h>
-#include "url_queue.h"
+#include <stddef.h> // offsetof
+#include "frontier.h"
 #include "requests.h"
-#include "hash_table.h"
+#include "url_table.h"
+#include "link_extractor.h"
+#include "fingerprint_set.h"
 #include "util.h"
+#include "profiler.h"
+#include "fetcher.h"
+#include "dns_cache.h"
+#include "checkpoint.h"
 
 #define DIR_PERMS 0700
 
 #define BUF_SIZE 256
+#define FETCHES_PER_THREAD 64 // Default number of pages each thread downloads at the same time
 
 #define CMD_OK       0
 #define CMD_SHUTDOWN 1
 #define CMD_SEARCH   2
+#define CMD_PROFILE  3
 #define CMD_INVALID -1
 #define CMD_ERROR   -2
 
 #define MAX_KEYWORDS 10
+#define PROFILE_SECONDS 10 // Default duration of PROFILE
 #define DOCFILE "docfile.txt"
 #define JE_DIR "./JE/"
 #define READ  0
 #define WRITE 1
 
+/* A page being downloaded. Its body is written to its file and its
+ * links are queued as the parts arrive */
+typedef struct page {
+	char *url;
+	char *path; // Of its file, removed if the download fails
+	int fd; // -1 after an error
+	int length; // Bytes received
+	LinkExtractor extractor;
+} Page;
+
 static void *threadFunc(void *);
-static void sendRequest(char *, char *);
+static char *nextUrl(void *, unsigned int *);
+static void *pageBegin(unsigned int, char *, int, void *);
+static void pagePart(void *, char *, int, void *);
+static void fetchDone(unsigned int, char *, void *, int, void *);
+static void finishCrawl(void);
+static void wakeFetchers(void *);
+static int commandProfile(int, char *);
+static void sendProfile(void);
+static long long currentTime(void);
 static int createConnection(char *);
-static char *readResponse(int);
-static void parseContent(char *, char *);
-static void saveFile(char *, char *, char *);
+static int connectUnix(char *);
+static int parseContent(Page *, char *, int);
+static int internUrls(char **, int, unsigned int *, int *);
+static void visitedDestroy(void);
+static void restoreUrl(char *, int, void *);
+static void checkpointStop(void);
+static char *createPath(char *, char *);
 static int handleCommand(int, long long, char ***, int *);
 static int hasData(int);
 static int validUrl(char *, char *, int);
@@ -56,23 +89,32 @@ static void usage(char *);
 static int threadStop = 0;
 static pthread_mutex_t thread_stop_mtx = PTHREAD_MUTEX_INITIALIZER;
 
-// Used to check if crawling has finished
-static int threadsInProgress = 0;
-static pthread_mutex_t thread_progress_mtx = PTHREAD_MUTEX_INITIALIZER;
-
 // Variables used for STATS command
-static int pagesDownloaded = 0;
-static int bytesDownloaded = 0;
+static long long pagesDownloaded = 0;
+static long long bytesDownloaded = 0;
 static pthread_mutex_t stats_mtx = PTHREAD_MUTEX_INITIALIZER;
 
-// Hash table of URLs to check if a URL has already been checked
-static HashTable table;
-static pthread_mutex_t table_mtx = PTHREAD_MUTEX_INITIALIZER;
+// URLs found so far, stored once and named by their id everywhere else. The
+// table also tells if a URL has already been checked; with -F the fingerprints
+// do, and the table only keeps the URLs until they are downloaded
+static UrlTable urlTable; // Has its own locks
+static FingerprintSet fingerprints; // Has its own locks
+static int useFingerprints = 0;
+
+// URLs to be requested by the threads, queued by host
+static Frontier frontier; // Has its own locks
+static __thread int workerId = 0; // Deque of the frontier used by the thread
+
+// Fetch engines, one per thread
+static Fetcher *fetchers = NULL;
+static int fetcherCount = 0;
+
+// Addresses of the hostnames of the URLs
+static DnsCache dnsCache;
 
-// Queue of URLs to be requested by the threads
-static URLQueue urlQueue;
-static pthread_mutex_t queue_mtx = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t cond_nonempty = PTHREAD_COND_INITIALIZER;
+// Snapshot and logs of the crawl kept with -P, to resume it after a crash
+static Checkpoint checkpoint; // Has its own locks
+static int checkpointing = 0;
 
 // Mutex used to update the docfile used by the Job Executor
 static pthread_mutex_t docfile_mtx = PTHREAD_MUTEX_INITIALIZER;
@@ -80,9 +122,30 @@ static pthread_mutex_t docfile_mtx = PTHREAD_MUTEX_INITIALIZER;
 // Job Executor PID
 static pid_t JE_pid = -1;
 
+// Unix socket of the server given as -h unix:<path>, NULL to connect over TCP.
+// The host and port of the URLs then only name the website
+static char *unixPath = NULL;
+
+// Stacks sampled on SIGPROF while PROFILE runs
+static Profiler *profiler = NULL;
+// The client of the PROFILE run, answered by the command loop once it is over
+static int profileSock = -1;
+static long long profileEnd = 0;
+
 
 int main(int argc, char *argv[]) {
-	if (argc != 12) {
+	// --resume takes no value, so it is taken out before the options are read in pairs
+	int resume = 0;
+	int arg;
+	for (arg = 1; arg < argc - 1; arg++) {
+		if (strcmp(argv[arg], "--resume") == 0) {
+			resume = 1;
+			memmove(&argv[arg], &argv[arg+1], (argc - arg) * sizeof(char *));
+			argc--;
+			break;
+		}
+	}
+	if (argc < 12 || argc > 28 || argc % 2 != 0) {
 		usage(argv[0]);
 		return -1;
 	}
@@ -94,6 +157,14 @@ int main(int argc, char *argv[]) {
 	int sport;
 	int cport;
 	int threadCount;
+	int maxFetches = FETCHES_PER_THREAD;
+	int maxPerHost = 0;
+	int pipeline = 1;
+	int maxHostFetches = 0;
+	double falsePositiveRate = 0;
+	char *spillDir = NULL;
+	char *checkpointDir = NULL;
+	int checkpointInterval = CKPT_INTERVAL;
 	char *startUrl = argv[argc-1];
 	char *dirname;
 	struct stat dirStat;
@@ -104,12 +175,30 @@ int main(int argc, char *argv[]) {
 	int got_cport = 0;
 	int got_threads = 0;
 	int got_dir = 0;
+	int got_fetches = 0;
+	int got_per_host = 0;
+	int got_pipeline = 0;
+	int got_host_fetches = 0;
+	int got_fp_rate = 0;
+	int got_spill = 0;
+	int got_checkpoint = 0;
+	int got_interval = 0;
 	int i;
 	for (i = 1; i < argc - 1; i += 2) {
 		if (strcmp(argv[i], "-h") == 0 && !got_host) {
 			got_host = 1;
 			host = argv[i+1];
 
+			// unix:<path> (or unix:@<abstract name>) connects to a local server
+			if (strncmp(host, "unix:", 5) == 0) {
+				unixPath = host + 5;
+				if (unixPath[0] == '\0' || strlen(unixPath) >= sizeof(((struct sockaddr_un *) 0)->sun_path)) {
+					fprintf(stderr, "[-] Invalid Unix socket path %s\n", unixPath);
+					return -1;
+				}
+				continue;
+			}
+
 			int j;
 			for (j = 0; j < strlen(host); j++) {
 				if (!isalnum(host[i]) && host[i] != '.' && host[i] != '/' && host[i] != '-') {
@@ -138,6 +227,63 @@ int main(int argc, char *argv[]) {
 				fprintf(stderr, "[-] The number of threads must be a positive integer\n");
 				return -1;
 			}
+		} else if (strcmp(argv[i], "-C") == 0 && !got_fetches) {
+			got_fetches = 1;
+			maxFetches = atoi(argv[i+1]);
+			if (maxFetches <= 0) {
+				fprintf(stderr, "[-] The number of concurrent fetches must be a positive integer\n");
+				return -1;
+			}
+		} else if (strcmp(argv[i], "-K") == 0 && !got_per_host) {
+			got_per_host = 1;
+			maxPerHost = atoi(argv[i+1]);
+			if (maxPerHost <= 0) {
+				fprintf(stderr, "[-] The number of connections per host must be a positive integer\n");
+				return -1;
+			}
+		} else if (strcmp(argv[i], "-Q") == 0 && !got_pipeline) {
+			got_pipeline = 1;
+			pipeline = atoi(argv[i+1]);
+			if (pipeline <= 0) {
+				fprintf(stderr, "[-] The number of pipelined requests must be a positive integer\n");
+				return -1;
+			}
+		} else if (strcmp(argv[i], "-H") == 0 && !got_host_fetches) {
+			got_host_fetches = 1;
+			maxHostFetches = atoi(argv[i+1]);
+			if (maxHostFetches <= 0) {
+				fprintf(stderr, "[-] The number of pages downloaded from a host at the same time must be a positive integer\n");
+				return -1;
+			}
+		} else if (strcmp(argv[i], "-F") == 0 && !got_fp_rate) {
+			got_fp_rate = 1;
+			char *end;
+			falsePositiveRate = strtod(argv[i+1], &end);
+			if (*end != '\0' || falsePositiveRate <= 0 || falsePositiveRate >= 1) {
+				fprintf(stderr, "[-] The false positive rate must be between 0 and 1\n");
+				return -1;
+			}
+		} else if (strcmp(argv[i], "-S") == 0 && !got_spill) {
+			got_spill = 1;
+			spillDir = argv[i+1];
+			if (access(spillDir, W_OK | X_OK) == -1) {
+				fprintf(stderr, "[-] Invalid spill directory %s\n", spillDir);
+				return -1;
+			}
+		} else if (strcmp(argv[i], "-P") == 0 && !got_checkpoint) {
+			got_checkpoint = 1;
+			checkpointDir = argv[i+1];
+			if (access(checkpointDir, W_OK | X_OK) == -1) {
+				fprintf(stderr, "[-] Invalid checkpoint directory %s\n", checkpointDir);
+				return -1;
+			}
+		} else if (strcmp(argv[i], "-I") == 0 && !got_interval) {
+			got_interval = 1;
+			checkpointInterval = atoi(argv[i+1]);
+			if (checkpointInterval <= 0) {
+				fprintf(stderr, "[-] The seconds between checkpoints must be a positive integer\n");
+				return -1;
+			}
 		} else if (strcmp(argv[i], "-d") == 0 && !got_dir) {
 			got_dir = 1;
 			dirname = argv[i+1];
@@ -162,6 +308,15 @@ int main(int argc, char *argv[]) {
 			return -1;
 		}
 	}
+	if (!got_host || !got_sport || !got_cport || !got_threads || !got_dir || (got_spill && !got_fp_rate)
+			|| ((got_interval || resume) && !got_checkpoint)) {
+		usage(argv[0]);
+		return -1;
+	}
+	// By default a thread may open a connection for each of its fetches
+	if (!got_per_host) {
+		maxPerHost = maxFetches;
+	}
 
 	if (!validUrl(startUrl, host, sport)) {
 		fprintf(stderr, "[-] Invalid starting URL\n");
@@ -175,19 +330,67 @@ int main(int argc, char *argv[]) {
 	long long startTime = tv.tv_sec * 1000 + tv.tv_usec / 1000;
 
 
-	queueInit(&urlQueue);
-	HT_initialize(&table);
+	if ((profiler = profilerCreate()) == NULL) {
+		return -2;
+	}
 
-	// Insert the starting URL in the URL Queue and the URL Hash Table
-	queueInsert(&urlQueue, startUrl);
-	HT_insert(&table, startUrl);
+	// Without an index the table only stores the URLs the fingerprints find new
+	useFingerprints = got_fp_rate;
+	if (UT_initialize(&urlTable, !useFingerprints) < 0) {
+		return -2;
+	}
+	if (useFingerprints && FS_initialize(&fingerprints, falsePositiveRate, spillDir) < 0) {
+		UT_destroy(&urlTable);
+		return -2;
+	}
+	// Every thread schedules hosts in its own deque of the frontier
+	if (frontierInit(&frontier, &urlTable, threadCount, maxHostFetches) < 0) {
+		visitedDestroy();
+		return -2;
+	}
+
+	// With --resume the visited set, the frontier and the stats are those of
+	// the checkpoint; the pages downloaded and the docfile are kept
+	int resumed = 0;
+	if (checkpointDir != NULL) {
+		long long pages, bytes;
+		int restored = checkpointOpen(&checkpoint, checkpointDir, checkpointInterval, resume, restoreUrl, NULL, &pages, &bytes);
+		if (restored < 0) {
+			visitedDestroy();
+			frontierDestroy(&frontier);
+			return -2;
+		}
+		checkpointing = 1;
+		if (restored > 0) {
+			resumed = 1;
+			pagesDownloaded = pages;
+			bytesDownloaded = bytes;
+			printf("[+] Resumed the crawl: %lld pages downloaded, %ld URLs queued\n", pages, frontierOutstanding(&frontier));
+		} else if (resume) {
+			printf("[*] No checkpoint in %s, starting over\n", checkpointDir);
+		}
+	}
+
+	// Insert the starting URL in the visited URLs and the frontier
+	unsigned int startId;
+	int isNew;
+	canonicalizeUrl(startUrl);
+	if (!resumed && (internUrls(&startUrl, 1, &startId, &isNew) < 1
+			|| (checkpointing && checkpointFound(&checkpoint, &startUrl, &isNew, 1) < 0)
+			|| frontierAdd(&frontier, 0, startId) < 0)) {
+		checkpointStop();
+		visitedDestroy();
+		frontierDestroy(&frontier);
+		return -2;
+	}
 
 	// Check if the docfile for the JE already exists and remove it
-	if (access(DOCFILE, F_OK) != -1) {
+	if (!resumed && access(DOCFILE, F_OK) != -1) {
 		if (remove(DOCFILE) == -1) {
 			perror("remove");
-			HT_destroy(&table);
-			queueDestroy(&urlQueue);
+			checkpointStop();
+			visitedDestroy();
+			frontierDestroy(&frontier);
 			return -2;
 		}
 	}
@@ -195,26 +398,50 @@ int main(int argc, char *argv[]) {
 	char *save_dir = malloc((strlen(dirname) + 1) * sizeof(char));
 	strcpy(save_dir, dirname);
 	// Remove save_dir and its contents if it already exists
-	if (removeDirectory(save_dir) != 0) {
+	if (!resumed && removeDirectory(save_dir) != 0) {
 		fprintf(stderr, "[-] Failed to remove previous save_dir %s\n", save_dir);
-		HT_destroy(&table);
-		queueDestroy(&urlQueue);
+		checkpointStop();
+		visitedDestroy();
+		frontierDestroy(&frontier);
 		free(save_dir);
 		return -2;
 	}
 	// Create new empty save_dir
-	if (mkdir(save_dir, DIR_PERMS) != 0) {
+	if (mkdir(save_dir, DIR_PERMS) != 0 && !(resumed && errno == EEXIST)) {
 		perror("mkdir");
-		HT_destroy(&table);
-		queueDestroy(&urlQueue);
+		checkpointStop();
+		visitedDestroy();
+		frontierDestroy(&frontier);
+		free(save_dir);
+		return -2;
+	}
+
+	// Hostnames are resolved by the threads of the cache, which wake up the engines
+	if (dnsInit(&dnsCache, wakeFetchers, NULL) < 0) {
+		checkpointStop();
+		visitedDestroy();
+		frontierDestroy(&frontier);
 		free(save_dir);
 		return -2;
 	}
 
-	// Create the thread pool
+	// Create the thread pool. Every thread runs a fetch engine downloading
+	// up to maxFetches pages at the same time over keep-alive connections
+	fetchers = malloc(threadCount * sizeof(Fetcher));
 	pthread_t *threads = malloc(threadCount * sizeof(pthread_t));
 	for (i = 0; i < threadCount; i++) {
-		pthread_create(&threads[i], NULL, threadFunc, save_dir);
+		if (fetcherInit(&fetchers[i], maxFetches, maxPerHost, pipeline, nextUrl, createConnection, pageBegin, pagePart, fetchDone, save_dir) < 0) {
+			cleanup(threads, 0, save_dir);
+			return -2;
+		}
+		fetcherCount++;
+	}
+	for (i = 0; i < threadCount; i++) {
+		pthread_create(&threads[i], NULL, threadFunc, &fetchers[i]);
+	}
+	// A crawl resumed after it had finished has nothing left to download
+	if (frontierOutstanding(&frontier) == 0) {
+		finishCrawl();
 	}
 
 
@@ -383,23 +610,42 @@ int main(int argc, char *argv[]) {
 					if (pthread_tryjoin_np(threads[j], NULL) == 0) {
 						printf("[-] A thread has been terminated\n");
 						printf("[*] Restarting thread...\n");
-						pthread_create(&threads[j], NULL, threadFunc, NULL);
+						pthread_create(&threads[j], NULL, threadFunc, &fetchers[j]);
 					}
 				}
 			}
 		}
 
+		// Answer PROFILE once its run is over
+		if (profileSock >= 0 && currentTime() >= profileEnd) {
+			sendProfile();
+		}
+
 		fd_set sockfds;
 		FD_ZERO(&sockfds);
 		FD_SET(cmd_sock, &sockfds);
 
-		// Periodically unblock select to check terminated threads
-		// The timeout has to be reinitialized after every call to select
+		// Periodically unblock select to check terminated threads, and when
+		// the PROFILE run is over. The timeout has to be reinitialized after
+		// every call to select
 		struct timeval timeout;
 		timeout.tv_sec = 5;
 		timeout.tv_usec = 0;
+		if (profileSock >= 0) {
+			long long left = profileEnd - currentTime();
+			if (left < 0) {
+				left = 0;
+			}
+			if (left < 5000) {
+				timeout.tv_sec = left / 1000;
+				timeout.tv_usec = (left % 1000) * 1000;
+			}
+		}
 
 		if (select(cmd_sock + 1, &sockfds, NULL, NULL, &timeout) == -1) {
+			if (errno == EINTR) { // SIGPROF while profiling
+				continue;
+			}
 			perror("select");
 			cleanup(threads, threadCount, save_dir);
 			close(cmd_sock);
@@ -508,7 +754,7 @@ int main(int argc, char *argv[]) {
 						free(keywords[i]);
 					}
 					free(keywords);
-				} else {
+				} else if (res != CMD_PROFILE) { // The PROFILE client is answered later
 					close(client_sock);
 				}
 			} else {
@@ -526,148 +772,165 @@ int main(int argc, char *argv[]) {
 }
 
 
-/* Thread pool function */
+/* Thread pool function: run the fetch engine until the crawling ends */
 void *threadFunc(void *ptr) {
-	char *save_dir = (char *) ptr;
-	int stop = 0;
-	while (1) {
-		pthread_mutex_lock(&queue_mtx);
-		while (isEmpty(&urlQueue)) {
-			// Wait for a thread to add a URL in the queue
-			pthread_cond_wait(&cond_nonempty, &queue_mtx);
-		}
-
-		// Check if the thread needs to stop before requesting a new page
-		// in case it was signaled from the main thread or the crawling has finished
-		pthread_mutex_lock(&thread_stop_mtx);
-		stop = threadStop;
-		pthread_mutex_unlock(&thread_stop_mtx);
-		if (stop) {
-			pthread_mutex_unlock(&queue_mtx);
-			printf("[*] Thread %ld exiting...\n", pthread_self());
-			pthread_exit(NULL);
-		}
+	Fetcher *fetcher = (Fetcher *) ptr;
+	workerId = fetcher - fetchers;
+	fetcherRun(fetcher);
+	printf("[*] Thread %ld exiting...\n", pthread_self());
+	return NULL;
+}
 
-		// Get a URL from the queue
-		char *url = queueRemove(&urlQueue);
-		printf("[+] Thread %ld getting URL: %s\n", pthread_self(), url);
 
-		// Increase threads in progress counter
-		pthread_mutex_lock(&thread_progress_mtx);
-		threadsInProgress++;
-		pthread_mutex_unlock(&thread_progress_mtx);
+/* Give a fetch engine the next URL of the frontier, or NULL if no
+ * host has one it may hand out */
+char *nextUrl(void *arg, unsigned int *id) {
+	if (frontierNext(&frontier, workerId, id) < 0) {
+		return NULL;
+	}
 
-		pthread_mutex_unlock(&queue_mtx);
+	char *url = UT_get(&urlTable, *id);
+	printf("[+] Thread %ld getting URL: %s\n", pthread_self(), url);
+	return url;
+}
 
 
-		sendRequest(url, save_dir);
-		free(url);
+/* The body of a page starts to arrive: create its file inside the save_dir.
+ * Returns NULL on error, which drops the page */
+void *pageBegin(unsigned int id, char *url, int length, void *arg) {
+	char *save_dir = (char *) arg;
+	Page *page = malloc(sizeof(Page));
+	if (page == NULL) {
+		perror("malloc");
+		return NULL;
+	}
 
-		pthread_mutex_lock(&thread_progress_mtx);
-		threadsInProgress--;
-		pthread_mutex_unlock(&thread_progress_mtx);
+	char *file = strchr(url + 7, '/'); // Ignore http://
+	page->path = createPath(save_dir, file + 1); // Start filename after first '/'
+	if (page->path == NULL) {
+		free(page);
+		return NULL;
+	}
+	if ((page->fd = open(page->path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror("open");
+		free(page->path);
+		free(page);
+		return NULL;
 	}
+	page->url = url;
+	page->length = 0;
+	linkExtractorInit(&(page->extractor), LINK_SCAN_AUTO);
+	return page;
 }
 
 
-/* Send a GET request to a URL and parse its response */
-void sendRequest(char *url, char *save_dir) {
-	// Copy URL to avoid changes from strtok_r
-	char *urlcopy = malloc((strlen(url) + 1) * sizeof(char));
-	strcpy(urlcopy, url);
+/* Write the next bytes of a page to its file and queue the links found in
+ * them, while the rest of the page is still downloading */
+void pagePart(void *ptr, char *data, int length, void *arg) {
+	Page *page = (Page *) ptr;
+	page->length += length;
 
-	char *start = url + 7; // Ignore http://
+	int written = 0;
+	while (page->fd >= 0 && written < length) {
+		int res = write(page->fd, data + written, length - written);
+		if (res < 0 && errno == EINTR) {
+			continue;
+		} else if (res <= 0) {
+			perror("write");
+			close(page->fd);
+			page->fd = -1;
+		} else {
+			written += res;
+		}
+	}
 
-	// Extract file from the URL
-	char *filePos = strchr(start, '/');
-	char *file = malloc((strlen(filePos) + 1) * sizeof(char));
-	strcpy(file, filePos);
+	// Notify the rest of the engines to read the new URLs
+	if (parseContent(page, data, length) > 0) {
+		wakeFetchers(NULL);
+	}
+}
 
-	// Extract host and port from the URL
-	char *saveptr;
-	char *host = strtok_r(start, "/", &saveptr);
 
-	// Create the request
-	char *req = createRequestHeaders(host, file);
-	if (req == NULL) {
-		fprintf(stderr, "[-] Error while creating request\n");
-		free(urlcopy);
-		free(file);
-		return;
+/* Close the file of a downloaded page, or remove it if the download failed.
+ * The crawling ends when no page is queued or in flight */
+void fetchDone(unsigned int id, char *url, void *ptr, int ok, void *arg) {
+	Page *page = (Page *) ptr;
+	int saved = ok && page != NULL && page->fd >= 0;
+	if (checkpointing) {
+		// A page failed isn't downloaded again after a resume either, but
+		// the ones abandoned when shutting down are
+		pthread_mutex_lock(&thread_stop_mtx);
+		int stopping = threadStop;
+		pthread_mutex_unlock(&thread_stop_mtx);
+		if (saved || !stopping) {
+			checkpointDone(&checkpoint, url, saved, saved ? page->length : 0);
+		}
 	}
-
-	int server_sock = createConnection(host);
-	if (server_sock < 0) {
-		fprintf(stderr, "[-] Error while connecting\n");
-		free(req);
-		free(urlcopy);
-		free(file);
-		return;
+	if (page != NULL) {
+		if (saved) {
+			// Update stats
+			pthread_mutex_lock(&stats_mtx);
+			pagesDownloaded++;
+			bytesDownloaded += page->length;
+			pthread_mutex_unlock(&stats_mtx);
+		} else if (unlink(page->path) < 0) {
+			perror("unlink");
+		}
+		if (page->fd >= 0) {
+			close(page->fd);
+		}
+		linkExtractorDestroy(&(page->extractor));
+		free(page->path);
+		free(page);
 	}
 
-	// Send the request
-	write(server_sock, req, strlen(req));
-	free(req);
+	int finished = frontierDone(&frontier, workerId, id);
+	UT_release(&urlTable, id);
+	if (finished) {
+		finishCrawl();
+	}
+}
 
-	// Read the response
-	char *content = readResponse(server_sock);
-	if (content == NULL) { // Error or page not found / page not accessible
-		// Check if there are any other threads in progress
-		int inProgress = 0;
-		pthread_mutex_lock(&thread_progress_mtx);
-		inProgress = threadsInProgress;
-		pthread_mutex_unlock(&thread_progress_mtx);
 
-		// We are the last thread. Crawling ended
-		if (inProgress == 1) {
-			printf("\n[+] Crawling has finsished\n");
-			// Set the thread stop flag and unblock all threads
-			pthread_mutex_lock(&thread_stop_mtx);
-			threadStop = 1;
-			pthread_mutex_unlock(&thread_stop_mtx);
-
-			pthread_mutex_lock(&queue_mtx);
-			queueInsert(&urlQueue, "DUMMY"); // Dummy insert
-			pthread_cond_broadcast(&cond_nonempty);
-			pthread_mutex_unlock(&queue_mtx);
-		}
-		free(urlcopy);
-		free(file);
-		return;
+/* No page is queued or in flight anymore */
+void finishCrawl(void) {
+	pthread_mutex_lock(&thread_stop_mtx);
+	if (threadStop == 0) {
+		printf("\n[+] Crawling has finsished\n");
 	}
+	threadStop = 1;
+	pthread_mutex_unlock(&thread_stop_mtx);
 
-	// Save the file inside the save_dir
-	saveFile(content, save_dir, file + 1); // Start filename after first '/'
-	free(file);
+	// Stop all engines
+	int i;
+	for (i = 0; i < fetcherCount; i++) {
+		fetcherStop(&fetchers[i]);
+	}
+}
 
-	// Update stats
-	int bytes = strlen(content);
-	pthread_mutex_lock(&stats_mtx);
-	pagesDownloaded++;
-	bytesDownloaded += bytes;
-	pthread_mutex_unlock(&stats_mtx);
 
-	// Extract the links from the page we received
-	parseContent(content, urlcopy);
-	free(urlcopy);
-	free(content);
+void wakeFetchers(void *arg) {
+	int i;
+	for (i = 0; i < fetcherCount; i++) {
+		fetcherWake(&fetchers[i]);
+	}
 }
 
 
-/* Create a socket to the given host */
+/* Create a non-blocking socket to the given host, or to the server's Unix socket.
+ * The connection may still be in progress when it returns. Returns CONNECT_LATER
+ * while the address of the hostname is being resolved */
 int createConnection(char *host) {
+	if (unixPath != NULL) {
+		return connectUnix(unixPath);
+	}
+
 	char *saveptr;
 	// Split hostname and port
 	char *hostname = strtok_r(host, ":", &saveptr);
 	char *portStr = strtok_r(NULL, "", &saveptr);
-	int port = atoi(portStr);
-	if (port <= 0 || port > 65535) {
-		return -1;
-	}
-
-	int sock;
-	if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-		perror("socket");
+	int port = portStr == NULL ? 0 : atoi(portStr);
+	if (hostname == NULL || port <= 0 || port > 65535) {
 		return -1;
 	}
 
@@ -675,38 +938,23 @@ int createConnection(char *host) {
 	server.sin_family = AF_INET;
 	server.sin_port = htons(port);
 
-	int res;
-	// Invalid IP address -> Convert hostname to IP address
-	if ((res = inet_pton(AF_INET, hostname, &(server.sin_addr))) == 0) {
-		struct addrinfo hints;
-		memset(&hints, 0, sizeof(hints));
-		hints.ai_socktype = SOCK_STREAM;
-		hints.ai_family = AF_INET;
-		struct addrinfo *info = NULL;
-
-		if (getaddrinfo(hostname, NULL, &hints, &info) != 0) {
-			perror("getaddrinfo");
-			close(sock);
+	// Invalid IP address -> Get the address of the hostname from the DNS cache
+	if (inet_pton(AF_INET, hostname, &(server.sin_addr)) == 0) {
+		int res = dnsLookup(&dnsCache, hostname, &(server.sin_addr));
+		if (res == DNS_PENDING) {
+			return CONNECT_LATER;
+		} else if (res == DNS_FAILED) {
 			return -1;
 		}
+	}
 
-		struct sockaddr_in *sa = (struct sockaddr_in *) info->ai_addr;
-		sa->sin_port = htons(port);
-		if ((connect(sock, info->ai_addr, info->ai_addrlen)) < 0) {
-			perror("connect");
-			close(sock);
-			freeaddrinfo(info);
-			return -1;
-		}
-		freeaddrinfo(info);
-	} else if (res > 0) {
-		if ((connect(sock, (struct sockaddr *) &server, sizeof(server))) < 0) {
-			perror("connect");
-			close(sock);
-			return -1;
-		}
-	} else {
-		perror("inet_pton");
+	int sock;
+	if ((sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+		perror("socket");
+		return -1;
+	}
+	if ((connect(sock, (struct sockaddr *) &server, sizeof(server))) < 0 && errno != EINPROGRESS) {
+		perror("connect");
 		close(sock);
 		return -1;
 	}
@@ -715,255 +963,225 @@ int createConnection(char *host) {
 }
 
 
-/* Read HTTP response from a GET request and return the content */
-char *readResponse(int sock) {
-	int bufSize = BUF_SIZE;
-	char *buf = malloc(bufSize * sizeof(char));
-	if (buf == NULL) {
-		perror("malloc");
-		close(sock);
-		return NULL;
+/* Connect to a Unix domain socket. Paths starting with '@' are abstract names.
+ * Local connections complete at once, so the socket is only made non-blocking
+ * afterwards (a non-blocking connect fails instead of waiting for a full backlog) */
+int connectUnix(char *path) {
+	int sock;
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		return -1;
 	}
 
-	int bufOffset = 0;
-	int bytesRecv;
-	char *headerEnd = NULL;
-
-	while ((bytesRecv = read(sock, buf + bufOffset, bufSize - bufOffset - 1)) > 0) {
-		// Check if we got 404 or 403 response
-		if (bufOffset == 0) {
-			if (strncmp(buf, "HTTP/1.1 200 OK", 15) != 0) {
-				fprintf(stderr, "[-] Page not found or not accessible\n");
-				free(buf);
-				close(sock);
-				return NULL;
-			}
-		}
-
-		// Resize buffer if needed
-		while (bufOffset + bytesRecv >= bufSize - 1) {
-			bufSize *= 2;
-			buf = realloc(buf, bufSize);
-			if (buf == NULL) {
-				perror("realloc");
-				close(sock);
-				return NULL;
-			}
-		}
-		bufOffset += bytesRecv;
-
-		buf[bufOffset] = '\0';
-		// Check if we reached the end of the HTTP headers
-		if ((headerEnd = strstr(buf, "\r\n\r\n")) != NULL) {
-			break;
-		}
+	struct sockaddr_un server;
+	memset(&server, 0, sizeof(server));
+	server.sun_family = AF_UNIX;
+	strcpy(server.sun_path, path);
+	socklen_t len = sizeof(server);
+	if (path[0] == '@') {
+		server.sun_path[0] = '\0';
+		len = offsetof(struct sockaddr_un, sun_path) + strlen(path);
 	}
 
-	if (bytesRecv < 0 && errno != EAGAIN) {
-		perror("read");
+	if (connect(sock, (struct sockaddr *) &server, len) < 0) {
+		perror("connect");
 		close(sock);
-		free(buf);
-		return NULL;
+		return -1;
 	}
-
-
-	// Find Content-Length header to check how much is left to read
-	char *contentLengthHeader = strstr(buf, "Content-Length:");
-	if (contentLengthHeader == NULL) {
-		fprintf(stderr, "[-] Received invalid response\n");
+	if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) < 0) {
+		perror("fcntl: F_SETFL");
 		close(sock);
-		free(buf);
-		return NULL;
+		return -1;
 	}
+	return sock;
+}
 
-	char *saveptr;
-	// Get length field
-	strtok_r(contentLengthHeader, ": ", &saveptr);
-	char *lengthStr = strtok_r(NULL, "", &saveptr);
-	int contentLength = atoi(lengthStr);
-	if (contentLength <= 0) {
-		fprintf(stderr, "[-] Received invalid response\n");
-		close(sock);
-		free(buf);
-		return NULL;
+
+/* Read the next part of a page and place the new links in the frontier
+ * if we haven't visited them already. Returns the number of new links */
+int parseContent(Page *page, char *content, int length) {
+	// Find the links in the text, <a ... href="link" ...>, without modifying
+	// it. The scan goes on where the last part ended
+	LinkExtractor *extractor = &(page->extractor);
+	int linkCount = extractLinksPart(extractor, content, length);
+	if (linkCount <= 0) {
+		return 0;
 	}
+	char *fullUrl = page->url;
 
-	char *content = malloc((contentLength + 1) * sizeof(char));
-	// Check how much of the content we have read and how much is remaining
-	headerEnd += 4; // Skip \r\n\r\n and go to the start of the content
-	int contentRead = (int) (buf + bufOffset - headerEnd);
+	// The base URL ends before the first '/' of the path, the directory of
+	// the page after the last one. fullUrl is interned, so it isn't modified
+	char *path = strchr(fullUrl + 7, '/'); // Ignore http://
+	int baseLen = path - fullUrl;
+	path++; // Start after first '/'
+	char *lastSlash = strrchr(path, '/');
+	int dirLen = lastSlash != NULL ? lastSlash + 1 - path : 0;
 
-	// Copy the content to a new string
-	if (contentRead > 0) {
-		memcpy(content, headerEnd, contentRead);
+	// The links are written one after the other in a single buffer, each with
+	// room for the base URL and the directory in front of it
+	LinkSpan *spans = extractor->spans;
+	long bufSize = 0;
+	int i;
+	for (i = 0; i < linkCount; i++) {
+		bufSize += baseLen + 1 + dirLen + spans[i].length + 1;
 	}
-	free(buf);
-
-	// Read the rest of the content
-	int remainingContent = contentLength - contentRead;
-	int offset = contentRead;
-	while (remainingContent > 0) {
-		bytesRecv = read(sock, content + offset, remainingContent);
-		if (bytesRecv == -1) {
-			perror("read");
-			free(content);
-			close(sock);
-			return NULL;
-		} else if (bytesRecv == 0) {
-			break;
-		}
-		remainingContent -= bytesRecv;
-		offset += bytesRecv;
+	char *buf = malloc(bufSize);
+	char **links = malloc(linkCount * sizeof(char *));
+	unsigned int *ids = malloc(linkCount * sizeof(unsigned int));
+	int *isNew = malloc(linkCount * sizeof(int));
+	if (buf == NULL || links == NULL || ids == NULL || isNew == NULL) {
+		perror("malloc");
+		free(buf);
+		free(links);
+		free(ids);
+		free(isNew);
+		return 0;
 	}
-	// Null termination
-	content[offset] = '\0';
 
-	close(sock);
-	return content;
-}
-
-
-/* Read response content and place the new links in the URL queue
- * if we haven't visited them already */
-void parseContent(char *content, char *fullUrl) {
-	// Create the base URL by adding a NULL byte at the start of the file path('/')
-	char *path = strchr(fullUrl + 7, '/'); // Ignore http://
-	*path = '\0';
-	path++; // Start after first '/'
-	char *baseUrl = fullUrl;
-	// Get the directory from the path
-	char *saveptr;
-	char *dir = strtok_r(path, "/", &saveptr);
-
-	int linkCount = 0;
-	int linksSize = BUF_SIZE;
-	char **links = malloc(linksSize * sizeof(char *));
-
-	// Find the links in the text
-	// <a href="link"> link_text </a>
-	char *curr = content;
-	char *link;
-	while ((link = strstr(curr, "<a")) != NULL) {
-		// Move the current position so that we don't search for the same
-		// <a on the next loop
-		curr++; // Don't find the same </a>
-		curr = strstr(curr, "</a>");
-		// No ending tag
-		if (curr == NULL) {
-			fprintf(stderr, "[-] Found link without ending </a> tag\n");
-			int i;
-			for (i = 0; i < linkCount; i++) {
-				free(links[i]);
-			}
-			free(links);
-			return;
+	long used = 0;
+	int urlCount = 0;
+	for (i = 0; i < linkCount; i++) {
+		// Decode the link where a relative one ends up
+		char *url = buf + used;
+		char *file = url + baseLen + 1 + dirLen;
+		// A link crossing the start of the part was kept by the extractor
+		char *text = (spans[i].held ? extractor->held : content) + spans[i].offset;
+		int fileLen = decodeLink(text, spans[i].length, file);
+		int schemeLen = strcspn(file, ":/?#");
+		int absolute = 0;
+
+		if (strncmp(file, "http://", 7) == 0) { // Absolute link
+			memmove(url, file, fileLen + 1);
+			absolute = 1;
+		} else if (file[schemeLen] == ':' || file[0] == '#') {
+			// Other schemes aren't downloaded, a fragment is in the same page
+			continue;
+		} else if (file[0] == '/' && file[1] == '/') { // Same scheme, other host
+			memcpy(url, "http:", 5);
+			memmove(url + 5, file, fileLen + 1);
+			absolute = 1;
+		} else if (file[0] == '/') { // External link
+			memcpy(url, fullUrl, baseLen);
+			memmove(url + baseLen, file, fileLen + 1);
+		} else { // Internal link
+			memcpy(url, fullUrl, baseLen);
+			url[baseLen] = '/';
+			memcpy(url + baseLen + 1, path, dirLen);
 		}
-
-		// Find the href part of the link
-		strtok_r(link, " ", &saveptr);
-		char *href = strtok_r(NULL, " >", &saveptr);
-		if (href == NULL || (strncmp(href, "href=\"", 6) != 0 && strncmp(href, "href='", 6) != 0)) {
-			// No href attribute found, continue to the next link
+		// So that the same page is found only once
+		canonicalizeUrl(url);
+		// Only the site of the starting URL is crawled (its pages are saved
+		// by their path), so links to another host or port are skipped
+		if (absolute && (strncmp(url, fullUrl, baseLen) != 0 || url[baseLen] != '/')) {
 			continue;
 		}
 
-		// Get the link inside the href attribute
-		strtok_r(href, "'\"", &saveptr);
-		char *file = strtok_r(NULL, "'\"", &saveptr);
-		if (file == NULL) {
+		int len = strlen(url);
+		if (len > UT_MAX_URL_LEN) {
 			continue;
 		}
+		links[urlCount++] = url;
+		used += len + 1;
+	}
 
-		// Create the full URL
-		char *url;
-		// Check if we have external or internal link
-		if (file[0] == '/') { // External link
-			url = malloc((strlen(baseUrl) + strlen(file) + 1) * sizeof(char));
-			strcpy(url, baseUrl);
-			strcat(url, file);
-		} else { // Internal link
-			url = malloc((strlen(baseUrl) + 1 + strlen(dir) + 1 + strlen(file) + 1) * sizeof(char));
-			strcpy(url, baseUrl);
-			strcat(url, "/");
-			strcat(url, dir);
-			strcat(url, "/");
-			strcat(url, file);
-		}
+	// Check which URLs haven't been visited. Every queued URL is in the
+	// visited set, so the new ones can't be in the frontier either
+	int newLinks = internUrls(links, urlCount, ids, isNew);
+	if (checkpointing && newLinks > 0) {
+		// Logged before they are queued, so no URL is done in the logs before it is found
+		checkpointFound(&checkpoint, links, isNew, urlCount);
+	}
 
-		// Add it to the URL array
-		if (linkCount >= linksSize) {
-			linksSize *= 2;
-			links = realloc(links, linksSize);
-			if (links == NULL) {
-				perror("realloc");
-				return;
-			}
+	// Add the new URLs to the frontier. Their hosts are scheduled in the
+	// deque of this thread, where the other threads can steal them
+	for (i = 0; i < urlCount && newLinks > 0; i++) {
+		if (isNew[i]) {
+			frontierAdd(&frontier, workerId, ids[i]);
 		}
-
-		links[linkCount++] = url;
 	}
 
-	int newLinks = linkCount;
+	free(isNew);
+	free(ids);
+	free(links);
+	free(buf);
+	return newLinks > 0 ? newLinks : 0;
+}
+
+
+/* Insert the URLs in the visited set and intern the new ones. isNew[i] is set
+ * to 1 and ids[i] to the id of urls[i] if it is new. Returns the number of new
+ * URLs, -1 on error */
+int internUrls(char **urls, int count, unsigned int *ids, int *isNew) {
+	if (!useFingerprints) {
+		return UT_internBatch(&urlTable, urls, count, ids, isNew);
+	}
+	if (count <= 0) {
+		return 0;
+	}
 
-	// Add the links to the URL Queue
+	// The fingerprints tell the new URLs apart, only these are stored. Both
+	// use the same hash, so every URL is hashed once
+	unsigned long long *hashes = malloc(count * sizeof(unsigned long long));
+	int *lens = malloc(count * sizeof(int));
+	if (hashes == NULL || lens == NULL) {
+		perror("malloc");
+		free(hashes);
+		free(lens);
+		return -1;
+	}
 	int i;
-	pthread_mutex_lock(&queue_mtx);
-	for (i = 0; i < linkCount; i++) {
-		// Check if the URL has already been visited
-		pthread_mutex_lock(&table_mtx);
-		if (HT_insert(&table, links[i]) == -1) {
-			pthread_mutex_unlock(&table_mtx);
-			newLinks--;
-			continue;
-		}
-		pthread_mutex_unlock(&table_mtx);
+	for (i = 0; i < count; i++) {
+		hashes[i] = hashString(urls[i], &lens[i]);
+	}
 
-		// Check if the URL is already in the URL Queue
-		if (queueExists(&urlQueue, links[i])) {
-			pthread_mutex_unlock(&queue_mtx);
-			newLinks--;
-			continue;
+	int newUrls = FS_insertHashed(&fingerprints, urls, hashes, lens, count, isNew);
+	for (i = 0; i < count && newUrls > 0; i++) {
+		if (isNew[i] && UT_internHashed(&urlTable, urls[i], hashes[i], lens[i], &ids[i]) < 0) {
+			isNew[i] = 0;
+			newUrls--;
 		}
+	}
+	free(hashes);
+	free(lens);
+	return newUrls;
+}
 
-		// New URL -> Add it in the URL Queue
-		queueInsert(&urlQueue, links[i]);
-	}
-	// Notify the rest of the threads to read the new URLs
-	// or to exit if the crawling has finished
-	if (newLinks > 0) {
-		pthread_cond_broadcast(&cond_nonempty);
-	} else if (isEmpty(&urlQueue)) {
-		// Check if there are any other threads in progress
-		int inProgress = 0;
-		pthread_mutex_lock(&thread_progress_mtx);
-		inProgress = threadsInProgress;
-		pthread_mutex_unlock(&thread_progress_mtx);
-
-		// We are the last thread. Crawling ended
-		if (inProgress == 1) {
-			printf("\n[+] Crawling has finsished\n");
-			// Set the thread stop flag and unblock all threads
-			pthread_mutex_lock(&thread_stop_mtx);
-			threadStop = 1;
-			pthread_mutex_unlock(&thread_stop_mtx);
 
-			queueInsert(&urlQueue, "DUMMY"); // Dummy insert
-			pthread_cond_broadcast(&cond_nonempty);
-		}
+/* A URL of the checkpoint being resumed: it is found again, and queued
+ * unless its page was done. With -F the done ones only need a fingerprint */
+void restoreUrl(char *url, int done, void *arg) {
+	if (done && useFingerprints) {
+		FS_insert(&fingerprints, url);
+		return;
 	}
-	pthread_mutex_unlock(&queue_mtx);
+	unsigned int id;
+	int isNew;
+	if (internUrls(&url, 1, &id, &isNew) == 1 && !done) {
+		frontierAdd(&frontier, 0, id);
+	}
+}
 
 
-	for (i = 0; i < linkCount; i++) {
-		free(links[i]);
+/* Write the last checkpoint, after the fetch threads have exited */
+void checkpointStop(void) {
+	if (checkpointing) {
+		checkpointClose(&checkpoint);
+		checkpointing = 0;
 	}
-	free(links);
 }
 
 
-/* Save a web page inside the save_dir and if the directory in which we found the page
- * is new, add it to the docfile used by the Job Executor when searching */
-void saveFile(char *content, char *save_dir, char *filename) {
+void visitedDestroy(void) {
+	if (useFingerprints) {
+		FS_destroy(&fingerprints);
+	}
+	UT_destroy(&urlTable);
+}
+
+
+/* Return the path of a web page inside the save_dir and if the directory in which we found
+ * the page is new, create it and add it to the docfile used by the Job Executor when searching */
+char *createPath(char *save_dir, char *filename) {
 	// Get number of directories needed to save the page
 	int count = 0;
 	char *pos = filename;
@@ -1000,7 +1218,7 @@ void saveFile(char *content, char *save_dir, char *filename) {
 				perror("mkdir");
 				free(path);
 				free(fullPath);
-				return;
+				return NULL;
 			}
 
 			// Append the directory to the docfile
@@ -1012,7 +1230,7 @@ void saveFile(char *content, char *save_dir, char *filename) {
 				free(path);
 				free(fullPath);
 				pthread_mutex_unlock(&docfile_mtx);
-				return;
+				return NULL;
 			}
 			// Create absolute path
 			char absPath[PATH_MAX];
@@ -1022,7 +1240,7 @@ void saveFile(char *content, char *save_dir, char *filename) {
 				free(fullPath);
 				fclose(fp);
 				pthread_mutex_unlock(&docfile_mtx);
-				return;
+				return NULL;
 			}
 			strcat(absPath, "/");
 			strcat(absPath, fullPath);
@@ -1041,18 +1259,7 @@ void saveFile(char *content, char *save_dir, char *filename) {
 	}
 	strcat(fullPath, page);
 	free(path);
-
-	// Write the contents to the file
-	FILE *fp = fopen(fullPath, "w");
-	if (fp == NULL) {
-		perror("fopen");
-		free(fullPath);
-		return;
-	}
-	free(fullPath);
-
-	fwrite(content, sizeof(char), strlen(content), fp);
-	fclose(fp);
+	return fullPath;
 }
 
 
@@ -1109,7 +1316,7 @@ int handleCommand(int client_sock, long long startTime, char **retKeywords[], in
 	if (strncmp(cmd, "STATS", 5) == 0) {
 		printf("[*] Received STATS command\n");
 
-		char msg[BUF_SIZE];
+		char msg[2 * BUF_SIZE];
 		// Get current time in milliseconds
 		struct timeval tv;
 		gettimeofday(&tv, NULL);
@@ -1125,11 +1332,23 @@ int handleCommand(int client_sock, long long startTime, char **retKeywords[], in
 
 
 		pthread_mutex_lock(&stats_mtx);
-		int pages = pagesDownloaded;
-		int bytes = bytesDownloaded;
+		long long pages = pagesDownloaded;
+		long long bytes = bytesDownloaded;
 		pthread_mutex_unlock(&stats_mtx);
 
-		sprintf(msg, "Crawler up for %02i:%02i:%02i.%03i, downloaded %d pages, %d bytes\n", hours, minutes, seconds, milliseconds, pages, bytes);
+		unsigned long long dnsHits, dnsMisses;
+		dnsStats(&dnsCache, &dnsHits, &dnsMisses);
+
+		int len = sprintf(msg, "Crawler up for %02i:%02i:%02i.%03i, downloaded %lld pages, %lld bytes, DNS cache %llu hits, %llu misses",
+				hours, minutes, seconds, milliseconds, pages, bytes, dnsHits, dnsMisses);
+		len += sprintf(msg + len, ", %ld URLs interned, %lld bytes held", UT_size(&urlTable), UT_memory(&urlTable));
+		if (useFingerprints) {
+			unsigned long long verified, collisions;
+			FS_stats(&fingerprints, &verified, &collisions);
+			len += sprintf(msg + len, ", %ld fingerprints in %lld bytes (%llu checked on disk, %llu collisions)",
+					FS_size(&fingerprints), FS_memory(&fingerprints), verified, collisions);
+		}
+		strcpy(msg + len, "\n");
 		write(client_sock, msg, strlen(msg));
 		free(buf);
 		return CMD_OK;
@@ -1189,6 +1408,11 @@ int handleCommand(int client_sock, long long startTime, char **retKeywords[], in
 
 		free(buf);
 		return CMD_SEARCH;
+	} else if (strncmp(cmd, "PROFILE", 7) == 0) {
+		printf("[*] Received PROFILE command\n");
+		int res = commandProfile(client_sock, strtok_r(NULL, " ", &saveptr));
+		free(buf);
+		return res;
 	} else {
 		printf("[*] Received invalid command\n");
 		char msg[] = "INVALID COMMAND\n";
@@ -1199,6 +1423,64 @@ int handleCommand(int client_sock, long long startTime, char **retKeywords[], in
 }
 
 
+/* Sample the stacks of the crawler for the given seconds (10 by default).
+ * The threads keep crawling meanwhile, and the command loop keeps serving
+ * the other commands until it sends the stacks (sendProfile). Returns
+ * CMD_PROFILE if the run started, so the client is kept open */
+int commandProfile(int client_sock, char *arg) {
+	int seconds = PROFILE_SECONDS;
+	if (arg != NULL) {
+		seconds = atoi(arg);
+	}
+	if (seconds <= 0 || seconds > MAX_PROFILE_SECONDS) {
+		char msg[] = "INVALID PROFILE DURATION\n";
+		write(client_sock, msg, strlen(msg));
+		return CMD_OK;
+	}
+	if (profilerStart(profiler, seconds) < 0) {
+		char msg[] = "PROFILE ALREADY RUNNING\n";
+		write(client_sock, msg, strlen(msg));
+		return CMD_OK;
+	}
+	profileSock = client_sock;
+	profileEnd = currentTime() + seconds * 1000LL;
+	return CMD_PROFILE;
+}
+
+
+/* Write the stacks of the PROFILE run that is over folded, as flamegraph
+ * tools read them, and close its client */
+void sendProfile(void) {
+	int len;
+	char *stacks = profilerReport(profiler, &len);
+	if (stacks == NULL) {
+		char msg[] = "PROFILE FAILED\n";
+		write(profileSock, msg, strlen(msg));
+	} else {
+		int offset = 0;
+		while (offset < len) {
+			int written = write(profileSock, stacks + offset, len - offset);
+			if (written < 0 && errno == EINTR) {
+				continue;
+			} else if (written <= 0) {
+				break;
+			}
+			offset += written;
+		}
+		free(stacks);
+	}
+	close(profileSock);
+	profileSock = -1;
+}
+
+
+long long currentTime(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+}
+
+
 /* Check if the given file descriptor has data available to be read
  * without blocking using select */
 int hasData(int fd) {
@@ -1210,7 +1492,8 @@ int hasData(int fd) {
 	timeout.tv_sec = 5; // Same as JE search timeout
 	timeout.tv_usec = 0;
 
-	int res = select(fd + 1, &fds, NULL, NULL, &timeout);
+	int res;
+	while ((res = select(fd + 1, &fds, NULL, NULL, &timeout)) == -1 && errno == EINTR);
 	if (res == -1) {
 		perror("select");
 		if (JE_pid > 0) {
@@ -1245,8 +1528,8 @@ int validUrl(char *url, char *host, int portArg) {
 		free(urlcopy);
 		return 0;
 	}
-	// Check if URL host matches the host argument
-	if (strcmp(hostname, host) != 0) {
+	// Check if URL host matches the host argument (any name is used with a Unix socket)
+	if (unixPath == NULL && strcmp(hostname, host) != 0) {
 		free(urlcopy);
 		return 0;
 	}
@@ -1284,30 +1567,36 @@ void cleanup(pthread_t *threads, int threadCount, char *save_dir) {
 	threadStop = 1;
 	pthread_mutex_unlock(&thread_stop_mtx);
 
-	// Unblock all threads so that they can read the exit flag
-	// The threads will stop after the current requests have finished
-	pthread_mutex_lock(&queue_mtx);
-	queueInsert(&urlQueue, "DUMMY"); // Dummy insert
-	pthread_cond_broadcast(&cond_nonempty);
-	pthread_mutex_unlock(&queue_mtx);
+	// Wake up all engines so that they read the exit flag
+	// The downloads in progress are abandoned
+	int i;
+	for (i = 0; i < fetcherCount; i++) {
+		fetcherStop(&fetchers[i]);
+	}
 
 	// Wait for threads to exit
-	int i;
 	for (i = 0; i < threadCount; i++) {
 		pthread_join(threads[i], NULL);
 	}
+	// The resolvers wake up the engines, so they are stopped first
+	dnsDestroy(&dnsCache);
+	for (i = 0; i < fetcherCount; i++) {
+		fetcherDestroy(&fetchers[i]);
+	}
+	free(fetchers);
 	free(threads);
 	free(save_dir);
+	checkpointStop();
 
 	pthread_mutex_destroy(&thread_stop_mtx);
-	pthread_mutex_destroy(&thread_progress_mtx);
 	pthread_mutex_destroy(&stats_mtx);
-	pthread_mutex_destroy(&table_mtx);
-	pthread_mutex_destroy(&queue_mtx);
-	pthread_cond_destroy(&cond_nonempty);
 
-	queueDestroy(&urlQueue);
-	HT_destroy(&table);
+	frontierDestroy(&frontier);
+	visitedDestroy();
+	if (profileSock >= 0) {
+		close(profileSock);
+	}
+	profilerDestroy(profiler);
 
 	// Disable SIGCHLD and kill the Job Executor
 	signal(SIGCHLD, SIG_IGN);
@@ -1337,5 +1626,5 @@ void child_handler(int sig) {
 
 
 void usage(char *name) {
-	printf("Usage: %s -h <host or IP> -p <port> -c <command port> -t <num of threads> -d <save dir> <starting URL>\n", name);
+	printf("Usage: %s -h <host or IP | unix:<socket path>> -p <port> -c <command port> -t <num of threads> -d <save dir> [-C <concurrent fetches per thread>] [-K <connections per host>] [-Q <pipelined requests>] [-H <fetches per host>] [-F <false positive rate> [-S <spill dir>]] [-P <checkpoint dir> [-I <seconds between checkpoints>] [--resume]] <starting URL>\n", name);
 }
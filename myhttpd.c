@@ -6,8 +6,13 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/select.h> // select
+#include <sys/epoll.h>
+#include <sys/mman.h> // mmap
+#include <sys/wait.h> // waitpid
+#include <sys/signalfd.h>
+#include <sys/prctl.h>
 #include <sys/socket.h>
+#include <sys/un.h> // sockaddr_un
 #include <netinet/in.h>
 #include <fcntl.h>
 #include <arpa/inet.h> // htonl, htons
@@ -15,32 +20,229 @@
 #include <signal.h>
 #include <sys/time.h> // gettimeofday
 #include <errno.h>
+#include <poll.h>
+#include <stddef.h> // offsetof
+#include <limits.h> // PATH_MAX
 #include "req_queue.h"
 #include "requests.h"
+#include "connection.h"
+#include "timer_wheel.h"
+#include "handoff.h"
+#include "hitters.h"
+#include "buffer_pool.h"
+#include "synthetic.h"
+#include "faults.h"
+#include "tuning.h"
+#include "ratelimit.h"
+#include "trace.h"
+#include "profiler.h"
 
 #define BUF_SIZE 256
+#define MAX_HEADER_SIZE 8192
+// Memory allocated with every connection for its requests. More is
+// allocated for requests that don't fit and freed after their response
+#define CONN_ARENA_SIZE 2048
+#define MAX_EVENTS 64
+
+// Connection deadlines in milliseconds
+#define HEADER_TIMEOUT_MS 10000
+#define IDLE_TIMEOUT_MS   15000
+#define WRITE_TIMEOUT_MS  30000
+// Longest time the main loop sleeps before checking for terminated threads
+#define THREAD_CHECK_MS   10000
+// Time given to a new server to start during an upgrade
+#define UPGRADE_TIMEOUT_MS 10000
+// Time given to the old server to finish its connections after an upgrade
+#define DRAIN_TIMEOUT_MS   60000
+#define DRAIN_CHECK_MS     1000
+// Files are sent in chunks taken from a pool of buffers. The size of the pool
+// bounds the memory used by responses in flight
+#define CHUNK_SIZE        (64 * 1024)
+#define DEFAULT_MEM_LIMIT 16 // MB
+// Larger files get readahead hints and are dropped from the page cache after being sent
+#define STREAM_THRESHOLD  (1024 * 1024)
+#define READAHEAD_SIZE    (1024 * 1024)
+#define DROP_BEHIND_SIZE  (4 * 1024 * 1024)
+// Prefork mode
+#define MAX_PROCS      64
+#define CHILD_CHECK_MS 1000
+
+#define TIMER_HEADER 0
+#define TIMER_IDLE   1
+#define TIMER_WRITE  2
 
 #define CMD_OK       0
 #define CMD_SHUTDOWN 1
+#define CMD_UPGRADE  2
+#define CMD_TOPPAGES 3
+#define CMD_QUIT     4
+#define CMD_PROFILE  5
 #define CMD_INVALID -1
 
+// Command port sessions
+#define MAX_SESSIONS       32
+#define SESSION_SEND_MS    1000 // Sessions that don't read their replies are closed
+#define MIN_WATCH_MS       100
+#define TRACE_SECONDS      10 // Default period dumped by TRACE
+#define PROFILE_SECONDS    10 // Default duration of PROFILE
+
+// Client connected to the command port. It can send several commands, one per line
+typedef struct session {
+	int sock;
+	char buf[BUF_SIZE];
+	int bufOffset;
+	int watchInterval; // Milliseconds between STATS sent by WATCH STATS, 0 if not watching
+	long long nextWatch;
+	long long profileEnd; // When the folded stacks of PROFILE are due, 0 if not profiling
+} Session;
+
+// The command port is served by its own thread, so commands and web requests
+// don't wait for each other. The thread tells the event loop to stop or drain
+// through actionPipe and is told to stop through stopPipe
+typedef struct commandArgs {
+	char **argv;
+	int web_sock;
+	int cmd_sock;
+	long long startTime;
+} CommandArgs;
+
+
+static int serveRequests(char **, int, int, int, int, int, char *, long long);
+static int runMaster(char **, int, int, int, int, int, char *, long long);
+static pid_t startChild(int, int, int, int, char *, long long);
 static void *threadFunc(void *);
-static void serveClient(char *, int);
+static int serveClient(char *, Connection *, Fault *);
+static int serveSynthetic(char *, Connection *, Fault *);
+static int writeChunk(void *, char *, int);
+static int writeBody(Connection *, Fault *, char *, int);
+static int sendResponse(Connection *, int, char *, int);
+static int writeAll(int, char *, int);
+static int writeNow(int, char *, int);
 static int invalidFile(char *);
-static int handleCommand(int, long long);
-static int handleRequest(int, char *);
+static int startCommandThread(char **, int, int, long long);
+static void stopCommandThread(void);
+static void closeCommandFds(void);
+static void *commandThreadFunc(void *);
+static int readSession(Session *, long long);
+static int sessionCommand(Session *, char *, long long);
+static void closeSession(Session *);
+static int handleCommand(int, char *, long long);
+static int formatStats(char *, long long);
+static void commandTopPages(int, char *);
+static void commandFault(int, char *);
+static void commandTrace(int, char *);
+static int sendProfile(int);
+static int createListener(int, int, Tuning *);
+static int createUnixListener(char *, int);
+static void removeUnixPath(void);
+static void findBinary(char *);
+static int setBinaryPath(char *);
+static pid_t upgradeServer(char **, int, int);
+static void replyUpgrade(int, pid_t);
+static void closeListeners(int, int);
+static void removeListeners(int);
+static void startDrain(void);
+static int acceptClients(int);
+static void handleRequest(Connection *, char *);
+static void finishRequest(Connection *, int);
+static void setDeadline(Connection *, int);
+static void extendDeadline(Connection *);
+static void expireConnections(void);
+static Connection *createConnection(int);
+static int resetConnection(Connection *);
+static void destroyConnection(Connection *);
+static long long currentTime(void);
+static int createShared(long long);
+static long long traceMark(Connection *);
+static void destroyShared(void);
 static void cleanup(pthread_t *, int);
 static void usage(char *);
 
 
 // Used to stop threads when shutting down server
+// and to stop keeping connections alive while draining after an upgrade
 static int threadStop = 0;
+static int draining = 0;
 static pthread_mutex_t thread_stop_mtx = PTHREAD_MUTEX_INITIALIZER;
 
-// Variables used for STATS command
-static int pagesServed = 0;
-static int bytesServed = 0;
-static pthread_mutex_t stats_mtx = PTHREAD_MUTEX_INITIALIZER;
+// Number of open web connections (used to know when draining has finished)
+static int openConnections = 0;
+static pthread_mutex_t conn_count_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+// Variables used for STATS command. Every process has its own slot in a shared
+// memory page, so that the master can add up the counters of its children
+typedef struct counters {
+	unsigned long long pagesServed;
+	unsigned long long bytesServed;
+	unsigned long long connectionsTimedOut;
+	unsigned long long requestsLimited;
+} __attribute__((aligned(64))) Counters; // Avoid false sharing between processes
+
+static Counters *counters = NULL;
+static int counterSlots = 0;
+static Counters *myCounters = NULL;
+
+// Request and byte counts of the most requested pages
+static HitterTable *hitters = NULL;
+static int rootDirLen = 0; // Stripped from the filenames to get the requested path
+
+// Deadlines of all open connections. Threads reschedule the deadline of the
+// connection they serve, so the wheel is protected by a mutex
+static TimerWheel wheel;
+static pthread_mutex_t wheel_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+// Buffers used to send files, shared by the threads
+static BufferPool bufferPool;
+static long long memLimit = DEFAULT_MEM_LIMIT * 1024LL * 1024;
+
+// Token buckets of the clients (NULL if requests aren't rate limited)
+static RateTable *rateLimits = NULL;
+static int rateLimit = 0; // Requests per second
+static int rateBurst = 0;
+
+// Sampled request stages, kept in one ring buffer per thread
+static TraceTable *traces = NULL;
+
+// Stacks sampled on SIGPROF while PROFILE runs
+static Profiler *profiler = NULL;
+
+// Socket options of the web listener and the values the kernel applied
+static Tuning tuning;
+static char socketReport[BUF_SIZE];
+
+// Unix domain socket also (or only) accepting web requests, -1 if not used.
+// A path starting with '@' is a name in the abstract namespace
+static char *unixPath = NULL;
+static int unix_sock = -1;
+static int unixPassed = 0; // Handed to a new server by UPGRADE, so the path is kept
+
+// Absolute path of the binary started again by UPGRADE, found at startup
+// because argv[0] may be a name looked up in $PATH or relative to the cwd
+static char binaryPath[PATH_MAX];
+
+// Faults injected in the responses, set through the command port
+static FaultTable *faults = NULL;
+
+static pthread_t cmdThread;
+static int cmdRunning = 0;
+static CommandArgs cmdArgs;
+static int actionPipe[2] = {-1, -1};
+static int stopPipe[2] = {-1, -1};
+static Session *sessions[MAX_SESSIONS];
+static int cmdEpfd = -1;
+
+// Destination of a response body and the faults injected in it
+typedef struct bodyWriter {
+	Connection *conn;
+	Fault *fault;
+} BodyWriter;
+
+// Website generated from a text file instead of being read from the root directory
+static Synthetic synth;
+static int synthetic = 0;
+
+// Event loop of the main thread. Threads re-arm keep-alive connections in it
+static int epfd = -1;
 
 // Queue of requests to be served by the threads
 static RequestQueue reqQueue;
@@ -50,7 +252,7 @@ static pthread_cond_t cond_nonfull = PTHREAD_COND_INITIALIZER;
 
 
 int main(int argc, char *argv[]) {
-	if (argc != 9) {
+	if (argc < 9 || argc % 2 == 0) {
 		usage(argv[0]);
 		return -1;
 	}
@@ -58,18 +260,33 @@ int main(int argc, char *argv[]) {
 	// Ignore SIGPIPEs. We will handle the errors
 	signal(SIGPIPE, SIG_IGN);
 
+	findBinary(argv[0]);
+
 	int sport;
 	int cport;
 	int threadCount;
-	char *dirname;
+	int procCount = 0; // 0: single process
+	char *dirname = "";
 	struct stat dirStat;
+	unsigned long long synthSeed;
+	int synthSites;
+	int synthPages;
+	char *synthText = "pg164.txt";
+	char *faultFile = NULL;
 
 	// Parse arguments
+	tuningDefaults(&tuning);
 	int got_sport = 0;
 	int got_cport = 0;
 	int got_threads = 0;
 	int got_dir = 0;
+	int got_procs = 0;
+	int got_mem = 0;
+	int got_faults = 0;
+	int got_tuning = 0;
+	int got_rate = 0;
 	int i;
+	int n;
 	for (i = 1; i < argc; i += 2) {
 		if (strcmp(argv[i], "-p") == 0 && !got_sport) {
 			got_sport = 1;
@@ -78,6 +295,12 @@ int main(int argc, char *argv[]) {
 				fprintf(stderr, "[-] Port number must be between 1 and 65535\n");
 				return -1;
 			}
+		} else if (strcmp(argv[i], "-U") == 0 && unixPath == NULL) {
+			unixPath = argv[i+1];
+			if (unixPath[0] == '\0' || strlen(unixPath) >= sizeof(((struct sockaddr_un *) 0)->sun_path)) {
+				fprintf(stderr, "[-] Invalid Unix socket path %s\n", unixPath);
+				return -1;
+			}
 		} else if (strcmp(argv[i], "-c") == 0 && !got_cport) {
 			got_cport = 1;
 			cport = atoi(argv[i+1]);
@@ -92,6 +315,56 @@ int main(int argc, char *argv[]) {
 				fprintf(stderr, "[-] The number of threads must be a positive integer\n");
 				return -1;
 			}
+		} else if (strcmp(argv[i], "-P") == 0 && !got_procs) {
+			got_procs = 1;
+			procCount = atoi(argv[i+1]);
+			if (procCount <= 0 || procCount > MAX_PROCS) {
+				fprintf(stderr, "[-] The number of processes must be between 1 and %d\n", MAX_PROCS);
+				return -1;
+			}
+		} else if (strcmp(argv[i], "-m") == 0 && !got_mem) {
+			got_mem = 1;
+			int megabytes = atoi(argv[i+1]);
+			if (megabytes <= 0) {
+				fprintf(stderr, "[-] The memory limit must be a positive number of MB\n");
+				return -1;
+			}
+			memLimit = megabytes * 1024LL * 1024;
+		} else if (strcmp(argv[i], "-R") == 0 && !got_rate) {
+			got_rate = 1;
+			// <requests per second>[,<burst>]
+			n = 0;
+			if (sscanf(argv[i+1], "%d%n", &rateLimit, &n) != 1 || rateLimit <= 0) {
+				fprintf(stderr, "[-] The rate limit must be given as <requests per second>[,<burst>]\n");
+				return -1;
+			}
+			rateBurst = rateLimit;
+			if (argv[i+1][n] == ',' && (sscanf(argv[i+1] + n + 1, "%d", &rateBurst) != 1 || rateBurst <= 0 || rateBurst > MAX_BURST)) {
+				fprintf(stderr, "[-] The burst must be between 1 and %d requests\n", MAX_BURST);
+				return -1;
+			}
+		} else if (strcmp(argv[i], "-T") == 0 && !got_tuning) {
+			got_tuning = 1;
+			// Either name=value pairs or a file with one pair per line
+			int res = strchr(argv[i+1], '=') != NULL ? tuningParse(&tuning, argv[i+1]) : tuningLoad(&tuning, argv[i+1]);
+			if (res < 0) {
+				return -1;
+			}
+		} else if (strcmp(argv[i], "-F") == 0 && !got_faults) {
+			got_faults = 1;
+			faultFile = argv[i+1];
+		} else if (strcmp(argv[i], "--synthetic") == 0 && !synthetic) {
+			synthetic = 1;
+			// <seed>,<sites>,<pages>[,<text file>]
+			n = 0;
+			if (sscanf(argv[i+1], "%llu,%d,%d%n", &synthSeed, &synthSites, &synthPages, &n) != 3
+					|| (argv[i+1][n] != '\0' && argv[i+1][n] != ',')) {
+				fprintf(stderr, "[-] The synthetic website must be given as <seed>,<sites>,<pages>\n");
+				return -1;
+			}
+			if (argv[i+1][n] == ',') {
+				synthText = argv[i+1] + n + 1;
+			}
 		} else if (strcmp(argv[i], "-d") == 0 && !got_dir) {
 			got_dir = 1;
 			dirname = argv[i+1];
@@ -116,138 +389,230 @@ int main(int argc, char *argv[]) {
 			return -1;
 		}
 	}
+	// The root directory isn't used by synthetic websites.
+	// Requests are served on the TCP port, the Unix socket or both
+	if ((!got_sport && unixPath == NULL) || !got_cport || !got_threads || (!got_dir && !synthetic)) {
+		usage(argv[0]);
+		return -1;
+	}
+
 
 
+	// Socket used to receive the listening sockets when started by UPGRADE
+	int handoff_sock = -1;
+	char *handoffStr = getenv(HANDOFF_ENV);
+	if (handoffStr != NULL) {
+		handoff_sock = atoi(handoffStr);
+		unsetenv(HANDOFF_ENV);
+	}
+
 
 	// Get the start time in milliseconds
 	struct timeval tv;
 	gettimeofday(&tv, NULL);
 	long long startTime = tv.tv_sec * 1000 + tv.tv_usec / 1000;
 
-	queueInit(&reqQueue);
-
-
-	// Create the thread pool
-	pthread_t *threads = malloc(threadCount * sizeof(pthread_t));
-	for (i = 0; i < threadCount; i++) {
-		pthread_create(&threads[i], NULL, threadFunc, NULL);
+	rootDirLen = strlen(dirname);
+	counterSlots = procCount > 0 ? procCount : 1;
+	memLimit /= counterSlots; // The limit is shared by the processes
+	if (createShared(startTime) < 0) {
+		destroyShared();
+		return -2;
+	}
+	if (faultFile != NULL && faultsLoad(faults, faultFile) < 0) {
+		destroyShared();
+		return -1;
 	}
 
 
-	int reuse = 1;
+	int web_sock = -1;
+	int cmd_sock;
+	if (handoff_sock >= 0) {
+		// Take over the listening sockets of the server we are replacing.
+		// They are sent in the order web, command, Unix (same arguments, same sockets)
+		int fds[3];
+		int count = 0;
+		if (recvListeners(handoff_sock, fds, 1 + got_sport + (unixPath != NULL)) < 0) {
+			close(handoff_sock);
+			destroyShared();
+			return -2;
+		}
+		if (got_sport) {
+			web_sock = fds[count++];
+		}
+		cmd_sock = fds[count++];
+		if (unixPath != NULL) {
+			unix_sock = fds[count++];
+		}
+		printf("[+] Took over listening sockets from the previous server\n");
+
+		// Our socket options replace the ones of the previous server
+		// (Calling listen again changes the backlog)
+		if (web_sock >= 0) {
+			tuningApplyListener(&tuning, web_sock);
+			if (listen(web_sock, tuning.backlog) < 0) {
+				perror("listen");
+			}
+		}
+		if (unix_sock >= 0 && listen(unix_sock, tuning.backlog) < 0) {
+			perror("listen");
+		}
+	} else {
+		// WEB SOCKETS
+		if (got_sport && (web_sock = createListener(sport, tuning.backlog, &tuning)) < 0) {
+			destroyShared();
+			return -2;
+		}
+		if (unixPath != NULL && (unix_sock = createUnixListener(unixPath, tuning.backlog)) < 0) {
+			closeListeners(web_sock, -1);
+			destroyShared();
+			return -2;
+		}
 
-	// WEB SOCKET
-	int web_sock;
-	if ((web_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-		perror("socket: web");
-		cleanup(threads, threadCount);
-		return -2;
+		// COMMAND SOCKET
+		if ((cmd_sock = createListener(cport, 5, NULL)) < 0) {
+			closeListeners(web_sock, -1);
+			removeUnixPath();
+			destroyShared();
+			return -2;
+		}
 	}
-	// Avoid TIME_WAIT state
-	if (setsockopt(web_sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
-		perror("setsockopt: web");
-		cleanup(threads, threadCount);
-		close(web_sock);
-		return -2;
+	// The TCP options read on a Unix socket are reported as -1
+	tuningReport(&tuning, web_sock >= 0 ? web_sock : unix_sock, socketReport, BUF_SIZE);
+	printf("[+] %s", socketReport);
+
+	// Pages are generated from the text file, loaded before any worker is forked
+	if (synthetic) {
+		if (synthInit(&synth, synthText, synthSeed, synthSites, synthPages) < 0) {
+			closeListeners(web_sock, cmd_sock);
+			removeUnixPath();
+			destroyShared();
+			return -2;
+		}
+		printf("[+] Serving a synthetic website of %d sites with %d pages each\n", synthSites, synthPages);
 	}
-
-	struct sockaddr_in web_server;
-	web_server.sin_family = AF_INET;
-	web_server.sin_addr.s_addr = htonl(INADDR_ANY);
-	web_server.sin_port = htons(sport);
-	if (bind(web_sock, (struct sockaddr *) &web_server, sizeof(web_server)) < 0) {
-		perror("bind: web");
-		cleanup(threads, threadCount);
-		close(web_sock);
-		return -2;
+	if (web_sock >= 0) {
+		printf("[+] Listening for requests on port %d\n", sport);
 	}
-
-	// Set the socket as non-blocking to handle client disconnection after select succeeds
-	int opts = fcntl(web_sock, F_GETFL);
-	if (opts < 0) {
-		perror("fcntl: F_GETFL");
-		cleanup(threads, threadCount);
-		close(web_sock);
-		return -2;
+	if (unix_sock >= 0) {
+		printf("[+] Listening for requests on Unix socket %s\n", unixPath);
 	}
-	if (fcntl(web_sock, F_SETFL, opts | O_NONBLOCK) < 0) {
-		perror("fcntl: F_SETFL");
-		cleanup(threads, threadCount);
-		close(web_sock);
-		return -2;
+	printf("[+] Listening for commands on port %d\n\n", cport);
+
+
+	int res;
+	if (procCount > 0) {
+		res = runMaster(argv, web_sock, cmd_sock, handoff_sock, procCount, threadCount, dirname, startTime);
+	} else {
+		res = serveRequests(argv, web_sock, cmd_sock, handoff_sock, -1, threadCount, dirname, startTime);
 	}
 
-	if (listen(web_sock, 16) < 0) {
-		perror("listen: web");
-		cleanup(threads, threadCount);
-		close(web_sock);
-		return -2;
+	if (synthetic) {
+		synthDestroy(&synth);
 	}
-	printf("[+] Listening for requests on port %d\n", sport);
+	// A new server started by UPGRADE keeps accepting on the path
+	if (!unixPassed) {
+		removeUnixPath();
+	}
+	destroyShared();
+	return res;
+}
 
 
-	// COMMAND SOCKET
-	int cmd_sock;
-	if ((cmd_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-		perror("socket: cmd");
-		cleanup(threads, threadCount);
-		close(web_sock);
+/* Run the thread pool and the event loop until the server is shut down or
+ * has finished draining. cmd_sock and handoff_sock are -1 in prefork children,
+ * which are told to stop or drain through sig_fd instead (-1 otherwise).
+ * The listening sockets are closed before returning */
+int serveRequests(char *argv[], int web_sock, int cmd_sock, int handoff_sock, int sig_fd,
+		int threadCount, char *dirname, long long startTime) {
+	queueInit(&reqQueue);
+	wheelInit(&wheel, startTime);
+	traceThread(traces, "event loop");
+	if (poolInit(&bufferPool, CHUNK_SIZE, memLimit / CHUNK_SIZE) < 0) {
+		queueDestroy(&reqQueue);
+		closeListeners(web_sock, cmd_sock);
 		return -2;
 	}
-	// Avoid TIME_WAIT state
-	if (setsockopt(cmd_sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
-		perror("setsockopt: command");
-		cleanup(threads, threadCount);
-		close(web_sock);
-		close(cmd_sock);
-		return -2;
+
+	// Create the thread pool
+	pthread_t *threads = malloc(threadCount * sizeof(pthread_t));
+	int i;
+	for (i = 0; i < threadCount; i++) {
+		pthread_create(&threads[i], NULL, threadFunc, NULL);
 	}
 
-	struct sockaddr_in cmd_server;
-	cmd_server.sin_family = AF_INET;
-	cmd_server.sin_addr.s_addr = htonl(INADDR_ANY);
-	cmd_server.sin_port = htons(cport);
-	if (bind(cmd_sock, (struct sockaddr *) &cmd_server, sizeof(cmd_server)) < 0) {
-		perror("bind: command");
+
+	// EVENT LOOP
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		perror("epoll_create1");
 		cleanup(threads, threadCount);
-		close(web_sock);
-		close(cmd_sock);
+		closeListeners(web_sock, cmd_sock);
 		return -2;
 	}
 
-	// Set the socket as non-blocking to handle client disconnection after select succeeds
-	opts = fcntl(cmd_sock, F_GETFL);
-	if (opts < 0) {
-		perror("fcntl: F_GETFL");
-		cleanup(threads, threadCount);
-		close(web_sock);
-		close(cmd_sock);
-		return -2;
+	// Listening sockets are told apart from connections by their data pointer
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	if (sig_fd >= 0) {
+		// Only one of the prefork children is woken up for each new client
+		ev.events |= EPOLLEXCLUSIVE;
 	}
-	if (fcntl(cmd_sock, F_SETFL, opts | O_NONBLOCK) < 0) {
-		perror("fcntl: F_SETFL");
+	ev.data.ptr = &web_sock;
+	if (web_sock >= 0 && epoll_ctl(epfd, EPOLL_CTL_ADD, web_sock, &ev) < 0) {
+		perror("epoll_ctl: web");
 		cleanup(threads, threadCount);
-		close(web_sock);
-		close(cmd_sock);
+		closeListeners(web_sock, cmd_sock);
 		return -2;
 	}
-
-	if (listen(cmd_sock, 5) < 0) {
-		perror("listen: command");
+	ev.data.ptr = &unix_sock;
+	if (unix_sock >= 0 && epoll_ctl(epfd, EPOLL_CTL_ADD, unix_sock, &ev) < 0) {
+		perror("epoll_ctl: unix");
 		cleanup(threads, threadCount);
-		close(web_sock);
-		close(cmd_sock);
+		closeListeners(web_sock, cmd_sock);
 		return -2;
 	}
-	printf("[+] Listening for commands on port %d\n\n", cport);
+	if (cmd_sock >= 0) {
+		// Commands are read by their own thread, which tells us to stop or drain
+		if (startCommandThread(argv, web_sock, cmd_sock, startTime) < 0) {
+			cleanup(threads, threadCount);
+			closeListeners(web_sock, cmd_sock);
+			return -2;
+		}
+		ev.events = EPOLLIN;
+		ev.data.ptr = &actionPipe[0];
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, actionPipe[0], &ev) < 0) {
+			perror("epoll_ctl: command");
+			cleanup(threads, threadCount);
+			closeListeners(web_sock, cmd_sock);
+			return -2;
+		}
+	}
+	if (sig_fd >= 0) {
+		ev.events = EPOLLIN;
+		ev.data.ptr = &sig_fd;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, sig_fd, &ev) < 0) {
+			perror("epoll_ctl: signals");
+			cleanup(threads, threadCount);
+			closeListeners(web_sock, cmd_sock);
+			return -2;
+		}
+	}
 
 
+	// Tell the previous server that it can stop accepting
+	if (handoff_sock >= 0) {
+		char ready = HANDOFF_READY;
+		write(handoff_sock, &ready, 1);
+		close(handoff_sock);
+	}
 
-	int client_sock;
-	struct sockaddr_in client;
-	socklen_t client_len = sizeof(client);
 
-	while (1) {
+	struct epoll_event events[MAX_EVENTS];
+
+	long long drainStart = 0;
+	int upgraded = 0;
+	int running = 1;
+	while (running) {
 		// Check if a thread was terminated and we need to create a new one
 		int j;
 		for (j = 0; j < threadCount; j++) {
@@ -259,96 +624,272 @@ int main(int argc, char *argv[]) {
 			}
 		}
 
-		fd_set sockfds;
-		FD_ZERO(&sockfds);
-		FD_SET(web_sock, &sockfds);
-		FD_SET(cmd_sock, &sockfds);
-		int maxfd;
-		if (web_sock > cmd_sock) {
-			maxfd = web_sock;
-		} else {
-			maxfd = cmd_sock;
-		}
-
-		// Periodically unblock select to check terminated threads
-		// The timeout has to be reinitialized after every call to select
-		struct timeval timeout;
-		timeout.tv_sec = 10;
-		timeout.tv_usec = 0;
+		// Sleep until the next connection deadline, but unblock periodically
+		// to check terminated threads
+		pthread_mutex_lock(&wheel_mtx);
+		int timeout = wheelTimeout(&wheel, currentTime(), drainStart > 0 ? DRAIN_CHECK_MS : THREAD_CHECK_MS);
+		pthread_mutex_unlock(&wheel_mtx);
 
-		if (select(maxfd + 1, &sockfds, NULL, NULL, &timeout) == -1) {
-			perror("select");
+		int nfds = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+		if (nfds == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("epoll_wait");
 			cleanup(threads, threadCount);
-			close(web_sock);
-			close(cmd_sock);
+			closeListeners(web_sock, cmd_sock);
 			return -2;
 		}
 
-		// Check which socket is ready to accept a connection
-		// Handle command request first
-		if (FD_ISSET(cmd_sock, &sockfds)) {
-			client_sock = accept(cmd_sock, (struct sockaddr *) &client, &client_len);
-			if (client_sock < 0 && errno != EAGAIN) {
-				perror("accept");
-				cleanup(threads, threadCount);
-				close(web_sock);
-				close(cmd_sock);
-				return -2;
-			} else if (client_sock >= 0) {
-				// Get the IP of the connected client
-				printf("[+] Client connected to COMMAND port from %s:%d\n", inet_ntoa(client.sin_addr), ntohs(client.sin_port));
+		for (j = 0; j < nfds; j++) {
+			void *ptr = events[j].data.ptr;
 
-				int res = handleCommand(client_sock, startTime);
-				// Client socket no longer needed (one command per connection)
-				close(client_sock);
-				if (res == CMD_SHUTDOWN) {
+			// Action requested through the command port
+			if (ptr == &actionPipe[0]) {
+				char action;
+				if (read(actionPipe[0], &action, 1) != 1) {
+					continue;
+				}
+				if (action == CMD_SHUTDOWN) {
 					printf("[!] SHUTTING DOWN SERVER\n");
+					running = 0;
 					break;
+				} else if (action == CMD_UPGRADE && drainStart == 0) {
+					// The new server accepts from now on. Stop listening and
+					// finish the connections that are already open
+					stopCommandThread();
+					removeListeners(web_sock);
+					closeListeners(web_sock, cmd_sock);
+					web_sock = -1;
+					cmd_sock = -1;
+					drainStart = currentTime();
+					upgraded = 1;
 				}
-			} else {
-				printf("[!] Client closed the connection\n");
-			}
-		}
-
-		// Handle web request
-		if (FD_ISSET(web_sock, &sockfds)) {
-			client_sock = accept(web_sock, (struct sockaddr *) &client, &client_len);
-			if (client_sock < 0 && errno != EAGAIN) {
-				perror("accept");
-				cleanup(threads, threadCount);
-				close(web_sock);
-				close(cmd_sock);
-				return -2;
-			} else if (client_sock >= 0) {
-				// Get the IP of the connected client
-				printf("[+] Client connected to WEB port from %s:%d\n", inet_ntoa(client.sin_addr), ntohs(client.sin_port));
-
-				if (handleRequest(client_sock, dirname) < 0) {
-					fprintf(stderr, "[-] Error while handling request\n");
+			// Signal from the master process (prefork mode)
+			} else if (ptr == &sig_fd) {
+				struct signalfd_siginfo info;
+				if (read(sig_fd, &info, sizeof(info)) != sizeof(info)) {
+					continue;
+				}
+				if (info.ssi_signo == SIGTERM) {
+					running = 0;
+					break;
+				} else if (info.ssi_signo == SIGUSR1) {
+					// The master started a PROFILE run
+					profilerArm(profiler);
+				} else if (info.ssi_signo == SIGUSR2 && drainStart == 0) {
+					// The master handed the listening sockets to a new server
+					removeListeners(web_sock);
+					closeListeners(web_sock, cmd_sock);
+					web_sock = -1;
+					drainStart = currentTime();
+					upgraded = 1;
+				}
+			// Handle new web clients (TCP or Unix socket)
+			} else if (ptr == &web_sock || ptr == &unix_sock) {
+				// The rest of the events of the round still run after an
+				// upgrade (the connections are EPOLLONESHOT), except those of
+				// the listeners, which are closed
+				if (drainStart > 0) {
+					continue;
+				}
+				if (acceptClients(*((int *) ptr)) < 0) {
 					cleanup(threads, threadCount);
-					close(web_sock);
-					close(cmd_sock);
+					closeListeners(web_sock, cmd_sock);
 					return -2;
 				}
+			// Request data on an open connection
 			} else {
-				printf("[!] Client closed the connection\n");
+				handleRequest((Connection *) ptr, dirname);
+			}
+		}
+
+		// Idle connections are closed once no event of this round can refer to them
+		if (upgraded) {
+			startDrain();
+			upgraded = 0;
+		}
+
+		// Close the connections whose deadline has passed
+		// (after the events, so that no event refers to a closed connection)
+		expireConnections();
+
+		// After an upgrade, exit once every connection has been closed
+		if (drainStart > 0) {
+			pthread_mutex_lock(&conn_count_mtx);
+			int open = openConnections;
+			pthread_mutex_unlock(&conn_count_mtx);
+
+			if (open == 0) {
+				printf("[!] All connections finished, exiting\n");
+				running = 0;
+			} else if (currentTime() - drainStart > DRAIN_TIMEOUT_MS) {
+				printf("[!] Drain timeout expired with %d connections open, exiting\n", open);
+				running = 0;
 			}
 		}
 	}
 
 
 	cleanup(threads, threadCount);
-	close(web_sock);
-	close(cmd_sock);
+	closeListeners(web_sock, cmd_sock);
+	traceThreadExit();
+	return 0;
+}
+
+
+/* Prefork mode: start the worker processes that serve the web socket
+ * and handle the command port, restarting any worker that terminates */
+int runMaster(char *argv[], int web_sock, int cmd_sock, int handoff_sock, int procCount,
+		int threadCount, char *dirname, long long startTime) {
+	pid_t *children = malloc(procCount * sizeof(pid_t));
+	if (children == NULL) {
+		perror("malloc");
+		closeListeners(web_sock, cmd_sock);
+		return -2;
+	}
+	int i;
+	for (i = 0; i < procCount; i++) {
+		children[i] = startChild(i, web_sock, cmd_sock, threadCount, dirname, startTime);
+	}
+
+	// The children are forked before the command thread is started
+	if (startCommandThread(argv, web_sock, cmd_sock, startTime) < 0) {
+		for (i = 0; i < procCount; i++) {
+			if (children[i] > 0) {
+				kill(children[i], SIGTERM);
+				waitpid(children[i], NULL, 0);
+			}
+		}
+		free(children);
+		closeListeners(web_sock, cmd_sock);
+		return -2;
+	}
+
+	// Tell the previous server that it can stop accepting
+	if (handoff_sock >= 0) {
+		char ready = HANDOFF_READY;
+		write(handoff_sock, &ready, 1);
+		close(handoff_sock);
+	}
+
+	int stopSignal = 0;
+	while (!stopSignal) {
+		// Restart the workers that crashed (or that failed to start)
+		int status;
+		pid_t pid;
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			for (i = 0; i < procCount; i++) {
+				if (children[i] == pid) {
+					printf("[-] Worker process %d has been terminated\n", pid);
+					children[i] = -1;
+					break;
+				}
+			}
+		}
+		for (i = 0; i < procCount; i++) {
+			if (children[i] < 0) {
+				printf("[*] Restarting worker process...\n");
+				children[i] = startChild(i, web_sock, cmd_sock, threadCount, dirname, startTime);
+			}
+		}
+
+		// Wait for an action requested through the command port
+		struct pollfd pfd;
+		pfd.fd = actionPipe[0];
+		pfd.events = POLLIN;
+		int res = poll(&pfd, 1, CHILD_CHECK_MS);
+		if (res < 0 && errno != EINTR) {
+			perror("poll");
+			stopSignal = SIGTERM;
+			break;
+		} else if (res <= 0) {
+			continue;
+		}
+
+		char action;
+		if (read(actionPipe[0], &action, 1) != 1) {
+			continue;
+		}
+		if (action == CMD_SHUTDOWN) {
+			printf("[!] SHUTTING DOWN SERVER\n");
+			stopSignal = SIGTERM;
+		} else if (action == CMD_UPGRADE) {
+			printf("[!] Draining worker processes\n");
+			stopSignal = SIGUSR2;
+		} else if (action == CMD_PROFILE) {
+			// The timer of every process has to be started by the process itself
+			for (i = 0; i < procCount; i++) {
+				if (children[i] > 0) {
+					kill(children[i], SIGUSR1);
+				}
+			}
+		}
+	}
+
+	// Workers stop at once on SIGTERM or finish their connections on SIGUSR2
+	stopCommandThread();
+	closeListeners(web_sock, cmd_sock);
+	for (i = 0; i < procCount; i++) {
+		if (children[i] > 0) {
+			kill(children[i], stopSignal);
+		}
+	}
+	for (i = 0; i < procCount; i++) {
+		if (children[i] > 0) {
+			waitpid(children[i], NULL, 0);
+		}
+	}
+	free(children);
 	return 0;
 }
 
 
+/* Fork a prefork worker process which uses the given counters slot */
+pid_t startChild(int index, int web_sock, int cmd_sock, int threadCount, char *dirname, long long startTime) {
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return -1;
+	} else if (pid > 0) {
+		return pid;
+	}
+
+	// WORKER PROCESS
+	close(cmd_sock);
+	closeCommandFds();
+	myCounters = &counters[index];
+
+	// Stop if the master dies
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+	// The master's signals are read from the event loop. They are blocked
+	// before the threads are created so that no thread receives them
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGUSR2);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	int sig_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+	if (sig_fd < 0) {
+		perror("signalfd");
+		exit(-2);
+	}
+
+	int res = serveRequests(NULL, web_sock, -1, -1, sig_fd, threadCount, dirname, startTime);
+	close(sig_fd);
+	destroyShared();
+	exit(res);
+}
+
+
 /* Thread pool function */
 void *threadFunc(void *ptr) {
 	char *filename;
-	int client_sock;
+	Connection *conn;
 	int stop = 0;
+	traceThread(traces, "worker");
 
 	while (1) {
 		// Each thread waits for a request to be added so that it can serve it
@@ -365,128 +906,324 @@ void *threadFunc(void *ptr) {
 		if (stop) {
 			pthread_mutex_unlock(&queue_mtx);
 			printf("[*] Thread %ld exiting...\n", pthread_self());
+			traceThreadExit();
 			pthread_exit(NULL);
 		}
 
-		queueRemove(&reqQueue, &filename, &client_sock);
+		queueRemove(&reqQueue, &filename, &conn);
 
 		// No need to broadcast, only 1 producer
 		pthread_cond_signal(&cond_nonfull);
 		pthread_mutex_unlock(&queue_mtx);
+		traceSpan(conn->traceId, STAGE_QUEUED, conn->traceStart);
+
+		// The response has to be written before the write deadline
+		pthread_mutex_lock(&wheel_mtx);
+		setDeadline(conn, TIMER_WRITE);
+		pthread_mutex_unlock(&wheel_mtx);
 
 		// Serve the client
-		serveClient(filename, client_sock);
-		free(filename);
-		close(client_sock);
+		Fault fault;
+		faultsDecide(faults, filename + rootDirLen, &fault);
+		int res = serveClient(filename, conn, &fault);
+		finishRequest(conn, res == 0);
 	}
 }
 
 
-/* Return the page requested to the client */
-void serveClient(char *filename, int client_sock) {
+/* Return the page requested to the client.
+ * Returns -1 if the connection can't be used for another request */
+int serveClient(char *filename, Connection *conn, Fault *fault) {
 	printf("[+] Thread: %ld serving page %s\n", pthread_self(), filename);
 
+	// Injected faults that replace the response
+	if (fault->delayMs > 0) {
+		usleep(fault->delayMs * 1000);
+	}
+	if (fault->drop) {
+		printf("[*] Dropping connection (injected fault)\n");
+		return -1;
+	}
+	if (fault->error) {
+		char msg[] = "<html><body><h3>503 Service Unavailable</h3></body></html>";
+		return sendResponse(conn, CODE_UNAVAILABLE, msg, 1);
+	}
+
+	if (synthetic) {
+		return serveSynthetic(filename + rootDirLen, conn, fault);
+	}
+	long long openStart = traceMark(conn);
+
 	// File not found
 	if (access(filename, F_OK) == -1) {
 		char msg[] = "<html><body><h3>404 Not Found</h3></body></html>";
-		char *headers = createResponseHeaders(CODE_NOT_FOUND, strlen(msg));
-		if (headers == NULL) {
-			return;
-		}
-
-		int resSize = strlen(msg) + strlen(headers) + 1;
-		char *response = malloc(resSize * sizeof(char));
-		if (response == NULL) {
-			perror("malloc");
-			return;
-		}
-
-		strcpy(response, headers);
-		strcat(response, msg);
-		write(client_sock, response, strlen(response));
-
-		free(headers);
-		free(response);
-		return;
+		return sendResponse(conn, CODE_NOT_FOUND, msg, 1);
 	}
 
 
 	struct stat fileStat;
 	if (stat(filename, &fileStat) != 0) {
 		perror("stat");
-		return;
+		return -1;
 	}
 
 	// File not readable or directory
 	if (access(filename, R_OK) == -1 || !S_ISREG(fileStat.st_mode) || invalidFile(filename)) {
 		char msg[] = "<html><body><h3>403 Forbidden</h3></body></html>";
-		char *headers = createResponseHeaders(CODE_FORBIDDEN, strlen(msg));
-		if (headers == NULL) {
-			return;
-		}
-
-		int resSize = strlen(msg) + strlen(headers) + 1;
-		char *response = malloc(resSize * sizeof(char));
-		if (response == NULL) {
-			perror("malloc");
-			return;
-		}
-
-		strcpy(response, headers);
-		strcat(response, msg);
-		write(client_sock, response, strlen(response));
-
-		free(headers);
-		free(response);
-		return;
+		return sendResponse(conn, CODE_FORBIDDEN, msg, 1);
 	}
 
 	// Send the requested page
-	FILE *fp = fopen(filename, "r");
-	if (fp == NULL) {
-		perror("fopen");
-		return;
+	int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		perror("open");
+		return -1;
 	}
-
-	// Get file size
-	fseek(fp, 0, SEEK_END);
-	int fileSize = ftell(fp);
-	fseek(fp, 0, SEEK_SET);
-
-	// Load file contents in memory
-	char *contents = malloc(fileSize * sizeof(char));
-	if (contents == NULL) {
-		perror("malloc");
-		return;
+	if (fstat(fd, &fileStat) != 0) {
+		perror("fstat");
+		close(fd);
+		return -1;
+	}
+	long long fileSize = fileStat.st_size;
+	if (fault->truncate) {
+		fault->limit = fileSize / 2;
+	}
+	traceSpan(conn->traceId, STAGE_OPEN, openStart);
+
+	// Large files are read once from start to end, so the kernel can read
+	// ahead of us and doesn't have to keep what has already been sent
+	int large = fileSize > STREAM_THRESHOLD;
+	long long readaheadEnd = 0;
+	long long dropped = 0;
+	if (large) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		readahead(fd, 0, READAHEAD_SIZE);
+		readaheadEnd = READAHEAD_SIZE;
 	}
-
-	fread(contents, sizeof(char), fileSize, fp);
-	fclose(fp);
 
 	// Send headers
-	char *headers = createResponseHeaders(CODE_OK, fileSize);
-	if (headers == NULL) {
-		free(contents);
-		return;
+	long long sendStart = traceMark(conn);
+	char *headers = arenaAlloc(&(conn->arena), RESPONSE_HEADER_SIZE);
+	int headersLen;
+	if (headers == NULL || (headersLen = createResponseHeaders(headers, RESPONSE_HEADER_SIZE, CODE_OK, fileSize, conn->keepAlive)) < 0) {
+		close(fd);
+		return -1;
+	}
+	if (writeAll(conn->sock, headers, headersLen) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	// Send file contents one chunk at a time
+	char *chunk = poolAcquire(&bufferPool);
+	if (chunk == NULL) {
+		close(fd);
+		return -1;
 	}
-	write(client_sock, headers, strlen(headers));
-	free(headers);
+	long long offset = 0;
+	while (offset < fileSize) {
+		long long left = fileSize - offset;
+		ssize_t n = pread(fd, chunk, left < CHUNK_SIZE ? left : CHUNK_SIZE, offset);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			// The file was truncated, we can't send the promised length
+			if (n < 0) {
+				perror("pread");
+			}
+			break;
+		}
+		if (writeBody(conn, fault, chunk, n) < 0) {
+			break;
+		}
+		offset += n;
 
-	// Send file contents
-	write(client_sock, contents, fileSize);
-	free(contents);
+		if (large) {
+			if (offset + READAHEAD_SIZE / 2 > readaheadEnd && readaheadEnd < fileSize) {
+				readahead(fd, readaheadEnd, READAHEAD_SIZE);
+				readaheadEnd += READAHEAD_SIZE;
+			}
+			if (offset - dropped >= DROP_BEHIND_SIZE) {
+				posix_fadvise(fd, dropped, offset - dropped, POSIX_FADV_DONTNEED);
+				dropped = offset;
+			}
+		}
+	}
+	poolRelease(&bufferPool, chunk);
+	close(fd);
+	if (offset < fileSize) {
+		return -1;
+	}
 
 	// Update stats
-	pthread_mutex_lock(&stats_mtx);
-	pagesServed++;
-	bytesServed += fileSize;
-	pthread_mutex_unlock(&stats_mtx);
+	__atomic_add_fetch(&(myCounters->pagesServed), 1, __ATOMIC_RELAXED);
+	traceSpan(conn->traceId, STAGE_SEND, sendStart);
+	__atomic_add_fetch(&(myCounters->bytesServed), fileSize, __ATOMIC_RELAXED);
+	hittersUpdate(hitters, filename + rootDirLen, fileSize);
+	return 0;
 }
 
 
-int invalidFile(char *filename) {
-	if (strstr(filename, "..") != NULL) {
-		return 1;
+/* Generate and send a page of the synthetic website */
+int serveSynthetic(char *path, Connection *conn, Fault *fault) {
+	long long openStart = traceMark(conn);
+	SynthPage page;
+	if (synthFind(&synth, path, &page) < 0) {
+		char msg[] = "<html><body><h3>404 Not Found</h3></body></html>";
+		return sendResponse(conn, CODE_NOT_FOUND, msg, 1);
+	}
+	long long length = synthLength(&synth, &page);
+	if (fault->truncate) {
+		fault->limit = length / 2;
+	}
+	traceSpan(conn->traceId, STAGE_OPEN, openStart);
+
+	// Send headers
+	long long sendStart = traceMark(conn);
+	char *headers = arenaAlloc(&(conn->arena), RESPONSE_HEADER_SIZE);
+	int headersLen;
+	if (headers == NULL || (headersLen = createResponseHeaders(headers, RESPONSE_HEADER_SIZE, CODE_OK, length, conn->keepAlive)) < 0) {
+		return -1;
+	}
+	if (writeAll(conn->sock, headers, headersLen) < 0) {
+		return -1;
+	}
+
+	// The page is generated one chunk at a time
+	char *chunk = poolAcquire(&bufferPool);
+	if (chunk == NULL) {
+		return -1;
+	}
+	BodyWriter writer;
+	writer.conn = conn;
+	writer.fault = fault;
+	int res = synthGenerate(&synth, &page, chunk, CHUNK_SIZE, writeChunk, &writer);
+	poolRelease(&bufferPool, chunk);
+	if (res < 0) {
+		return -1;
+	}
+	traceSpan(conn->traceId, STAGE_SEND, sendStart);
+
+	// Update stats
+	__atomic_add_fetch(&(myCounters->pagesServed), 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&(myCounters->bytesServed), length, __ATOMIC_RELAXED);
+	hittersUpdate(hitters, path, length);
+	return 0;
+}
+
+
+/* Send a generated chunk of a synthetic page */
+int writeChunk(void *arg, char *buf, int size) {
+	BodyWriter *writer = (BodyWriter *) arg;
+	return writeBody(writer->conn, writer->fault, buf, size);
+}
+
+
+/* Send part of a response body, trickling or truncating it if these faults
+ * were injected. Returns -1 if the connection can't be used anymore */
+int writeBody(Connection *conn, Fault *fault, char *buf, int size) {
+	int truncated = 0;
+	if (fault->limit >= 0) {
+		if (size > fault->limit) {
+			size = fault->limit;
+			truncated = 1;
+		}
+		fault->limit -= size;
+	}
+
+	// Trickled bodies are sent in pieces every 100ms
+	int piece = size;
+	if (fault->trickleRate > 0) {
+		piece = (fault->trickleRate + 9) / 10;
+	}
+
+	int offset = 0;
+	while (offset < size) {
+		int count = size - offset < piece ? size - offset : piece;
+		if (writeAll(conn->sock, buf + offset, count) < 0) {
+			return -1;
+		}
+		offset += count;
+		// The deadline only expires if the client stops reading
+		extendDeadline(conn);
+		if (fault->trickleRate > 0) {
+			usleep(100000);
+		}
+	}
+
+	if (truncated) {
+		printf("[*] Truncating response (injected fault)\n");
+		return -1;
+	}
+	return 0;
+}
+
+
+/* Send a response consisting of the headers and a short HTML message.
+ * Without wait it is only sent if the socket takes all of it at once */
+int sendResponse(Connection *conn, int code, char *msg, int wait) {
+	int msgLen = strlen(msg);
+	char *response = arenaAlloc(&(conn->arena), RESPONSE_HEADER_SIZE + msgLen);
+	if (response == NULL) {
+		return -1;
+	}
+
+	int len = createResponseHeaders(response, RESPONSE_HEADER_SIZE, code, msgLen, conn->keepAlive);
+	if (len < 0) {
+		return -1;
+	}
+	memcpy(response + len, msg, msgLen);
+	if (!wait) {
+		return writeNow(conn->sock, response, len + msgLen);
+	}
+	return writeAll(conn->sock, response, len + msgLen);
+}
+
+
+/* Write the whole buffer to a non-blocking socket.
+ * If the write deadline expires the socket is shut down and the write fails */
+int writeAll(int sock, char *buf, int size) {
+	int offset = 0;
+	while (offset < size) {
+		int written = write(sock, buf + offset, size - offset);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				// Wait until the client reads some of the data
+				struct pollfd pfd;
+				pfd.fd = sock;
+				pfd.events = POLLOUT;
+				if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+					perror("poll");
+					return -1;
+				}
+				continue;
+			}
+			return -1;
+		}
+		offset += written;
+	}
+	return 0;
+}
+
+
+/* Write the buffer only if the socket takes all of it now. Used by the event
+ * loop, which can't wait for a client that doesn't read (its write deadline
+ * is only checked by the loop itself) */
+int writeNow(int sock, char *buf, int size) {
+	int written;
+	do {
+		written = send(sock, buf, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+	} while (written < 0 && errno == EINTR);
+	return written == size ? 0 : -1;
+}
+
+
+int invalidFile(char *filename) {
+	if (strstr(filename, "..") != NULL) {
+		return 1;
 	}
 
 	int i;
@@ -500,130 +1237,1110 @@ int invalidFile(char *filename) {
 }
 
 
-/* Check if a web request is valid and place it in the request queue so that a thread
- * can serve it */
-int handleRequest(int client_sock, char *root_dir) {
-	// Receive the request
-	char *buf = malloc(BUF_SIZE * sizeof(char));
-	if (buf == NULL) {
-		perror("malloc");
-		close(client_sock);
-		return -1;
-	}
-	int bufSize = BUF_SIZE;
-	int bufOffset = 0;
-	int bytesRecv;
+/* Accept every pending client of a web socket and wait for its request */
+int acceptClients(int listen_sock) {
+	struct sockaddr_storage client;
+	socklen_t client_len;
 
-	while ((bytesRecv = read(client_sock, buf + bufOffset, bufSize - bufOffset - 1)) > 0) {
-		// Resize buffer if needed
-		while (bufOffset + bytesRecv >= bufSize - 1) {
-			bufSize *= 2;
-			buf = realloc(buf, bufSize);
-			if (buf == NULL) {
-				perror("realloc");
-				close(client_sock);
-				return -1;
+	while (1) {
+		client_len = sizeof(client);
+		int client_sock = accept4(listen_sock, (struct sockaddr *) &client, &client_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (client_sock < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			} else if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			} else if (errno == EMFILE || errno == ENFILE) {
+				// Leave the rest in the backlog until some connections are closed
+				perror("accept");
+				return 0;
 			}
+			perror("accept");
+			return -1;
 		}
-		bufOffset += bytesRecv;
 
-		buf[bufOffset] = '\0';
-		// Check if we read "\r\n\r\n"
-		if (strstr(buf, "\r\n\r\n") != NULL) {
-			break;
+		// Get the IP of the connected client. Clients of the Unix socket are
+		// local, so they are rate limited as the loopback address
+		unsigned int addr = htonl(INADDR_LOOPBACK);
+		if (client.ss_family == AF_INET) {
+			struct sockaddr_in *in = (struct sockaddr_in *) &client;
+			printf("[+] Client connected to WEB port from %s:%d\n", inet_ntoa(in->sin_addr), ntohs(in->sin_port));
+			addr = in->sin_addr.s_addr;
+		} else {
+			printf("[+] Client connected to WEB socket %s\n", unixPath);
+		}
+		unsigned int traceId = traceSample(traces);
+		long long acceptStart = traceId ? traceNow() : 0;
+
+		if (client.ss_family == AF_INET) {
+			tuningApplyClient(&tuning, client_sock);
+		}
+
+		Connection *conn = createConnection(client_sock);
+		if (conn == NULL) {
+			close(client_sock);
+			continue;
+		}
+
+		conn->addr = addr;
+		conn->traceId = traceId;
+
+		// The whole request has to arrive before the header deadline
+		pthread_mutex_lock(&wheel_mtx);
+		setDeadline(conn, TIMER_HEADER);
+		struct epoll_event ev;
+		ev.events = EPOLLIN | EPOLLONESHOT;
+		ev.data.ptr = conn;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, client_sock, &ev) < 0) {
+			perror("epoll_ctl");
+			wheelCancel(&wheel, &(conn->timer));
+			pthread_mutex_unlock(&wheel_mtx);
+			destroyConnection(conn);
+			continue;
 		}
+		pthread_mutex_unlock(&wheel_mtx);
+
+		// Only this thread reads the connection, so it can still be used
+		traceSpan(traceId, STAGE_ACCEPT, acceptStart);
+		conn->traceStart = traceMark(conn);
 	}
+}
 
-	if (bytesRecv < 0 && errno != EAGAIN) {
-		perror("read");
-		close(client_sock);
-		free(buf);
-		return -1;
+
+/* Read the available bytes of a request. When the headers are complete check if
+ * the request is valid and place it in the request queue so that a thread can serve it */
+void handleRequest(Connection *conn, char *root_dir) {
+	// First request after an idle period starts a new header deadline
+	if (conn->state == CONN_IDLE) {
+		pthread_mutex_lock(&wheel_mtx);
+		conn->state = CONN_READING;
+		setDeadline(conn, TIMER_HEADER);
+		pthread_mutex_unlock(&wheel_mtx);
+
+		// Sampled when it starts arriving, so that idle time isn't counted as header reading
+		conn->traceId = traceSample(traces);
+		conn->traceStart = traceMark(conn);
 	}
 
+	// Receive the request. Bytes left over from a pipelined request may
+	// already contain the whole headers
+	char *headerEnd = strstr(conn->buf, "\r\n\r\n");
+	while (headerEnd == NULL) {
+		if (conn->bufOffset >= MAX_HEADER_SIZE) {
+			printf("[*] Received too large request\n");
+			break;
+		}
 
-	// Get the file requested
-	char *req_file;
-	if ((req_file = parseRequest(buf)) == NULL) {
-		printf("[*] Received invalid request\n");
+		// Resize buffer if needed. The old one is given back with the rest of the request
+		if (conn->bufOffset >= conn->bufSize - 1) {
+			char *newBuf = arenaAlloc(&(conn->arena), conn->bufSize * 2);
+			if (newBuf == NULL) {
+				pthread_mutex_lock(&wheel_mtx);
+				wheelCancel(&wheel, &(conn->timer));
+				pthread_mutex_unlock(&wheel_mtx);
+				destroyConnection(conn);
+				return;
+			}
+			memcpy(newBuf, conn->buf, conn->bufOffset + 1);
+			conn->buf = newBuf;
+			conn->bufSize *= 2;
+		}
 
-		// Send 400 Bad Request response
-		char msg[] = "<html><body><h3>400 Bad Request</h3></body></html>";
-		char *headers = createResponseHeaders(CODE_BAD, strlen(msg));
-		if (headers != NULL) {
-			int resSize = strlen(headers) + strlen(msg) + 1;
-			char *response = malloc(resSize * sizeof(char));
-			if (response != NULL) {
-				strcpy(response, headers);
-				strcat(response, msg);
-				write(client_sock, response, resSize - 1);
-				free(response);
+		int bytesRecv = read(conn->sock, conn->buf + conn->bufOffset, conn->bufSize - conn->bufOffset - 1);
+		if (bytesRecv < 0 && errno == EINTR) {
+			continue;
+		} else if (bytesRecv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			// Wait for the rest of the request. The header deadline keeps running
+			pthread_mutex_lock(&wheel_mtx);
+			struct epoll_event ev;
+			ev.events = EPOLLIN | EPOLLONESHOT;
+			ev.data.ptr = conn;
+			if (epoll_ctl(epfd, EPOLL_CTL_MOD, conn->sock, &ev) < 0) {
+				perror("epoll_ctl");
+				wheelCancel(&wheel, &(conn->timer));
+				pthread_mutex_unlock(&wheel_mtx);
+				destroyConnection(conn);
+				return;
 			}
-			free(headers);
+			pthread_mutex_unlock(&wheel_mtx);
+			return;
+		} else if (bytesRecv <= 0) {
+			// Client closed the connection or the read failed
+			if (bytesRecv < 0) {
+				perror("read");
+			}
+			pthread_mutex_lock(&wheel_mtx);
+			wheelCancel(&wheel, &(conn->timer));
+			pthread_mutex_unlock(&wheel_mtx);
+			destroyConnection(conn);
+			return;
 		}
 
-		close(client_sock);
-		free(buf);
-		return 1;
+		// Only the new bytes (and the 3 before them) can complete "\r\n\r\n"
+		int searchFrom = conn->bufOffset > 3 ? conn->bufOffset - 3 : 0;
+		conn->bufOffset += bytesRecv;
+		conn->buf[conn->bufOffset] = '\0';
+		headerEnd = strstr(conn->buf + searchFrom, "\r\n\r\n");
+	}
+
+	// Headers complete (or too large): the header deadline no longer applies
+	pthread_mutex_lock(&wheel_mtx);
+	wheelCancel(&wheel, &(conn->timer));
+	pthread_mutex_unlock(&wheel_mtx);
+	traceSpan(conn->traceId, STAGE_HEADERS, conn->traceStart);
+	long long parseStart = traceMark(conn);
+
+	// Keep the bytes after the headers for the next request
+	int reqSize = conn->bufOffset;
+	if (headerEnd != NULL) {
+		reqSize = headerEnd + 4 - conn->buf;
+	}
+	char saved = conn->buf[reqSize];
+	conn->buf[reqSize] = '\0';
+
+	// Get the file requested
+	char *req_file = NULL;
+	if (headerEnd == NULL || (req_file = parseRequest(conn->buf, &(conn->keepAlive))) == NULL) {
+		printf("[*] Received invalid request\n");
+
+		// Send 400 Bad Request response and close the connection
+		char msg[] = "<html><body><h3>400 Bad Request</h3></body></html>";
+		conn->keepAlive = 0;
+		sendResponse(conn, CODE_BAD, msg, 0);
+		destroyConnection(conn);
+		return;
 	}
 
 	printf("[*] Received GET request for %s\n", req_file);
 
-	// Create full path of requested file
-	int size = strlen(root_dir) + strlen(req_file) + 1;
-	char *filename = malloc(size * sizeof(char));
+	// Create full path of requested file, before req_file is overwritten
+	// by the bytes left over
+	int size = rootDirLen + strlen(req_file) + 1;
+	Request *req = arenaAlloc(&(conn->arena), sizeof(Request) + size);
+	if (req == NULL) {
+		destroyConnection(conn);
+		return;
+	}
+	char *filename = (char *) (req + 1);
 	strcpy(filename, root_dir);
 	strcat(filename, req_file);
-	free(req_file);
-	free(buf);
 
+	conn->buf[reqSize] = saved;
+	memmove(conn->buf, conn->buf + reqSize, conn->bufOffset - reqSize);
+	conn->bufOffset -= reqSize;
+	conn->buf[conn->bufOffset] = '\0';
 
-	// Place the request in the request queue for a thread to serve it
+	// Clients over their request rate are answered here without reaching the threads
+	if (rateLimits != NULL && !rateAllow(rateLimits, conn->addr, currentTime())) {
+		__atomic_add_fetch(&(myCounters->requestsLimited), 1, __ATOMIC_RELAXED);
+
+		char msg[] = "<html><body><h3>429 Too Many Requests</h3></body></html>";
+		conn->keepAlive = 0;
+		sendResponse(conn, CODE_TOO_MANY, msg, 0);
+		destroyConnection(conn);
+		return;
+	}
+
+	// Connections are closed after their response while draining
+	pthread_mutex_lock(&thread_stop_mtx);
+	if (draining) {
+		conn->keepAlive = 0;
+	}
+	pthread_mutex_unlock(&thread_stop_mtx);
+
+	traceSpan(conn->traceId, STAGE_PARSE, parseStart);
+
+
+	// Place the request in the request queue for a thread to serve it.
+	// A thread may finish with conn before the enqueue span is recorded
+	unsigned int traceId = conn->traceId;
+	long long enqueueStart = traceMark(conn);
+	conn->traceStart = enqueueStart;
+	conn->state = CONN_SERVING;
 	pthread_mutex_lock(&queue_mtx);
 	// Wait for an empty position to be created in the request queue
 	while (isFull(&reqQueue)) {
 		pthread_cond_wait(&cond_nonfull, &queue_mtx);
 	}
-	queueInsert(&reqQueue, filename, client_sock);
+	req->filename = filename;
+	req->conn = conn;
+	queueInsert(&reqQueue, req);
 	// Signal the threads so that they can serve the new request
 	pthread_cond_signal(&cond_nonempty);
 	pthread_mutex_unlock(&queue_mtx);
+	traceSpan(traceId, STAGE_ENQUEUE, enqueueStart);
+}
 
-	free(filename);
+
+/* Hand a served connection back to the main loop to wait for its next request,
+ * or close it if it can't be kept alive */
+void finishRequest(Connection *conn, int served) {
+	int stop = 0;
+	pthread_mutex_lock(&thread_stop_mtx);
+	stop = threadStop || draining;
+	pthread_mutex_unlock(&thread_stop_mtx);
+
+	// The main loop may reuse conn as soon as it is re-armed
+	unsigned int traceId = conn->traceId;
+	long long closeStart = traceMark(conn);
+
+	pthread_mutex_lock(&wheel_mtx);
+	wheelCancel(&wheel, &(conn->timer));
+	// The arena is reset before the main loop can use the connection again
+	if (served && conn->keepAlive && !conn->timedOut && !stop && resetConnection(conn) == 0) {
+		conn->state = CONN_IDLE;
+		setDeadline(conn, TIMER_IDLE);
+		conn->traceId = 0;
+
+		// If a pipelined request is already buffered, EPOLLOUT wakes up the main loop at once
+		struct epoll_event ev;
+		ev.events = EPOLLIN | EPOLLONESHOT;
+		if (conn->bufOffset > 0) {
+			ev.events |= EPOLLOUT;
+		}
+		ev.data.ptr = conn;
+		// Re-arm while holding the mutex so that the deadline can't expire before
+		if (epoll_ctl(epfd, EPOLL_CTL_MOD, conn->sock, &ev) == 0) {
+			pthread_mutex_unlock(&wheel_mtx);
+			traceSpan(traceId, STAGE_CLOSE, closeStart);
+			return;
+		}
+		perror("epoll_ctl");
+		wheelCancel(&wheel, &(conn->timer));
+	}
+	pthread_mutex_unlock(&wheel_mtx);
+
+	destroyConnection(conn);
+	traceSpan(traceId, STAGE_CLOSE, closeStart);
+}
+
+
+/* Schedule the deadline of a connection for its current stage.
+ * Must be called with wheel_mtx locked */
+void setDeadline(Connection *conn, int kind) {
+	int delay;
+	if (kind == TIMER_HEADER) {
+		delay = HEADER_TIMEOUT_MS;
+	} else if (kind == TIMER_IDLE) {
+		delay = IDLE_TIMEOUT_MS;
+	} else {
+		delay = WRITE_TIMEOUT_MS;
+	}
+	conn->timer.kind = kind;
+	wheelAdd(&wheel, &(conn->timer), currentTime(), delay);
+}
+
+
+/* Push the write deadline back after some progress has been made, so that
+ * large files only time out when the client stops reading */
+void extendDeadline(Connection *conn) {
+	pthread_mutex_lock(&wheel_mtx);
+	// Once expired the connection has already been shut down
+	if (timerPending(&(conn->timer))) {
+		setDeadline(conn, TIMER_WRITE);
+	}
+	pthread_mutex_unlock(&wheel_mtx);
+}
+
+
+/* Start time of a stage, only read when the request is traced */
+long long traceMark(Connection *conn) {
+	return conn->traceId != 0 ? traceNow() : 0;
+}
+
+
+/* Close the connections whose deadline has expired */
+void expireConnections(void) {
+	int expiredCount = 0;
+
+	pthread_mutex_lock(&wheel_mtx);
+	Timer *expired = wheelAdvance(&wheel, currentTime());
+	while (expired != NULL) {
+		Timer *next = expired->next;
+		Connection *conn = (Connection *) expired->data;
+
+		if (conn->state == CONN_SERVING) {
+			// The thread serving it owns the connection. Shutting the socket down
+			// makes its pending write fail and the thread closes it
+			conn->timedOut = 1;
+			shutdown(conn->sock, SHUT_RDWR);
+		} else {
+			destroyConnection(conn);
+		}
+		expiredCount++;
+		expired = next;
+	}
+	pthread_mutex_unlock(&wheel_mtx);
+
+	if (expiredCount > 0) {
+		printf("[*] Closed %d connections after their deadline expired\n", expiredCount);
+		__atomic_add_fetch(&(myCounters->connectionsTimedOut), expiredCount, __ATOMIC_RELAXED);
+	}
+}
+
+
+/* Allocate a connection together with the first block of its arena,
+ * which starts with the buffer of the request headers */
+Connection *createConnection(int sock) {
+	int connSize = (sizeof(Connection) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	Connection *conn = malloc(connSize + CONN_ARENA_SIZE);
+	if (conn == NULL) {
+		perror("malloc");
+		return NULL;
+	}
+
+	arenaInit(&(conn->arena), (char *) conn + connSize, CONN_ARENA_SIZE);
+	conn->buf = arenaAlloc(&(conn->arena), BUF_SIZE);
+	arenaMark(&(conn->arena));
+	conn->buf[0] = '\0';
+	conn->bufSize = BUF_SIZE;
+	conn->bufOffset = 0;
+
+	pthread_mutex_lock(&conn_count_mtx);
+	openConnections++;
+	pthread_mutex_unlock(&conn_count_mtx);
+
+	conn->sock = sock;
+	conn->state = CONN_READING;
+	conn->keepAlive = 1;
+	conn->timedOut = 0;
+	conn->traceId = 0;
+	conn->traceStart = 0;
+	timerInit(&(conn->timer), TIMER_HEADER, conn);
+	return conn;
+}
+
+
+/* Give back the memory of the request that was served. The bytes of the
+ * next requests that were already received are moved to the buffer the
+ * connection started with, or to a new one if they don't fit in it.
+ * Returns -1 if the new buffer can't be allocated */
+int resetConnection(Connection *conn) {
+	char *first = conn->arena.base;
+	if (conn->buf == first) {
+		arenaReset(&(conn->arena));
+		return 0;
+	}
+	if (conn->bufOffset < BUF_SIZE) {
+		memcpy(first, conn->buf, conn->bufOffset + 1);
+		conn->buf = first;
+		conn->bufSize = BUF_SIZE;
+		arenaReset(&(conn->arena));
+		return 0;
+	}
+
+	// The buffer is at most twice the largest request
+	char saved[2 * MAX_HEADER_SIZE];
+	memcpy(saved, conn->buf, conn->bufOffset + 1);
+	arenaReset(&(conn->arena));
+	conn->buf = arenaAlloc(&(conn->arena), conn->bufSize);
+	if (conn->buf == NULL) {
+		conn->buf = first;
+		conn->bufOffset = 0;
+		return -1;
+	}
+	memcpy(conn->buf, saved, conn->bufOffset + 1);
 	return 0;
 }
 
 
+/* Close the socket and free the connection. Its timer must not be scheduled */
+void destroyConnection(Connection *conn) {
+	// Closing the socket also removes it from the event loop
+	close(conn->sock);
+	arenaDestroy(&(conn->arena));
+	free(conn);
+
+	pthread_mutex_lock(&conn_count_mtx);
+	openConnections--;
+	pthread_mutex_unlock(&conn_count_mtx);
+}
+
+
+/* Create a non-blocking TCP socket listening on the given port.
+ * It is not inherited by exec, it can only be passed on by UPGRADE.
+ * The tuning options are applied if given */
+int createListener(int port, int backlog, Tuning *options) {
+	int reuse = 1;
+	int sock;
+	if ((sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+		perror("socket");
+		return -1;
+	}
+	// Avoid TIME_WAIT state
+	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
+		perror("setsockopt");
+		close(sock);
+		return -1;
+	}
+
+	struct sockaddr_in server;
+	server.sin_family = AF_INET;
+	server.sin_addr.s_addr = htonl(INADDR_ANY);
+	server.sin_port = htons(port);
+	if (bind(sock, (struct sockaddr *) &server, sizeof(server)) < 0) {
+		perror("bind");
+		close(sock);
+		return -1;
+	}
+
+	// Set the socket as non-blocking to handle client disconnection after epoll succeeds
+	int opts = fcntl(sock, F_GETFL);
+	if (opts < 0) {
+		perror("fcntl: F_GETFL");
+		close(sock);
+		return -1;
+	}
+	if (fcntl(sock, F_SETFL, opts | O_NONBLOCK) < 0) {
+		perror("fcntl: F_SETFL");
+		close(sock);
+		return -1;
+	}
+
+	if (options != NULL) {
+		tuningApplyListener(options, sock);
+	}
+
+	if (listen(sock, backlog) < 0) {
+		perror("listen");
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+
+/* Create a non-blocking Unix domain socket listening on path, which is
+ * a name in the abstract namespace if it starts with '@'. A socket file
+ * nobody accepts on (left by a server that didn't exit cleanly) is replaced */
+int createUnixListener(char *path, int backlog) {
+	int sock;
+	if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	struct sockaddr_un server;
+	memset(&server, 0, sizeof(server));
+	server.sun_family = AF_UNIX;
+	strcpy(server.sun_path, path);
+	socklen_t len = sizeof(server);
+	if (path[0] == '@') {
+		// Abstract names start with a null byte and aren't null-terminated
+		server.sun_path[0] = '\0';
+		len = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+	} else {
+		struct stat st;
+		if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)
+				&& connect(sock, (struct sockaddr *) &server, len) < 0 && errno == ECONNREFUSED) {
+			unlink(path);
+		}
+	}
+
+	if (bind(sock, (struct sockaddr *) &server, len) < 0) {
+		perror("bind");
+		close(sock);
+		return -1;
+	}
+	if (listen(sock, backlog) < 0) {
+		perror("listen");
+		close(sock);
+		removeUnixPath();
+		return -1;
+	}
+	return sock;
+}
+
+
+/* Remove the file of the Unix socket (abstract names go away with the socket) */
+void removeUnixPath(void) {
+	if (unixPath != NULL && unixPath[0] != '@') {
+		unlink(unixPath);
+	}
+}
+
+
+void replyUpgrade(int client_sock, pid_t pid) {
+	char msg[BUF_SIZE];
+	if (pid > 0) {
+		sprintf(msg, "\n*** SERVER UPGRADED (new PID %d) ***\n", pid);
+	} else {
+		sprintf(msg, "\n*** UPGRADE FAILED ***\n");
+	}
+	write(client_sock, msg, strlen(msg));
+}
+
+
+/* Close the listening sockets that are still open (-1 if not),
+ * together with the Unix socket */
+void closeListeners(int web_sock, int cmd_sock) {
+	if (web_sock >= 0) {
+		close(web_sock);
+	}
+	if (unix_sock >= 0) {
+		close(unix_sock);
+		unix_sock = -1;
+	}
+	if (cmd_sock >= 0) {
+		close(cmd_sock);
+	}
+}
+
+
+/* Stop watching the listening sockets before they are closed. The new server
+ * holds the same sockets, so closing them wouldn't remove them from epfd */
+void removeListeners(int web_sock) {
+	if (web_sock >= 0 && epoll_ctl(epfd, EPOLL_CTL_DEL, web_sock, NULL) < 0) {
+		perror("epoll_ctl: web");
+	}
+	if (unix_sock >= 0 && epoll_ctl(epfd, EPOLL_CTL_DEL, unix_sock, NULL) < 0) {
+		perror("epoll_ctl: unix");
+	}
+}
+
+
+/* Set binaryPath to the absolute path of the binary run as name: name itself
+ * if it has a '/', else the first match in $PATH, like the shell. Without
+ * one, /proc/self/exe is used (the binary running, even if it was replaced) */
+void findBinary(char *name) {
+	if (strchr(name, '/') != NULL) {
+		if (access(name, X_OK) == 0 && setBinaryPath(name) == 0) {
+			return;
+		}
+	} else if (getenv("PATH") != NULL) {
+		char *paths = strdup(getenv("PATH"));
+		if (paths == NULL) {
+			perror("strdup");
+			strcpy(binaryPath, "/proc/self/exe");
+			return;
+		}
+		char *saveptr;
+		char *dir;
+		for (dir = strtok_r(paths, ":", &saveptr); dir != NULL; dir = strtok_r(NULL, ":", &saveptr)) {
+			char path[PATH_MAX];
+			if (snprintf(path, PATH_MAX, "%s/%s", dir, name) < PATH_MAX && access(path, X_OK) == 0
+					&& setBinaryPath(path) == 0) {
+				free(paths);
+				return;
+			}
+		}
+		free(paths);
+	}
+	strcpy(binaryPath, "/proc/self/exe");
+}
+
+
+/* Set binaryPath to path, joined to the working directory if it is relative.
+ * Symlinks aren't resolved, so that UPGRADE runs the binary a symlink points
+ * to by then (a deploy that swaps it). Returns -1 if it is too long */
+int setBinaryPath(char *path) {
+	if (path[0] == '/') {
+		return snprintf(binaryPath, PATH_MAX, "%s", path) < PATH_MAX ? 0 : -1;
+	}
+	char cwd[PATH_MAX];
+	if (getcwd(cwd, PATH_MAX) == NULL) {
+		perror("getcwd");
+		return -1;
+	}
+	return snprintf(binaryPath, PATH_MAX, "%s/%s", cwd, path) < PATH_MAX ? 0 : -1;
+}
+
+
+/* Start a new server from the (possibly replaced) binary and pass it the listening
+ * sockets over a Unix domain socket. Returns the PID of the new server once it
+ * is ready to accept, or -1 if the upgrade failed and we keep serving */
+pid_t upgradeServer(char *argv[], int web_sock, int cmd_sock) {
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+		perror("socketpair");
+		return -1;
+	}
+
+	// Prepare the environment of the new server before forking
+	// (Only async-signal-safe calls are allowed in the child of a threaded process)
+	extern char **environ;
+	int envCount = 0;
+	while (environ[envCount] != NULL) {
+		envCount++;
+	}
+	char **envp = malloc((envCount + 2) * sizeof(char *));
+	if (envp == NULL) {
+		perror("malloc");
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+	char handoffVar[BUF_SIZE];
+	sprintf(handoffVar, "%s=%d", HANDOFF_ENV, sv[1]);
+	memcpy(envp, environ, envCount * sizeof(char *));
+	envp[envCount] = handoffVar;
+	envp[envCount + 1] = NULL;
+
+	pid_t pid = fork();
+	if (pid == 0) { // NEW SERVER
+		// Only the child's end of the socket pair survives exec
+		close(sv[0]);
+		fcntl(sv[1], F_SETFD, 0);
+		execve(binaryPath, argv, envp);
+		perror("execve");
+		_exit(-1);
+	}
+	free(envp);
+	close(sv[1]);
+	if (pid < 0) {
+		perror("fork");
+		close(sv[0]);
+		return -1;
+	}
+
+	// Only the sockets in use are sent, the new server has the same arguments
+	int fds[3];
+	int count = 0;
+	if (web_sock >= 0) {
+		fds[count++] = web_sock;
+	}
+	fds[count++] = cmd_sock;
+	if (unix_sock >= 0) {
+		fds[count++] = unix_sock;
+	}
+	if (sendListeners(sv[0], fds, count) < 0) {
+		kill(pid, SIGTERM);
+		close(sv[0]);
+		return -1;
+	}
+
+	// Wait until the new server accepts on the sockets
+	// (If exec fails the socket is closed and read returns 0)
+	struct pollfd pfd;
+	pfd.fd = sv[0];
+	pfd.events = POLLIN;
+	char ready = 0;
+	if (poll(&pfd, 1, UPGRADE_TIMEOUT_MS) <= 0 || read(sv[0], &ready, 1) != 1 || ready != HANDOFF_READY) {
+		fprintf(stderr, "[-] New server did not start\n");
+		kill(pid, SIGTERM);
+		close(sv[0]);
+		return -1;
+	}
+
+	close(sv[0]);
+	return pid;
+}
+
+
+/* Stop keeping connections alive and close the ones waiting for their next request */
+void startDrain(void) {
+	pthread_mutex_lock(&thread_stop_mtx);
+	draining = 1;
+	pthread_mutex_unlock(&thread_stop_mtx);
+
+	// Take every deadline out of the wheel, close the idle connections
+	// and put the rest back with the time they had left
+	long long now = currentTime();
+	pthread_mutex_lock(&wheel_mtx);
+	Timer *timers = wheelExpireAll(&wheel);
+	while (timers != NULL) {
+		Timer *next = timers->next;
+		Connection *conn = (Connection *) timers->data;
+		if (conn->state == CONN_IDLE) {
+			destroyConnection(conn);
+		} else {
+			long long left = (timers->expires * WHEEL_TICK_MS) - now;
+			wheelAdd(&wheel, timers, now, left > 0 ? (int) left : 0);
+		}
+		timers = next;
+	}
+	pthread_mutex_unlock(&wheel_mtx);
+}
+
+
+/* Current time in milliseconds */
+long long currentTime(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+}
+
+
+/* Start the thread serving the command port */
+int startCommandThread(char *argv[], int web_sock, int cmd_sock, long long startTime) {
+	if (pipe2(actionPipe, O_CLOEXEC) < 0) {
+		perror("pipe2");
+		return -1;
+	}
+	if (pipe2(stopPipe, O_CLOEXEC) < 0) {
+		perror("pipe2");
+		close(actionPipe[0]);
+		close(actionPipe[1]);
+		return -1;
+	}
+
+	cmdArgs.argv = argv;
+	cmdArgs.web_sock = web_sock;
+	cmdArgs.cmd_sock = cmd_sock;
+	cmdArgs.startTime = startTime;
+	if (pthread_create(&cmdThread, NULL, commandThreadFunc, &cmdArgs) != 0) {
+		fprintf(stderr, "[-] Could not create the command thread\n");
+		close(actionPipe[0]);
+		close(actionPipe[1]);
+		close(stopPipe[0]);
+		close(stopPipe[1]);
+		return -1;
+	}
+	cmdRunning = 1;
+	return 0;
+}
+
+
+/* Stop the command thread (if it is running) and close its sessions.
+ * The command socket itself is left open */
+void stopCommandThread(void) {
+	if (!cmdRunning) {
+		return;
+	}
+	char stop = 1;
+	write(stopPipe[1], &stop, 1);
+	pthread_join(cmdThread, NULL);
+
+	close(actionPipe[0]);
+	close(actionPipe[1]);
+	close(stopPipe[0]);
+	close(stopPipe[1]);
+	cmdRunning = 0;
+}
+
+
+/* Close the command thread's descriptors copied by fork in a prefork child
+ * (the thread itself isn't copied) */
+void closeCommandFds(void) {
+	if (!cmdRunning) {
+		return;
+	}
+	int i;
+	for (i = 0; i < MAX_SESSIONS; i++) {
+		if (sessions[i] != NULL) {
+			close(sessions[i]->sock);
+			sessions[i] = NULL;
+		}
+	}
+	if (cmdEpfd >= 0) {
+		close(cmdEpfd);
+	}
+	close(actionPipe[0]);
+	close(actionPipe[1]);
+	close(stopPipe[0]);
+	close(stopPipe[1]);
+	cmdRunning = 0;
+}
+
+
+/* Command thread function. Accepts sessions on the command port, runs
+ * their commands and sends the STATS of watching sessions */
+void *commandThreadFunc(void *ptr) {
+	CommandArgs *args = (CommandArgs *) ptr;
+	char action = 0;
+
+	if ((cmdEpfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		perror("epoll_create1");
+		action = CMD_SHUTDOWN;
+		write(actionPipe[1], &action, 1);
+		return NULL;
+	}
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = &(args->cmd_sock);
+	epoll_ctl(cmdEpfd, EPOLL_CTL_ADD, args->cmd_sock, &ev);
+	ev.data.ptr = &stopPipe[0];
+	epoll_ctl(cmdEpfd, EPOLL_CTL_ADD, stopPipe[0], &ev);
+
+	struct epoll_event events[MAX_EVENTS];
+	int i;
+	int j;
+	while (action == 0) {
+		// Sleep until the next STATS of a watching session or a profile is due
+		long long now = currentTime();
+		int timeout = -1;
+		for (i = 0; i < MAX_SESSIONS; i++) {
+			if (sessions[i] == NULL) {
+				continue;
+			}
+			long long due = -1;
+			if (sessions[i]->watchInterval > 0) {
+				due = sessions[i]->nextWatch;
+			}
+			if (sessions[i]->profileEnd > 0 && (due < 0 || sessions[i]->profileEnd < due)) {
+				due = sessions[i]->profileEnd;
+			}
+			if (due >= 0) {
+				long long wait = due - now;
+				if (wait < 0) {
+					wait = 0;
+				}
+				if (timeout < 0 || wait < timeout) {
+					timeout = wait;
+				}
+			}
+		}
+
+		int nfds = epoll_wait(cmdEpfd, events, MAX_EVENTS, timeout);
+		if (nfds < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("epoll_wait");
+			action = CMD_SHUTDOWN;
+			break;
+		}
+
+		for (j = 0; j < nfds && action == 0; j++) {
+			void *evPtr = events[j].data.ptr;
+
+			// Told to stop by the main thread
+			if (evPtr == &stopPipe[0]) {
+				action = -1;
+			// New session
+			} else if (evPtr == &(args->cmd_sock)) {
+				struct sockaddr_in client;
+				socklen_t client_len = sizeof(client);
+				int client_sock = accept4(args->cmd_sock, (struct sockaddr *) &client, &client_len, SOCK_CLOEXEC);
+				if (client_sock < 0) {
+					if (errno != EAGAIN) {
+						perror("accept");
+					}
+					continue;
+				}
+				printf("[+] Client connected to COMMAND port from %s:%d\n", inet_ntoa(client.sin_addr), ntohs(client.sin_port));
+
+				// Replies are written with a timeout instead of blocking the thread
+				struct timeval sendTimeout;
+				sendTimeout.tv_sec = SESSION_SEND_MS / 1000;
+				sendTimeout.tv_usec = (SESSION_SEND_MS % 1000) * 1000;
+				setsockopt(client_sock, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout, sizeof(sendTimeout));
+
+				for (i = 0; i < MAX_SESSIONS && sessions[i] != NULL; i++);
+				Session *session = i < MAX_SESSIONS ? malloc(sizeof(Session)) : NULL;
+				if (session == NULL) {
+					char msg[] = "TOO MANY SESSIONS\n";
+					write(client_sock, msg, strlen(msg));
+					close(client_sock);
+					continue;
+				}
+				session->sock = client_sock;
+				session->bufOffset = 0;
+				session->watchInterval = 0;
+				session->nextWatch = 0;
+				session->profileEnd = 0;
+				sessions[i] = session;
+
+				ev.events = EPOLLIN;
+				ev.data.ptr = session;
+				if (epoll_ctl(cmdEpfd, EPOLL_CTL_ADD, client_sock, &ev) < 0) {
+					perror("epoll_ctl: session");
+					closeSession(session);
+				}
+			// Commands of a session
+			} else {
+				Session *session = (Session *) evPtr;
+				int res = readSession(session, args->startTime);
+				if (res == CMD_QUIT) {
+					closeSession(session);
+				} else if (res == CMD_SHUTDOWN) {
+					action = CMD_SHUTDOWN;
+				} else if (res == CMD_UPGRADE) {
+					pid_t pid = upgradeServer(args->argv, args->web_sock, args->cmd_sock);
+					replyUpgrade(session->sock, pid);
+					if (pid > 0) {
+						printf("[!] New server started with PID %d\n", pid);
+						unixPassed = 1;
+						action = CMD_UPGRADE;
+					}
+				}
+			}
+		}
+
+		// Send the profiles that finished
+		now = currentTime();
+		for (i = 0; i < MAX_SESSIONS && action == 0; i++) {
+			Session *session = sessions[i];
+			if (session != NULL && session->profileEnd > 0 && session->profileEnd <= now) {
+				session->profileEnd = 0;
+				if (sendProfile(session->sock) < 0) {
+					closeSession(session);
+				}
+			}
+		}
+
+		// Send the STATS of the watching sessions that are due
+		for (i = 0; i < MAX_SESSIONS && action == 0; i++) {
+			Session *session = sessions[i];
+			if (session == NULL || session->watchInterval <= 0 || session->nextWatch > now) {
+				continue;
+			}
+			char msg[BUF_SIZE];
+			int len = formatStats(msg, args->startTime);
+			if (write(session->sock, msg, len) != len) {
+				closeSession(session);
+				continue;
+			}
+			session->nextWatch += session->watchInterval;
+			if (session->nextWatch <= now) {
+				// Skip the intervals we were late for
+				session->nextWatch = now + session->watchInterval;
+			}
+		}
+	}
+
+	// Tell the event loop to stop or drain (unless it told us to stop)
+	if (action > 0) {
+		write(actionPipe[1], &action, 1);
+	}
+	for (i = 0; i < MAX_SESSIONS; i++) {
+		if (sessions[i] != NULL) {
+			closeSession(sessions[i]);
+		}
+	}
+	close(cmdEpfd);
+	cmdEpfd = -1;
+	return NULL;
+}
+
+
+/* Read what the session sent and run every complete line.
+ * Returns CMD_QUIT if the session has to be closed, CMD_SHUTDOWN or CMD_UPGRADE
+ * if it asked for them (the lines after them are ignored), CMD_OK otherwise */
+int readSession(Session *session, long long startTime) {
+	int bytes = read(session->sock, session->buf + session->bufOffset, BUF_SIZE - 1 - session->bufOffset);
+	if (bytes < 0 && errno == EINTR) {
+		return CMD_OK;
+	}
+	if (bytes <= 0) {
+		printf("[!] Client closed the connection\n");
+		return CMD_QUIT;
+	}
+	session->bufOffset += bytes;
+	session->buf[session->bufOffset] = '\0';
+
+	char *line = session->buf;
+	char *newline;
+	while ((newline = strchr(line, '\n')) != NULL) {
+		*newline = '\0';
+		if (newline > line && newline[-1] == '\r') {
+			newline[-1] = '\0';
+		}
+
+		int res = sessionCommand(session, line, startTime);
+		if (res == CMD_QUIT || res == CMD_SHUTDOWN || res == CMD_UPGRADE) {
+			return res;
+		}
+		line = newline + 1;
+	}
+
+	// Keep the incomplete line for the next read
+	session->bufOffset = strlen(line);
+	memmove(session->buf, line, session->bufOffset + 1);
+	if (session->bufOffset == BUF_SIZE - 1) {
+		char msg[] = "COMMAND TOO LONG\n";
+		write(session->sock, msg, strlen(msg));
+		return CMD_QUIT;
+	}
+	return CMD_OK;
+}
+
+
+/* Run a line sent by a session. WATCH and QUIT only concern the session,
+ * the rest are the commands of handleCommand */
+int sessionCommand(Session *session, char *line, long long startTime) {
+	line += strspn(line, " \t");
+	if (*line == '\0') {
+		return CMD_OK;
+	}
+
+	if (strncmp(line, "QUIT", 4) == 0) {
+		return CMD_QUIT;
+	} else if (strncmp(line, "WATCH STOP", 10) == 0) {
+		session->watchInterval = 0;
+		return CMD_OK;
+	} else if (strncmp(line, "WATCH STATS", 11) == 0) {
+		// Interval in seconds, fractions allowed
+		double seconds = atof(line + 11);
+		if (seconds <= 0) {
+			seconds = 1;
+		}
+		session->watchInterval = seconds * 1000;
+		if (session->watchInterval < MIN_WATCH_MS) {
+			session->watchInterval = MIN_WATCH_MS;
+		}
+		session->nextWatch = currentTime();
+		printf("[*] Received WATCH STATS command (every %d ms)\n", session->watchInterval);
+		return CMD_OK;
+	} else if (strncmp(line, "PROFILE", 7) == 0) {
+		// The folded stacks are sent once the run is over
+		char *end;
+		int seconds = strtol(line + 7, &end, 10);
+		if (end == line + 7) {
+			seconds = PROFILE_SECONDS;
+		}
+		if (*(end + strspn(end, " \t")) != '\0' || seconds <= 0 || seconds > MAX_PROFILE_SECONDS) {
+			char msg[] = "INVALID PROFILE DURATION\n";
+			write(session->sock, msg, strlen(msg));
+			return CMD_INVALID;
+		}
+		if (profilerStart(profiler, seconds) < 0) {
+			char msg[] = "PROFILE ALREADY RUNNING\n";
+			write(session->sock, msg, strlen(msg));
+			return CMD_INVALID;
+		}
+		printf("[*] Received PROFILE command (%d seconds)\n", seconds);
+
+		// Prefork children are told to sample themselves by the master
+		char action = CMD_PROFILE;
+		write(actionPipe[1], &action, 1);
+		session->profileEnd = currentTime() + seconds * 1000LL;
+		return CMD_OK;
+	}
+
+	return handleCommand(session->sock, line, startTime);
+}
+
+
+/* Close a session and remove it from the list */
+void closeSession(Session *session) {
+	int i;
+	for (i = 0; i < MAX_SESSIONS; i++) {
+		if (sessions[i] == session) {
+			sessions[i] = NULL;
+		}
+	}
+	close(session->sock); // Also removes it from the epoll set
+	free(session);
+}
+
+
 /* Run a command sent through the command port */
-int handleCommand(int client_sock, long long startTime) {
-	char buf[32] = {0};
-	read(client_sock, buf, 32);
+int handleCommand(int client_sock, char *buf, long long startTime) {
 	if (strncmp(buf, "STATS", 5) == 0) {
 		printf("[*] Received STATS command\n");
 
-		char msg[BUF_SIZE];
-		// Get the current time in milliseconds
-		struct timeval tv;
-		gettimeofday(&tv, NULL);
-		long long currTime = tv.tv_sec * 1000 + tv.tv_usec / 1000;
-		// Get elaped time
-		long long diff = currTime - startTime;
-		long long secondsDiff = diff / 1000;
-
-		int hours = secondsDiff / 3600;
-		int minutes = (secondsDiff % 3600) / 60;
-		int seconds = secondsDiff % 60;
-		int milliseconds = diff % 1000;
-
-
-		pthread_mutex_lock(&stats_mtx);
-		int pages = pagesServed;
-		int bytes = bytesServed;
-		pthread_mutex_unlock(&stats_mtx);
-
-		sprintf(msg, "Server up for %02i:%02i:%02i.%03i, served %d pages, %d bytes\n", hours, minutes, seconds, milliseconds, pages, bytes);
+		char msg[2 * BUF_SIZE];
+		int len = formatStats(msg, startTime);
+		strcpy(msg + len, socketReport);
 		write(client_sock, msg, strlen(msg));
 		return CMD_OK;
+	} else if (strncmp(buf, "TOPPAGES", 8) == 0) {
+		printf("[*] Received TOPPAGES command\n");
+		commandTopPages(client_sock, buf + 8);
+		return CMD_TOPPAGES;
+	} else if (strncmp(buf, "FAULT", 5) == 0) {
+		printf("[*] Received FAULT command\n");
+		commandFault(client_sock, buf + 5);
+		return CMD_OK;
+	} else if (strncmp(buf, "TRACE", 5) == 0) {
+		printf("[*] Received TRACE command\n");
+		commandTrace(client_sock, buf + 5);
+		return CMD_OK;
+	} else if (strncmp(buf, "UPGRADE", 7) == 0) {
+		// The main loop replies after starting the new server
+		printf("[*] Received UPGRADE command\n");
+		return CMD_UPGRADE;
 	} else if (strncmp(buf, "SHUTDOWN", 8) == 0) {
 		printf("[*] Received SHUTDOWN command\n");
 		char msg[] = "\n*** SERVER SHUTTING DOWN ***\n";
@@ -638,8 +2355,224 @@ int handleCommand(int client_sock, long long startTime) {
 }
 
 
+/* Write the uptime and the counters of every process in msg and return its length */
+int formatStats(char *msg, long long startTime) {
+	// Get elaped time
+	long long diff = currentTime() - startTime;
+	long long secondsDiff = diff / 1000;
+
+	int hours = secondsDiff / 3600;
+	int minutes = (secondsDiff % 3600) / 60;
+	int seconds = secondsDiff % 60;
+	int milliseconds = diff % 1000;
+
+
+	// Add up the counters of every process
+	unsigned long long pages = 0;
+	unsigned long long bytes = 0;
+	unsigned long long timedOut = 0;
+	unsigned long long limited = 0;
+	int i;
+	for (i = 0; i < counterSlots; i++) {
+		pages += __atomic_load_n(&(counters[i].pagesServed), __ATOMIC_RELAXED);
+		bytes += __atomic_load_n(&(counters[i].bytesServed), __ATOMIC_RELAXED);
+		timedOut += __atomic_load_n(&(counters[i].connectionsTimedOut), __ATOMIC_RELAXED);
+		limited += __atomic_load_n(&(counters[i].requestsLimited), __ATOMIC_RELAXED);
+	}
+
+	return sprintf(msg, "Server up for %02i:%02i:%02i.%03i, served %llu pages, %llu bytes, %llu connections timed out, %llu requests rate limited\n", hours, minutes, seconds, milliseconds, pages, bytes, timedOut, limited);
+}
+
+
+/* Send the most requested pages with their estimated requests and bytes.
+ * arg holds the number of pages requested (10 if not given) */
+void commandTopPages(int client_sock, char *arg) {
+	int n = atoi(arg);
+	if (n <= 0) {
+		n = 10;
+	} else if (n > TOP_K) {
+		n = TOP_K;
+	}
+
+	Hitter top[TOP_K];
+	n = hittersTop(hitters, top, n);
+	if (n == 0) {
+		char msg[] = "No pages served yet\n";
+		write(client_sock, msg, strlen(msg));
+		return;
+	}
+
+	// Each line holds the path and two counters
+	char *msg = malloc(n * (MAX_PATH_LEN + 64) * sizeof(char));
+	if (msg == NULL) {
+		perror("malloc");
+		return;
+	}
+	int offset = 0;
+	int i;
+	for (i = 0; i < n; i++) {
+		offset += sprintf(msg + offset, "%2d. %s %llu requests, %llu bytes\n", i + 1, top[i].path, top[i].count, top[i].bytes);
+	}
+	write(client_sock, msg, offset);
+	free(msg);
+}
+
+
+/* Change the fault rules if arg holds a rule and send them back */
+void commandFault(int client_sock, char *arg) {
+	arg += strspn(arg, " \t\r\n");
+	if (*arg != '\0' && faultsCommand(faults, arg) < 0) {
+		char msg[] = "INVALID FAULT RULE\n";
+		write(client_sock, msg, strlen(msg));
+		return;
+	}
+
+	char msg[MAX_FAULT_RULES * 2 * BUF_SIZE];
+	int len = faultsList(faults, msg, sizeof(msg));
+	write(client_sock, msg, len);
+}
+
+
+/* TRACE [seconds] writes the traced requests of the last seconds (10 by
+ * default) as Chrome trace_event JSON. TRACE SAMPLE <n> traces 1 request
+ * in n from now on, 0 stops tracing */
+void commandTrace(int client_sock, char *arg) {
+	char *end;
+	arg += strspn(arg, " \t\r\n");
+	if (strncmp(arg, "SAMPLE", 6) == 0) {
+		int rate = strtol(arg + 6, &end, 10);
+		if (end == arg + 6 || rate < 0 || *(end + strspn(end, " \t\r\n")) != '\0') {
+			char msg[] = "INVALID TRACE SAMPLE RATE\n";
+			write(client_sock, msg, strlen(msg));
+			return;
+		}
+		__atomic_store_n(&(traces->sampleRate), rate, __ATOMIC_RELAXED);
+
+		char msg[BUF_SIZE];
+		int len = snprintf(msg, BUF_SIZE, "Tracing 1 request in %d\n", rate);
+		if (rate == 0) {
+			len = snprintf(msg, BUF_SIZE, "Tracing disabled\n");
+		}
+		write(client_sock, msg, len);
+		return;
+	}
+
+	int seconds = TRACE_SECONDS;
+	if (*arg != '\0') {
+		seconds = strtol(arg, &end, 10);
+		if (end == arg || seconds <= 0 || *(end + strspn(end, " \t\r\n")) != '\0') {
+			char msg[] = "INVALID TRACE DURATION\n";
+			write(client_sock, msg, strlen(msg));
+			return;
+		}
+	}
+
+	int len;
+	char *json = traceDump(traces, seconds, &len);
+	if (json == NULL) {
+		char msg[] = "TRACE FAILED\n";
+		write(client_sock, msg, strlen(msg));
+		return;
+	}
+	// Stop if the session's send timeout expires
+	int offset = 0;
+	while (offset < len) {
+		int written = write(client_sock, json + offset, len - offset);
+		if (written < 0 && errno == EINTR) {
+			continue;
+		} else if (written <= 0) {
+			break;
+		}
+		offset += written;
+	}
+	free(json);
+}
+
+
+/* Write the folded stacks of the last PROFILE run. Stops if the session's
+ * send timeout expires. Returns -1 if they couldn't be sent */
+int sendProfile(int client_sock) {
+	int len;
+	char *stacks = profilerReport(profiler, &len);
+	if (stacks == NULL) {
+		char msg[] = "PROFILE FAILED\n";
+		write(client_sock, msg, strlen(msg));
+		return 0;
+	}
+
+	int offset = 0;
+	while (offset < len) {
+		int written = write(client_sock, stacks + offset, len - offset);
+		if (written < 0 && errno == EINTR) {
+			continue;
+		} else if (written <= 0) {
+			free(stacks);
+			return -1;
+		}
+		offset += written;
+	}
+	free(stacks);
+	return 0;
+}
+
+
+/* Create the state shared with the children in prefork mode: counters and
+ * page hits, which the master adds up, fault rules, which the master changes,
+ * the rate limits of the clients, the trace buffers and the profiler */
+int createShared(long long startTime) {
+	if ((hitters = hittersCreate()) == NULL) {
+		return -1;
+	}
+	if ((faults = faultsCreate()) == NULL) {
+		return -1;
+	}
+	if ((traces = traceCreate()) == NULL) {
+		return -1;
+	}
+	if ((profiler = profilerCreate()) == NULL) {
+		return -1;
+	}
+	if (rateLimit > 0 && (rateLimits = rateCreate(rateLimit, rateBurst, startTime)) == NULL) {
+		return -1;
+	}
+	counters = mmap(NULL, counterSlots * sizeof(Counters), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (counters == MAP_FAILED) {
+		perror("mmap");
+		counters = NULL;
+		return -1;
+	}
+	myCounters = &counters[0];
+	return 0;
+}
+
+
+void destroyShared(void) {
+	if (hitters != NULL) {
+		hittersDestroy(hitters);
+	}
+	if (faults != NULL) {
+		faultsDestroy(faults);
+	}
+	if (traces != NULL) {
+		traceDestroy(traces);
+	}
+	if (profiler != NULL) {
+		profilerDestroy(profiler);
+	}
+	if (rateLimits != NULL) {
+		rateDestroy(rateLimits);
+	}
+	if (counters != NULL) {
+		munmap(counters, counterSlots * sizeof(Counters));
+	}
+}
+
+
 /* Stop threads and free memory */
 void cleanup(pthread_t *threads, int threadCount) {
+	// Stop reading commands first (if the command port is served by this process)
+	stopCommandThread();
+
 	// Notify the threads to stop
 	pthread_mutex_lock(&thread_stop_mtx);
 	threadStop = 1;
@@ -651,7 +2584,9 @@ void cleanup(pthread_t *threads, int threadCount) {
 	while (isFull(&reqQueue)) {
 		pthread_cond_wait(&cond_nonfull, &queue_mtx);
 	}
-	queueInsert(&reqQueue, "DUMMY", 0); // Dummy insert
+	// Dummy insert (it stays in the queue after the threads are gone)
+	static Request dummy = {"DUMMY", NULL, NULL};
+	queueInsert(&reqQueue, &dummy);
 	pthread_cond_broadcast(&cond_nonempty);
 	pthread_mutex_unlock(&queue_mtx);
 
@@ -662,19 +2597,35 @@ void cleanup(pthread_t *threads, int threadCount) {
 	}
 	free(threads);
 
+	// Close the connections still waiting for a request
+	// (Every connection not served by a thread has a deadline scheduled)
+	Timer *open = wheelExpireAll(&wheel);
+	while (open != NULL) {
+		Timer *next = open->next;
+		destroyConnection((Connection *) open->data);
+		open = next;
+	}
+	if (epfd >= 0) {
+		close(epfd);
+	}
+
 	// Free mutexes and condition variables
 	pthread_mutex_destroy(&thread_stop_mtx);
-	pthread_mutex_destroy(&stats_mtx);
+	pthread_mutex_destroy(&conn_count_mtx);
+	pthread_mutex_destroy(&wheel_mtx);
 	pthread_mutex_destroy(&queue_mtx);
 	pthread_cond_destroy(&cond_nonempty);
 	pthread_cond_destroy(&cond_nonfull);
 
-	// Destroy the request queue
+	// Destroy the request queue and the buffers
 	// (No mutex needed since all threads have stopped)
 	queueDestroy(&reqQueue);
+	poolDestroy(&bufferPool);
 }
 
 
 void usage(char *name) {
-	printf("Usage: %s -p <serving port> -c <command port> -t <num of threads> -d <root dir>\n", name);
+	printf("Usage: %s -p <serving port> -c <command port> -t <num of threads> -d <root dir> [-P <num of processes>] [-m <response memory limit in MB>] [-F <fault rules file>]\n"
+		"       [-T <name=value,... | socket options file>] [-R <requests per second>[,<burst>]] [-U <Unix socket path | @abstract name>]\n"
+		"       %s -p <serving port> -c <command port> -t <num of threads> --synthetic <seed>,<sites>,<pages>[,<text file>] [...]\n", name, name);
 }
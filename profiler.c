@@ -0,0 +1,427 @@
+#define _GNU_SOURCE // dladdr
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dlfcn.h> // dladdr
+#include <elf.h>
+#include <execinfo.h> // backtrace
+#include <sys/mman.h> // mmap
+#include <sys/stat.h>
+#include <sys/time.h> // setitimer
+#include "profiler.h"
+
+#define SKIP_FRAMES 2 // The handler and the signal trampoline
+
+/* Function of the executable, with its address once loaded */
+typedef struct symbol {
+	unsigned long start;
+	unsigned long end;
+	char *name;
+} Symbol;
+
+/* Functions of the executable sorted by address */
+typedef struct symbolTable {
+	Symbol *symbols;
+	int count;
+	char *names;
+} SymbolTable;
+
+// Profiler of this process, used by the signal handler
+static Profiler *activeProfiler = NULL;
+
+// Buffer of the calling thread in the current run
+static __thread ProfileBuffer *myBuffer = NULL;
+static __thread int myRun = 0;
+
+static void profileHandler(int);
+static long long monotonicTime(void);
+static void stopTimer(void);
+static int loadSymbols(SymbolTable *);
+static int compareSymbols(const void *, const void *);
+static int compareStacks(const void *, const void *);
+static const char *frameName(SymbolTable *, void *, char *, int);
+static char *foldStack(SymbolTable *, ProfileSample *);
+
+
+/* The profiler is placed in shared memory, so that processes forked after
+ * its creation can be profiled by the process that created it */
+Profiler *profilerCreate(void) {
+	Profiler *prof = mmap(NULL, sizeof(Profiler), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (prof == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+
+	// backtrace loads libgcc the first time it is called, which must not
+	// happen in the signal handler
+	void *frames[1];
+	backtrace(frames, 1);
+
+	activeProfiler = prof;
+	return prof;
+}
+
+
+/* Start a run of the given seconds and sample this process.
+ * Returns -1 if a run is already in progress */
+int profilerStart(Profiler *prof, int seconds) {
+	if (profilerRunning(prof)) {
+		return -1;
+	}
+
+	int i;
+	for (i = 0; i < MAX_PROFILE_BUFFERS; i++) {
+		prof->buffers[i].count = 0;
+		prof->buffers[i].dropped = 0;
+	}
+	prof->nextBuffer = 0;
+	__atomic_add_fetch(&(prof->run), 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&(prof->until), monotonicTime() + seconds * 1000LL, __ATOMIC_RELEASE);
+	return profilerArm(prof);
+}
+
+
+/* Sample the calling process until the current run ends. Processes
+ * sharing the profiler call it when told that a run has started */
+int profilerArm(Profiler *prof) {
+	activeProfiler = prof;
+
+	struct sigaction act = {0};
+	act.sa_handler = profileHandler;
+	act.sa_flags = SA_RESTART;
+	sigemptyset(&(act.sa_mask));
+	if (sigaction(SIGPROF, &act, NULL) < 0) {
+		perror("sigaction");
+		return -1;
+	}
+
+	struct itimerval timer;
+	timer.it_interval.tv_sec = 0;
+	timer.it_interval.tv_usec = 1000000 / PROFILE_HZ;
+	timer.it_value = timer.it_interval;
+	if (setitimer(ITIMER_PROF, &timer, NULL) < 0) {
+		perror("setitimer");
+		return -1;
+	}
+	return 0;
+}
+
+
+int profilerRunning(Profiler *prof) {
+	return monotonicTime() < __atomic_load_n(&(prof->until), __ATOMIC_ACQUIRE);
+}
+
+
+/* Folded stacks of the last run ("outer;inner;leaf count" lines, as read by
+ * flamegraph tools). Returns a buffer to be freed by the caller */
+char *profilerReport(Profiler *prof, int *length) {
+	SymbolTable table;
+	if (loadSymbols(&table) < 0) {
+		table.symbols = NULL;
+		table.count = 0;
+		table.names = NULL;
+	}
+
+	int total = 0;
+	int dropped = 0;
+	int i;
+	for (i = 0; i < MAX_PROFILE_BUFFERS; i++) {
+		int count = __atomic_load_n(&(prof->buffers[i].count), __ATOMIC_ACQUIRE);
+		total += count < PROFILE_SAMPLES ? count : PROFILE_SAMPLES;
+		dropped += prof->buffers[i].dropped;
+	}
+	if (dropped > 0) {
+		printf("[!] %d profile samples dropped\n", dropped);
+	}
+
+	char **stacks = malloc((total + 1) * sizeof(char *));
+	if (stacks == NULL) {
+		perror("malloc");
+		free(table.symbols);
+		free(table.names);
+		return NULL;
+	}
+	int stackCount = 0;
+	for (i = 0; i < MAX_PROFILE_BUFFERS && stackCount < total; i++) {
+		ProfileBuffer *buffer = &(prof->buffers[i]);
+		int count = __atomic_load_n(&(buffer->count), __ATOMIC_ACQUIRE);
+		int j;
+		for (j = 0; j < count && j < PROFILE_SAMPLES && stackCount < total; j++) {
+			char *stack = foldStack(&table, &(buffer->samples[j]));
+			if (stack != NULL) {
+				stacks[stackCount++] = stack;
+			}
+		}
+	}
+	free(table.symbols);
+	free(table.names);
+
+	// Identical stacks are next to each other once sorted
+	qsort(stacks, stackCount, sizeof(char *), compareStacks);
+
+	int size = 1;
+	for (i = 0; i < stackCount; i++) {
+		size += strlen(stacks[i]) + 16;
+	}
+	char *buf = malloc(size * sizeof(char));
+	if (buf == NULL) {
+		perror("malloc");
+		for (i = 0; i < stackCount; i++) {
+			free(stacks[i]);
+		}
+		free(stacks);
+		return NULL;
+	}
+
+	int offset = 0;
+	buf[0] = '\0';
+	for (i = 0; i < stackCount; ) {
+		int j = i + 1;
+		while (j < stackCount && strcmp(stacks[j], stacks[i]) == 0) {
+			j++;
+		}
+		offset += sprintf(buf + offset, "%s %d\n", stacks[i], j - i);
+		i = j;
+	}
+	for (i = 0; i < stackCount; i++) {
+		free(stacks[i]);
+	}
+	free(stacks);
+
+	*length = offset;
+	return buf;
+}
+
+
+void profilerDestroy(Profiler *prof) {
+	stopTimer();
+	if (activeProfiler == prof) {
+		activeProfiler = NULL;
+	}
+	munmap(prof, sizeof(Profiler));
+}
+
+
+/* Record the stack of the interrupted thread. Only async-signal-safe calls */
+void profileHandler(int sig) {
+	int savedErrno = errno;
+	Profiler *prof = activeProfiler;
+	if (prof == NULL) {
+		errno = savedErrno;
+		return;
+	}
+	if (monotonicTime() >= __atomic_load_n(&(prof->until), __ATOMIC_ACQUIRE)) {
+		stopTimer();
+		errno = savedErrno;
+		return;
+	}
+
+	// The first sample of a thread in a run claims a buffer
+	int run = __atomic_load_n(&(prof->run), __ATOMIC_ACQUIRE);
+	if (myRun != run) {
+		myRun = run;
+		int index = __atomic_fetch_add(&(prof->nextBuffer), 1, __ATOMIC_RELAXED);
+		myBuffer = index < MAX_PROFILE_BUFFERS ? &(prof->buffers[index]) : NULL;
+	}
+	ProfileBuffer *buffer = myBuffer;
+	if (buffer == NULL) {
+		errno = savedErrno;
+		return;
+	}
+	if (buffer->count >= PROFILE_SAMPLES) {
+		buffer->dropped++;
+		errno = savedErrno;
+		return;
+	}
+
+	void *frames[PROFILE_DEPTH + SKIP_FRAMES];
+	int depth = backtrace(frames, PROFILE_DEPTH + SKIP_FRAMES) - SKIP_FRAMES;
+	ProfileSample *sample = &(buffer->samples[buffer->count]);
+	sample->depth = depth > 0 ? depth : 0;
+	if (depth > 0) {
+		memcpy(sample->frames, frames + SKIP_FRAMES, depth * sizeof(void *));
+	}
+	__atomic_store_n(&(buffer->count), buffer->count + 1, __ATOMIC_RELEASE);
+	errno = savedErrno;
+}
+
+
+long long monotonicTime(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+
+void stopTimer(void) {
+	struct itimerval timer;
+	memset(&timer, 0, sizeof(timer));
+	setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+
+/* Read the functions of the running executable from its symbol table, which
+ * also has the static functions that dladdr can't name */
+int loadSymbols(SymbolTable *table) {
+	table->symbols = NULL;
+	table->count = 0;
+	table->names = NULL;
+
+	int fd = open("/proc/self/exe", O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		perror("open");
+		return -1;
+	}
+	struct stat fileStat;
+	if (fstat(fd, &fileStat) < 0) {
+		perror("fstat");
+		close(fd);
+		return -1;
+	}
+	char *file = mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (file == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+
+	Elf64_Ehdr *header = (Elf64_Ehdr *) file;
+	if (fileStat.st_size < (off_t) sizeof(Elf64_Ehdr) || memcmp(header->e_ident, ELFMAG, SELFMAG) != 0 ||
+			header->e_ident[EI_CLASS] != ELFCLASS64 ||
+			header->e_shoff + (unsigned long) header->e_shnum * sizeof(Elf64_Shdr) > (unsigned long) fileStat.st_size) {
+		munmap(file, fileStat.st_size);
+		return -1;
+	}
+
+	// Position independent executables are loaded at the address dladdr reports
+	unsigned long base = 0;
+	Dl_info info;
+	if (header->e_type == ET_DYN && dladdr((void *) profilerCreate, &info) != 0) {
+		base = (unsigned long) info.dli_fbase;
+	}
+
+	Elf64_Shdr *sections = (Elf64_Shdr *) (file + header->e_shoff);
+	int i;
+	for (i = 0; i < header->e_shnum; i++) {
+		if (sections[i].sh_type != SHT_SYMTAB || sections[i].sh_link >= header->e_shnum) {
+			continue;
+		}
+		Elf64_Sym *syms = (Elf64_Sym *) (file + sections[i].sh_offset);
+		int symCount = sections[i].sh_size / sizeof(Elf64_Sym);
+		char *strings = file + sections[sections[i].sh_link].sh_offset;
+		unsigned long stringsSize = sections[sections[i].sh_link].sh_size;
+
+		table->symbols = malloc(symCount * sizeof(Symbol));
+		table->names = malloc(stringsSize * sizeof(char));
+		if (table->symbols == NULL || table->names == NULL) {
+			perror("malloc");
+			free(table->symbols);
+			free(table->names);
+			table->symbols = NULL;
+			table->names = NULL;
+			break;
+		}
+		memcpy(table->names, strings, stringsSize);
+
+		int j;
+		for (j = 0; j < symCount; j++) {
+			if (ELF64_ST_TYPE(syms[j].st_info) != STT_FUNC || syms[j].st_value == 0 ||
+					syms[j].st_name >= stringsSize) {
+				continue;
+			}
+			Symbol *symbol = &(table->symbols[table->count++]);
+			symbol->start = base + syms[j].st_value;
+			symbol->end = symbol->start + syms[j].st_size;
+			symbol->name = table->names + syms[j].st_name;
+		}
+		break;
+	}
+	munmap(file, fileStat.st_size);
+
+	qsort(table->symbols, table->count, sizeof(Symbol), compareSymbols);
+	return 0;
+}
+
+
+int compareSymbols(const void *a, const void *b) {
+	const Symbol *first = a;
+	const Symbol *second = b;
+	if (first->start != second->start) {
+		return first->start < second->start ? -1 : 1;
+	}
+	return 0;
+}
+
+
+int compareStacks(const void *a, const void *b) {
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+
+/* Name of the function containing addr: from the executable's symbol table,
+ * else the exported name dladdr finds, else the library it belongs to */
+const char *frameName(SymbolTable *table, void *addr, char *buf, int size) {
+	unsigned long value = (unsigned long) addr;
+	int low = 0;
+	int high = table->count - 1;
+	while (low <= high) {
+		int mid = (low + high) / 2;
+		if (table->symbols[mid].start <= value) {
+			low = mid + 1;
+		} else {
+			high = mid - 1;
+		}
+	}
+	if (high >= 0 && value < table->symbols[high].end) {
+		return table->symbols[high].name;
+	}
+
+	Dl_info info;
+	if (dladdr(addr, &info) != 0) {
+		if (info.dli_sname != NULL) {
+			return info.dli_sname;
+		}
+		if (info.dli_fname != NULL) {
+			char *name = strrchr(info.dli_fname, '/');
+			snprintf(buf, size, "[%s]", name != NULL ? name + 1 : info.dli_fname);
+			return buf;
+		}
+	}
+	snprintf(buf, size, "[%p]", addr);
+	return buf;
+}
+
+
+/* Frames of a sample from the outermost to the innermost, separated by ';' */
+char *foldStack(SymbolTable *table, ProfileSample *sample) {
+	const char *names[PROFILE_DEPTH];
+	char unknown[PROFILE_DEPTH][64];
+	int size = 1;
+	int depth = sample->depth < PROFILE_DEPTH ? sample->depth : PROFILE_DEPTH;
+	int i;
+	for (i = 0; i < depth; i++) {
+		// Outer frames hold return addresses, which may be past the end of the caller
+		char *addr = (char *) sample->frames[i];
+		names[i] = frameName(table, i == 0 ? addr : addr - 1, unknown[i], 64);
+		size += strlen(names[i]) + 1;
+	}
+	if (depth == 0) {
+		return strdup("[unknown]");
+	}
+
+	char *stack = malloc(size * sizeof(char));
+	if (stack == NULL) {
+		perror("malloc");
+		return NULL;
+	}
+	int offset = 0;
+	for (i = depth - 1; i >= 0; i--) {
+		offset += sprintf(stack + offset, "%s%s", names[i], i > 0 ? ";" : "");
+	}
+	return stack;
+}
@@ -0,0 +1,41 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#define PROFILE_HZ          99 // Samples per second of CPU time
+#define PROFILE_DEPTH       32 // Deepest stack recorded
+#define PROFILE_SAMPLES     1024 // Samples each thread keeps during a run
+#define MAX_PROFILE_BUFFERS 64 // Threads sampled during a run
+#define MAX_PROFILE_SECONDS 300
+
+/* Stack of the thread that was running when SIGPROF arrived, innermost frame first */
+typedef struct profileSample {
+	int depth;
+	void *frames[PROFILE_DEPTH];
+} ProfileSample;
+
+/* Samples of one thread. Only its SIGPROF handler writes it; count is
+ * increased after a sample is written, so readers know which are complete */
+typedef struct profileBuffer {
+	int count;
+	int dropped; // Samples lost because the buffer was full
+	ProfileSample samples[PROFILE_SAMPLES];
+} ProfileBuffer;
+
+/* Samples of a run. The profiler is in shared memory, so that the processes
+ * forked after its creation record their samples where their parent can read them */
+typedef struct profiler {
+	int run; // Increased by every run, so that threads claim a new buffer
+	long long until; // End of the current run (CLOCK_MONOTONIC milliseconds)
+	int nextBuffer;
+	ProfileBuffer buffers[MAX_PROFILE_BUFFERS];
+} Profiler;
+
+
+Profiler *profilerCreate(void);
+int profilerStart(Profiler *, int);
+int profilerArm(Profiler *);
+int profilerRunning(Profiler *);
+char *profilerReport(Profiler *, int *);
+void profilerDestroy(Profiler *);
+
+#endif // PROFILER_H
@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h> // mmap
+#include "ratelimit.h"
+
+#define TOKEN_UNIT  256 // Tokens are counted in 1/256 to refill them smoothly
+#define TOKEN_BITS  24
+#define TOKEN_MASK  ((1ULL << TOKEN_BITS) - 1)
+#define SHARD_MASK  (LIMIT_SHARD_SLOTS - 1)
+
+static Bucket *findBucket(RateTable *, unsigned int, unsigned long long);
+static unsigned int hashAddr(unsigned int);
+
+
+/* The table is placed in shared memory, so that processes forked
+ * after its creation share the buckets */
+RateTable *rateCreate(int rate, int burst, long long nowMs) {
+	if (burst > MAX_BURST) {
+		burst = MAX_BURST;
+	}
+	RateTable *table = mmap(NULL, sizeof(RateTable), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (table == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+	// Anonymous mappings are zero-filled, every slot starts free
+	table->rate = rate;
+	table->burst = burst;
+	table->epoch = nowMs;
+	return table;
+}
+
+
+/* Take a token from the bucket of addr. Tokens are added lazily from the
+ * time passed since the last refill. Returns 0 if the bucket is empty */
+int rateAllow(RateTable *table, unsigned int addr, long long nowMs) {
+	unsigned long long now = nowMs - table->epoch;
+	unsigned long long full = (unsigned long long) table->burst * TOKEN_UNIT;
+	Bucket *bucket = findBucket(table, addr, now);
+
+	unsigned long long old = __atomic_load_n(&(bucket->state), __ATOMIC_RELAXED);
+	while (1) {
+		unsigned long long tokens = old & TOKEN_MASK;
+		unsigned long long last = old >> TOKEN_BITS;
+
+		if (now > last) {
+			tokens += (now - last) * table->rate * TOKEN_UNIT / 1000;
+			if (tokens > full) {
+				tokens = full;
+			}
+		} else {
+			now = last; // Another process may have a slightly later clock
+		}
+		if (tokens < TOKEN_UNIT) {
+			return 0; // Nothing to write, the refill is computed again next time
+		}
+
+		unsigned long long new = (now << TOKEN_BITS) | (tokens - TOKEN_UNIT);
+		if (__atomic_compare_exchange_n(&(bucket->state), &old, new, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			return 1;
+		}
+		// old now holds the current state, retry with it
+	}
+}
+
+
+void rateDestroy(RateTable *table) {
+	munmap(table, sizeof(RateTable));
+}
+
+
+/* Find the bucket of addr among the slots it can use, taking a free one or
+ * the least recently refilled one if it has none. The eviction is approximate:
+ * a client racing with it can briefly use the tokens of the evicted one */
+Bucket *findBucket(RateTable *table, unsigned int addr, unsigned long long now) {
+	unsigned int hash = hashAddr(addr);
+	Bucket *slots = table->shards[hash % LIMIT_SHARDS].slots;
+	unsigned int start = hash / LIMIT_SHARDS;
+
+	Bucket *oldest = NULL;
+	unsigned long long oldestTime = 0;
+	int i;
+	for (i = 0; i < LIMIT_PROBES; i++) {
+		Bucket *bucket = &slots[(start + i) & SHARD_MASK];
+		unsigned int curr = __atomic_load_n(&(bucket->addr), __ATOMIC_ACQUIRE);
+		if (curr == addr) {
+			return bucket;
+		}
+
+		if (curr == 0) {
+			// New clients start with a full bucket
+			unsigned int expected = 0;
+			if (__atomic_compare_exchange_n(&(bucket->addr), &expected, addr, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				__atomic_store_n(&(bucket->state), (now << TOKEN_BITS) | ((unsigned long long) table->burst * TOKEN_UNIT), __ATOMIC_RELEASE);
+				return bucket;
+			} else if (expected == addr) {
+				return bucket;
+			}
+			continue;
+		}
+
+		unsigned long long last = __atomic_load_n(&(bucket->state), __ATOMIC_RELAXED) >> TOKEN_BITS;
+		if (oldest == NULL || last < oldestTime) {
+			oldest = bucket;
+			oldestTime = last;
+		}
+	}
+
+	// Evict the least recently refilled client
+	__atomic_store_n(&(oldest->state), (now << TOKEN_BITS) | ((unsigned long long) table->burst * TOKEN_UNIT), __ATOMIC_RELAXED);
+	__atomic_store_n(&(oldest->addr), addr, __ATOMIC_RELEASE);
+	return oldest;
+}
+
+
+/* Murmur3 finalizer */
+unsigned int hashAddr(unsigned int addr) {
+	addr ^= addr >> 16;
+	addr *= 0x85ebca6b;
+	addr ^= addr >> 13;
+	addr *= 0xc2b2ae35;
+	addr ^= addr >> 16;
+	return addr;
+}
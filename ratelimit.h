@@ -0,0 +1,36 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#define LIMIT_SHARDS      16
+#define LIMIT_SHARD_SLOTS 1024 // Must be a power of 2
+#define LIMIT_PROBES      8
+#define MAX_BURST         65535
+
+/* Token bucket of a client IP. The state packs the tokens left (in 1/256
+ * of a token) in the low 24 bits and the time of the last refill (in
+ * milliseconds since the table was created) in the high 40 bits, so it is
+ * updated with a single compare and swap */
+typedef struct bucket {
+	unsigned int addr; // IPv4 address, 0 if the slot is free
+	unsigned long long state;
+} Bucket;
+
+/* Every shard is a small open addressing table. A client only probes a few
+ * slots of its shard; when they are taken the least recently refilled one
+ * is given to the new client. No locks are taken, and the table is in
+ * shared memory so that prefork workers share the buckets */
+typedef struct rateTable {
+	int rate; // Tokens added per second
+	int burst; // Size of the buckets
+	long long epoch;
+	struct {
+		Bucket slots[LIMIT_SHARD_SLOTS];
+	} __attribute__((aligned(64))) shards[LIMIT_SHARDS];
+} RateTable;
+
+
+RateTable *rateCreate(int, int, long long);
+int rateAllow(RateTable *, unsigned int, long long);
+void rateDestroy(RateTable *);
+
+#endif // RATELIMIT_H
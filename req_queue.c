@@ -1,5 +1,4 @@
 #include <stdlib.h>
-#include <string.h>
 #include "req_queue.h"
 
 #define MAX_SIZE 32
@@ -21,15 +20,11 @@ int isFull(RequestQueue *queue) {
 }
 
 
-int queueInsert(RequestQueue *queue, char *filename, int client_sock) {
+int queueInsert(RequestQueue *queue, Request *req) {
 	if (isFull(queue)) {
 		return -1;
 	}
 
-	Request *req = malloc(sizeof(Request));
-	req->filename = malloc((strlen(filename) + 1) * sizeof(char));
-	strcpy(req->filename, filename);
-	req->client_sock = client_sock;
 	req->next = NULL;
 
 	(queue->size)++;
@@ -47,7 +42,7 @@ int queueInsert(RequestQueue *queue, char *filename, int client_sock) {
 }
 
 
-int queueRemove(RequestQueue *queue, char **filename, int *client_sock) {
+int queueRemove(RequestQueue *queue, char **filename, Connection **conn) {
 	if (isEmpty(queue)) {
 		return -1;
 	}
@@ -55,11 +50,8 @@ int queueRemove(RequestQueue *queue, char **filename, int *client_sock) {
 	Request *req = queue->front;
 	queue->front = queue->front->next;
 
-	*filename = malloc((strlen(req->filename) + 1) * sizeof(char));
-	strcpy(*filename, req->filename);
-	*client_sock = req->client_sock;
-	free(req->filename);
-	free(req);
+	*filename = req->filename;
+	*conn = req->conn;
 
 	(queue->size)--;
 
@@ -73,15 +65,8 @@ int queueRemove(RequestQueue *queue, char **filename, int *client_sock) {
 
 
 void queueDestroy(RequestQueue *queue) {
-	if (isEmpty(queue)) {
-		return;
-	}
-
-	Request *temp;
-	while (queue->front != NULL) {
-		temp = queue->front;
-		queue->front = queue->front->next;
-		free(temp->filename);
-		free(temp);
-	}
+	// The nodes are freed with their connections
+	queue->front = NULL;
+	queue->rear = NULL;
+	queue->size = 0;
 }
@@ -1,9 +1,13 @@
 #ifndef REQ_QUEUE_H
 #define REQ_QUEUE_H
 
+#include "connection.h"
+
+/* Nodes belong to the caller (they are allocated from the arena of their
+ * connection), the queue only links them */
 typedef struct request {
 	char *filename;
-	int client_sock;
+	Connection *conn;
 
 	struct request *next;
 } Request;
@@ -18,8 +22,8 @@ typedef struct requestQueue {
 void queueInit(RequestQueue *);
 int isEmpty(RequestQueue *);
 int isFull(RequestQueue *);
-int queueInsert(RequestQueue *, char *, int);
-int queueRemove(RequestQueue *, char **, int *);
+int queueInsert(RequestQueue *, Request *);
+int queueRemove(RequestQueue *, char **, Connection **);
 void queueDestroy(RequestQueue *);
 
 #endif // REQ_QUEUE_H
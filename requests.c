@@ -1,16 +1,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h> // strcasecmp
 #include <time.h>
 #include "requests.h"
 
 #define BUF_SIZE 128
 
-static char *createTimeStamp(void);
+static void createTimeStamp(char *, int);
 
 
-/* Check if an HTTP request we received is in a valid format and return the file requested */
-char *parseRequest(char *req) {
+/* Check if an HTTP request we received is in a valid format and return the file requested.
+ * It points inside req, which is modified. keepAlive is cleared if the client asked to
+ * close the connection after the response */
+char *parseRequest(char *req, int *keepAlive) {
 	char *reqsaveptr; // Used in strtok_r to split request in headers
 	char *headersaveptr; // Used in strtok_r to get header name field and value
 
@@ -53,6 +56,7 @@ char *parseRequest(char *req) {
 
 	// Check if every field is followed by \r\n and includes a ":"
 	// and if there is a Host header included in the request
+	*keepAlive = 1; // Default for HTTP/1.1
 	int foundHost = 0;
 	char *header;
 	while ((header = strtok_r(NULL, "\n", &reqsaveptr)) != NULL) {
@@ -78,16 +82,21 @@ char *parseRequest(char *req) {
 			if (value == NULL) {
 				return NULL;
 			}
+		} else if (strcasecmp(field, "Connection") == 0) {
+			char *value = strtok_r(NULL, "\r\n", &headersaveptr);
+			if (value != NULL) {
+				value += strspn(value, " \t");
+				if (strncasecmp(value, "close", 5) == 0) {
+					*keepAlive = 0;
+				}
+			}
 		}
 	}
 	if (!foundHost) {
 		return NULL;
 	}
 
-
-	char *filename = malloc((strlen(reqFile) + 1) * sizeof(char));
-	strcpy(filename, reqFile);
-	return filename;
+	return reqFile;
 }
 
 
@@ -111,67 +120,45 @@ char *createRequestHeaders(char *host, char *filename) {
 }
 
 
-char *createResponseHeaders(int code, int length) {
-	char *headers = NULL;
-	int size = 0;
-
-	char *date = createTimeStamp();
-	size += strlen(date) + strlen("Date: ") + 2;
-	char *server = "Server: myhttpd/654.0.3\r\n";
-	size += strlen(server);
-	char contentLength[16];
-	sprintf(contentLength, "Content-Length: %d\r\n", length);
-	size += strlen(contentLength);
-	char *contentType = "Content-Type: text/html\r\n";
-	size += strlen(contentType);
-	char *connection = "Connection: Closed\r\n";
-	size += strlen(connection);
+/* Write the headers of a response in buf. Returns their length, or -1 if
+ * the code is unknown or they don't fit (RESPONSE_HEADER_SIZE always fits) */
+int createResponseHeaders(char *buf, int size, int code, long long length, int keepAlive) {
 	char *info = NULL;
-
 	if (code == CODE_OK) {
-		info = "HTTP/1.1 200 OK\r\n";
+		info = "HTTP/1.1 200 OK";
 	} else if (code == CODE_NOT_FOUND) {
-		info = "HTTP/1.1 404 Not Found\r\n";
+		info = "HTTP/1.1 404 Not Found";
 	} else if (code == CODE_FORBIDDEN) {
-		info = "HTTP/1.1 403 Forbidden\r\n";
+		info = "HTTP/1.1 403 Forbidden";
 	} else if (code == CODE_BAD) {
-		info = "HTTP/1.1 400 Bad Request\r\n";
+		info = "HTTP/1.1 400 Bad Request";
+	} else if (code == CODE_TOO_MANY) {
+		info = "HTTP/1.1 429 Too Many Requests";
+	} else if (code == CODE_UNAVAILABLE) {
+		info = "HTTP/1.1 503 Service Unavailable";
 	} else {
-		free(date);
-		return NULL;
+		return -1;
 	}
 
-	size += strlen(info) + 2 + 1; // Include ending \r\n
-	headers = malloc(size * sizeof(char));
-	if (headers == NULL) {
-		perror("malloc");
-		free(date);
-		return NULL;
+	char date[BUF_SIZE];
+	createTimeStamp(date, BUF_SIZE);
+	int len = snprintf(buf, size, "%s\r\nDate: %s\r\nServer: myhttpd/654.0.3\r\nContent-Length: %lld\r\n"
+			"Content-Type: text/html\r\nConnection: %s\r\n\r\n",
+			info, date, length, keepAlive ? "keep-alive" : "close");
+	if (len >= size) {
+		return -1;
 	}
-	strcpy(headers, info);
-	strcat(headers, "Date: ");
-	strcat(headers, date);
-	strcat(headers, "\r\n");
-	strcat(headers, server);
-	strcat(headers, contentLength);
-	strcat(headers, contentType);
-	strcat(headers, connection);
-	strcat(headers, "\r\n");
-
-	free(date);
-	return headers;
+	return len;
 }
 
 
 /* Create a timestamp for the HTTP Date header
  * https://stackoverflow.com/questions/7548759/generate-a-date-string-in-http-response-date-format-in-c */
-char *createTimeStamp(void) {
-	char *buf = malloc(BUF_SIZE * sizeof(char));
+void createTimeStamp(char *buf, int size) {
 	time_t curr = time(NULL);
 	struct tm curr_tm;
 	// gmtime is not thread safe
 	// gmtime_r should be thread safe
 	gmtime_r(&curr, &curr_tm);
-	strftime(buf, BUF_SIZE, "%a, %d %b %Y %H:%M:%S %Z", &curr_tm);
-	return buf;
+	strftime(buf, size, "%a, %d %b %Y %H:%M:%S %Z", &curr_tm);
 }
@@ -1,13 +1,17 @@
 #ifndef REQUESTS_H
 #define REQUESTS_H
 
-#define CODE_OK        200
-#define CODE_NOT_FOUND 404
-#define CODE_FORBIDDEN 403
-#define CODE_BAD       400
+#define CODE_OK          200
+#define CODE_NOT_FOUND   404
+#define CODE_FORBIDDEN   403
+#define CODE_BAD         400
+#define CODE_TOO_MANY    429
+#define CODE_UNAVAILABLE 503
 
-char *parseRequest(char *);
+#define RESPONSE_HEADER_SIZE 256
+
+char *parseRequest(char *, int *);
 char *createRequestHeaders(char *, char *);
-char *createResponseHeaders(int, int);
+int createResponseHeaders(char *, int, int, long long, int);
 
 #endif // REQUESTS_H
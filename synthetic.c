@@ -0,0 +1,379 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "synthetic.h"
+#include "util.h"
+
+#define SALT_NUMBERS  0
+#define SALT_INTERNAL 1
+#define SALT_EXTERNAL 2
+#define SALT_ORDER    3
+#define SALT_START    4
+#define SALT_LINES    5
+
+static char header[] = "<!DOCTYPE html>\n<html>\n   <body>\n";
+static char footer[] = "   </body>\n</html>\n";
+
+// Generated bytes are gathered in the caller's buffer and flushed when it fills up
+typedef struct output {
+	char *buf;
+	int size;
+	int used;
+	int (*flush)(void *, char *, int);
+	void *arg;
+} Output;
+
+static unsigned long long randomValue(unsigned long long, long long, long long, int);
+static long long gcd(long long, long long);
+static void permInit(Permutation *, long long, unsigned long long);
+static long long permValue(Permutation *, long long);
+static long long permIndex(Permutation *, long long);
+static int pageNumber(Synthetic *, int, int);
+static int formatLink(Synthetic *, SynthPage *, int, char *);
+static int emit(Output *, char *, long long);
+
+
+/* Load the text file and compute the link counts like webcreator.sh.
+ * Lines are stored already formatted as they appear in the pages */
+int synthInit(Synthetic *syn, char *textFile, unsigned long long seed, int sites, int pages) {
+	if (sites <= 0 || pages <= 0 || pages > SYNTH_MAX_PAGES) {
+		fprintf(stderr, "[-] Synthetic websites need at least 1 site and 1 to %d pages per site\n", SYNTH_MAX_PAGES);
+		return -1;
+	}
+
+	FILE *fp = fopen(textFile, "r");
+	if (fp == NULL) {
+		perror("fopen");
+		return -1;
+	}
+	fseek(fp, 0, SEEK_END);
+	long fileSize = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	char *contents = malloc((fileSize + 1) * sizeof(char));
+	if (contents == NULL) {
+		perror("malloc");
+		fclose(fp);
+		return -1;
+	}
+	fileSize = fread(contents, sizeof(char), fileSize, fp);
+	contents[fileSize] = '\0';
+	fclose(fp);
+
+	// Only complete lines are counted (as wc -l does)
+	int lineCount = 0;
+	long i;
+	for (i = 0; i < fileSize; i++) {
+		if (contents[i] == '\n') {
+			lineCount++;
+		}
+	}
+	if (lineCount < SYNTH_MIN_LINES) {
+		fprintf(stderr, "[-] Invalid text file %s: less than %d lines\n", textFile, SYNTH_MIN_LINES);
+		free(contents);
+		return -1;
+	}
+
+	// Every line gets "   " in front and "<br>\n" after it
+	syn->text = malloc((fileSize + lineCount * 8) * sizeof(char));
+	syn->lineStart = malloc((lineCount + 1) * sizeof(long long));
+	if (syn->text == NULL || syn->lineStart == NULL) {
+		perror("malloc");
+		free(syn->text);
+		free(syn->lineStart);
+		free(contents);
+		return -1;
+	}
+
+	long long pos = 0;
+	char *line = contents;
+	int l;
+	for (l = 0; l < lineCount; l++) {
+		char *end = strchr(line, '\n');
+		char *next = end + 1;
+
+		// read strips the surrounding blanks, tr removes every '\r'
+		while (line < end && (*line == ' ' || *line == '\t')) {
+			line++;
+		}
+		while (end > line && (end[-1] == ' ' || end[-1] == '\t')) {
+			end--;
+		}
+
+		syn->lineStart[l] = pos;
+		memcpy(syn->text + pos, "   ", 3);
+		pos += 3;
+		for (; line < end; line++) {
+			if (*line != '\r') {
+				syn->text[pos++] = *line;
+			}
+		}
+		memcpy(syn->text + pos, "<br>\n", 5);
+		pos += 5;
+
+		line = next;
+	}
+	syn->lineStart[lineCount] = pos;
+	free(contents);
+
+	syn->seed = seed;
+	syn->sites = sites;
+	syn->pages = pages;
+	syn->lineCount = lineCount;
+	syn->internalLinks = pages / 2 + 1;
+	syn->externalLinks = 0;
+	if (sites > 1) {
+		if (sites == 2 && pages == 1) {
+			syn->externalLinks = 1;
+		} else {
+			syn->externalLinks = sites / 2 + 1;
+		}
+	}
+	return 0;
+}
+
+
+/* Find the page a path like /site<i>/page<i>_<n>.html refers to.
+ * Returns -1 if it isn't part of the website */
+int synthFind(Synthetic *syn, char *path, SynthPage *page) {
+	int site;
+	int number;
+	if (sscanf(path, "/site%d/page%*d_%d.html", &site, &number) != 2) {
+		return -1;
+	}
+	if (site < 0 || site >= syn->sites || number < 1 || number > SYNTH_MAX_PAGES) {
+		return -1;
+	}
+
+	// Reject every other spelling of the same numbers (leading zeros etc.)
+	char canonical[SYNTH_LINK_LEN];
+	snprintf(canonical, SYNTH_LINK_LEN, "/site%d/page%d_%d.html", site, site, number);
+	if (strcmp(path, canonical) != 0) {
+		return -1;
+	}
+
+	// Only the first pages values of the site's permutation are used
+	Permutation numbers;
+	permInit(&numbers, SYNTH_MAX_PAGES, randomValue(syn->seed, site, -1, SALT_NUMBERS));
+	long long index = permIndex(&numbers, number - 1);
+	if (index >= syn->pages) {
+		return -1;
+	}
+
+	page->site = site;
+	page->index = index;
+	page->number = number;
+
+	// 1 < k < #lines - 2000 and 1000 < m < 2000
+	page->firstLine = 2 + randomValue(syn->seed, site, index, SALT_START) % (syn->lineCount - 2000);
+	page->lineCount = 1001 + randomValue(syn->seed, site, index, SALT_LINES) % 999;
+
+	permInit(&(page->internal), syn->pages, randomValue(syn->seed, site, index, SALT_INTERNAL));
+	permInit(&(page->external), (long long) (syn->sites - 1) * syn->pages,
+			randomValue(syn->seed, site, index, SALT_EXTERNAL));
+	permInit(&(page->order), syn->internalLinks + syn->externalLinks,
+			randomValue(syn->seed, site, index, SALT_ORDER));
+	page->selfPos = permIndex(&(page->internal), index);
+	return 0;
+}
+
+
+/* Size of the generated page, used for the Content-Length header */
+long long synthLength(Synthetic *syn, SynthPage *page) {
+	int linkCount = syn->internalLinks + syn->externalLinks;
+	int perSegment = (page->lineCount + linkCount - 1) / linkCount;
+	long long length = strlen(header) + strlen(footer);
+
+	// Text lines are contiguous, followed by one link per segment
+	int first = page->firstLine - 1;
+	length += syn->lineStart[first + page->lineCount] - syn->lineStart[first];
+	int segments = (page->lineCount + perSegment - 1) / perSegment;
+
+	char link[2 * SYNTH_LINK_LEN];
+	int c;
+	for (c = 0; c < segments; c++) {
+		length += formatLink(syn, page, c, link);
+	}
+	return length;
+}
+
+
+/* Generate the page into buf, calling flush with arg every time buf fills up
+ * and at the end. Returns -1 if flush fails */
+int synthGenerate(Synthetic *syn, SynthPage *page, char *buf, int bufSize,
+		int (*flush)(void *, char *, int), void *arg) {
+	Output out;
+	out.buf = buf;
+	out.size = bufSize;
+	out.used = 0;
+	out.flush = flush;
+	out.arg = arg;
+
+	int linkCount = syn->internalLinks + syn->externalLinks;
+	int perSegment = (page->lineCount + linkCount - 1) / linkCount;
+
+	if (emit(&out, header, strlen(header)) < 0) {
+		return -1;
+	}
+
+	int remaining = page->lineCount;
+	int line = page->firstLine - 1;
+	char link[2 * SYNTH_LINK_LEN];
+	int c = 0;
+	while (remaining > 0) {
+		int count = remaining < perSegment ? remaining : perSegment;
+		char *text = syn->text + syn->lineStart[line];
+		if (emit(&out, text, syn->lineStart[line + count] - syn->lineStart[line]) < 0) {
+			return -1;
+		}
+
+		// Add a link after the text segment
+		int len = formatLink(syn, page, c, link);
+		if (emit(&out, link, len) < 0) {
+			return -1;
+		}
+
+		c++;
+		line += count;
+		remaining -= count;
+	}
+
+	if (emit(&out, footer, strlen(footer)) < 0) {
+		return -1;
+	}
+	if (out.used > 0 && flush(arg, out.buf, out.used) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+
+void synthDestroy(Synthetic *syn) {
+	free(syn->text);
+	free(syn->lineStart);
+}
+
+
+/* Write the HTML of the link at position c of the page and return its length */
+int formatLink(Synthetic *syn, SynthPage *page, int c, char *buf) {
+	char target[SYNTH_LINK_LEN];
+	long long l = permValue(&(page->order), c);
+
+	if (l < syn->internalLinks) {
+		// The page links to itself only when every page of the site is linked
+		long long index;
+		if (syn->internalLinks == syn->pages) {
+			index = permValue(&(page->internal), l);
+		} else {
+			index = permValue(&(page->internal), l < page->selfPos ? l : l + 1);
+		}
+		snprintf(target, SYNTH_LINK_LEN, "page%d_%d.html", page->site, pageNumber(syn, page->site, index));
+	} else {
+		// Pages of the other sites, skipping the current one
+		long long ext = permValue(&(page->external), l - syn->internalLinks);
+		int site = ext / syn->pages;
+		if (site >= page->site) {
+			site++;
+		}
+		int index = ext % syn->pages;
+		snprintf(target, SYNTH_LINK_LEN, "/site%d/page%d_%d.html", site, site, pageNumber(syn, site, index));
+	}
+
+	return sprintf(buf, "   <a href=\"%s\">link_%d</a><br>\n", target, c);
+}
+
+
+/* Number in the name of the page at the given position of a site */
+int pageNumber(Synthetic *syn, int site, int index) {
+	Permutation numbers;
+	permInit(&numbers, SYNTH_MAX_PAGES, randomValue(syn->seed, site, -1, SALT_NUMBERS));
+	return permValue(&numbers, index) + 1;
+}
+
+
+int emit(Output *out, char *data, long long len) {
+	while (len > 0) {
+		int space = out->size - out->used;
+		int count = len < space ? len : space;
+		memcpy(out->buf + out->used, data, count);
+		out->used += count;
+		data += count;
+		len -= count;
+
+		if (out->used == out->size) {
+			if (out->flush(out->arg, out->buf, out->used) < 0) {
+				return -1;
+			}
+			out->used = 0;
+		}
+	}
+	return 0;
+}
+
+
+void permInit(Permutation *perm, long long size, unsigned long long random) {
+	perm->size = size;
+	perm->mult = 1;
+	perm->add = 0;
+	if (size <= 1) {
+		return;
+	}
+
+	perm->mult = 1 + random % (size - 1);
+	while (gcd(perm->mult, size) != 1) {
+		perm->mult = perm->mult % (size - 1) + 1;
+	}
+	perm->add = (random >> 32) % size;
+}
+
+
+long long permValue(Permutation *perm, long long i) {
+	if (perm->size <= 1) {
+		return 0;
+	}
+	return ((unsigned __int128) perm->mult * i + perm->add) % perm->size;
+}
+
+
+/* Position at which the permutation gives value (extended Euclid for the inverse of mult) */
+long long permIndex(Permutation *perm, long long value) {
+	if (perm->size <= 1) {
+		return 0;
+	}
+
+	long long r0 = perm->size, r1 = perm->mult;
+	long long t0 = 0, t1 = 1;
+	while (r1 != 0) {
+		long long q = r0 / r1;
+		long long tmp = r0 - q * r1;
+		r0 = r1;
+		r1 = tmp;
+		tmp = t0 - q * t1;
+		t0 = t1;
+		t1 = tmp;
+	}
+	long long inverse = t0 < 0 ? t0 + perm->size : t0;
+
+	long long diff = (value - perm->add) % perm->size;
+	if (diff < 0) {
+		diff += perm->size;
+	}
+	return ((unsigned __int128) diff * inverse) % perm->size;
+}
+
+
+long long gcd(long long a, long long b) {
+	while (b != 0) {
+		long long tmp = a % b;
+		a = b;
+		b = tmp;
+	}
+	return a;
+}
+
+
+/* Same seed and inputs always give the same value */
+unsigned long long randomValue(unsigned long long seed, long long a, long long b, int salt) {
+	return mixHash(seed ^ mixHash(a ^ mixHash(b ^ mixHash(salt))));
+}
+
@@ -0,0 +1,50 @@
+#ifndef SYNTHETIC_H
+#define SYNTHETIC_H
+
+#define SYNTH_MAX_PAGES  99999 // Page numbers are between 1 and 99999 like webcreator.sh
+#define SYNTH_MIN_LINES  10000 // Text files must be at least as long as webcreator.sh requires
+#define SYNTH_LINK_LEN   64
+
+/* Random permutation of 0 .. size-1 as an affine map i -> (mult * i + add) % size.
+ * The first n values are n distinct numbers, so no memory is needed to pick them */
+typedef struct permutation {
+	long long size;
+	long long mult; // Coprime with size
+	long long add;
+} Permutation;
+
+/* Website of sites * pages pages with the names and links webcreator.sh would
+ * create. Pages are generated when requested, only the text file is kept in memory */
+typedef struct synthetic {
+	unsigned long long seed;
+	int sites;
+	int pages;
+	int internalLinks; // f in webcreator.sh
+	int externalLinks; // q in webcreator.sh
+
+	char *text; // Lines of the text file as written in the pages
+	long long *lineStart; // lineStart[i] .. lineStart[i+1] is line i (0 based)
+	int lineCount;
+} Synthetic;
+
+/* A page of the website and the random choices used to generate it */
+typedef struct synthPage {
+	int site;
+	int index; // Position of the page in its site
+	int number; // Number in the page's name
+	int firstLine; // k in webcreator.sh (1 based)
+	int lineCount; // m in webcreator.sh
+	long long selfPos; // Position of the page in its internal permutation
+	Permutation internal;
+	Permutation external;
+	Permutation order; // Order of the links in the page
+} SynthPage;
+
+
+int synthInit(Synthetic *, char *, unsigned long long, int, int);
+int synthFind(Synthetic *, char *, SynthPage *);
+long long synthLength(Synthetic *, SynthPage *);
+int synthGenerate(Synthetic *, SynthPage *, char *, int, int (*)(void *, char *, int), void *);
+void synthDestroy(Synthetic *);
+
+#endif // SYNTHETIC_H
@@ -0,0 +1,151 @@
+#include <stdlib.h>
+#include "timer_wheel.h"
+
+#define SLOT_MASK (WHEEL_SLOTS - 1)
+
+static void unlinkTimer(Timer *);
+
+
+void wheelInit(TimerWheel *wheel, long long nowMs) {
+	int i;
+	for (i = 0; i < WHEEL_SLOTS; i++) {
+		wheel->slots[i].prev = &(wheel->slots[i]);
+		wheel->slots[i].next = &(wheel->slots[i]);
+		wheel->slots[i].expires = -1;
+	}
+	wheel->currTick = nowMs / WHEEL_TICK_MS;
+	wheel->count = 0;
+}
+
+
+void timerInit(Timer *timer, int kind, void *data) {
+	timer->expires = -1;
+	timer->kind = kind;
+	timer->data = data;
+	timer->prev = NULL;
+	timer->next = NULL;
+}
+
+
+int timerPending(Timer *timer) {
+	return timer->prev != NULL;
+}
+
+
+/* Schedule a timer to expire delayMs milliseconds after nowMs.
+ * If the timer is already scheduled it is moved to its new slot. */
+void wheelAdd(TimerWheel *wheel, Timer *timer, long long nowMs, int delayMs) {
+	if (timerPending(timer)) {
+		wheelCancel(wheel, timer);
+	}
+
+	// Round up so that a timer never expires early
+	long long expires = (nowMs + delayMs + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+	if (expires <= wheel->currTick) {
+		expires = wheel->currTick + 1;
+	}
+	timer->expires = expires;
+
+	// Insert at the end of the slot's list
+	Timer *head = &(wheel->slots[expires & SLOT_MASK]);
+	timer->next = head;
+	timer->prev = head->prev;
+	head->prev->next = timer;
+	head->prev = timer;
+
+	(wheel->count)++;
+}
+
+
+void wheelCancel(TimerWheel *wheel, Timer *timer) {
+	if (!timerPending(timer)) {
+		return;
+	}
+	unlinkTimer(timer);
+	(wheel->count)--;
+}
+
+
+/* Move the wheel forward to nowMs and return the list of expired timers
+ * linked through their next pointers (NULL if nothing expired) */
+Timer *wheelAdvance(TimerWheel *wheel, long long nowMs) {
+	long long nowTick = nowMs / WHEEL_TICK_MS;
+	Timer *expired = NULL;
+	if (nowTick <= wheel->currTick) {
+		return NULL;
+	}
+
+	// No need to visit a slot more than once
+	long long ticks = nowTick - wheel->currTick;
+	if (ticks > WHEEL_SLOTS) {
+		ticks = WHEEL_SLOTS;
+	}
+
+	long long t;
+	for (t = nowTick - ticks + 1; t <= nowTick; t++) {
+		Timer *head = &(wheel->slots[t & SLOT_MASK]);
+		Timer *curr = head->next;
+		while (curr != head) {
+			Timer *next = curr->next;
+			// Timers more than one revolution away stay in the slot
+			if (curr->expires <= nowTick) {
+				unlinkTimer(curr);
+				(wheel->count)--;
+				curr->next = expired;
+				expired = curr;
+			}
+			curr = next;
+		}
+	}
+
+	wheel->currTick = nowTick;
+	return expired;
+}
+
+
+/* Remove every scheduled timer from the wheel and return them as a list */
+Timer *wheelExpireAll(TimerWheel *wheel) {
+	Timer *expired = NULL;
+	int i;
+	for (i = 0; i < WHEEL_SLOTS; i++) {
+		Timer *head = &(wheel->slots[i]);
+		while (head->next != head) {
+			Timer *curr = head->next;
+			unlinkTimer(curr);
+			(wheel->count)--;
+			curr->next = expired;
+			expired = curr;
+		}
+	}
+	return expired;
+}
+
+
+/* Milliseconds until the next occupied slot is due, at most maxMs */
+int wheelTimeout(TimerWheel *wheel, long long nowMs, int maxMs) {
+	if (wheel->count == 0) {
+		return maxMs;
+	}
+
+	long long t;
+	for (t = wheel->currTick + 1; t <= wheel->currTick + WHEEL_SLOTS; t++) {
+		Timer *head = &(wheel->slots[t & SLOT_MASK]);
+		if (head->next != head) {
+			long long wait = t * WHEEL_TICK_MS - nowMs;
+			if (wait < 0) {
+				return 0;
+			}
+			return wait < maxMs ? (int) wait : maxMs;
+		}
+	}
+	return maxMs;
+}
+
+
+void unlinkTimer(Timer *timer) {
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	// expires is kept so that the caller can still see when the timer was due
+	timer->prev = NULL;
+	timer->next = NULL;
+}
@@ -0,0 +1,35 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#define WHEEL_SLOTS   512 // Must be a power of 2
+#define WHEEL_TICK_MS 100 // One revolution covers 51.2 seconds
+
+typedef struct timer {
+	long long expires; // Absolute expiry tick (last one if not scheduled)
+	int kind; // Set by the caller to tell which deadline expired
+	void *data;
+
+	struct timer *prev;
+	struct timer *next;
+} Timer;
+
+/* Hashed timer wheel. Every slot is a doubly linked list of timers,
+ * so adding and cancelling a timer is O(1). Timers farther away than
+ * one revolution stay in their slot until their expiry tick is reached. */
+typedef struct timerWheel {
+	Timer slots[WHEEL_SLOTS]; // Sentinel node of each slot
+	long long currTick;
+	int count;
+} TimerWheel;
+
+
+void wheelInit(TimerWheel *, long long);
+void timerInit(Timer *, int, void *);
+int timerPending(Timer *);
+void wheelAdd(TimerWheel *, Timer *, long long, int);
+void wheelCancel(TimerWheel *, Timer *);
+Timer *wheelAdvance(TimerWheel *, long long);
+Timer *wheelExpireAll(TimerWheel *);
+int wheelTimeout(TimerWheel *, long long, int);
+
+#endif // TIMER_WHEEL_H
@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h> // kill
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h> // mmap
+#include "trace.h"
+
+#define RING_MASK  (TRACE_RING_EVENTS - 1)
+#define EVENT_JSON 160 // Longest event in the dump
+
+static char *stageNames[] = {"accept", "header read", "parse", "enqueue", "queue wait", "open", "send", "close"};
+
+// Ring of the calling thread (NULL if it doesn't trace)
+static __thread TraceRing *myRing = NULL;
+
+static int appendEvent(char *, int, int, TraceEvent *);
+static unsigned int mix(unsigned int);
+
+
+/* The table is placed in shared memory, so that processes forked
+ * after its creation record their events where the master can read them */
+TraceTable *traceCreate(void) {
+	TraceTable *table = mmap(NULL, sizeof(TraceTable), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (table == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+	// Anonymous mappings are zero-filled, every ring starts free
+	table->sampleRate = DEFAULT_TRACE_RATE;
+	return table;
+}
+
+
+/* Give the calling thread a ring. Rings of processes that no longer exist
+ * are reused. The thread doesn't trace if every ring is taken */
+void traceThread(TraceTable *table, char *name) {
+	int pid = getpid();
+	int i;
+	for (i = 0; i < MAX_TRACE_RINGS; i++) {
+		TraceRing *ring = &(table->rings[i]);
+		int owner = __atomic_load_n(&(ring->pid), __ATOMIC_ACQUIRE);
+		if (owner != 0 && (kill(owner, 0) == 0 || errno != ESRCH)) {
+			continue;
+		}
+		if (__atomic_compare_exchange_n(&(ring->pid), &owner, pid, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			snprintf(ring->name, TRACE_NAME_LEN, "%s", name);
+			__atomic_store_n(&(ring->head), 0, __ATOMIC_RELEASE);
+			myRing = ring;
+			return;
+		}
+	}
+}
+
+
+/* Free the ring of a thread that exits */
+void traceThreadExit(void) {
+	if (myRing != NULL) {
+		__atomic_store_n(&(myRing->pid), 0, __ATOMIC_RELEASE);
+		myRing = NULL;
+	}
+}
+
+
+/* Id of a new request if it is sampled, 0 if it isn't traced. Ids are
+ * hashed so that a regular pattern of requests can't always miss the sample */
+unsigned int traceSample(TraceTable *table) {
+	int rate = __atomic_load_n(&(table->sampleRate), __ATOMIC_RELAXED);
+	if (rate <= 0) {
+		return 0;
+	}
+	unsigned int id = __atomic_add_fetch(&(table->nextRequest), 1, __ATOMIC_RELAXED);
+	if (mix(id) % rate != 0) {
+		return 0;
+	}
+	return id;
+}
+
+
+long long traceNow(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+
+/* Record that a traced request spent the time from start until now in stage */
+void traceSpan(unsigned int request, int stage, long long start) {
+	if (request == 0 || myRing == NULL) {
+		return;
+	}
+	unsigned long long head = myRing->head;
+	TraceEvent *event = &(myRing->events[head & RING_MASK]);
+	event->start = start;
+	event->duration = traceNow() - start;
+	event->request = request;
+	event->stage = stage;
+	__atomic_store_n(&(myRing->head), head + 1, __ATOMIC_RELEASE);
+}
+
+
+/* Chrome trace_event JSON of the events of the last seconds, with the
+ * names of the threads. Returns a buffer to be freed by the caller */
+char *traceDump(TraceTable *table, int seconds, int *length) {
+	long long since = traceNow() - seconds * 1000000LL;
+	int size = 4096;
+	// Only the rings counted in the size are dumped, even if
+	// threads claim other ones meanwhile
+	char counted[MAX_TRACE_RINGS];
+	int i;
+	for (i = 0; i < MAX_TRACE_RINGS; i++) {
+		counted[i] = __atomic_load_n(&(table->rings[i].pid), __ATOMIC_ACQUIRE) != 0;
+		if (counted[i]) {
+			size += (TRACE_RING_EVENTS + 1) * EVENT_JSON;
+		}
+	}
+	char *buf = malloc(size * sizeof(char));
+	if (buf == NULL) {
+		perror("malloc");
+		return NULL;
+	}
+
+	int offset = sprintf(buf, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	int first = 1;
+	for (i = 0; i < MAX_TRACE_RINGS; i++) {
+		TraceRing *ring = &(table->rings[i]);
+		int pid = __atomic_load_n(&(ring->pid), __ATOMIC_ACQUIRE);
+		if (!counted[i] || pid == 0) {
+			continue;
+		}
+
+		offset += sprintf(buf + offset, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%.*s\"}}",
+				first ? "" : ",", pid, i, TRACE_NAME_LEN, ring->name);
+		first = 0;
+
+		// Copy the events, then drop the ones the thread overwrote meanwhile
+		unsigned long long head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+		unsigned long long count = head < TRACE_RING_EVENTS ? head : TRACE_RING_EVENTS;
+		TraceEvent *events = malloc(count * sizeof(TraceEvent) + 1);
+		if (events == NULL) {
+			continue;
+		}
+		unsigned long long j;
+		for (j = 0; j < count; j++) {
+			events[j] = ring->events[(head - count + j) & RING_MASK];
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		unsigned long long newHead = __atomic_load_n(&(ring->head), __ATOMIC_RELAXED);
+		unsigned long long skip = newHead - head;
+
+		for (j = skip; j < count; j++) {
+			if (events[j].start >= since) {
+				offset += appendEvent(buf + offset, pid, i, &events[j]);
+			}
+		}
+		free(events);
+	}
+	offset += sprintf(buf + offset, "]}\n");
+
+	*length = offset;
+	return buf;
+}
+
+
+void traceDestroy(TraceTable *table) {
+	munmap(table, sizeof(TraceTable));
+}
+
+
+/* Complete ("X") event: stage name, start and duration in microseconds */
+int appendEvent(char *buf, int pid, int tid, TraceEvent *event) {
+	char *name = "unknown";
+	if (event->stage >= 0 && event->stage < (int) (sizeof(stageNames) / sizeof(char *))) {
+		name = stageNames[event->stage];
+	}
+	return sprintf(buf, ",{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%d,\"pid\":%d,\"tid\":%d,\"args\":{\"request\":%u}}",
+			name, event->start, event->duration, pid, tid, event->request);
+}
+
+
+/* murmur3 finalizer */
+unsigned int mix(unsigned int x) {
+	x ^= x >> 16;
+	x *= 0x85ebca6bU;
+	x ^= x >> 13;
+	x *= 0xc2b2ae35U;
+	return x ^ (x >> 16);
+}
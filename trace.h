@@ -0,0 +1,54 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#define MAX_TRACE_RINGS    128
+#define TRACE_RING_EVENTS  2048 // Must be a power of 2
+#define TRACE_NAME_LEN     24
+#define DEFAULT_TRACE_RATE 64 // One request in 64 is traced
+
+// Stages of a request
+#define STAGE_ACCEPT  0
+#define STAGE_HEADERS 1
+#define STAGE_PARSE   2
+#define STAGE_ENQUEUE 3
+#define STAGE_QUEUED  4
+#define STAGE_OPEN    5
+#define STAGE_SEND    6
+#define STAGE_CLOSE   7
+
+/* Time a request spent in one stage */
+typedef struct traceEvent {
+	long long start; // Microseconds (CLOCK_MONOTONIC)
+	int duration;
+	unsigned int request;
+	int stage;
+} TraceEvent;
+
+/* Events of one thread. Only its thread writes it; head is increased after
+ * an event is written, so readers know which events are complete */
+typedef struct traceRing {
+	int pid; // Owner process, 0 if the ring is free
+	char name[TRACE_NAME_LEN];
+	unsigned long long head;
+	TraceEvent events[TRACE_RING_EVENTS];
+} TraceRing;
+
+/* Rings of every thread of every process. The table is in shared memory,
+ * so that the master can dump the events of the prefork children */
+typedef struct traceTable {
+	int sampleRate; // 1 request in sampleRate is traced, 0 to disable tracing
+	unsigned int nextRequest;
+	TraceRing rings[MAX_TRACE_RINGS];
+} TraceTable;
+
+
+TraceTable *traceCreate(void);
+void traceThread(TraceTable *, char *);
+void traceThreadExit(void);
+unsigned int traceSample(TraceTable *);
+long long traceNow(void);
+void traceSpan(unsigned int, int, long long);
+char *traceDump(TraceTable *, int, int *);
+void traceDestroy(TraceTable *);
+
+#endif // TRACE_H
@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h> // TCP_NODELAY, TCP_DEFER_ACCEPT, TCP_FASTOPEN
+#include "tuning.h"
+
+#define LINE_SIZE 256
+
+static int setOption(Tuning *, char *, char *);
+static void setInt(int, int, int, char *, int);
+static int getInt(int, int, int);
+static int readSomaxconn(void);
+
+
+void tuningDefaults(Tuning *tuning) {
+	memset(tuning, 0, sizeof(Tuning));
+	tuning->backlog = DEFAULT_BACKLOG;
+}
+
+
+/* Set the options of a comma separated list of name=value pairs.
+ * Names: backlog, nodelay, defer_accept, fastopen, rcvbuf, sndbuf, busy_poll */
+int tuningParse(Tuning *tuning, char *options) {
+	char *copy = strdup(options);
+	if (copy == NULL) {
+		perror("strdup");
+		return -1;
+	}
+
+	char *savePtr;
+	char *option;
+	for (option = strtok_r(copy, ", \t\r\n", &savePtr); option != NULL; option = strtok_r(NULL, ", \t\r\n", &savePtr)) {
+		char *value = strchr(option, '=');
+		if (value == NULL) {
+			fprintf(stderr, "[-] Invalid socket option %s\n", option);
+			free(copy);
+			return -1;
+		}
+		*value = '\0';
+		if (setOption(tuning, option, value + 1) < 0) {
+			free(copy);
+			return -1;
+		}
+	}
+
+	free(copy);
+	return 0;
+}
+
+
+/* Set the options of a file with one name=value pair per line.
+ * Empty lines and lines starting with '#' are ignored */
+int tuningLoad(Tuning *tuning, char *filename) {
+	FILE *fp = fopen(filename, "r");
+	if (fp == NULL) {
+		perror("fopen");
+		return -1;
+	}
+
+	char line[LINE_SIZE];
+	while (fgets(line, LINE_SIZE, fp) != NULL) {
+		char *start = line + strspn(line, " \t\r\n");
+		if (*start == '\0' || *start == '#') {
+			continue;
+		}
+		if (tuningParse(tuning, start) < 0) {
+			fclose(fp);
+			return -1;
+		}
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+
+/* Apply the options to the listening socket before listen() is called.
+ * Accepted sockets inherit the buffer sizes and busy polling from it.
+ * Options the kernel refuses are reported and left to their defaults */
+void tuningApplyListener(Tuning *tuning, int sock) {
+	if (tuning->rcvBuf > 0) {
+		setInt(sock, SOL_SOCKET, SO_RCVBUF, "SO_RCVBUF", tuning->rcvBuf);
+	}
+	if (tuning->sndBuf > 0) {
+		setInt(sock, SOL_SOCKET, SO_SNDBUF, "SO_SNDBUF", tuning->sndBuf);
+	}
+	if (tuning->busyPoll > 0) {
+		setInt(sock, SOL_SOCKET, SO_BUSY_POLL, "SO_BUSY_POLL", tuning->busyPoll);
+	}
+	if (tuning->noDelay) {
+		setInt(sock, IPPROTO_TCP, TCP_NODELAY, "TCP_NODELAY", 1);
+	}
+	if (tuning->deferAccept > 0) {
+		setInt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, "TCP_DEFER_ACCEPT", tuning->deferAccept);
+	}
+	if (tuning->fastOpen > 0) {
+		setInt(sock, IPPROTO_TCP, TCP_FASTOPEN, "TCP_FASTOPEN", tuning->fastOpen);
+	}
+}
+
+
+/* Apply the options that are set on every accepted socket */
+void tuningApplyClient(Tuning *tuning, int sock) {
+	if (tuning->noDelay) {
+		int on = 1;
+		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	}
+}
+
+
+/* Write the values the kernel uses for the listening socket in buf.
+ * Returns the length written */
+int tuningReport(Tuning *tuning, int sock, char *buf, int size) {
+	// listen() silently caps the backlog
+	int backlog = tuning->backlog;
+	int somaxconn = readSomaxconn();
+	if (somaxconn > 0 && backlog > somaxconn) {
+		backlog = somaxconn;
+	}
+
+	return snprintf(buf, size, "Sockets: backlog %d, nodelay %s, defer accept %ds, fastopen %d, rcvbuf %d, sndbuf %d, busy poll %dus\n",
+			backlog, getInt(sock, IPPROTO_TCP, TCP_NODELAY) > 0 ? "on" : "off",
+			getInt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT), getInt(sock, IPPROTO_TCP, TCP_FASTOPEN),
+			getInt(sock, SOL_SOCKET, SO_RCVBUF), getInt(sock, SOL_SOCKET, SO_SNDBUF),
+			getInt(sock, SOL_SOCKET, SO_BUSY_POLL));
+}
+
+
+int setOption(Tuning *tuning, char *name, char *value) {
+	char *end;
+	long number = strtol(value, &end, 10);
+	if (*value == '\0' || *end != '\0' || number < 0 || number > 1 << 30) {
+		fprintf(stderr, "[-] Invalid value %s for socket option %s\n", value, name);
+		return -1;
+	}
+
+	if (strcmp(name, "backlog") == 0 && number > 0) {
+		tuning->backlog = number;
+	} else if (strcmp(name, "nodelay") == 0 && number <= 1) {
+		tuning->noDelay = number;
+	} else if (strcmp(name, "defer_accept") == 0) {
+		tuning->deferAccept = number;
+	} else if (strcmp(name, "fastopen") == 0) {
+		tuning->fastOpen = number;
+	} else if (strcmp(name, "rcvbuf") == 0) {
+		tuning->rcvBuf = number;
+	} else if (strcmp(name, "sndbuf") == 0) {
+		tuning->sndBuf = number;
+	} else if (strcmp(name, "busy_poll") == 0) {
+		tuning->busyPoll = number;
+	} else {
+		fprintf(stderr, "[-] Invalid socket option %s=%s\n", name, value);
+		return -1;
+	}
+	return 0;
+}
+
+
+void setInt(int sock, int level, int option, char *name, int value) {
+	if (setsockopt(sock, level, option, &value, sizeof(value)) < 0) {
+		fprintf(stderr, "[!] Could not set %s: ", name);
+		perror("setsockopt");
+	}
+}
+
+
+/* Value of a socket option, -1 if it can't be read */
+int getInt(int sock, int level, int option) {
+	int value = 0;
+	socklen_t len = sizeof(value);
+	if (getsockopt(sock, level, option, &value, &len) < 0) {
+		return -1;
+	}
+	return value;
+}
+
+
+int readSomaxconn(void) {
+	FILE *fp = fopen("/proc/sys/net/core/somaxconn", "r");
+	if (fp == NULL) {
+		return -1;
+	}
+	int value = -1;
+	if (fscanf(fp, "%d", &value) != 1) {
+		value = -1;
+	}
+	fclose(fp);
+	return value;
+}
@@ -0,0 +1,25 @@
+#ifndef TUNING_H
+#define TUNING_H
+
+#define DEFAULT_BACKLOG 1024
+
+/* Socket options of the web listener. 0 leaves the kernel default */
+typedef struct tuning {
+	int backlog;
+	int noDelay; // TCP_NODELAY on accepted sockets
+	int deferAccept; // TCP_DEFER_ACCEPT in seconds
+	int fastOpen; // TCP_FASTOPEN queue length
+	int rcvBuf; // SO_RCVBUF in bytes
+	int sndBuf; // SO_SNDBUF in bytes
+	int busyPoll; // SO_BUSY_POLL in microseconds
+} Tuning;
+
+
+void tuningDefaults(Tuning *);
+int tuningParse(Tuning *, char *);
+int tuningLoad(Tuning *, char *);
+void tuningApplyListener(Tuning *, int);
+void tuningApplyClient(Tuning *, int);
+int tuningReport(Tuning *, int, char *, int);
+
+#endif // TUNING_H
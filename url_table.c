@@ -0,0 +1,291 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "url_table.h"
+#include "util.h"
+
+static int stripeIntern(UrlTable *, UrlStripe *, unsigned long long, char *, int, unsigned int *);
+static UrlSlot *probe(UrlTable *, UrlSlot *, unsigned long long, unsigned long long, char *);
+static int grow(UrlTable *, UrlStripe *);
+static int append(UrlTable *, UrlStripe *, char *, int, unsigned int *);
+static void dropChunk(UrlTable *, unsigned int);
+
+
+/* Allocate the table of chunks and, if indexed is set, the first slots of
+ * the index of every stripe. Returns -1 on error */
+int UT_initialize(UrlTable *table, int indexed) {
+	memset(table, 0, sizeof(UrlTable));
+	table->indexed = indexed;
+	// Only the pages of the numbers used are touched
+	table->chunks = calloc(UT_MAX_CHUNKS, sizeof(UrlChunk *));
+	if (table->chunks == NULL) {
+		perror("calloc");
+		return -1;
+	}
+
+	int i;
+	for (i = 0; i < UT_STRIPES; i++) {
+		UrlStripe *stripe = &(table->stripes[i]);
+		pthread_mutex_init(&(stripe->mtx), NULL);
+		if (!indexed) {
+			continue;
+		}
+		stripe->slots = calloc(UT_INITIAL_SLOTS, sizeof(UrlSlot));
+		if (stripe->slots == NULL) {
+			perror("calloc");
+			UT_destroy(table);
+			return -1;
+		}
+		stripe->mask = UT_INITIAL_SLOTS - 1;
+	}
+	return 0;
+}
+
+
+/* Store url and set *id to its id. With an index, a URL interned before isn't
+ * stored again and gets its id. Returns 1 if the URL is new, 0 if it isn't
+ * and -1 on error (or if it is longer than UT_MAX_URL_LEN) */
+int UT_intern(UrlTable *table, char *url, unsigned int *id) {
+	int len;
+	unsigned long long h = hashString(url, &len);
+	return UT_internHashed(table, url, h, len, id);
+}
+
+
+/* UT_intern for a URL whose hash (hashString) and length are known */
+int UT_internHashed(UrlTable *table, char *url, unsigned long long h, int len, unsigned int *id) {
+	UrlStripe *stripe = &(table->stripes[h >> (64 - UT_STRIPE_BITS)]);
+
+	pthread_mutex_lock(&(stripe->mtx));
+	int res = stripeIntern(table, stripe, h, url, len, id);
+	pthread_mutex_unlock(&(stripe->mtx));
+	return res;
+}
+
+
+/* Intern count URLs, locking each stripe once. isNew[i] is set to 1 if urls[i]
+ * is new (not also earlier in urls) and to 0 if it isn't or on error; ids[i]
+ * is set unless there was an error. Returns the number of new URLs, -1 on error */
+int UT_internBatch(UrlTable *table, char **urls, int count, unsigned int *ids, int *isNew) {
+	if (count <= 0) {
+		return 0;
+	}
+	unsigned long long *hashes = malloc(count * sizeof(unsigned long long));
+	int *lens = malloc(count * sizeof(int));
+	int *order = malloc(count * sizeof(int));
+	if (hashes == NULL || lens == NULL || order == NULL) {
+		perror("malloc");
+		free(hashes);
+		free(lens);
+		free(order);
+		return -1;
+	}
+
+	int i;
+	for (i = 0; i < count; i++) {
+		hashes[i] = hashString(urls[i], &lens[i]);
+	}
+	// Each stripe is then locked once for all of its URLs
+	int start[UT_STRIPES + 1];
+	sortByStripe(hashes, count, UT_STRIPE_BITS, order, start);
+
+	int inserted = 0;
+	int s;
+	for (s = 0; s < UT_STRIPES; s++) {
+		if (start[s] == start[s + 1]) {
+			continue;
+		}
+		UrlStripe *stripe = &(table->stripes[s]);
+		pthread_mutex_lock(&(stripe->mtx));
+		for (i = start[s]; i < start[s + 1]; i++) {
+			int k = order[i];
+			isNew[k] = stripeIntern(table, stripe, hashes[k], urls[k], lens[k], &ids[k]) == 1;
+			inserted += isNew[k];
+		}
+		pthread_mutex_unlock(&(stripe->mtx));
+	}
+
+	free(hashes);
+	free(lens);
+	free(order);
+	return inserted;
+}
+
+
+/* The URL of an id. It must not have been released */
+char *UT_get(UrlTable *table, unsigned int id) {
+	UrlChunk *chunk = table->chunks[id >> UT_OFFSET_BITS];
+	return chunk->data + (id & ((1 << UT_OFFSET_BITS) - 1)) * UT_ALIGN;
+}
+
+
+/* The URL of id won't be used anymore. Its chunk is freed once all of its
+ * URLs are released. The URLs of a table with an index are never freed */
+void UT_release(UrlTable *table, unsigned int id) {
+	if (!table->indexed) {
+		dropChunk(table, id >> UT_OFFSET_BITS);
+		__atomic_add_fetch(&(table->released), 1, __ATOMIC_RELAXED);
+	}
+}
+
+
+/* URLs stored and not released */
+long UT_size(UrlTable *table) {
+	// Read first, so that it is never more than the URLs counted after
+	long size = -__atomic_load_n(&(table->released), __ATOMIC_RELAXED);
+	int i;
+	for (i = 0; i < UT_STRIPES; i++) {
+		pthread_mutex_lock(&(table->stripes[i].mtx));
+		size += table->stripes[i].count;
+		pthread_mutex_unlock(&(table->stripes[i].mtx));
+	}
+	return size;
+}
+
+
+/* Bytes taken by the chunks and the index */
+long long UT_memory(UrlTable *table) {
+	long long bytes = (long long) __atomic_load_n(&(table->liveChunks), __ATOMIC_RELAXED) * sizeof(UrlChunk);
+	int i;
+	for (i = 0; i < UT_STRIPES; i++) {
+		pthread_mutex_lock(&(table->stripes[i].mtx));
+		if (table->stripes[i].slots != NULL) {
+			bytes += (table->stripes[i].mask + 1) * sizeof(UrlSlot);
+		}
+		pthread_mutex_unlock(&(table->stripes[i].mtx));
+	}
+	return bytes;
+}
+
+
+void UT_destroy(UrlTable *table) {
+	unsigned int i;
+	for (i = 0; i < UT_STRIPES; i++) {
+		free(table->stripes[i].slots);
+		pthread_mutex_destroy(&(table->stripes[i].mtx));
+	}
+	for (i = 0; table->chunks != NULL && i < table->chunkCount && i < UT_MAX_CHUNKS; i++) {
+		free(table->chunks[i]);
+	}
+	free(table->chunks);
+}
+
+
+/* Called with the stripe locked */
+int stripeIntern(UrlTable *table, UrlStripe *stripe, unsigned long long h, char *url, int len, unsigned int *id) {
+	if (len > UT_MAX_URL_LEN) {
+		return -1;
+	}
+
+	UrlSlot *slot = NULL;
+	if (stripe->slots != NULL) {
+		slot = probe(table, stripe->slots, stripe->mask, h, url);
+		if (slot->ref != 0) {
+			*id = slot->ref - 1;
+			return 0;
+		}
+		if ((unsigned long long) (stripe->count + 1) * 100 > (stripe->mask + 1) * UT_MAX_LOAD) {
+			if (grow(table, stripe) < 0) {
+				return -1;
+			}
+			slot = probe(table, stripe->slots, stripe->mask, h, url);
+		}
+	}
+
+	if (append(table, stripe, url, len, id) < 0) {
+		return -1;
+	}
+	if (slot != NULL) {
+		slot->tag = h;
+		slot->ref = *id + 1;
+	}
+	stripe->count++;
+	return 1;
+}
+
+
+/* Find the slot of url, or the empty slot where it would be inserted.
+ * The tags are compared first, so strcmp rarely runs for other URLs */
+UrlSlot *probe(UrlTable *table, UrlSlot *slots, unsigned long long mask, unsigned long long h, char *url) {
+	unsigned int tag = h;
+	unsigned long long i = (h >> 32) & mask;
+	while (slots[i].ref != 0) {
+		if (slots[i].tag == tag && strcmp(UT_get(table, slots[i].ref - 1), url) == 0) {
+			break;
+		}
+		i = (i + 1) & mask;
+	}
+	return &(slots[i]);
+}
+
+
+/* Double the index slots. The slots only keep part of the hash,
+ * so the hashes are computed again from the URLs */
+int grow(UrlTable *table, UrlStripe *stripe) {
+	unsigned long long size = (stripe->mask + 1) * 2;
+	UrlSlot *slots = calloc(size, sizeof(UrlSlot));
+	if (slots == NULL) {
+		perror("calloc");
+		return -1;
+	}
+
+	unsigned long long i;
+	for (i = 0; i <= stripe->mask; i++) {
+		if (stripe->slots[i].ref != 0) {
+			int len;
+			char *url = UT_get(table, stripe->slots[i].ref - 1);
+			*probe(table, slots, size - 1, hashString(url, &len), url) = stripe->slots[i];
+		}
+	}
+	free(stripe->slots);
+	stripe->slots = slots;
+	stripe->mask = size - 1;
+	return 0;
+}
+
+
+/* Called with the stripe locked. Copy url to the open chunk of the stripe,
+ * starting a new one if it doesn't fit. Returns -1 on error */
+int append(UrlTable *table, UrlStripe *stripe, char *url, int len, unsigned int *id) {
+	int size = (len + 1 + UT_ALIGN - 1) / UT_ALIGN * UT_ALIGN;
+	if (stripe->open == NULL || stripe->open->used + size > UT_CHUNK_SIZE) {
+		unsigned int index = __atomic_fetch_add(&(table->chunkCount), 1, __ATOMIC_RELAXED);
+		if (index >= UT_MAX_CHUNKS) {
+			fprintf(stderr, "[-] URL table is full\n");
+			return -1;
+		}
+		UrlChunk *chunk = malloc(sizeof(UrlChunk));
+		if (chunk == NULL) {
+			perror("malloc");
+			return -1;
+		}
+		chunk->refs = 1;
+		chunk->used = 0;
+		table->chunks[index] = chunk;
+		__atomic_add_fetch(&(table->liveChunks), 1, __ATOMIC_RELAXED);
+
+		// The previous chunk is freed once its URLs are released
+		if (stripe->open != NULL) {
+			dropChunk(table, stripe->openIndex);
+		}
+		stripe->open = chunk;
+		stripe->openIndex = index;
+	}
+
+	UrlChunk *chunk = stripe->open;
+	memcpy(chunk->data + chunk->used, url, len + 1);
+	*id = (stripe->openIndex << UT_OFFSET_BITS) | (chunk->used / UT_ALIGN);
+	chunk->used += size;
+	__atomic_add_fetch(&(chunk->refs), 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+
+void dropChunk(UrlTable *table, unsigned int index) {
+	UrlChunk *chunk = table->chunks[index];
+	if (__atomic_sub_fetch(&(chunk->refs), 1, __ATOMIC_ACQ_REL) == 0) {
+		table->chunks[index] = NULL;
+		free(chunk);
+		__atomic_sub_fetch(&(table->liveChunks), 1, __ATOMIC_RELAXED);
+	}
+}
@@ -0,0 +1,64 @@
+#ifndef URL_TABLE_H
+#define URL_TABLE_H
+
+#include <pthread.h>
+
+#define UT_STRIPES       64 // Independent parts, each behind its own lock
+#define UT_STRIPE_BITS   6
+#define UT_INITIAL_SLOTS 64 // Index slots of a stripe at first (a power of 2)
+#define UT_MAX_LOAD      75 // Percent of the index slots used before a stripe grows
+#define UT_CHUNK_SIZE    16384 // Bytes of URLs in a chunk
+#define UT_ALIGN         4 // URLs start at multiples of it in their chunk
+#define UT_OFFSET_BITS   12 // Bits of an id for the position in the chunk: log2(UT_CHUNK_SIZE / UT_ALIGN)
+#define UT_MAX_CHUNKS    (1 << (32 - UT_OFFSET_BITS))
+#define UT_MAX_URL_LEN   4095
+
+/* URLs copied one after the other. refs counts the URLs in it that weren't
+ * released, plus one while URLs are appended to it; it is freed at 0 */
+typedef struct urlChunk {
+	int refs;
+	int used;
+	char data[UT_CHUNK_SIZE];
+} UrlChunk;
+
+typedef struct urlSlot {
+	unsigned int tag; // Low bits of the hash of the URL
+	unsigned int ref; // Id + 1, 0 for empty slots
+} UrlSlot;
+
+/* Open addressing index with linear probing of the URLs whose hash picks the
+ * stripe, and the chunk where they are appended */
+typedef struct urlStripe {
+	UrlChunk *open;
+	unsigned int openIndex;
+	UrlSlot *slots; // NULL without an index
+	unsigned long long mask; // Slots - 1
+	long count;
+	pthread_mutex_t mtx;
+} UrlStripe;
+
+/* Every URL is stored once and named by a 32-bit id: the number of its chunk
+ * in the high bits and its position in the chunk in the low ones, so
+ * UT_get needs no lock. With an index, interning a URL again gives the same
+ * id, so the table is the set of the URLs found. Without one, the caller only
+ * interns new URLs and releases them when it doesn't need them anymore */
+typedef struct urlTable {
+	UrlStripe stripes[UT_STRIPES];
+	UrlChunk **chunks; // By number, NULL once freed
+	unsigned int chunkCount; // Numbers given so far
+	int liveChunks;
+	long released; // URLs released, not counted by UT_size anymore
+	int indexed;
+} UrlTable;
+
+int UT_initialize(UrlTable *, int);
+int UT_intern(UrlTable *, char *, unsigned int *);
+int UT_internHashed(UrlTable *, char *, unsigned long long, int, unsigned int *);
+int UT_internBatch(UrlTable *, char **, int, unsigned int *, int *);
+char *UT_get(UrlTable *, unsigned int);
+void UT_release(UrlTable *, unsigned int);
+long UT_size(UrlTable *);
+long long UT_memory(UrlTable *);
+void UT_destroy(UrlTable *);
+
+#endif // URL_TABLE_H
@@ -4,6 +4,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <ftw.h> // nftw
+#include <string.h>
+#include <ctype.h> // tolower
 #include "util.h"
 
 int min(int x, int y) {
@@ -66,3 +68,118 @@ int removeDirectory(char *dirPath) {
 	// (https://stackoverflow.com/questions/5467725/how-to-delete-a-directory-and-its-contents-in-posix-c)
 	return nftw(dirPath, removeFun, 1, FTW_PHYS | FTW_DEPTH);
 }
+
+
+/* Bring a URL ("scheme://host/path?query#fragment") to the form used to tell
+ * URLs apart, in place: scheme and host in lower case, no fragment and no
+ * empty, "." or ".." segments in the path (".." never goes above the root) */
+void canonicalizeUrl(char *url) {
+	char *fragment = strchr(url, '#');
+	if (fragment != NULL) {
+		*fragment = '\0';
+	}
+
+	char *host = strstr(url, "://");
+	host = host != NULL ? host + 3 : url;
+	char *c;
+	for (c = url; *c != '\0' && *c != '/' && *c != '?'; c++) {
+		*c = tolower((unsigned char) *c);
+	}
+	for (c = host; *c != '\0' && *c != '/' && *c != '?'; c++) {
+		*c = tolower((unsigned char) *c);
+	}
+
+	// The path is written over itself: out never passes in
+	char *path = c;
+	char *in = path;
+	char *out = path;
+	int dropped = 0; // The last segment was "." or ".."
+	while (*in == '/') {
+		char *segment = in + 1;
+		int len = strcspn(segment, "/?");
+		char *next = segment + len;
+
+		if ((len == 1 && segment[0] == '.') || (len == 0 && *next == '/')) {
+			dropped = len == 1;
+		} else if (len == 2 && segment[0] == '.' && segment[1] == '.') {
+			// Remove the last segment written with its '/'
+			while (out > path && *(--out) != '/');
+			dropped = 1;
+		} else {
+			memmove(out, in, len + 1);
+			out += len + 1;
+			dropped = 0;
+		}
+		in = next;
+	}
+	if (in != path && (dropped || out == path)) {
+		*out++ = '/';
+	}
+	memmove(out, in, strlen(in) + 1); // The query
+}
+
+
+/* splitmix64 finalizer, so that both the top bits (stripe) and
+ * the bottom bits (slot or bucket) of a hash are well mixed */
+unsigned long long mixHash(unsigned long long h) {
+	h += 0x9e3779b97f4a7c15ULL;
+	h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+	return h ^ (h >> 31);
+}
+
+
+/* Hash of the URLs, hostnames and keys of the crawler's tables: FNV-1a
+ * finished with splitmix64. Also returns the length of key */
+unsigned long long hashString(char *key, int *len) {
+	unsigned long long h = 14695981039346656037ULL;
+	char *c;
+	for (c = key; *c != '\0'; c++) {
+		h = (h ^ (unsigned char) *c) * 1099511628211ULL;
+	}
+	*len = c - key;
+	return mixHash(h);
+}
+
+
+/* 64-bit FNV-1a of key, not finished with mixHash */
+unsigned long long fnvHash(char *key) {
+	unsigned long long h = 14695981039346656037ULL;
+	for (; *key != '\0'; key++) {
+		h = (h ^ (unsigned char) *key) * 1099511628211ULL;
+	}
+	return h;
+}
+
+
+/* The same hash for the first len bytes of key */
+unsigned long long hashBytes(char *key, int len) {
+	unsigned long long h = 14695981039346656037ULL;
+	int i;
+	for (i = 0; i < len; i++) {
+		h = (h ^ (unsigned char) key[i]) * 1099511628211ULL;
+	}
+	return mixHash(h);
+}
+
+
+/* Sort the indexes of count hashes by their stripe, the top bits of the hash,
+ * with a counting sort that keeps their order within a stripe. Stripe s gets
+ * order[start[s]] to order[start[s + 1] - 1]; start has 2^bits + 1 entries */
+void sortByStripe(unsigned long long *hashes, int count, int bits, int *order, int *start) {
+	int stripes = 1 << bits;
+	memset(start, 0, (stripes + 1) * sizeof(int));
+	int i;
+	for (i = 0; i < count; i++) {
+		start[(hashes[i] >> (64 - bits)) + 1]++;
+	}
+	for (i = 0; i < stripes; i++) {
+		start[i + 1] += start[i];
+	}
+	// Each start moves to the end of its stripe, which is where the next one starts
+	for (i = 0; i < count; i++) {
+		order[start[hashes[i] >> (64 - bits)]++] = i;
+	}
+	memmove(start + 1, start, stripes * sizeof(int));
+	start[0] = 0;
+}
@@ -5,5 +5,11 @@ int min(int, int);
 int Ceil(double);
 int digits(int);
 int removeDirectory(char *);
+void canonicalizeUrl(char *);
+unsigned long long mixHash(unsigned long long);
+unsigned long long fnvHash(char *);
+unsigned long long hashString(char *, int *);
+unsigned long long hashBytes(char *, int);
+void sortByStripe(unsigned long long *, int, int, int *, int *);
 
 #endif // UTIL_H